@@ -1,6 +1,25 @@
+/*
+ * time_client.c - UDP TIME 客户端 (RFC 868)
+ *
+ * 解析所有给定主机的全部地址，用一个非阻塞套接字并发查询，
+ * 每个服务器独立维护重传定时器（指数退避）。
+ *
+ * 两种模式：
+ *   默认   先到先得：收到第一个合法应答即输出并退出
+ *   -a     收集全部应答，按 RTT 补偿计算时钟偏差并做中值滤波
+ *
+ * 用法：time_client [-a] [-p port] [-t timeout_ms] [-r retries] [host[:port] ...]
+ *       time_client host port    (兼容旧用法)
+ */
+
 #define _GNU_SOURCE
 #include <arpa/inet.h>
+#include <ctype.h>
+#include <errno.h>
+#include <getopt.h>
+#include <limits.h>
 #include <netdb.h>
+#include <poll.h>
 #include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
@@ -12,18 +31,61 @@
 #define TIMEPORT 37
 #define TIME_DIFF_1900_TO_1970 2208988800U
 
-int main(int argc, char *argv[]) {
-  const char *host = (argc >= 2) ? argv[1] : "127.0.0.1";
-  int port = (argc >= 3) ? atoi(argv[2]) : TIMEPORT;
-  struct addrinfo hints, *res = NULL;
-  int sock = -1;
-  uint32_t net_time = 0;
+#define MAX_TARGETS 64
+#define DEFAULT_TIMEOUT_MS 300 /* 首次重传超时，之后每次翻倍 */
+#define DEFAULT_RETRIES 3      /* 每个服务器的最大重传次数 */
 
-  if (port <= 0 || port > 65535) {
-    fprintf(stderr, "无效端口号: %s\n", argv[2]);
-    return 1;
+enum target_state { T_PENDING, T_REPLIED, T_FAILED };
+
+struct target {
+  struct sockaddr_in addr;
+  char label[96];      /* host:port，用于输出 */
+  enum target_state state;
+  int attempts;        /* 已发送次数 */
+  int64_t first_mono;  /* 第一次发送时刻（单调时钟） */
+  int64_t sent_mono;   /* 最近一次发送时刻（单调时钟） */
+  int64_t deadline;    /* 下一次重传时刻（单调时钟） */
+  uint32_t seconds1900;
+  double rtt;          /* 秒；重传过时是首次发送到收到应答的整个区间 */
+  int retransmitted;   /* 应答到达前重传过：不知道对应哪次发送，不是 RTT 样本 */
+  double offset;       /* 服务器时间 - 本地时间（秒） */
+};
+
+static int64_t now_ns(clockid_t clk) {
+  struct timespec ts;
+  clock_gettime(clk, &ts);
+  return (int64_t)ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+static int valid_port(const char *s) {
+  if (*s == '\0')
+    return 0;
+  for (const char *p = s; *p; p++)
+    if (!isdigit((unsigned char)*p))
+      return 0;
+  int port = atoi(s);
+  return port > 0 && port <= 65535;
+}
+
+/* 解析 host[:port]，把该主机的所有 IPv4 地址加入目标表（去重） */
+static int add_targets(const char *spec, int default_port, struct target *t,
+                       int *count) {
+  char host[256];
+  int port = default_port;
+  const char *colon = strrchr(spec, ':');
+
+  if (colon != NULL && valid_port(colon + 1)) {
+    size_t len = (size_t)(colon - spec);
+    if (len >= sizeof(host))
+      len = sizeof(host) - 1;
+    memcpy(host, spec, len);
+    host[len] = '\0';
+    port = atoi(colon + 1);
+  } else {
+    snprintf(host, sizeof(host), "%s", spec);
   }
 
+  struct addrinfo hints, *res = NULL;
   memset(&hints, 0, sizeof(hints));
   hints.ai_family = AF_INET; /* IPv4 only (TIME is simple) */
   hints.ai_socktype = SOCK_DGRAM;
@@ -31,66 +93,330 @@ int main(int argc, char *argv[]) {
   char port_str[6];
   snprintf(port_str, sizeof(port_str), "%d", port);
 
-  if (getaddrinfo(host, port_str, &hints, &res) != 0) {
-    perror("getaddrinfo");
-    return 1;
+  int rc = getaddrinfo(host, port_str, &hints, &res);
+  if (rc != 0) {
+    fprintf(stderr, "getaddrinfo(%s): %s\n", host, gai_strerror(rc));
+    return -1;
   }
 
-  sock = socket(res->ai_family, res->ai_socktype, res->ai_protocol);
-  if (sock < 0) {
-    perror("socket");
-    freeaddrinfo(res);
-    return 1;
+  for (struct addrinfo *ai = res; ai != NULL; ai = ai->ai_next) {
+    struct sockaddr_in *sin = (struct sockaddr_in *)ai->ai_addr;
+    int dup = 0;
+    for (int i = 0; i < *count; i++) {
+      if (t[i].addr.sin_addr.s_addr == sin->sin_addr.s_addr &&
+          t[i].addr.sin_port == sin->sin_port) {
+        dup = 1;
+        break;
+      }
+    }
+    if (dup)
+      continue;
+    if (*count >= MAX_TARGETS) {
+      fprintf(stderr, "too many servers, ignoring the rest (max %d)\n",
+              MAX_TARGETS);
+      break;
+    }
+    struct target *tg = &t[(*count)++];
+    memset(tg, 0, sizeof(*tg));
+    tg->addr = *sin;
+    char ip[INET_ADDRSTRLEN];
+    inet_ntop(AF_INET, &sin->sin_addr, ip, sizeof(ip));
+    snprintf(tg->label, sizeof(tg->label), "%s:%d", ip, port);
   }
 
+  freeaddrinfo(res);
+  return 0;
+}
+
+static int send_request(int sock, struct target *tg, int timeout_ms) {
   /* Send a single zero byte to request the time (many servers accept empty or
    * any data) */
   unsigned char buf[1] = {0};
-  ssize_t sent =
-      sendto(sock, buf, sizeof(buf), 0, res->ai_addr, res->ai_addrlen);
-  if (sent < 0) {
-    perror("sendto");
-    close(sock);
-    freeaddrinfo(res);
-    return 1;
+  int64_t now = now_ns(CLOCK_MONOTONIC);
+
+  if (tg->attempts++ == 0)
+    tg->first_mono = now;
+  tg->sent_mono = now;
+  /* 指数退避：第 n 次发送的超时为 timeout_ms * 2^(n-1) */
+  tg->deadline = now + ((int64_t)timeout_ms << (tg->attempts - 1)) * 1000000LL;
+
+  if (sendto(sock, buf, sizeof(buf), 0, (struct sockaddr *)&tg->addr,
+             sizeof(tg->addr)) < 0 &&
+      errno != EAGAIN && errno != EWOULDBLOCK) {
+    fprintf(stderr, "sendto %s: %s\n", tg->label, strerror(errno));
+    return -1;
   }
+  return 0;
+}
 
-  /* Receive 4 bytes: 32-bit unsigned big-endian seconds since 1900-01-01 */
-  struct sockaddr_storage from;
-  socklen_t fromlen = sizeof(from);
-  ssize_t rec = recvfrom(sock, &net_time, sizeof(net_time), 0,
-                         (struct sockaddr *)&from, &fromlen);
-  if (rec < 0) {
-    perror("recvfrom");
-    close(sock);
-    freeaddrinfo(res);
-    return 1;
+static int cmp_double(const void *a, const void *b) {
+  double x = *(const double *)a, y = *(const double *)b;
+  return (x > y) - (x < y);
+}
+
+static void print_time(const char *label, uint32_t seconds1900) {
+  time_t unix_seconds = (time_t)(seconds1900 - TIME_DIFF_1900_TO_1970);
+  struct tm tmres;
+  char timestr[256];
+
+  if (localtime_r(&unix_seconds, &tmres) == NULL ||
+      strftime(timestr, sizeof(timestr), "%Y-%m-%d %H:%M:%S %z", &tmres) == 0)
+    strncpy(timestr, "<time-format-failed>", sizeof(timestr));
+
+  printf("TIME from %s -> %s\n", label, timestr);
+}
+
+/*
+ * 中值滤波的时钟偏差：先取所有偏差的中值，剔除与中值相差超过
+ * 1 秒（协议分辨率）加该样本 RTT/2 的离群点，再对剩余样本取平均。
+ * 重传过的样本误差界更宽：只要有服务器在第一次发送时就应答，
+ * 重传后才应答的样本都不参与滤波。
+ */
+static void report_offset(struct target *t, int count) {
+  double offsets[MAX_TARGETS];
+  int n = 0, replied = 0, clean = 0;
+
+  for (int i = 0; i < count; i++)
+    if (t[i].state == T_REPLIED && !t[i].retransmitted)
+      clean++;
+  for (int i = 0; i < count; i++) {
+    if (t[i].state != T_REPLIED)
+      continue;
+    replied++;
+    if (!t[i].retransmitted || clean == 0)
+      offsets[n++] = t[i].offset;
   }
-  if (rec < 4) {
-    fprintf(stderr, "received %zd bytes, expected 4\n", rec);
-    close(sock);
-    freeaddrinfo(res);
+
+  if (n == 0) {
+    fprintf(stderr, "no server replied\n");
+    return;
+  }
+
+  qsort(offsets, (size_t)n, sizeof(double), cmp_double);
+  double median = (n % 2) ? offsets[n / 2]
+                          : (offsets[n / 2 - 1] + offsets[n / 2]) / 2.0;
+
+  printf("\n%-24s %10s %12s %s\n", "server", "rtt(ms)", "offset(s)", "");
+  double sum = 0.0;
+  int used = 0;
+  for (int i = 0; i < count; i++) {
+    if (t[i].state != T_REPLIED) {
+      printf("%-24s %10s %12s no reply after %d tries\n", t[i].label, "-", "-",
+             t[i].attempts);
+      continue;
+    }
+    int skipped = t[i].retransmitted && clean > 0;
+    int outlier = t[i].offset - median > 1.0 + t[i].rtt / 2 ||
+                  median - t[i].offset > 1.0 + t[i].rtt / 2;
+    if (!outlier && !skipped) {
+      sum += t[i].offset;
+      used++;
+    }
+    char rtt[32];
+    snprintf(rtt, sizeof(rtt), "%s%.3f", t[i].retransmitted ? "<" : "",
+             t[i].rtt * 1000.0);
+    printf("%-24s %10s %+12.3f %s\n", t[i].label, rtt, t[i].offset,
+           skipped   ? "retransmitted"
+           : outlier ? "outlier"
+                     : "");
+  }
+
+  printf("\nreplies: %d/%d, median offset: %+.3f s", replied, count, median);
+  if (used > 0)
+    printf(", filtered offset: %+.3f s (%d samples)", sum / used, used);
+  printf(", resolution 1 s\n");
+}
+
+static void usage(const char *prog) {
+  fprintf(stderr,
+          "用法: %s [-a] [-p port] [-t timeout_ms] [-r retries] "
+          "[host[:port] ...]\n"
+          "  -a  收集所有服务器的应答并计算 RTT 补偿后的时钟偏差\n"
+          "  -p  默认端口 (默认 %d)\n"
+          "  -t  首次重传超时毫秒数，之后每次翻倍 (默认 %d)\n"
+          "  -r  每个服务器的最大重传次数 (默认 %d)\n",
+          prog, TIMEPORT, DEFAULT_TIMEOUT_MS, DEFAULT_RETRIES);
+}
+
+int main(int argc, char *argv[]) {
+  int collect_all = 0;
+  int port = TIMEPORT;
+  int timeout_ms = DEFAULT_TIMEOUT_MS;
+  int retries = DEFAULT_RETRIES;
+  int opt;
+
+  while ((opt = getopt(argc, argv, "ap:t:r:h")) != -1) {
+    switch (opt) {
+    case 'a':
+      collect_all = 1;
+      break;
+    case 'p':
+      if (!valid_port(optarg)) {
+        fprintf(stderr, "无效端口号: %s\n", optarg);
+        return 1;
+      }
+      port = atoi(optarg);
+      break;
+    case 't':
+      timeout_ms = atoi(optarg);
+      break;
+    case 'r':
+      retries = atoi(optarg);
+      break;
+    default:
+      usage(argv[0]);
+      return 1;
+    }
+  }
+  if (timeout_ms <= 0 || retries < 0 || retries > 16) {
+    usage(argv[0]);
     return 1;
   }
 
-  uint32_t seconds1900 = ntohl(net_time);
-  time_t unix_seconds = (time_t)(seconds1900 - TIME_DIFF_1900_TO_1970);
+  /* 兼容旧用法 "time_client host port" */
+  int nhosts = argc - optind;
+  if (nhosts == 2 && valid_port(argv[optind + 1])) {
+    port = atoi(argv[optind + 1]);
+    nhosts = 1;
+  }
 
-  struct tm tmres;
-  if (localtime_r(&unix_seconds, &tmres) == NULL) {
-    perror("localtime_r");
-    close(sock);
-    freeaddrinfo(res);
+  struct target targets[MAX_TARGETS];
+  int count = 0;
+  if (nhosts == 0) {
+    add_targets("127.0.0.1", port, targets, &count);
+  } else {
+    for (int i = 0; i < nhosts; i++)
+      add_targets(argv[optind + i], port, targets, &count);
+  }
+  if (count == 0) {
+    fprintf(stderr, "no usable server address\n");
     return 1;
   }
 
-  char timestr[256];
-  if (strftime(timestr, sizeof(timestr), "%Y-%m-%d %H:%M:%S %z", &tmres) == 0)
-    strncpy(timestr, "<time-format-failed>", sizeof(timestr));
+  int sock = socket(AF_INET, SOCK_DGRAM | SOCK_NONBLOCK, 0);
+  if (sock < 0) {
+    perror("socket");
+    return 1;
+  }
+
+  /* 同时向所有服务器发出第一个请求 */
+  for (int i = 0; i < count; i++)
+    if (send_request(sock, &targets[i], timeout_ms) < 0)
+      targets[i].state = T_FAILED;
+
+  int pending = 0;
+  for (int i = 0; i < count; i++)
+    if (targets[i].state == T_PENDING)
+      pending++;
+
+  struct target *winner = NULL;
+  while (pending > 0 && winner == NULL) {
+    /* 等到最近的重传时刻 */
+    int64_t now = now_ns(CLOCK_MONOTONIC);
+    int64_t next = INT64_MAX;
+    for (int i = 0; i < count; i++)
+      if (targets[i].state == T_PENDING && targets[i].deadline < next)
+        next = targets[i].deadline;
+    /* -t 很大时毫秒数超出 int，截断到 INT_MAX */
+    int64_t wait = next > now ? (next - now + 999999) / 1000000 : 0;
+    int wait_ms = wait > INT_MAX ? INT_MAX : (int)wait;
+
+    struct pollfd pfd = {.fd = sock, .events = POLLIN};
+    int rc = poll(&pfd, 1, wait_ms);
+    if (rc < 0) {
+      if (errno == EINTR)
+        continue;
+      perror("poll");
+      break;
+    }
+
+    /* 读空所有已到达的应答 */
+    while (rc > 0) {
+      uint32_t net_time = 0;
+      struct sockaddr_in from;
+      socklen_t fromlen = sizeof(from);
+      ssize_t rec = recvfrom(sock, &net_time, sizeof(net_time), 0,
+                             (struct sockaddr *)&from, &fromlen);
+      if (rec < 0)
+        break;
+      int64_t recv_mono = now_ns(CLOCK_MONOTONIC);
+      int64_t recv_real = now_ns(CLOCK_REALTIME);
+
+      struct target *tg = NULL;
+      for (int i = 0; i < count; i++) {
+        if (targets[i].addr.sin_addr.s_addr == from.sin_addr.s_addr &&
+            targets[i].addr.sin_port == from.sin_port) {
+          tg = &targets[i];
+          break;
+        }
+      }
+      /* 忽略未知来源、重复应答和长度错误的报文 */
+      if (tg == NULL || tg->state != T_PENDING || rec != 4)
+        continue;
 
-  printf("TIME from %s:%d -> %s\n", host, port, timestr);
+      tg->state = T_REPLIED;
+      tg->seconds1900 = ntohl(net_time);
+      pending--;
+
+      /*
+       * 只发送过一次时 RTT 就是这次往返。重传过的交换无法判断应答对应
+       * 哪一次发送（TIME 请求不带编号），按 Karn 算法不取 RTT 样本：
+       * 只知道往返落在首次发送到收到应答之间，偏差按这个区间的中点估计，
+       * 误差界也放宽到整个区间。服务器时间被截断到整秒，取区间中点
+       * (+0.5 s) 作为估计，并假设它对应本地请求往返的中点时刻。
+       */
+      tg->retransmitted = tg->attempts > 1;
+      tg->rtt = (recv_mono - (tg->retransmitted ? tg->first_mono
+                                                : tg->sent_mono)) /
+                1e9;
+      double server_unix =
+          (double)(tg->seconds1900 - TIME_DIFF_1900_TO_1970) + 0.5;
+      tg->offset = server_unix - (recv_real / 1e9 - tg->rtt / 2);
+
+      if (!collect_all) {
+        winner = tg;
+        break;
+      }
+    }
+
+    /* 处理到期的重传定时器 */
+    now = now_ns(CLOCK_MONOTONIC);
+    for (int i = 0; i < count && winner == NULL; i++) {
+      struct target *tg = &targets[i];
+      if (tg->state != T_PENDING || now < tg->deadline)
+        continue;
+      if (tg->attempts > retries || send_request(sock, tg, timeout_ms) < 0) {
+        tg->state = T_FAILED;
+        pending--;
+      }
+    }
+  }
 
   close(sock);
-  freeaddrinfo(res);
-  return 0;
+
+  if (!collect_all) {
+    if (winner == NULL) {
+      fprintf(stderr, "no reply from %d server(s)\n", count);
+      return 1;
+    }
+    print_time(winner->label, winner->seconds1900);
+    if (winner->retransmitted)
+      printf("rtt unknown (retransmitted, < %.3f ms), %d server(s) queried\n",
+             winner->rtt * 1000.0, count);
+    else
+      printf("rtt %.3f ms, %d server(s) queried\n", winner->rtt * 1000.0,
+             count);
+    return 0;
+  }
+
+  for (int i = 0; i < count; i++)
+    if (targets[i].state == T_REPLIED) {
+      print_time(targets[i].label, targets[i].seconds1900);
+      break;
+    }
+  report_offset(targets, count);
+  for (int i = 0; i < count; i++)
+    if (targets[i].state == T_REPLIED)
+      return 0;
+  return 1;
 }
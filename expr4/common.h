@@ -17,6 +17,10 @@
 #include <netinet/in.h>
 #include <arpa/inet.h>
 #include <errno.h>
+#include <stdint.h>
+#include <endian.h>
+#include <linux/errqueue.h>
+#include <linux/net_tstamp.h>
 
 /* TIME协议默认端口 */
 #define TIME_PORT 37
@@ -41,14 +45,20 @@ static inline void error_exit(const char *msg)
     exit(EXIT_FAILURE);
 }
 
+/**
+ * 将Unix时间戳转换为TIME协议时间（编译期常量表达式形式）
+ * 参数为常量时结果也是常量，可用于静态初始化
+ */
+#define TIME_PROTOCOL_FROM_UNIX(t) ((uint32_t)((t) + TIME_OFFSET))
+
 /**
  * 将Unix时间戳转换为TIME协议时间
  * @param unix_time Unix时间戳
  * @return TIME协议时间（从1900年开始的秒数）
  */
-static inline uint32_t unix_to_time_protocol(time_t unix_time)
+static inline __attribute__((const)) uint32_t unix_to_time_protocol(time_t unix_time)
 {
-    return (uint32_t)(unix_time + TIME_OFFSET);
+    return TIME_PROTOCOL_FROM_UNIX(unix_time);
 }
 
 /**
@@ -56,9 +66,281 @@ static inline uint32_t unix_to_time_protocol(time_t unix_time)
  * @param time_protocol TIME协议时间
  * @return Unix时间戳
  */
-static inline time_t time_protocol_to_unix(uint32_t time_protocol)
+static inline __attribute__((const)) time_t time_protocol_to_unix(uint32_t time_protocol)
 {
     return (time_t)(time_protocol - TIME_OFFSET);
 }
 
+/*
+ * 扩展TIME协议（亚秒精度，可选）
+ *
+ * 请求以魔数 "TIMX" 开头时服务器返回扩展应答，否则仍返回RFC 868的4字节应答，
+ * 旧客户端不受影响。所有字段均为网络字节序：
+ *
+ * 请求（16字节）：
+ *   0  magic   u32  "TIMX"
+ *   4  version u16  TIMEX_VERSION
+ *   6  flags   u16  保留，填0
+ *   8  tag     u64  客户端自定义标识，服务器原样返回，用于匹配应答
+ *
+ * 应答（40字节）：
+ *   0  magic   u32  "TIMX"
+ *   4  version u16
+ *   6  flags   u16  TIMEX_FLAG_KERNEL_RX：接收时刻来自内核时间戳
+ *   8  tag     u64  请求中的tag
+ *   16 rx_sec  u64  服务器收到请求的时刻，自1900年起的秒数（64位，不受2036年回绕影响）
+ *   24 tx_sec  u64  服务器发出应答的时刻（即返回给客户端的当前时间）
+ *   32 rx_nsec u32  rx时刻的纳秒部分
+ *   36 tx_nsec u32  tx时刻的纳秒部分
+ */
+#define TIMEX_MAGIC 0x54494D58U /* "TIMX" */
+#define TIMEX_VERSION 1
+#define TIMEX_REQUEST_SIZE 16
+#define TIMEX_REPLY_SIZE 40
+#define TIMEX_FLAG_KERNEL_RX 0x0001
+
+/* 扩展应答解码结果，时间均为自1900年起的纳秒数拆分形式 */
+typedef struct
+{
+    uint16_t flags;
+    uint64_t tag;
+    uint64_t rx_sec;
+    uint32_t rx_nsec;
+    uint64_t tx_sec;
+    uint32_t tx_nsec;
+} timex_reply_t;
+
+/* 按网络字节序读写未对齐的整数字段 */
+static inline void put_be16(unsigned char *p, uint16_t v)
+{
+    v = htobe16(v);
+    memcpy(p, &v, sizeof(v));
+}
+
+static inline void put_be32(unsigned char *p, uint32_t v)
+{
+    v = htobe32(v);
+    memcpy(p, &v, sizeof(v));
+}
+
+static inline void put_be64(unsigned char *p, uint64_t v)
+{
+    v = htobe64(v);
+    memcpy(p, &v, sizeof(v));
+}
+
+static inline uint16_t get_be16(const unsigned char *p)
+{
+    uint16_t v;
+    memcpy(&v, p, sizeof(v));
+    return be16toh(v);
+}
+
+static inline uint32_t get_be32(const unsigned char *p)
+{
+    uint32_t v;
+    memcpy(&v, p, sizeof(v));
+    return be32toh(v);
+}
+
+static inline uint64_t get_be64(const unsigned char *p)
+{
+    uint64_t v;
+    memcpy(&v, p, sizeof(v));
+    return be64toh(v);
+}
+
+/**
+ * 批量将Unix纳秒时间拆分为自1900年起的秒数和纳秒部分
+ * 循环体无分支、无别名（restrict），除以常量会被编译为乘法和移位，
+ * 一批请求的时间戳转换可以一次完成
+ * @param unix_ns Unix纳秒时间数组（CLOCK_REALTIME）
+ * @param sec 输出：自1900年起的秒数
+ * @param nsec 输出：纳秒部分
+ * @param n 元素个数
+ */
+static inline void unix_ns_to_time_protocol64_batch(const int64_t *restrict unix_ns,
+                                                    uint64_t *restrict sec,
+                                                    uint32_t *restrict nsec, size_t n)
+{
+    for (size_t i = 0; i < n; i++)
+    {
+        uint64_t ns = (uint64_t)unix_ns[i];
+        sec[i] = ns / 1000000000ULL + TIME_OFFSET;
+        nsec[i] = (uint32_t)(ns % 1000000000ULL);
+    }
+}
+
+/**
+ * 编码扩展请求
+ * @param buf 输出缓冲区，至少TIMEX_REQUEST_SIZE字节
+ * @param tag 客户端标识
+ */
+static inline void timex_encode_request(unsigned char *buf, uint64_t tag)
+{
+    put_be32(buf, TIMEX_MAGIC);
+    put_be16(buf + 4, TIMEX_VERSION);
+    put_be16(buf + 6, 0);
+    put_be64(buf + 8, tag);
+}
+
+/**
+ * 判断请求是否为扩展请求
+ * @param buf 请求数据
+ * @param len 请求长度
+ * @param tag 输出：客户端标识
+ * @return 是扩展请求返回1，否则返回0（按RFC 868处理）
+ */
+static inline int timex_parse_request(const unsigned char *buf, size_t len, uint64_t *tag)
+{
+    if (len < TIMEX_REQUEST_SIZE || get_be32(buf) != TIMEX_MAGIC ||
+        get_be16(buf + 4) != TIMEX_VERSION)
+    {
+        return 0;
+    }
+    *tag = get_be64(buf + 8);
+    return 1;
+}
+
+/**
+ * 编码扩展应答
+ * @param buf 输出缓冲区，至少TIMEX_REPLY_SIZE字节
+ */
+static inline void timex_encode_reply(unsigned char *buf, uint16_t flags, uint64_t tag,
+                                      uint64_t rx_sec, uint32_t rx_nsec,
+                                      uint64_t tx_sec, uint32_t tx_nsec)
+{
+    put_be32(buf, TIMEX_MAGIC);
+    put_be16(buf + 4, TIMEX_VERSION);
+    put_be16(buf + 6, flags);
+    put_be64(buf + 8, tag);
+    put_be64(buf + 16, rx_sec);
+    put_be64(buf + 24, tx_sec);
+    put_be32(buf + 32, rx_nsec);
+    put_be32(buf + 36, tx_nsec);
+}
+
+/**
+ * 解码扩展应答
+ * @return 合法的扩展应答返回1，否则返回0
+ */
+static inline int timex_decode_reply(const unsigned char *buf, size_t len, timex_reply_t *r)
+{
+    if (len != TIMEX_REPLY_SIZE || get_be32(buf) != TIMEX_MAGIC ||
+        get_be16(buf + 4) != TIMEX_VERSION)
+    {
+        return 0;
+    }
+    r->flags = get_be16(buf + 6);
+    r->tag = get_be64(buf + 8);
+    r->rx_sec = get_be64(buf + 16);
+    r->tx_sec = get_be64(buf + 24);
+    r->rx_nsec = get_be32(buf + 32);
+    r->tx_nsec = get_be32(buf + 36);
+    return 1;
+}
+
+/**
+ * 将自1900年起的秒数和纳秒部分转换回Unix纳秒时间
+ */
+static inline __attribute__((const)) int64_t time_protocol64_to_unix_ns(uint64_t sec, uint32_t nsec)
+{
+    return (int64_t)(sec - TIME_OFFSET) * 1000000000LL + nsec;
+}
+
+/**
+ * 获取单调时钟的当前时间（纳秒）
+ * 用于计算RTT等时间间隔，不受系统时间调整影响
+ * @return 单调时钟纳秒数
+ */
+static inline int64_t monotonic_ns(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (int64_t)ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+/**
+ * 将timespec转换为纳秒
+ */
+static inline int64_t timespec_to_ns(const struct timespec *ts)
+{
+    return (int64_t)ts->tv_sec * 1000000000LL + ts->tv_nsec;
+}
+
+/**
+ * 获取系统实时时钟的当前时间（纳秒）
+ * 内核软件时间戳基于CLOCK_REALTIME，与之比较时使用此函数
+ */
+static inline int64_t realtime_ns(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_REALTIME, &ts);
+    return timespec_to_ns(&ts);
+}
+
+/**
+ * 为套接字开启内核时间戳（SO_TIMESTAMPING）
+ * @param sockfd 套接字
+ * @param tx 是否同时开启发送时间戳（通过错误队列返回）
+ * @param hw 是否请求硬件时间戳（需网卡支持并已通过SIOCSHWTSTAMP启用）
+ * @return 成功返回0，失败返回-1
+ */
+static inline int enable_timestamping(int sockfd, int tx, int hw)
+{
+    int flags = SOF_TIMESTAMPING_SOFTWARE | SOF_TIMESTAMPING_RX_SOFTWARE;
+
+    if (tx)
+    {
+        /* OPT_TSONLY：错误队列只返回时间戳，不回送报文内容 */
+        flags |= SOF_TIMESTAMPING_TX_SOFTWARE | SOF_TIMESTAMPING_OPT_ID |
+                 SOF_TIMESTAMPING_OPT_TSONLY;
+    }
+    if (hw)
+    {
+        flags |= SOF_TIMESTAMPING_RAW_HARDWARE | SOF_TIMESTAMPING_RX_HARDWARE;
+        if (tx)
+        {
+            flags |= SOF_TIMESTAMPING_TX_HARDWARE;
+        }
+    }
+    return setsockopt(sockfd, SOL_SOCKET, SO_TIMESTAMPING, &flags, sizeof(flags));
+}
+
+/**
+ * 从recvmsg返回的控制消息中提取内核时间戳
+ * 优先使用硬件时间戳，没有时退回软件时间戳
+ * @param msg recvmsg使用的消息头
+ * @param hw 输出：1表示硬件时间戳，0表示软件时间戳
+ * @return 时间戳（纳秒，CLOCK_REALTIME或网卡时钟），没有时间戳时返回0
+ */
+static inline int64_t cmsg_timestamp_ns(struct msghdr *msg, int *hw)
+{
+    struct cmsghdr *cmsg;
+
+    for (cmsg = CMSG_FIRSTHDR(msg); cmsg != NULL; cmsg = CMSG_NXTHDR(msg, cmsg))
+    {
+        if (cmsg->cmsg_level == SOL_SOCKET && cmsg->cmsg_type == SCM_TIMESTAMPING)
+        {
+            struct scm_timestamping tss;
+            memcpy(&tss, CMSG_DATA(cmsg), sizeof(tss));
+            /* ts[0]为软件时间戳，ts[2]为网卡原始硬件时间戳 */
+            if (tss.ts[2].tv_sec != 0 || tss.ts[2].tv_nsec != 0)
+            {
+                if (hw != NULL)
+                {
+                    *hw = 1;
+                }
+                return timespec_to_ns(&tss.ts[2]);
+            }
+            if (hw != NULL)
+            {
+                *hw = 0;
+            }
+            return timespec_to_ns(&tss.ts[0]);
+        }
+    }
+    return 0;
+}
+
 #endif /* COMMON_H */
@@ -0,0 +1,836 @@
+/**
+ * time_bench.c - TIME服务器开环压测工具
+ *
+ * 按固定速率向TIME服务器发送请求，测量服务器在丢包出现前能承受的最大请求速率
+ *
+ * 功能：
+ * 1. 开环发送：发送节奏只由目标速率决定，不等待应答
+ * 2. 使用大量源端口（每个端口一个套接字）分摊请求，epoll异步接收应答
+ * 3. 每个套接字同一时刻最多一个未完成请求，应答按套接字精确匹配
+ * 4. 统计实际发送速率、应答速率、丢包率和RTT直方图
+ * 5. 扫描模式：逐步提高速率，找出丢包率不超过阈值的最大速率
+ * 6. TCP模式：每个请求新建一个连接（churn压测），测量连接到收齐应答的延迟
+ *
+ * 用法：./time_bench [options] <server_ip> [port]
+ */
+
+#include "common.h"
+
+#include <getopt.h>
+#include <sys/epoll.h>
+#include <sys/timerfd.h>
+
+/* 默认参数 */
+#define DEFAULT_RATE 10000      /* 请求/秒 */
+#define DEFAULT_DURATION 5      /* 秒 */
+#define DEFAULT_SOCKETS 256     /* 源端口数量 */
+#define DEFAULT_TIMEOUT_MS 1000 /* 单个请求超时（毫秒） */
+#define DEFAULT_LOSS_LIMIT 0.1  /* 扫描模式允许的丢包率（%） */
+
+#define MAX_SOCKETS 16384
+#define MAX_EVENTS 256
+#define SCAN_INTERVAL_NS 10000000LL /* 超时扫描周期：10ms */
+
+/* RTT直方图：对数-线性分桶，每个2的幂区间再分8个子桶（单位：微秒） */
+#define HIST_SUB_BITS 3
+#define HIST_SUB (1 << HIST_SUB_BITS)
+#define HIST_BUCKETS (HIST_SUB * 2 + HIST_SUB * 40)
+
+/* 源端口套接字状态 */
+enum slot_state
+{
+    SLOT_IDLE,      /* 空闲，可发送 */
+    SLOT_BUSY,      /* 已发送，等待应答 */
+    SLOT_QUARANTINE /* 超时后隔离一段时间，避免迟到应答被错配到新请求 */
+};
+
+typedef struct
+{
+    int fd;
+    enum slot_state state;
+    int64_t sent_ns;  /* 发送时刻 */
+    int64_t until_ns; /* 隔离结束时刻 */
+    int got;          /* TCP模式：已收到的应答字节数 */
+} slot_t;
+
+typedef struct
+{
+    uint64_t counts[HIST_BUCKETS];
+    uint64_t total;
+    uint64_t max_us;
+    uint64_t sum_us;
+} histogram_t;
+
+typedef struct
+{
+    uint64_t sent;       /* 已发送请求 */
+    uint64_t received;   /* 按时收到的应答 */
+    uint64_t lost;       /* 超时未应答 */
+    uint64_t late;       /* 超时后才到达的应答 */
+    uint64_t bad;        /* 长度错误或无法匹配的应答 */
+    uint64_t stalled;    /* 到期时没有空闲源端口而推迟的请求 */
+    uint64_t send_errors; /* 发送或发起连接失败 */
+    uint64_t failed;      /* TCP连接被拒绝或复位 */
+    int64_t elapsed_ns;  /* 发送阶段实际耗时 */
+    histogram_t rtt;
+} bench_result_t;
+
+/* 压测协议 */
+enum bench_mode
+{
+    MODE_UDP, /* 每个请求一个UDP数据报 */
+    MODE_TCP  /* 每个请求一个新TCP连接（连接建立/关闭的churn压测） */
+};
+
+typedef struct
+{
+    struct sockaddr_in server;
+    enum bench_mode mode;
+    int extended; /* UDP模式：发送扩展请求（TIMX），期望40字节应答 */
+    long rate;
+    int duration;
+    int nsockets;
+    int timeout_ms;
+} bench_config_t;
+
+static void usage(const char *prog)
+{
+    fprintf(stderr, "Usage: %s [options] <server_ip> [port]\n", prog);
+    fprintf(stderr, "Options:\n");
+    fprintf(stderr, "  -r <rate>     目标请求速率（请求/秒，默认 %d）\n", DEFAULT_RATE);
+    fprintf(stderr, "  -d <seconds>  每轮发送时长（默认 %d）\n", DEFAULT_DURATION);
+    fprintf(stderr, "  -m <udp|tcp>  压测协议（默认 udp）\n");
+    fprintf(stderr, "  -x            UDP模式发送扩展请求（纳秒精度应答）\n");
+    fprintf(stderr, "  -s <sockets>  源端口数量/TCP最大并发连接数（默认 %d，最大 %d）\n",
+            DEFAULT_SOCKETS, MAX_SOCKETS);
+    fprintf(stderr, "  -t <ms>       请求超时（默认 %d）\n", DEFAULT_TIMEOUT_MS);
+    fprintf(stderr, "  -S <max_rate> 扫描模式：从 -r 开始每轮速率翻倍直到 max_rate\n");
+    fprintf(stderr, "  -l <percent>  扫描模式允许的丢包率（默认 %.1f%%）\n",
+            DEFAULT_LOSS_LIMIT);
+    fprintf(stderr, "Example: %s -r 50000 -d 10 127.0.0.1 8037\n", prog);
+    fprintf(stderr, "         %s -m tcp -r 5000 -s 1024 127.0.0.1 8037\n", prog);
+}
+
+/**
+ * 计算RTT（微秒）所属的直方图桶
+ */
+static int hist_bucket(uint64_t us)
+{
+    if (us < 2 * HIST_SUB)
+    {
+        return (int)us;
+    }
+    int msb = 63 - __builtin_clzll(us);
+    int sub = (int)((us >> (msb - HIST_SUB_BITS)) & (HIST_SUB - 1));
+    int idx = 2 * HIST_SUB + (msb - HIST_SUB_BITS - 1) * HIST_SUB + sub;
+    return idx < HIST_BUCKETS ? idx : HIST_BUCKETS - 1;
+}
+
+/**
+ * 直方图桶的上界（微秒）
+ */
+static uint64_t hist_upper(int idx)
+{
+    if (idx < 2 * HIST_SUB)
+    {
+        return (uint64_t)idx;
+    }
+    int msb = (idx - 2 * HIST_SUB) / HIST_SUB + HIST_SUB_BITS + 1;
+    int sub = (idx - 2 * HIST_SUB) % HIST_SUB;
+    uint64_t base = 1ULL << msb;
+    uint64_t step = 1ULL << (msb - HIST_SUB_BITS);
+    return base + (uint64_t)(sub + 1) * step - 1;
+}
+
+static void hist_add(histogram_t *h, uint64_t us)
+{
+    h->counts[hist_bucket(us)]++;
+    h->total++;
+    h->sum_us += us;
+    if (us > h->max_us)
+    {
+        h->max_us = us;
+    }
+}
+
+static uint64_t hist_percentile(const histogram_t *h, double pct)
+{
+    if (h->total == 0)
+    {
+        return 0;
+    }
+    uint64_t target = (uint64_t)(h->total * pct / 100.0);
+    if (target >= h->total)
+    {
+        target = h->total - 1;
+    }
+    uint64_t seen = 0;
+    for (int i = 0; i < HIST_BUCKETS; i++)
+    {
+        seen += h->counts[i];
+        if (seen > target)
+        {
+            uint64_t upper = hist_upper(i);
+            return upper < h->max_us ? upper : h->max_us;
+        }
+    }
+    return h->max_us;
+}
+
+/**
+ * 按2的幂区间汇总打印直方图
+ */
+static void hist_print(const histogram_t *h)
+{
+    if (h->total == 0)
+    {
+        return;
+    }
+    printf("RTT histogram (us):\n");
+    uint64_t lo = 0;
+    uint64_t hi = 1;
+    uint64_t bucket_count = 0;
+    for (int i = 0; i < HIST_BUCKETS; i++)
+    {
+        uint64_t upper = hist_upper(i);
+        while (upper >= hi)
+        {
+            if (bucket_count > 0)
+            {
+                printf("  [%7lu, %7lu) %10lu  %6.2f%%\n", (unsigned long)lo,
+                       (unsigned long)hi, (unsigned long)bucket_count,
+                       100.0 * bucket_count / h->total);
+            }
+            lo = hi;
+            hi <<= 1;
+            bucket_count = 0;
+        }
+        bucket_count += h->counts[i];
+    }
+    if (bucket_count > 0)
+    {
+        printf("  [%7lu, %7lu) %10lu  %6.2f%%\n", (unsigned long)lo,
+               (unsigned long)hi, (unsigned long)bucket_count,
+               100.0 * bucket_count / h->total);
+    }
+}
+
+/* 一轮压测的运行上下文 */
+typedef struct
+{
+    const bench_config_t *cfg;
+    bench_result_t *res;
+    slot_t *slots;
+    int n;
+    int *free_ring;       /* 空闲槽位FIFO（单调递增下标，取模访问） */
+    unsigned free_head;
+    unsigned free_tail;
+    int epfd;
+    int64_t timeout_ns;
+} bench_ctx_t;
+
+static void free_push(bench_ctx_t *ctx, int idx)
+{
+    ctx->slots[idx].state = SLOT_IDLE;
+    ctx->free_ring[ctx->free_tail++ % (unsigned)ctx->n] = idx;
+}
+
+static int free_pop(bench_ctx_t *ctx)
+{
+    if (ctx->free_head == ctx->free_tail)
+    {
+        return -1;
+    }
+    return ctx->free_ring[ctx->free_head++ % (unsigned)ctx->n];
+}
+
+/**
+ * 关闭TCP槽位上的连接并放回空闲队列
+ */
+static void tcp_release(bench_ctx_t *ctx, int idx)
+{
+    slot_t *s = &ctx->slots[idx];
+    close(s->fd); /* close会自动从epoll中移除 */
+    s->fd = -1;
+    free_push(ctx, idx);
+}
+
+/**
+ * 超时扫描
+ * UDP：超时记为丢失并进入隔离，隔离期满的套接字回到空闲队列
+ * TCP：超时记为丢失并直接关闭连接，迟到的应答不会再被读到
+ */
+static void scan_slots(bench_ctx_t *ctx, int64_t now)
+{
+    for (int i = 0; i < ctx->n; i++)
+    {
+        slot_t *s = &ctx->slots[i];
+        if (s->state == SLOT_BUSY && now - s->sent_ns >= ctx->timeout_ns)
+        {
+            ctx->res->lost++;
+            if (ctx->cfg->mode == MODE_TCP)
+            {
+                tcp_release(ctx, i);
+            }
+            else
+            {
+                s->state = SLOT_QUARANTINE;
+                s->until_ns = now + ctx->timeout_ns;
+            }
+        }
+        else if (s->state == SLOT_QUARANTINE && now >= s->until_ns)
+        {
+            free_push(ctx, i);
+        }
+    }
+}
+
+/**
+ * UDP模式：创建源端口套接字，connect后内核只向该套接字投递来自服务器的应答
+ */
+static int udp_setup(bench_ctx_t *ctx)
+{
+    for (int i = 0; i < ctx->n; i++)
+    {
+        int fd = socket(AF_INET, SOCK_DGRAM | SOCK_NONBLOCK, 0);
+        if (fd < 0)
+        {
+            perror("Failed to create socket");
+            return -1;
+        }
+        ctx->slots[i].fd = fd;
+        if (connect(fd, (struct sockaddr *)&ctx->cfg->server,
+                    sizeof(ctx->cfg->server)) < 0)
+        {
+            perror("Failed to connect socket");
+            return -1;
+        }
+        struct epoll_event ev = {.events = EPOLLIN, .data.u32 = (uint32_t)i};
+        if (epoll_ctl(ctx->epfd, EPOLL_CTL_ADD, fd, &ev) < 0)
+        {
+            perror("epoll_ctl");
+            return -1;
+        }
+        free_push(ctx, i);
+    }
+    return 0;
+}
+
+/**
+ * UDP模式：在空闲套接字上发出一个请求
+ */
+static void udp_fire(bench_ctx_t *ctx, int idx)
+{
+    unsigned char request[TIMEX_REQUEST_SIZE] = "TIME";
+    size_t len = 4;
+    slot_t *s = &ctx->slots[idx];
+
+    s->sent_ns = monotonic_ns();
+    if (ctx->cfg->extended)
+    {
+        timex_encode_request(request, (uint64_t)idx);
+        len = TIMEX_REQUEST_SIZE;
+    }
+    if (send(s->fd, request, len, 0) < 0)
+    {
+        ctx->res->send_errors++;
+        free_push(ctx, idx);
+        return;
+    }
+    s->state = SLOT_BUSY;
+    ctx->res->sent++;
+}
+
+/**
+ * UDP模式：读空该套接字上的所有应答
+ */
+static void udp_on_event(bench_ctx_t *ctx, int idx)
+{
+    slot_t *s = &ctx->slots[idx];
+    unsigned char reply[64];
+    ssize_t expect = ctx->cfg->extended ? TIMEX_REPLY_SIZE : (ssize_t)sizeof(uint32_t);
+    ssize_t len;
+
+    while ((len = recv(s->fd, reply, sizeof(reply), 0)) >= 0)
+    {
+        int64_t now = monotonic_ns();
+        if (s->state == SLOT_BUSY && len == expect)
+        {
+            hist_add(&ctx->res->rtt, (uint64_t)(now - s->sent_ns) / 1000);
+            ctx->res->received++;
+            free_push(ctx, idx);
+        }
+        else if (s->state == SLOT_QUARANTINE)
+        {
+            ctx->res->late++;
+        }
+        else
+        {
+            ctx->res->bad++;
+        }
+    }
+}
+
+/**
+ * TCP模式：发起一个非阻塞连接，服务器accept后写入4字节并关闭
+ */
+static void tcp_fire(bench_ctx_t *ctx, int idx)
+{
+    slot_t *s = &ctx->slots[idx];
+
+    s->sent_ns = monotonic_ns();
+    s->got = 0;
+    s->fd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK, 0);
+    if (s->fd < 0)
+    {
+        ctx->res->send_errors++;
+        free_push(ctx, idx);
+        return;
+    }
+    if (connect(s->fd, (struct sockaddr *)&ctx->cfg->server,
+                sizeof(ctx->cfg->server)) < 0 &&
+        errno != EINPROGRESS)
+    {
+        ctx->res->send_errors++;
+        tcp_release(ctx, idx);
+        return;
+    }
+    struct epoll_event ev = {.events = EPOLLIN | EPOLLRDHUP, .data.u32 = (uint32_t)idx};
+    if (epoll_ctl(ctx->epfd, EPOLL_CTL_ADD, s->fd, &ev) < 0)
+    {
+        ctx->res->send_errors++;
+        tcp_release(ctx, idx);
+        return;
+    }
+    s->state = SLOT_BUSY;
+    ctx->res->sent++;
+}
+
+/**
+ * TCP模式：读取应答直到对端关闭
+ * 等服务器先关闭再关闭本端，TIME_WAIT留在服务器一侧，压测端不会耗尽临时端口
+ */
+static void tcp_on_event(bench_ctx_t *ctx, int idx)
+{
+    slot_t *s = &ctx->slots[idx];
+    unsigned char reply[64];
+    ssize_t len;
+
+    if (s->state != SLOT_BUSY)
+    {
+        return;
+    }
+
+    while ((len = recv(s->fd, reply, sizeof(reply), 0)) > 0)
+    {
+        if (s->got < (int)sizeof(uint32_t) && s->got + len >= (ssize_t)sizeof(uint32_t))
+        {
+            /* 收齐4字节时间即为一次完整应答 */
+            hist_add(&ctx->res->rtt, (uint64_t)(monotonic_ns() - s->sent_ns) / 1000);
+        }
+        s->got += (int)len;
+    }
+    if (len < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+    {
+        return;
+    }
+
+    /* 对端关闭（len == 0）或连接出错（拒绝、复位） */
+    if (len == 0 && s->got == (int)sizeof(uint32_t))
+    {
+        ctx->res->received++;
+    }
+    else if (len == 0)
+    {
+        ctx->res->bad++;
+    }
+    else
+    {
+        ctx->res->failed++;
+    }
+    tcp_release(ctx, idx);
+}
+
+/**
+ * 以固定速率运行一轮压测
+ */
+static int run_bench(const bench_config_t *cfg, bench_result_t *res)
+{
+    bench_ctx_t ctx;
+    int64_t duration_ns = (int64_t)cfg->duration * 1000000000LL;
+    int tfd = -1;
+    int ret = -1;
+
+    memset(res, 0, sizeof(*res));
+    memset(&ctx, 0, sizeof(ctx));
+    ctx.cfg = cfg;
+    ctx.res = res;
+    ctx.n = cfg->nsockets;
+    ctx.timeout_ns = (int64_t)cfg->timeout_ms * 1000000LL;
+    ctx.slots = calloc(ctx.n, sizeof(slot_t));
+    ctx.free_ring = calloc(ctx.n, sizeof(int));
+    ctx.epfd = epoll_create1(0);
+    tfd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK);
+    if (ctx.slots == NULL || ctx.free_ring == NULL || ctx.epfd < 0 || tfd < 0)
+    {
+        perror("Failed to initialize benchmark");
+        goto out;
+    }
+
+    for (int i = 0; i < ctx.n; i++)
+    {
+        ctx.slots[i].fd = -1;
+    }
+    if (cfg->mode == MODE_UDP)
+    {
+        if (udp_setup(&ctx) < 0)
+        {
+            goto out;
+        }
+    }
+    else
+    {
+        /* TCP模式每个请求新建连接，槽位数即最大并发连接数 */
+        for (int i = 0; i < ctx.n; i++)
+        {
+            free_push(&ctx, i);
+        }
+    }
+
+    /* 发送节拍：每个节拍补发所有已到期的请求，节拍间隔在50us~1ms之间 */
+    int64_t interval_ns = 1000000000LL / cfg->rate;
+    int64_t tick_ns = interval_ns < 50000 ? 50000 : interval_ns;
+    if (tick_ns > 1000000)
+    {
+        tick_ns = 1000000;
+    }
+    struct itimerspec its;
+    its.it_interval.tv_sec = 0;
+    its.it_interval.tv_nsec = tick_ns;
+    its.it_value = its.it_interval;
+    if (timerfd_settime(tfd, 0, &its, NULL) < 0)
+    {
+        perror("timerfd_settime");
+        goto out;
+    }
+    struct epoll_event tev = {.events = EPOLLIN, .data.u32 = UINT32_MAX};
+    if (epoll_ctl(ctx.epfd, EPOLL_CTL_ADD, tfd, &tev) < 0)
+    {
+        perror("epoll_ctl");
+        goto out;
+    }
+
+    struct epoll_event events[MAX_EVENTS];
+    int64_t start = monotonic_ns();
+    int64_t send_end = start + duration_ns;
+    int64_t drain_end = send_end + ctx.timeout_ns;
+    int64_t next_scan = start + SCAN_INTERVAL_NS;
+    uint64_t scheduled = 0;
+    int sending = 1;
+
+    while (1)
+    {
+        int nev = epoll_wait(ctx.epfd, events, MAX_EVENTS, 10);
+        if (nev < 0)
+        {
+            if (errno == EINTR)
+            {
+                continue;
+            }
+            perror("epoll_wait");
+            goto out;
+        }
+
+        for (int e = 0; e < nev; e++)
+        {
+            uint32_t id = events[e].data.u32;
+            if (id == UINT32_MAX)
+            {
+                uint64_t expirations;
+                if (read(tfd, &expirations, sizeof(expirations)) < 0 &&
+                    errno != EAGAIN)
+                {
+                    perror("read timerfd");
+                }
+            }
+            else if (cfg->mode == MODE_UDP)
+            {
+                udp_on_event(&ctx, (int)id);
+            }
+            else
+            {
+                tcp_on_event(&ctx, (int)id);
+            }
+        }
+
+        int64_t now = monotonic_ns();
+
+        /* 补发到期请求：目标发送数 = 已过时间 × 速率 */
+        if (sending)
+        {
+            int64_t t = now < send_end ? now : send_end;
+            uint64_t due = (uint64_t)((t - start) / 1000) * (uint64_t)cfg->rate / 1000000ULL;
+            while (scheduled < due)
+            {
+                int idx = free_pop(&ctx);
+                if (idx < 0)
+                {
+                    /* 所有槽位都在等待应答，剩余请求记为推迟 */
+                    res->stalled += due - scheduled;
+                    scheduled = due;
+                    break;
+                }
+                if (cfg->mode == MODE_UDP)
+                {
+                    udp_fire(&ctx, idx);
+                }
+                else
+                {
+                    tcp_fire(&ctx, idx);
+                }
+                scheduled++;
+            }
+            if (now >= send_end)
+            {
+                sending = 0;
+                res->elapsed_ns = now - start;
+            }
+        }
+
+        if (now >= next_scan)
+        {
+            scan_slots(&ctx, now);
+            next_scan = now + SCAN_INTERVAL_NS;
+        }
+
+        if (!sending && now >= drain_end)
+        {
+            break;
+        }
+    }
+
+    /* 排空阶段结束后仍未应答的请求均计为丢失 */
+    for (int i = 0; i < ctx.n; i++)
+    {
+        if (ctx.slots[i].state == SLOT_BUSY)
+        {
+            res->lost++;
+        }
+    }
+    ret = 0;
+
+out:
+    if (ctx.slots != NULL)
+    {
+        for (int i = 0; i < ctx.n; i++)
+        {
+            if (ctx.slots[i].fd >= 0)
+            {
+                close(ctx.slots[i].fd);
+            }
+        }
+    }
+    if (tfd >= 0)
+    {
+        close(tfd);
+    }
+    if (ctx.epfd >= 0)
+    {
+        close(ctx.epfd);
+    }
+    free(ctx.free_ring);
+    free(ctx.slots);
+    return ret;
+}
+
+static double loss_percent(const bench_result_t *res)
+{
+    return res->sent ? 100.0 * (res->lost + res->failed) / res->sent : 0.0;
+}
+
+static void print_result(const bench_config_t *cfg, const bench_result_t *res)
+{
+    double secs = res->elapsed_ns / 1e9;
+    const histogram_t *h = &res->rtt;
+
+    printf("===========================================\n");
+    printf("Protocol            : %s\n",
+           cfg->mode == MODE_TCP ? "TCP" : (cfg->extended ? "UDP (extended)" : "UDP"));
+    printf("Target rate         : %ld req/s\n", cfg->rate);
+    printf("Achieved send rate  : %.0f req/s\n", secs > 0 ? res->sent / secs : 0.0);
+    printf("Reply rate          : %.0f req/s\n", secs > 0 ? res->received / secs : 0.0);
+    printf("Sent / received     : %lu / %lu\n", (unsigned long)res->sent,
+           (unsigned long)res->received);
+    printf("Lost                : %lu (%.3f%%)\n",
+           (unsigned long)(res->lost + res->failed), loss_percent(res));
+    if (res->failed > 0)
+    {
+        printf("  refused / reset   : %lu\n", (unsigned long)res->failed);
+    }
+    printf("Late / bad replies  : %lu / %lu\n", (unsigned long)res->late,
+           (unsigned long)res->bad);
+    if (res->stalled > 0 || res->send_errors > 0)
+    {
+        printf("Stalled / send err  : %lu / %lu (increase -s if stalled)\n",
+               (unsigned long)res->stalled, (unsigned long)res->send_errors);
+    }
+    if (h->total > 0)
+    {
+        printf("RTT avg/p50/p90/p99/p99.9/max (us): %lu / %lu / %lu / %lu / %lu / %lu\n",
+               (unsigned long)(h->sum_us / h->total),
+               (unsigned long)hist_percentile(h, 50.0),
+               (unsigned long)hist_percentile(h, 90.0),
+               (unsigned long)hist_percentile(h, 99.0),
+               (unsigned long)hist_percentile(h, 99.9),
+               (unsigned long)h->max_us);
+        hist_print(h);
+    }
+    printf("===========================================\n");
+}
+
+int main(int argc, char *argv[])
+{
+    bench_config_t cfg;
+    long max_rate = 0;
+    double loss_limit = DEFAULT_LOSS_LIMIT;
+    int port = TIME_PORT;
+    int opt;
+
+    memset(&cfg, 0, sizeof(cfg));
+    cfg.rate = DEFAULT_RATE;
+    cfg.duration = DEFAULT_DURATION;
+    cfg.nsockets = DEFAULT_SOCKETS;
+    cfg.timeout_ms = DEFAULT_TIMEOUT_MS;
+
+    while ((opt = getopt(argc, argv, "m:xr:d:s:t:S:l:h")) != -1)
+    {
+        switch (opt)
+        {
+        case 'm':
+            if (strcmp(optarg, "udp") == 0)
+            {
+                cfg.mode = MODE_UDP;
+            }
+            else if (strcmp(optarg, "tcp") == 0)
+            {
+                cfg.mode = MODE_TCP;
+            }
+            else
+            {
+                usage(argv[0]);
+                exit(EXIT_FAILURE);
+            }
+            break;
+        case 'x':
+            cfg.extended = 1;
+            break;
+        case 'r':
+            cfg.rate = atol(optarg);
+            break;
+        case 'd':
+            cfg.duration = atoi(optarg);
+            break;
+        case 's':
+            cfg.nsockets = atoi(optarg);
+            break;
+        case 't':
+            cfg.timeout_ms = atoi(optarg);
+            break;
+        case 'S':
+            max_rate = atol(optarg);
+            break;
+        case 'l':
+            loss_limit = atof(optarg);
+            break;
+        default:
+            usage(argv[0]);
+            exit(EXIT_FAILURE);
+        }
+    }
+
+    if (optind >= argc)
+    {
+        usage(argv[0]);
+        exit(EXIT_FAILURE);
+    }
+    if (cfg.rate <= 0 || cfg.duration <= 0 || cfg.timeout_ms <= 0 ||
+        cfg.nsockets <= 0 || cfg.nsockets > MAX_SOCKETS)
+    {
+        fprintf(stderr, "Invalid benchmark parameters\n");
+        exit(EXIT_FAILURE);
+    }
+    if (optind + 1 < argc)
+    {
+        port = atoi(argv[optind + 1]);
+        if (port <= 0 || port > 65535)
+        {
+            fprintf(stderr, "Invalid port number: %s\n", argv[optind + 1]);
+            exit(EXIT_FAILURE);
+        }
+    }
+
+    cfg.server.sin_family = AF_INET;
+    cfg.server.sin_port = htons(port);
+    if (inet_pton(AF_INET, argv[optind], &cfg.server.sin_addr) <= 0)
+    {
+        fprintf(stderr, "Invalid server IP address: %s\n", argv[optind]);
+        exit(EXIT_FAILURE);
+    }
+
+    printf("===========================================\n");
+    printf("     TIME服务器开环压测 (%s)\n", cfg.mode == MODE_TCP ? "TCP" : "UDP");
+    printf("===========================================\n");
+    printf("Server              : %s:%d\n", argv[optind], port);
+    printf("%s: %d\n", cfg.mode == MODE_TCP ? "Max connections     " : "Source ports        ",
+           cfg.nsockets);
+    printf("Duration per round  : %d s\n", cfg.duration);
+    printf("Request timeout     : %d ms\n", cfg.timeout_ms);
+
+    bench_result_t res;
+    if (max_rate <= 0)
+    {
+        if (run_bench(&cfg, &res) < 0)
+        {
+            exit(EXIT_FAILURE);
+        }
+        print_result(&cfg, &res);
+        return 0;
+    }
+
+    /* 扫描模式：速率逐轮翻倍，直到丢包率超过阈值或达到上限 */
+    long sustainable = 0;
+    int over_limit = 0; /* 因丢包率超过阈值而停止（而不是压测端卡住或达到上限） */
+    for (long rate = cfg.rate; rate <= max_rate; rate *= 2)
+    {
+        cfg.rate = rate;
+        if (run_bench(&cfg, &res) < 0)
+        {
+            exit(EXIT_FAILURE);
+        }
+        print_result(&cfg, &res);
+        if (res.stalled > 0)
+        {
+            /* 压测端自身成为瓶颈，结果不能归因于服务器 */
+            printf("Stopped: all slots busy at %ld req/s, rerun with larger -s\n",
+                   rate);
+            break;
+        }
+        if (loss_percent(&res) > loss_limit)
+        {
+            over_limit = 1;
+            break;
+        }
+        sustainable = rate;
+    }
+
+    if (sustainable > 0)
+    {
+        printf("Max sustainable rate: %ld req/s (loss <= %.2f%%)\n", sustainable,
+               loss_limit);
+    }
+    else if (over_limit)
+    {
+        printf("Loss exceeded %.2f%% already at %ld req/s\n", loss_limit, cfg.rate);
+    }
+    return 0;
+}
@@ -7,12 +7,73 @@
  * 1. 向TIME服务器发送请求
  * 2. 接收服务器返回的时间值
  * 3. 将时间值转换为可读格式并显示
+ * 4. 可选：使用内核时间戳（SO_TIMESTAMPING）把往返延迟拆分为内核与用户态部分
+ * 5. 可选：请求纳秒精度的扩展应答，计算时钟偏差并单独报告服务器处理延迟
  *
- * 用法：./time_client <server_ip> [port]
+ * 用法：./time_client [-x] [-T | -H] <server_ip> [port]
+ *   -x  请求扩展应答（服务器不支持时自动按RFC 868的4字节应答处理）
+ *   -T  使用内核软件时间戳
+ *   -H  优先使用网卡硬件时间戳（网卡不支持时退回软件时间戳）
  */
 
 #include "common.h"
 
+#include <getopt.h>
+#include <poll.h>
+
+/* 控制消息缓冲区大小 */
+#define CONTROL_SIZE 512
+
+/* 等待发送时间戳出现在错误队列中的最长时间（毫秒） */
+#define TX_TIMESTAMP_WAIT_MS 100
+
+/**
+ * 打印用法说明
+ */
+static void print_usage(const char *prog)
+{
+    fprintf(stderr, "Usage: %s [-x] [-T | -H] <server_ip> [port]\n", prog);
+    fprintf(stderr, "  -x  request the nanosecond extended reply\n");
+    fprintf(stderr, "  -T  use kernel software timestamps\n");
+    fprintf(stderr, "  -H  prefer NIC hardware timestamps\n");
+    fprintf(stderr, "Example: %s -T 127.0.0.1 8037\n", prog);
+}
+
+/**
+ * 从错误队列读取发送时间戳
+ * @param sockfd 套接字
+ * @param hw 输出：是否为硬件时间戳
+ * @return 时间戳（纳秒），超时或失败返回0
+ */
+static int64_t read_tx_timestamp(int sockfd, int *hw)
+{
+    char control[CONTROL_SIZE];
+    struct msghdr msg;
+    struct pollfd pfd;
+
+    pfd.fd = sockfd;
+    pfd.events = 0; /* POLLERR总是会被报告 */
+
+    while (poll(&pfd, 1, TX_TIMESTAMP_WAIT_MS) > 0 && (pfd.revents & POLLERR))
+    {
+        memset(&msg, 0, sizeof(msg));
+        msg.msg_control = control;
+        msg.msg_controllen = sizeof(control);
+
+        if (recvmsg(sockfd, &msg, MSG_ERRQUEUE | MSG_DONTWAIT) < 0)
+        {
+            break;
+        }
+
+        int64_t ts = cmsg_timestamp_ns(&msg, hw);
+        if (ts != 0)
+        {
+            return ts;
+        }
+    }
+    return 0;
+}
+
 int main(int argc, char *argv[])
 {
     int sockfd;                     /* UDP套接字描述符 */
@@ -20,31 +81,63 @@ int main(int argc, char *argv[])
     socklen_t server_len;           /* 服务器地址长度 */
     int port;                       /* 服务端口号 */
     const char *server_ip;          /* 服务器IP地址 */
-    char request[] = "TIME";        /* 请求消息（内容不重要） */
+    unsigned char request[TIMEX_REQUEST_SIZE] = "TIME"; /* 请求消息（RFC 868中内容不重要） */
+    size_t request_len = 4;         /* 请求长度 */
+    unsigned char reply[TIMEX_REPLY_SIZE]; /* 应答缓冲区 */
+    int extended = 0;               /* 是否请求扩展应答 */
+    uint64_t tag = 0;               /* 扩展请求标识 */
+    timex_reply_t xr;               /* 解码后的扩展应答 */
+    int got_extended = 0;           /* 是否收到扩展应答 */
     uint32_t network_time;          /* 网络字节序时间值 */
     uint32_t time_value;            /* TIME协议时间值 */
     time_t unix_time;               /* Unix时间戳 */
     char time_str[64];              /* 时间字符串 */
     struct timeval timeout;         /* 超时设置 */
     ssize_t recv_len;               /* 接收数据长度 */
+    int timestamping = 0;           /* 0:关闭 1:软件时间戳 2:硬件时间戳 */
+    char control[CONTROL_SIZE];     /* 接收控制消息缓冲区 */
+    struct iovec iov;               /* 接收数据缓冲区描述 */
+    struct msghdr msg;              /* recvmsg消息头 */
+    int64_t user_send_ns;           /* 调用sendto前的用户态时刻 */
+    int64_t user_recv_ns;           /* recvmsg返回后的用户态时刻 */
+    int opt;
+
+    /* 解析选项 */
+    while ((opt = getopt(argc, argv, "xTH")) != -1)
+    {
+        switch (opt)
+        {
+        case 'x':
+            extended = 1;
+            break;
+        case 'T':
+            timestamping = 1;
+            break;
+        case 'H':
+            timestamping = 2;
+            break;
+        default:
+            print_usage(argv[0]);
+            exit(EXIT_FAILURE);
+        }
+    }
 
     /* 检查参数 */
-    if (argc < 2)
+    if (argc - optind < 1)
     {
-        fprintf(stderr, "Usage: %s <server_ip> [port]\n", argv[0]);
-        fprintf(stderr, "Example: %s 127.0.0.1 8037\n", argv[0]);
+        print_usage(argv[0]);
         exit(EXIT_FAILURE);
     }
 
-    server_ip = argv[1];
+    server_ip = argv[optind];
 
     /* 解析端口参数 */
-    if (argc > 2)
+    if (argc - optind > 1)
     {
-        port = atoi(argv[2]);
+        port = atoi(argv[optind + 1]);
         if (port <= 0 || port > 65535)
         {
-            fprintf(stderr, "Invalid port number: %s\n", argv[2]);
+            fprintf(stderr, "Invalid port number: %s\n", argv[optind + 1]);
             exit(EXIT_FAILURE);
         }
     }
@@ -74,6 +167,13 @@ int main(int argc, char *argv[])
         perror("Warning: Failed to set timeout");
     }
 
+    /* 开启内核收发时间戳 */
+    if (timestamping && enable_timestamping(sockfd, 1, timestamping == 2) < 0)
+    {
+        perror("Warning: Failed to enable SO_TIMESTAMPING");
+        timestamping = 0;
+    }
+
     /* 初始化服务器地址结构 */
     memset(&server_addr, 0, sizeof(server_addr));
     server_addr.sin_family = AF_INET;   /* IPv4 */
@@ -88,8 +188,15 @@ int main(int argc, char *argv[])
     }
 
     /* 发送时间请求 */
-    printf("Sending time request...\n");
-    if (sendto(sockfd, request, strlen(request), 0,
+    printf("Sending time request%s...\n", extended ? " (extended)" : "");
+    if (extended)
+    {
+        tag = (uint64_t)monotonic_ns() ^ ((uint64_t)getpid() << 48);
+        timex_encode_request(request, tag);
+        request_len = TIMEX_REQUEST_SIZE;
+    }
+    user_send_ns = realtime_ns();
+    if (sendto(sockfd, request, request_len, 0,
                (struct sockaddr *)&server_addr, sizeof(server_addr)) < 0)
     {
         close(sockfd);
@@ -97,9 +204,19 @@ int main(int argc, char *argv[])
     }
 
     /* 接收服务器响应 */
+    /* 使用recvmsg接收，以便同时取得内核接收时间戳 */
     server_len = sizeof(server_addr);
-    recv_len = recvfrom(sockfd, &network_time, sizeof(network_time), 0,
-                        (struct sockaddr *)&server_addr, &server_len);
+    iov.iov_base = reply;
+    iov.iov_len = sizeof(reply);
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_name = &server_addr;
+    msg.msg_namelen = server_len;
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = control;
+    msg.msg_controllen = sizeof(control);
+    recv_len = recvmsg(sockfd, &msg, 0);
+    user_recv_ns = realtime_ns();
 
     if (recv_len < 0)
     {
@@ -115,17 +232,31 @@ int main(int argc, char *argv[])
         exit(EXIT_FAILURE);
     }
 
-    if (recv_len != sizeof(network_time))
+    if (extended && timex_decode_reply(reply, (size_t)recv_len, &xr) && xr.tag == tag)
+    {
+        got_extended = 1;
+        /* 32位TIME值与RFC 868一致（2036年后回绕） */
+        time_value = (uint32_t)xr.tx_sec;
+    }
+    else if (recv_len == sizeof(network_time))
+    {
+        if (extended)
+        {
+            printf("Server does not support the extended reply, using RFC 868\n");
+        }
+        memcpy(&network_time, reply, sizeof(network_time));
+
+        /* 转换字节序 */
+        time_value = ntohl(network_time);
+    }
+    else
     {
         close(sockfd);
         fprintf(stderr, "Error: Invalid response size (expected %zu, got %zd)\n",
-                sizeof(network_time), recv_len);
+                extended ? (size_t)TIMEX_REPLY_SIZE : sizeof(network_time), recv_len);
         exit(EXIT_FAILURE);
     }
 
-    /* 转换字节序 */
-    time_value = ntohl(network_time);
-
     /* 转换为Unix时间戳 */
     unix_time = time_protocol_to_unix(time_value);
 
@@ -140,6 +271,10 @@ int main(int argc, char *argv[])
     printf("TIME protocol value : %u\n", time_value);
     printf("Unix timestamp      : %ld\n", (long)unix_time);
     printf("Local time          : %s\n", time_str);
+    if (got_extended)
+    {
+        printf("Server tx time      : %s.%09u\n", time_str, xr.tx_nsec);
+    }
     printf("===========================================\n");
 
     /* 与本地时间比较 */
@@ -147,6 +282,60 @@ int main(int argc, char *argv[])
     long diff = (long)(unix_time - local_time);
     printf("\nTime difference from local: %ld seconds\n", diff);
 
+    /* 延迟拆分：用户态往返 = 发送路径 + 网络及服务器 + 接收路径 */
+    printf("\nRound-trip time     : %.3f us (user space)\n",
+           (user_recv_ns - user_send_ns) / 1000.0);
+    if (timestamping)
+    {
+        int rx_hw = 0, tx_hw = 0;
+        int64_t rx_ns = cmsg_timestamp_ns(&msg, &rx_hw);
+        int64_t tx_ns = read_tx_timestamp(sockfd, &tx_hw);
+
+        if (rx_ns == 0 || tx_ns == 0)
+        {
+            printf("Kernel timestamps   : unavailable (rx %s, tx %s)\n",
+                   rx_ns ? "ok" : "missing", tx_ns ? "ok" : "missing");
+        }
+        else if (rx_hw != tx_hw)
+        {
+            /* 硬件时钟与系统时钟不同源，混用没有意义 */
+            printf("Kernel timestamps   : mixed hardware/software, not comparable\n");
+        }
+        else
+        {
+            int64_t wire_ns = rx_ns - tx_ns;
+            printf("Timestamp source    : %s\n", rx_hw ? "hardware" : "software");
+            printf("  Wire + server     : %.3f us (kernel tx -> kernel rx)\n",
+                   wire_ns / 1000.0);
+            if (!rx_hw)
+            {
+                printf("  Send path         : %.3f us (sendto -> kernel tx)\n",
+                       (tx_ns - user_send_ns) / 1000.0);
+                printf("  Receive path      : %.3f us (kernel rx -> recvmsg return)\n",
+                       (user_recv_ns - rx_ns) / 1000.0);
+            }
+            printf("  User-space share  : %.3f us\n",
+                   (user_recv_ns - user_send_ns - wire_ns) / 1000.0);
+        }
+    }
+
+    /* 扩展应答：服务器收发时刻把往返时间中的服务器处理部分分离出来 */
+    if (got_extended)
+    {
+        int64_t t1 = user_send_ns;
+        int64_t t2 = time_protocol64_to_unix_ns(xr.rx_sec, xr.rx_nsec);
+        int64_t t3 = time_protocol64_to_unix_ns(xr.tx_sec, xr.tx_nsec);
+        int64_t t4 = user_recv_ns;
+
+        printf("\nServer processing   : %.3f us (%s rx -> tx)\n", (t3 - t2) / 1000.0,
+               (xr.flags & TIMEX_FLAG_KERNEL_RX) ? "kernel" : "user-space");
+        /* NTP算法：偏差 = ((t2 - t1) + (t3 - t4)) / 2，延迟 = (t4 - t1) - (t3 - t2) */
+        printf("Network delay       : %.3f us (round trip minus server processing)\n",
+               ((t4 - t1) - (t3 - t2)) / 1000.0);
+        printf("Clock offset        : %+.3f us (server - local)\n",
+               ((t2 - t1) + (t3 - t4)) / 2000.0);
+    }
+
     /* 关闭套接字 */
     close(sockfd);
 
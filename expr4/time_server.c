@@ -1,57 +1,92 @@
 /**
- * time_server.c - 无连接TIME服务器
+ * time_server.c - TIME服务器
  *
- * 使用UDP协议实现RFC 868 TIME协议服务器
+ * 实现RFC 868 TIME协议服务器，UDP与TCP在同一个单线程epoll循环中提供服务
  *
  * 功能：
- * 1. 监听指定UDP端口
- * 2. 接收客户端请求
- * 3. 返回当前时间（从1900年1月1日开始的秒数）
+ * 1. 监听指定端口的UDP和TCP
+ * 2. UDP：收到任意数据报即返回当前时间
+ * 3. TCP：accept后立即写入4字节时间并关闭连接，不保存任何连接状态
+ * 4. 返回当前时间（从1900年1月1日开始的秒数）
+ * 5. UDP扩展：请求以 "TIMX" 开头时返回纳秒精度的扩展应答（见common.h）
  *
- * 用法：./time_server [port]
+ * 用法：./time_server [-q] [-T] [port]
+ *   -q  安静模式，不逐条打印请求（压测时使用，避免终端输出成为瓶颈）
+ *   -T  用内核接收时间戳（SO_TIMESTAMPING）记录请求到达时刻，报告服务器处理延迟
  */
 
+#define _GNU_SOURCE /* accept4, recvmmsg, sendmmsg */
 #include "common.h"
 
-int main(int argc, char *argv[])
+#include <fcntl.h>
+#include <getopt.h>
+#include <signal.h>
+#include <sys/epoll.h>
+
+/* 控制消息缓冲区大小 */
+#define CONTROL_SIZE 512
+
+/* TCP监听队列长度：短连接高频到达，需要较大的backlog */
+#define LISTEN_BACKLOG 4096
+
+/* 每次recvmmsg/sendmmsg处理的最大数据报数 */
+#define UDP_BATCH 32
+
+/* epoll一次返回的最大事件数 */
+#define MAX_EVENTS 16
+
+/* 服务器运行选项 */
+static int quiet = 0;        /* 安静模式 */
+static int timestamping = 0; /* 是否记录内核接收时间戳 */
+
+/* 预留的空闲文件描述符，文件描述符耗尽时用于接受并立即关闭连接 */
+static int reserve_fd = -1;
+
+/**
+ * 打印一条请求日志
+ * @param proto 协议名称
+ * @param addr 客户端地址
+ * @param now 当前Unix时间
+ * @param time_value TIME协议时间值
+ * @param proc_ns 处理延迟（纳秒），为0时不打印
+ */
+static void log_request(const char *proto, const struct sockaddr_in *addr,
+                        time_t now, uint32_t time_value, int64_t proc_ns)
 {
-    int sockfd;                     /* UDP套接字描述符 */
-    struct sockaddr_in server_addr; /* 服务器地址结构 */
-    struct sockaddr_in client_addr; /* 客户端地址结构 */
-    socklen_t client_len;           /* 客户端地址长度 */
-    int port;                       /* 服务端口号 */
-    char buffer[BUFFER_SIZE];       /* 接收缓冲区 */
-    ssize_t recv_len;               /* 接收数据长度 */
-    time_t current_time;            /* 当前Unix时间 */
-    uint32_t time_value;            /* TIME协议时间值 */
-    uint32_t network_time;          /* 网络字节序时间值 */
-    char time_str[64];              /* 时间字符串 */
+    char time_str[64];
 
-    /* 解析端口参数 */
-    if (argc > 1)
-    {
-        port = atoi(argv[1]);
-        if (port <= 0 || port > 65535)
-        {
-            fprintf(stderr, "Invalid port number: %s\n", argv[1]);
-            fprintf(stderr, "Usage: %s [port]\n", argv[0]);
-            exit(EXIT_FAILURE);
-        }
-    }
-    else
+    /* 获取可读的时间字符串 */
+    strftime(time_str, sizeof(time_str), "%Y-%m-%d %H:%M:%S", localtime(&now));
+
+    /* 打印客户端信息 */
+    printf("[Request/%s] From %s:%d\n", proto, inet_ntoa(addr->sin_addr),
+           ntohs(addr->sin_port));
+    printf("  TIME value: %u\n", time_value);
+    if (proc_ns)
     {
-        port = TIME_PORT;
+        printf("  Processing: %.3f us (kernel rx -> reply)\n", proc_ns / 1000.0);
     }
+    printf("  Local time: %s\n\n", time_str);
+}
 
-    /* 创建UDP套接字 */
-    sockfd = socket(AF_INET, SOCK_DGRAM, 0);
+/**
+ * 创建并绑定非阻塞套接字
+ * @param type SOCK_DGRAM或SOCK_STREAM
+ * @param port 端口号
+ * @return 套接字描述符，失败时退出程序
+ */
+static int create_bound_socket(int type, int port)
+{
+    struct sockaddr_in server_addr; /* 服务器地址结构 */
+    int opt = 1;
+
+    int sockfd = socket(AF_INET, type | SOCK_NONBLOCK, 0);
     if (sockfd < 0)
     {
         error_exit("Failed to create socket");
     }
 
     /* 设置套接字选项，允许地址重用 */
-    int opt = 1;
     if (setsockopt(sockfd, SOL_SOCKET, SO_REUSEADDR, &opt, sizeof(opt)) < 0)
     {
         error_exit("Failed to set socket option");
@@ -70,60 +105,315 @@ int main(int argc, char *argv[])
         error_exit("Failed to bind socket");
     }
 
-    printf("===========================================\n");
-    printf("     无连接TIME服务器 (UDP)\n");
-    printf("===========================================\n");
-    printf("TIME Server started on port %d\n", port);
-    printf("Waiting for client requests...\n");
-    printf("Press Ctrl+C to stop the server\n");
-    printf("===========================================\n\n");
+    return sockfd;
+}
+
+/**
+ * 处理UDP套接字上所有已到达的请求，直到EAGAIN
+ * 对于TIME协议，客户端只需发送任意数据即可请求时间；
+ * 以 "TIMX" 魔数开头的请求返回扩展应答（64位秒 + 纳秒，含服务器收发时刻）
+ *
+ * 用recvmmsg/sendmmsg按批处理：一批应答共用一次发送时刻的时钟读取，
+ * 接收时刻的转换也按批完成，扩展编码几乎不增加开销
+ */
+static void handle_udp(int sockfd)
+{
+    static struct sockaddr_in client_addr[UDP_BATCH];           /* 客户端地址 */
+    static unsigned char buffer[UDP_BATCH][BUFFER_SIZE];        /* 接收缓冲区 */
+    static char control[UDP_BATCH][CONTROL_SIZE];               /* 控制消息缓冲区 */
+    static unsigned char reply[UDP_BATCH][TIMEX_REPLY_SIZE];    /* 应答缓冲区 */
+    struct iovec iov[UDP_BATCH], out_iov[UDP_BATCH];            /* 收发数据描述 */
+    struct mmsghdr msgs[UDP_BATCH], out[UDP_BATCH];             /* 收发消息头 */
+    int64_t rx_ns[UDP_BATCH];                                   /* 接收时刻 */
+    uint64_t rx_sec[UDP_BATCH];                                 /* 接收时刻：秒 */
+    uint32_t rx_nsec[UDP_BATCH];                                /* 接收时刻：纳秒 */
+    uint16_t rx_flags[UDP_BATCH];                               /* 扩展应答标志 */
 
-    /* 主循环：等待并处理客户端请求 */
     while (1)
     {
-        client_len = sizeof(client_addr);
+        memset(msgs, 0, sizeof(msgs));
+        for (int i = 0; i < UDP_BATCH; i++)
+        {
+            iov[i].iov_base = buffer[i];
+            iov[i].iov_len = BUFFER_SIZE;
+            msgs[i].msg_hdr.msg_name = &client_addr[i];
+            msgs[i].msg_hdr.msg_namelen = sizeof(client_addr[i]);
+            msgs[i].msg_hdr.msg_iov = &iov[i];
+            msgs[i].msg_hdr.msg_iovlen = 1;
+            msgs[i].msg_hdr.msg_control = control[i];
+            msgs[i].msg_hdr.msg_controllen = CONTROL_SIZE;
+        }
+
+        int n = recvmmsg(sockfd, msgs, UDP_BATCH, 0, NULL);
+        if (n <= 0)
+        {
+            if (n < 0 && errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR)
+            {
+                perror("Failed to receive data");
+            }
+            return;
+        }
+
+        /* 接收时刻：优先使用内核时间戳，否则使用本批的用户态接收时刻 */
+        int64_t batch_rx_ns = realtime_ns();
+        for (int i = 0; i < n; i++)
+        {
+            rx_ns[i] = timestamping ? cmsg_timestamp_ns(&msgs[i].msg_hdr, NULL) : 0;
+            rx_flags[i] = rx_ns[i] ? TIMEX_FLAG_KERNEL_RX : 0;
+            if (!rx_ns[i])
+            {
+                rx_ns[i] = batch_rx_ns;
+            }
+        }
+        unix_ns_to_time_protocol64_batch(rx_ns, rx_sec, rx_nsec, (size_t)n);
 
-        /* 接收客户端请求（阻塞等待） */
-        /* 对于TIME协议，客户端只需发送任意数据即可请求时间 */
-        recv_len = recvfrom(sockfd, buffer, BUFFER_SIZE, 0,
-                            (struct sockaddr *)&client_addr, &client_len);
+        /* 发送时刻：整批共用一次时钟读取 */
+        int64_t tx_ns = realtime_ns();
+        uint64_t tx_sec;
+        uint32_t tx_nsec;
+        unix_ns_to_time_protocol64_batch(&tx_ns, &tx_sec, &tx_nsec, 1);
+        time_t current_time = (time_t)(tx_ns / 1000000000LL);
+        uint32_t time_value = unix_to_time_protocol(current_time);
+        uint32_t network_time = htonl(time_value);
 
-        if (recv_len < 0)
+        memset(out, 0, sizeof(struct mmsghdr) * (size_t)n);
+        for (int i = 0; i < n; i++)
         {
-            perror("Failed to receive data");
-            continue;
+            uint64_t tag;
+            if (timex_parse_request(buffer[i], msgs[i].msg_len, &tag))
+            {
+                timex_encode_reply(reply[i], rx_flags[i], tag, rx_sec[i], rx_nsec[i],
+                                   tx_sec, tx_nsec);
+                out_iov[i].iov_len = TIMEX_REPLY_SIZE;
+            }
+            else
+            {
+                memcpy(reply[i], &network_time, sizeof(network_time));
+                out_iov[i].iov_len = sizeof(network_time);
+            }
+            out_iov[i].iov_base = reply[i];
+            out[i].msg_hdr.msg_name = &client_addr[i];
+            out[i].msg_hdr.msg_namelen = msgs[i].msg_hdr.msg_namelen;
+            out[i].msg_hdr.msg_iov = &out_iov[i];
+            out[i].msg_hdr.msg_iovlen = 1;
+
+            if (!quiet)
+            {
+                /* 处理延迟：内核收到请求 -> 即将发送应答 */
+                int64_t proc_ns = rx_flags[i] ? tx_ns - rx_ns[i] : 0;
+                log_request(out_iov[i].iov_len == TIMEX_REPLY_SIZE ? "UDP+X" : "UDP",
+                            &client_addr[i], current_time, time_value, proc_ns);
+            }
         }
 
-        /* 获取当前时间 */
-        current_time = time(NULL);
+        /* 发送时间值给客户端：sendmmsg可能只发出一部分，剩余的继续发送 */
+        for (int sent = 0; sent < n;)
+        {
+            int rc = sendmmsg(sockfd, out + sent, (unsigned int)(n - sent), 0);
+            if (rc < 0)
+            {
+                if (errno == EINTR)
+                {
+                    continue;
+                }
+                /* 发送缓冲区满或目的地址不可达：丢弃当前这条，继续处理后面的 */
+                if (errno != EAGAIN && errno != EWOULDBLOCK)
+                {
+                    perror("Failed to send data");
+                }
+                rc = 1;
+            }
+            sent += rc;
+        }
 
-        /* 转换为TIME协议时间（从1900年开始的秒数） */
-        time_value = unix_to_time_protocol(current_time);
+        if (n < UDP_BATCH)
+        {
+            return; /* 本批未满，队列已读空 */
+        }
+    }
+}
 
-        /* 转换为网络字节序（大端序） */
-        network_time = htonl(time_value);
+/**
+ * 接受所有排队的TCP连接，直到EAGAIN
+ * 每个连接直接写入4字节时间后关闭：新连接的发送缓冲区为空，
+ * 4字节写入不会阻塞，因此不需要为连接保存任何状态
+ */
+static void handle_tcp(int listenfd)
+{
+    struct sockaddr_in client_addr; /* 客户端地址结构 */
+    socklen_t client_len;           /* 客户端地址长度 */
 
-        /* 获取可读的时间字符串 */
-        strftime(time_str, sizeof(time_str), "%Y-%m-%d %H:%M:%S",
-                 localtime(&current_time));
+    while (1)
+    {
+        client_len = sizeof(client_addr);
+        int connfd = accept4(listenfd, (struct sockaddr *)&client_addr,
+                             &client_len, SOCK_NONBLOCK | SOCK_CLOEXEC);
+        if (connfd < 0)
+        {
+            if (errno == EINTR || errno == ECONNABORTED)
+            {
+                continue;
+            }
+            if ((errno == EMFILE || errno == ENFILE) && reserve_fd >= 0)
+            {
+                /* 文件描述符耗尽：释放预留描述符，接受并立即关闭一个连接，
+                 * 否则水平触发的epoll会在监听套接字上不停返回就绪 */
+                close(reserve_fd);
+                connfd = accept(listenfd, NULL, NULL);
+                if (connfd >= 0)
+                {
+                    close(connfd);
+                }
+                reserve_fd = open("/dev/null", O_RDONLY | O_CLOEXEC);
+                fprintf(stderr, "Out of file descriptors, dropped a connection\n");
+                continue;
+            }
+            if (errno != EAGAIN && errno != EWOULDBLOCK)
+            {
+                perror("Failed to accept connection");
+            }
+            return;
+        }
 
-        /* 打印客户端信息 */
-        printf("[Request] From %s:%d\n",
-               inet_ntoa(client_addr.sin_addr),
-               ntohs(client_addr.sin_port));
-        printf("  TIME value: %u\n", time_value);
-        printf("  Local time: %s\n\n", time_str);
+        time_t current_time = time(NULL);
+        uint32_t time_value = unix_to_time_protocol(current_time);
+        uint32_t network_time = htonl(time_value);
 
-        /* 发送时间值给客户端 */
-        if (sendto(sockfd, &network_time, sizeof(network_time), 0,
-                   (struct sockaddr *)&client_addr, client_len) < 0)
+        if (send(connfd, &network_time, sizeof(network_time), MSG_NOSIGNAL) !=
+            (ssize_t)sizeof(network_time))
         {
             perror("Failed to send data");
-            continue;
+        }
+        close(connfd);
+
+        if (!quiet)
+        {
+            log_request("TCP", &client_addr, current_time, time_value, 0);
+        }
+    }
+}
+
+int main(int argc, char *argv[])
+{
+    int udpfd;                             /* UDP套接字描述符 */
+    int listenfd;                          /* TCP监听套接字描述符 */
+    int epfd;                              /* epoll实例 */
+    int port;                              /* 服务端口号 */
+    struct epoll_event ev;                 /* 注册事件 */
+    struct epoll_event events[MAX_EVENTS]; /* 就绪事件 */
+    int opt;
+
+    /* 解析选项 */
+    while ((opt = getopt(argc, argv, "qT")) != -1)
+    {
+        switch (opt)
+        {
+        case 'q':
+            quiet = 1;
+            break;
+        case 'T':
+            timestamping = 1;
+            break;
+        default:
+            fprintf(stderr, "Usage: %s [-q] [-T] [port]\n", argv[0]);
+            exit(EXIT_FAILURE);
+        }
+    }
+
+    /* 解析端口参数 */
+    if (optind < argc)
+    {
+        port = atoi(argv[optind]);
+        if (port <= 0 || port > 65535)
+        {
+            fprintf(stderr, "Invalid port number: %s\n", argv[optind]);
+            fprintf(stderr, "Usage: %s [-q] [-T] [port]\n", argv[0]);
+            exit(EXIT_FAILURE);
+        }
+    }
+    else
+    {
+        port = TIME_PORT;
+    }
+
+    /* 对端提前关闭时不因SIGPIPE退出 */
+    signal(SIGPIPE, SIG_IGN);
+
+    /* 创建UDP套接字 */
+    udpfd = create_bound_socket(SOCK_DGRAM, port);
+
+    /* 开启内核接收时间戳 */
+    if (timestamping && enable_timestamping(udpfd, 0, 0) < 0)
+    {
+        perror("Warning: Failed to enable SO_TIMESTAMPING");
+        timestamping = 0;
+    }
+
+    /* 创建TCP监听套接字（与UDP使用同一端口号） */
+    listenfd = create_bound_socket(SOCK_STREAM, port);
+    if (listen(listenfd, LISTEN_BACKLOG) < 0)
+    {
+        error_exit("Failed to listen");
+    }
+
+    reserve_fd = open("/dev/null", O_RDONLY | O_CLOEXEC);
+
+    /* 两个套接字注册到同一个epoll实例 */
+    epfd = epoll_create1(EPOLL_CLOEXEC);
+    if (epfd < 0)
+    {
+        error_exit("Failed to create epoll instance");
+    }
+    ev.events = EPOLLIN;
+    ev.data.fd = udpfd;
+    if (epoll_ctl(epfd, EPOLL_CTL_ADD, udpfd, &ev) < 0)
+    {
+        error_exit("Failed to register UDP socket");
+    }
+    ev.events = EPOLLIN;
+    ev.data.fd = listenfd;
+    if (epoll_ctl(epfd, EPOLL_CTL_ADD, listenfd, &ev) < 0)
+    {
+        error_exit("Failed to register TCP socket");
+    }
+
+    printf("===========================================\n");
+    printf("     TIME服务器 (UDP + TCP)\n");
+    printf("===========================================\n");
+    printf("TIME Server started on port %d (UDP and TCP)\n", port);
+    printf("Waiting for client requests...\n");
+    printf("Press Ctrl+C to stop the server\n");
+    printf("===========================================\n\n");
+
+    /* 主循环：等待并处理客户端请求 */
+    while (1)
+    {
+        int nev = epoll_wait(epfd, events, MAX_EVENTS, -1);
+        if (nev < 0)
+        {
+            if (errno == EINTR)
+            {
+                continue;
+            }
+            error_exit("epoll_wait");
+        }
+
+        for (int i = 0; i < nev; i++)
+        {
+            if (events[i].data.fd == udpfd)
+            {
+                handle_udp(udpfd);
+            }
+            else
+            {
+                handle_tcp(listenfd);
+            }
         }
     }
 
     /* 关闭套接字（实际上不会执行到这里） */
-    close(sockfd);
+    close(epfd);
+    close(listenfd);
+    close(udpfd);
     return 0;
 }
@@ -0,0 +1,1061 @@
+/**
+ * 聊天服务器压测工具
+ * 功能：用少量 epoll 线程模拟成千上万个在线用户，按房间分组、以设定的总速率发送带发送时间戳的消息，
+ *       在每个接收者处测量端到端的投递延迟（p50/p99/max）、每秒投递的消息数和丢失率
+ *
+ * 测量方法：
+ * 1. 每个模拟用户一条连接，连接后进入房间 bench<N>（用户 i 在第 i % 房间数 个房间）
+ * 2. 前 -S 个用户是发送者，所有发送者合计按 -r 条/秒开环发送：发送节奏只由目标速率决定，
+ *    不等待投递完成；消息内容以 "#B <轮次> <发送时刻纳秒>" 开头，补齐到 -l 字节
+ * 3. 每个接收者收到消息时用同一个 CLOCK_MONOTONIC 计算延迟（压测工具和服务器在同一台机器时最准确）
+ * 4. 应投递数 = 每条消息发出时所在房间的人数 - 1（服务器不回发给发送者），
+ *    发送结束后再等待 -w 秒，仍未收到的记为丢失
+ * 5. 扫描模式（-M）：保持连接不变，每轮速率翻倍，直到丢失率超过 -L 或达到上限
+ * 6. 压缩模式（-Z）：每个连接协商压缩（见 chat_zip.h），报告线上和解压后的字节数，
+ *    以及接收端解压的耗时；不加 -Z 时线上字节数可以作为对照
+ *
+ * 用法：./chat_bench [选项] [服务器IP] [端口]
+ */
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <time.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdatomic.h>
+#include <stdint.h>
+#include <sys/socket.h>
+#include <sys/types.h>
+#include <sys/epoll.h>
+#include <sys/resource.h>
+#include <fcntl.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+#include "chat_proto.h"
+#include "chat_zip.h"
+
+#define DEFAULT_PORT 8888
+#define DEFAULT_SERVER "127.0.0.1"
+#define DEFAULT_USERS 1000
+#define DEFAULT_THREADS 4
+#define DEFAULT_RATE 100       // 所有发送者合计的消息数/秒
+#define DEFAULT_DURATION 10    // 每轮发送的秒数
+#define DEFAULT_PAYLOAD 64     // 消息内容的字节数
+#define DEFAULT_WAIT 2         // 发送结束后等待投递的秒数
+#define DEFAULT_LOSS_LIMIT 1.0 // 扫描模式允许的丢失率（%）
+#define MAX_ROUNDS 32
+#define MAX_EVENTS 256
+#define RX_BUFFER_SIZE 65536
+#define CARRY_SIZE 4608        // 未凑成完整一行（一帧）的输入，足够放下最长的行和帧
+#define ZIP_CARRY_SIZE (ZIP_FRAME_HEADER + ZIP_FRAME_MAX) // 压缩模式下未收完的一个压缩帧
+#define MARK "#B "             // 压测消息内容的开头
+
+// 延迟直方图：对数-线性分桶，每个 2 的幂区间再分 8 个子桶（单位：微秒）
+#define HIST_SUB_BITS 3
+#define HIST_SUB (1 << HIST_SUB_BITS)
+#define HIST_BUCKETS (HIST_SUB * 2 + HIST_SUB * 40)
+
+typedef struct
+{
+    uint64_t counts[HIST_BUCKETS];
+    uint64_t total;
+    uint64_t max_us;
+    uint64_t sum_us;
+} Histogram;
+
+// 一轮压测的计数（每个线程各一份，轮次结束时汇总）
+typedef struct
+{
+    Histogram latency;
+    uint64_t sent;        // 发出的消息数
+    uint64_t expected;    // 应投递的次数
+    uint64_t received;    // 实际收到的次数
+    uint64_t blocked;     // 发送缓冲区满而没有发出的消息数
+    uint64_t reported;    // 服务器提示“接收过慢，错过了 N 条消息”的合计
+    uint64_t wire_bytes;  // 从套接字收到的字节数
+    uint64_t raw_bytes;   // 解压后的字节数（未压缩的连接等于收到的字节数）
+    uint64_t zip_frames;  // 解压的帧数
+    uint64_t unzip_ns;    // 解压耗时
+} RoundStats;
+
+// 一个模拟用户
+typedef struct
+{
+    int fd;
+    int index;
+    int room;
+    int joined;      // 已收到进入房间的确认
+    int negotiated;  // 二进制模式：已收到服务器回复的魔数
+    int zipped;      // 已收到压缩确认，之后收到的都是压缩帧
+    char *carry;     // 未处理完的输入（按需分配）
+    size_t carry_len;
+    char *zcarry;    // 压缩模式：上一帧解压后剩下的半行（半帧）
+    size_t zcarry_len;
+} User;
+
+// 压测线程：一个 epoll 实例和它负责的用户
+typedef struct
+{
+    int id;
+    pthread_t thread;
+    int epoll_fd;
+    User *users;
+    int user_count;
+    int *senders;     // 本线程负责的发送者在 users[] 中的下标
+    int sender_count;
+    int next_sender;
+    uint64_t scheduled; // 本轮已经安排发送的消息数
+    RoundStats stats[MAX_ROUNDS];
+    z_stream unzip;     // 压缩模式：本线程所有连接共用的解压状态（每帧重置）
+    char rx_buf[RX_BUFFER_SIZE + ZIP_CARRY_SIZE];
+    char zip_buf[CARRY_SIZE + ZIP_FRAME_MAX];
+} Worker;
+
+// 配置
+struct sockaddr_in server_addr;
+int user_total = DEFAULT_USERS;
+int thread_count = DEFAULT_THREADS;
+int room_count = 1;
+int sender_total = -1;
+int payload_size = DEFAULT_PAYLOAD;
+int use_binary = 0;
+int use_zip = 0;
+int duration = DEFAULT_DURATION;
+int wait_secs = DEFAULT_WAIT;
+
+// 线程间共享的状态：轮次参数只在两次屏障之间由主线程修改
+Worker *workers = NULL;
+atomic_int *room_members = NULL;  // 每个房间当前的在线人数
+atomic_int connected_count = 0;
+atomic_int joined_count = 0;
+atomic_int disconnect_count = 0;  // 被服务器断开的连接数
+atomic_int sync_request = 0;      // 主线程请求各线程停在屏障处
+pthread_barrier_t barrier;
+int bench_running = 1;
+int current_round = -1;
+double round_rate = 0;            // 本轮每个发送者的平均速率（条/秒）
+int64_t round_start = 0;
+int64_t round_end = 0;
+volatile sig_atomic_t interrupted = 0;
+
+static int64_t monotonic_ns(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (int64_t)ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+// 计算延迟（微秒）所属的直方图桶
+static int hist_bucket(uint64_t us)
+{
+    if (us < 2 * HIST_SUB)
+    {
+        return (int)us;
+    }
+    int msb = 63 - __builtin_clzll(us);
+    int sub = (int)((us >> (msb - HIST_SUB_BITS)) & (HIST_SUB - 1));
+    int idx = 2 * HIST_SUB + (msb - HIST_SUB_BITS - 1) * HIST_SUB + sub;
+    return idx < HIST_BUCKETS ? idx : HIST_BUCKETS - 1;
+}
+
+// 直方图桶的上界（微秒）
+static uint64_t hist_upper(int idx)
+{
+    if (idx < 2 * HIST_SUB)
+    {
+        return (uint64_t)idx;
+    }
+    int msb = (idx - 2 * HIST_SUB) / HIST_SUB + HIST_SUB_BITS + 1;
+    int sub = (idx - 2 * HIST_SUB) % HIST_SUB;
+    uint64_t base = 1ULL << msb;
+    uint64_t step = 1ULL << (msb - HIST_SUB_BITS);
+    return base + (uint64_t)(sub + 1) * step - 1;
+}
+
+static void hist_add(Histogram *h, uint64_t us)
+{
+    h->counts[hist_bucket(us)]++;
+    h->total++;
+    h->sum_us += us;
+    if (us > h->max_us)
+    {
+        h->max_us = us;
+    }
+}
+
+static void hist_merge(Histogram *dst, const Histogram *src)
+{
+    for (int i = 0; i < HIST_BUCKETS; i++)
+    {
+        dst->counts[i] += src->counts[i];
+    }
+    dst->total += src->total;
+    dst->sum_us += src->sum_us;
+    if (src->max_us > dst->max_us)
+    {
+        dst->max_us = src->max_us;
+    }
+}
+
+static uint64_t hist_percentile(const Histogram *h, double pct)
+{
+    if (h->total == 0)
+    {
+        return 0;
+    }
+    uint64_t target = (uint64_t)(h->total * pct / 100.0);
+    if (target >= h->total)
+    {
+        target = h->total - 1;
+    }
+    uint64_t seen = 0;
+    for (int i = 0; i < HIST_BUCKETS; i++)
+    {
+        seen += h->counts[i];
+        if (seen > target)
+        {
+            uint64_t upper = hist_upper(i);
+            return upper < h->max_us ? upper : h->max_us;
+        }
+    }
+    return h->max_us;
+}
+
+// 按 2 的幂区间汇总打印直方图
+static void hist_print(const Histogram *h)
+{
+    if (h->total == 0)
+    {
+        return;
+    }
+    printf("投递延迟分布 (微秒):\n");
+    uint64_t lo = 0;
+    uint64_t hi = 1;
+    uint64_t bucket_count = 0;
+    for (int i = 0; i < HIST_BUCKETS; i++)
+    {
+        uint64_t upper = hist_upper(i);
+        while (upper >= hi)
+        {
+            if (bucket_count > 0)
+            {
+                printf("  [%7lu, %7lu) %10lu  %6.2f%%\n", (unsigned long)lo,
+                       (unsigned long)hi, (unsigned long)bucket_count,
+                       100.0 * bucket_count / h->total);
+            }
+            lo = hi;
+            hi <<= 1;
+            bucket_count = 0;
+        }
+        bucket_count += h->counts[i];
+    }
+    if (bucket_count > 0)
+    {
+        printf("  [%7lu, %7lu) %10lu  %6.2f%%\n", (unsigned long)lo,
+               (unsigned long)hi, (unsigned long)bucket_count,
+               100.0 * bucket_count / h->total);
+    }
+}
+
+// 发送一条命令或帧（连接建立阶段使用，数据量很小，一次发完）
+static int send_all(int fd, const char *data, size_t len)
+{
+    while (len > 0)
+    {
+        ssize_t n = send(fd, data, len, MSG_NOSIGNAL);
+        if (n < 0)
+        {
+            if (errno == EINTR)
+            {
+                continue;
+            }
+            return -1;
+        }
+        data += n;
+        len -= (size_t)n;
+    }
+    return 0;
+}
+
+// 建立连接并进入房间：文本模式发送 "/join bench<N>"，二进制模式发送魔数和 OP_JOIN 帧
+static int user_connect(Worker *w, User *u)
+{
+    char buffer[64];
+    u->fd = socket(AF_INET, SOCK_STREAM, 0);
+    if (u->fd < 0)
+    {
+        return -1;
+    }
+    if (connect(u->fd, (struct sockaddr *)&server_addr, sizeof(server_addr)) < 0)
+    {
+        close(u->fd);
+        u->fd = -1;
+        return -1;
+    }
+    int opt = 1;
+    setsockopt(u->fd, IPPROTO_TCP, TCP_NODELAY, &opt, sizeof(opt));
+
+    int n;
+    if (use_binary)
+    {
+        int room_len = snprintf(buffer + PROTO_MAGIC_LEN + PROTO_HEADER_SIZE,
+                                sizeof(buffer) - PROTO_MAGIC_LEN - PROTO_HEADER_SIZE,
+                                "bench%d", u->room);
+        memcpy(buffer, PROTO_MAGIC, PROTO_MAGIC_LEN);
+        proto_put_header(buffer + PROTO_MAGIC_LEN, OP_JOIN, (size_t)room_len);
+        n = PROTO_MAGIC_LEN + PROTO_HEADER_SIZE + room_len;
+        if (use_zip)
+        {
+            proto_put_header(buffer + n, OP_COMPRESS, 0);
+            n += PROTO_HEADER_SIZE;
+        }
+    }
+    else
+    {
+        n = snprintf(buffer, sizeof(buffer), "/join bench%d\n%s", u->room,
+                     use_zip ? "/compress\n" : "");
+    }
+    if (send_all(u->fd, buffer, (size_t)n) < 0)
+    {
+        close(u->fd);
+        u->fd = -1;
+        return -1;
+    }
+
+    int flags = fcntl(u->fd, F_GETFL, 0);
+    fcntl(u->fd, F_SETFL, flags | O_NONBLOCK);
+    struct epoll_event ev;
+    ev.events = EPOLLIN | EPOLLRDHUP;
+    ev.data.ptr = u;
+    if (epoll_ctl(w->epoll_fd, EPOLL_CTL_ADD, u->fd, &ev) < 0)
+    {
+        close(u->fd);
+        u->fd = -1;
+        return -1;
+    }
+    atomic_fetch_add(&room_members[u->room], 1);
+    return 0;
+}
+
+// 连接被服务器关闭（接收过慢被断开或服务器退出）
+static void user_lost(User *u)
+{
+    close(u->fd);
+    u->fd = -1;
+    free(u->carry);
+    u->carry = NULL;
+    u->carry_len = 0;
+    free(u->zcarry);
+    u->zcarry = NULL;
+    u->zcarry_len = 0;
+    atomic_fetch_sub(&room_members[u->room], 1);
+    atomic_fetch_add(&disconnect_count, 1);
+}
+
+// 处理一条消息内容（文本行或帧负载）：压测消息记录延迟，系统消息检查进房确认和丢弃提示
+static void handle_text(Worker *w, User *u, const char *text, size_t len, int64_t now)
+{
+    const char *mark = memmem(text, len, MARK, strlen(MARK));
+    if (mark != NULL)
+    {
+        char *end;
+        int round = (int)strtol(mark + strlen(MARK), &end, 10);
+        long long sent = strtoll(end, NULL, 10);
+        if (round >= 0 && round < MAX_ROUNDS && sent > 0)
+        {
+            RoundStats *st = &w->stats[round];
+            st->received++;
+            hist_add(&st->latency, now > sent ? (uint64_t)(now - sent) / 1000 : 0);
+        }
+        return;
+    }
+    if (use_zip && !u->zipped && len == strlen(ZIP_ACK_TEXT) - 1 &&
+        memcmp(text, ZIP_ACK_TEXT, len) == 0)
+    {
+        u->zipped = 1;
+        return;
+    }
+    if (!u->joined && memmem(text, len, "你已进入房间", strlen("你已进入房间")) != NULL)
+    {
+        u->joined = 1;
+        atomic_fetch_add(&joined_count, 1);
+        return;
+    }
+    const char *missed = memmem(text, len, "错过了 ", strlen("错过了 "));
+    if (missed != NULL && current_round >= 0)
+    {
+        w->stats[current_round].reported += strtoull(missed + strlen("错过了 "), NULL, 10);
+    }
+}
+
+// 文本协议：按行切分，返回已处理的字节数。收到压缩确认时停下，之后的字节是压缩帧
+static size_t parse_lines(Worker *w, User *u, const char *data, size_t len, int64_t now)
+{
+    size_t off = 0;
+    const char *nl;
+    int zipped = u->zipped;
+    while (u->zipped == zipped && (nl = memchr(data + off, '\n', len - off)) != NULL)
+    {
+        handle_text(w, u, data + off, (size_t)(nl - data - off), now);
+        off = (size_t)(nl - data) + 1;
+    }
+    return off;
+}
+
+// 二进制协议：先丢弃魔数之前的字节，之后按长度字段切帧，返回已处理的字节数。
+// 收到 OP_COMPRESS_ON 时停下，之后的字节是压缩帧
+static size_t parse_frames(Worker *w, User *u, const char *data, size_t len, int64_t now)
+{
+    size_t off = 0;
+    int zipped = u->zipped;
+    if (!u->negotiated)
+    {
+        const char *magic = memmem(data, len, PROTO_MAGIC, PROTO_MAGIC_LEN);
+        if (magic == NULL)
+        {
+            // 保留末尾可能是半个魔数的几个字节
+            return len > PROTO_MAGIC_LEN ? len - (PROTO_MAGIC_LEN - 1) : 0;
+        }
+        u->negotiated = 1;
+        off = (size_t)(magic - data) + PROTO_MAGIC_LEN;
+    }
+    while (u->zipped == zipped && len - off >= PROTO_HEADER_SIZE)
+    {
+        size_t n = proto_get_len(data + off);
+        if (len - off < PROTO_LEN_SIZE + n)
+        {
+            break;
+        }
+        uint8_t type = (uint8_t)data[off + PROTO_LEN_SIZE];
+        const char *payload = data + off + PROTO_HEADER_SIZE;
+        size_t payload_len = n - 1;
+        if (type == OP_CHAT_FROM && payload_len > 0)
+        {
+            // 跳过发送者昵称
+            size_t name_len = (unsigned char)payload[0];
+            if (1 + name_len <= payload_len)
+            {
+                handle_text(w, u, payload + 1 + name_len, payload_len - 1 - name_len, now);
+            }
+        }
+        else if (type == OP_SYSTEM)
+        {
+            handle_text(w, u, payload, payload_len, now);
+        }
+        else if (type == OP_COMPRESS_ON)
+        {
+            u->zipped = 1;
+        }
+        off += PROTO_LEN_SIZE + n;
+    }
+    return off;
+}
+
+// 压缩模式：逐帧解压，解压后的数据接在上一帧剩下的半行（半帧）之后解析。
+// 返回已处理的字节数，帧损坏时断开连接
+static size_t user_unzip(Worker *w, User *u, const char *data, size_t len, int64_t now)
+{
+    RoundStats *st = current_round >= 0 ? &w->stats[current_round] : NULL;
+    size_t off = 0;
+    for (;;)
+    {
+        size_t have = u->zcarry_len;
+        if (have > 0)
+        {
+            memcpy(w->zip_buf, u->zcarry, have);
+        }
+        size_t raw_len;
+        int64_t t0 = monotonic_ns();
+        long n = zip_unframe(&w->unzip, data + off, len - off, w->zip_buf + have, &raw_len);
+        if (n == 0)
+        {
+            return off;
+        }
+        if (n < 0)
+        {
+            fprintf(stderr, "用户 %d 收到损坏的压缩帧\n", u->index);
+            user_lost(u);
+            return len;
+        }
+        if (st != NULL)
+        {
+            st->unzip_ns += (uint64_t)(monotonic_ns() - t0);
+            st->zip_frames++;
+            st->raw_bytes += raw_len;
+        }
+        off += (size_t)n;
+        size_t total = have + raw_len;
+        size_t used = use_binary ? parse_frames(w, u, w->zip_buf, total, now)
+                                 : parse_lines(w, u, w->zip_buf, total, now);
+        u->zcarry_len = total - used;
+        if (u->zcarry_len > CARRY_SIZE)
+        {
+            u->zcarry_len = 0; // 超长的行不可能是压测消息，丢弃
+        }
+        if (u->zcarry_len > 0 && u->zcarry == NULL &&
+            (u->zcarry = malloc(CARRY_SIZE)) == NULL)
+        {
+            u->zcarry_len = 0;
+        }
+        if (u->zcarry_len > 0)
+        {
+            memcpy(u->zcarry, w->zip_buf + used, u->zcarry_len);
+        }
+    }
+}
+
+// 读空连接上的数据。直接在线程共享的读缓冲区中解析，只有剩下半行（半帧）时才拷贝到该用户的 carry
+static void user_read(Worker *w, User *u)
+{
+    for (;;)
+    {
+        size_t have = u->carry_len;
+        if (have > 0)
+        {
+            memcpy(w->rx_buf, u->carry, have);
+        }
+        ssize_t n = recv(u->fd, w->rx_buf + have, sizeof(w->rx_buf) - have, 0);
+        if (n == 0 || (n < 0 && errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR))
+        {
+            user_lost(u);
+            return;
+        }
+        if (n < 0)
+        {
+            return;
+        }
+        int64_t now = monotonic_ns();
+        size_t len = have + (size_t)n;
+        size_t used = 0;
+        if (current_round >= 0)
+        {
+            w->stats[current_round].wire_bytes += (uint64_t)n;
+            w->stats[current_round].raw_bytes += u->zipped ? 0 : (uint64_t)n;
+        }
+        if (!u->zipped)
+        {
+            used = use_binary ? parse_frames(w, u, w->rx_buf, len, now)
+                              : parse_lines(w, u, w->rx_buf, len, now);
+        }
+        if (u->zipped)
+        {
+            used += user_unzip(w, u, w->rx_buf + used, len - used, now);
+            if (u->fd < 0)
+            {
+                return;
+            }
+        }
+        u->carry_len = len - used;
+        if (u->carry_len > (u->zipped ? ZIP_CARRY_SIZE : CARRY_SIZE))
+        {
+            // 超长的行不可能是压测消息，丢弃
+            u->carry_len = 0;
+        }
+        if (u->carry_len == 0)
+        {
+            free(u->carry);
+            u->carry = NULL;
+            continue;
+        }
+        if (u->carry == NULL &&
+            (u->carry = malloc(use_zip ? ZIP_CARRY_SIZE : CARRY_SIZE)) == NULL)
+        {
+            u->carry_len = 0;
+            continue;
+        }
+        memcpy(u->carry, w->rx_buf + used, u->carry_len);
+    }
+}
+
+// 由一个发送者发出一条压测消息，内容带轮次和发送时刻
+static void send_one(Worker *w, User *u)
+{
+    char buffer[PROTO_HEADER_SIZE + PROTO_MAX_FRAME];
+    char *text = buffer + (use_binary ? PROTO_HEADER_SIZE : 0);
+    RoundStats *st = &w->stats[current_round];
+    int64_t now = monotonic_ns();
+    int n = snprintf(text, 64, MARK "%d %lld ", current_round, (long long)now);
+    if (n < payload_size)
+    {
+        memset(text + n, 'x', (size_t)(payload_size - n));
+        n = payload_size;
+    }
+    size_t len;
+    if (use_binary)
+    {
+        proto_put_header(buffer, OP_CHAT, (size_t)n);
+        len = PROTO_HEADER_SIZE + (size_t)n;
+    }
+    else
+    {
+        text[n] = '\n';
+        len = (size_t)n + 1;
+    }
+    // 发送缓冲区满时整条放弃，不发半条；服务器读得慢本身就是要测量的现象
+    ssize_t sent = send(u->fd, buffer, len, MSG_NOSIGNAL | MSG_DONTWAIT);
+    if (sent == (ssize_t)len)
+    {
+        st->sent++;
+        st->expected += (uint64_t)(atomic_load(&room_members[u->room]) - 1);
+    }
+    else if (sent >= 0 || errno == EAGAIN || errno == EWOULDBLOCK)
+    {
+        st->blocked++;
+        if (sent > 0)
+        {
+            user_lost(u); // 发出了半条，字节流已经乱了
+        }
+    }
+}
+
+// 补发本轮到期的消息：目标发送数 = 已过时间 × 本线程的速率，发送者轮流发送
+static void send_due(Worker *w, int64_t now)
+{
+    if (current_round < 0 || w->sender_count == 0 || now < round_start)
+    {
+        return;
+    }
+    int64_t t = now < round_end ? now : round_end;
+    uint64_t due = (uint64_t)((double)(t - round_start) / 1e9 * round_rate * w->sender_count);
+    while (w->scheduled < due)
+    {
+        User *u = &w->users[w->senders[w->next_sender]];
+        w->next_sender = (w->next_sender + 1) % w->sender_count;
+        w->scheduled++;
+        if (u->fd >= 0)
+        {
+            send_one(w, u);
+        }
+    }
+}
+
+// 压测线程：先建立本线程负责的所有连接，之后循环收消息、按节拍发消息，
+// 主线程请求同步时停在屏障处（此时主线程汇总计数、设置下一轮参数）
+void *worker_main(void *arg)
+{
+    Worker *w = arg;
+    struct epoll_event events[MAX_EVENTS];
+
+    for (int i = 0; i < w->user_count && !interrupted; i++)
+    {
+        if (user_connect(w, &w->users[i]) == 0)
+        {
+            atomic_fetch_add(&connected_count, 1);
+        }
+    }
+
+    for (;;)
+    {
+        if (atomic_load(&sync_request))
+        {
+            pthread_barrier_wait(&barrier);
+            pthread_barrier_wait(&barrier); // 主线程在两次屏障之间修改轮次参数
+            w->scheduled = 0;
+            if (!bench_running)
+            {
+                break;
+            }
+        }
+        int n = epoll_wait(w->epoll_fd, events, MAX_EVENTS, 1);
+        for (int i = 0; i < n; i++)
+        {
+            User *u = events[i].data.ptr;
+            if (u->fd >= 0)
+            {
+                user_read(w, u);
+            }
+        }
+        send_due(w, monotonic_ns());
+    }
+
+    for (int i = 0; i < w->user_count; i++)
+    {
+        if (w->users[i].fd >= 0)
+        {
+            close(w->users[i].fd);
+        }
+        free(w->users[i].carry);
+        free(w->users[i].zcarry);
+    }
+    return NULL;
+}
+
+// 让所有线程停在屏障处，调用 fn 之后放行
+static void sync_workers(void (*fn)(void *), void *arg)
+{
+    atomic_store(&sync_request, 1);
+    pthread_barrier_wait(&barrier);
+    fn(arg);
+    atomic_store(&sync_request, 0);
+    pthread_barrier_wait(&barrier);
+}
+
+typedef struct
+{
+    int round;         // 下一轮的轮次，-1 表示停止发送
+    double rate;       // 所有发送者合计的速率
+    RoundStats total;  // 输出：刚结束的一轮的汇总
+    int exit;          // 结束压测，线程退出
+} RoundControl;
+
+// 汇总刚结束的一轮的计数并设置下一轮参数（各线程都停在屏障处时调用）
+static void round_switch(void *arg)
+{
+    RoundControl *rc = arg;
+    if (current_round >= 0)
+    {
+        memset(&rc->total, 0, sizeof(rc->total));
+        for (int i = 0; i < thread_count; i++)
+        {
+            RoundStats *st = &workers[i].stats[current_round];
+            hist_merge(&rc->total.latency, &st->latency);
+            rc->total.sent += st->sent;
+            rc->total.expected += st->expected;
+            rc->total.received += st->received;
+            rc->total.blocked += st->blocked;
+            rc->total.reported += st->reported;
+            rc->total.wire_bytes += st->wire_bytes;
+            rc->total.raw_bytes += st->raw_bytes;
+            rc->total.zip_frames += st->zip_frames;
+            rc->total.unzip_ns += st->unzip_ns;
+        }
+    }
+    if (rc->exit)
+    {
+        bench_running = 0;
+    }
+    current_round = rc->round;
+    if (current_round < 0)
+    {
+        return;
+    }
+    round_rate = rc->rate / sender_total;
+    round_start = monotonic_ns() + 10000000LL; // 10 毫秒后所有线程同时开始
+    round_end = round_start + (int64_t)duration * 1000000000LL;
+}
+
+static void signal_handler(int sig)
+{
+    (void)sig;
+    interrupted = 1;
+}
+
+// 睡眠 ms 毫秒，收到 Ctrl+C 时提前返回
+static void sleep_ms(long ms)
+{
+    while (ms > 0 && !interrupted)
+    {
+        long step = ms < 100 ? ms : 100;
+        usleep((useconds_t)step * 1000);
+        ms -= step;
+    }
+}
+
+static double loss_percent(const RoundStats *st)
+{
+    if (st->expected == 0 || st->received >= st->expected)
+    {
+        return 0.0;
+    }
+    return 100.0 * (double)(st->expected - st->received) / (double)st->expected;
+}
+
+static void print_round(double rate, const RoundStats *st, int verbose)
+{
+    const Histogram *h = &st->latency;
+    if (!verbose)
+    {
+        printf("%10.0f %10.0f %12.0f %8.3f%% %9lu %9lu %9lu %9lu\n", rate,
+               (double)st->sent / duration, (double)st->received / duration,
+               loss_percent(st), (unsigned long)hist_percentile(h, 50.0),
+               (unsigned long)hist_percentile(h, 99.0),
+               (unsigned long)hist_percentile(h, 99.9), (unsigned long)h->max_us);
+        return;
+    }
+    printf("===========================================\n");
+    printf("协议                : %s%s\n", use_binary ? "二进制" : "文本",
+           use_zip ? " (压缩)" : "");
+    printf("在线用户 / 房间     : %d / %d (发送者 %d)\n",
+           atomic_load(&connected_count), room_count, sender_total);
+    printf("目标发送速率        : %.0f 条/秒\n", rate);
+    printf("实际发送速率        : %.0f 条/秒\n", (double)st->sent / duration);
+    printf("投递速率            : %.0f 条/秒\n", (double)st->received / duration);
+    printf("应投递 / 实际收到   : %lu / %lu\n", (unsigned long)st->expected,
+           (unsigned long)st->received);
+    printf("丢失率              : %.3f%%\n", loss_percent(st));
+    printf("接收字节 (线上)     : %lu (每条投递 %.1f 字节)\n", (unsigned long)st->wire_bytes,
+           st->received ? (double)st->wire_bytes / st->received : 0.0);
+    if (use_zip && st->raw_bytes > 0)
+    {
+        printf("解压后字节          : %lu (线上为解压后的 %.1f%%)\n",
+               (unsigned long)st->raw_bytes, 100.0 * st->wire_bytes / st->raw_bytes);
+        printf("解压 帧数 / 耗时    : %lu / %.1f 毫秒 (每帧 %.2f 微秒, %.0f MB/s)\n",
+               (unsigned long)st->zip_frames, st->unzip_ns / 1e6,
+               st->zip_frames ? st->unzip_ns / 1e3 / st->zip_frames : 0.0,
+               st->unzip_ns ? st->raw_bytes * 1e3 / st->unzip_ns : 0.0);
+    }
+    if (st->reported > 0)
+    {
+        printf("服务器提示错过      : %lu 条\n", (unsigned long)st->reported);
+    }
+    if (st->blocked > 0)
+    {
+        printf("发送缓冲区满未发出  : %lu 条\n", (unsigned long)st->blocked);
+    }
+    if (atomic_load(&disconnect_count) > 0)
+    {
+        printf("被服务器断开的连接  : %d\n", atomic_load(&disconnect_count));
+    }
+    if (h->total > 0)
+    {
+        printf("延迟 avg/p50/p90/p99/p99.9/max (微秒): %lu / %lu / %lu / %lu / %lu / %lu\n",
+               (unsigned long)(h->sum_us / h->total),
+               (unsigned long)hist_percentile(h, 50.0),
+               (unsigned long)hist_percentile(h, 90.0),
+               (unsigned long)hist_percentile(h, 99.0),
+               (unsigned long)hist_percentile(h, 99.9),
+               (unsigned long)h->max_us);
+        hist_print(h);
+    }
+    printf("===========================================\n");
+}
+
+static void usage(const char *prog)
+{
+    printf("用法: %s [选项] [服务器IP] [端口]\n", prog);
+    printf("  -u 用户数    模拟的在线用户数 (默认 %d)\n", DEFAULT_USERS);
+    printf("  -t 线程数    epoll 线程数 (默认 %d)\n", DEFAULT_THREADS);
+    printf("  -R 房间数    用户平均分到 bench0..benchN-1 (默认 1)\n");
+    printf("  -S 发送者数  前 N 个用户发送消息 (默认全部用户)\n");
+    printf("  -r 速率      所有发送者合计的消息数/秒 (默认 %d)\n", DEFAULT_RATE);
+    printf("  -d 秒        每轮发送时长 (默认 %d)\n", DEFAULT_DURATION);
+    printf("  -l 字节      消息内容长度 (默认 %d，最大 %d)\n", DEFAULT_PAYLOAD,
+           PROTO_MAX_FRAME - 1);
+    printf("  -w 秒        发送结束后等待投递的时间 (默认 %d)\n", DEFAULT_WAIT);
+    printf("  -B           使用二进制协议\n");
+    printf("  -Z           协商压缩，报告压缩率和解压耗时\n");
+    printf("  -M 最大速率  扫描模式：从 -r 开始每轮速率翻倍直到该值\n");
+    printf("  -L 百分比    扫描模式允许的丢失率 (默认 %.1f%%)\n", DEFAULT_LOSS_LIMIT);
+    printf("示例: %s -u 2000 -R 10 -r 5000 127.0.0.1 8888\n", prog);
+    printf("      %s -u 1000 -r 100 -M 6400 -d 5 127.0.0.1 8888\n", prog);
+}
+
+int main(int argc, char *argv[])
+{
+    const char *server_ip = DEFAULT_SERVER;
+    int port = DEFAULT_PORT;
+    double rate = DEFAULT_RATE;
+    double max_rate = 0;
+    double loss_limit = DEFAULT_LOSS_LIMIT;
+    int opt;
+
+    while ((opt = getopt(argc, argv, "u:t:R:S:r:d:l:w:BZM:L:h")) != -1)
+    {
+        switch (opt)
+        {
+        case 'u':
+            user_total = atoi(optarg);
+            break;
+        case 't':
+            thread_count = atoi(optarg);
+            break;
+        case 'R':
+            room_count = atoi(optarg);
+            break;
+        case 'S':
+            sender_total = atoi(optarg);
+            break;
+        case 'r':
+            rate = atof(optarg);
+            break;
+        case 'd':
+            duration = atoi(optarg);
+            break;
+        case 'l':
+            payload_size = atoi(optarg);
+            break;
+        case 'w':
+            wait_secs = atoi(optarg);
+            break;
+        case 'B':
+            use_binary = 1;
+            break;
+        case 'Z':
+            use_zip = 1;
+            break;
+        case 'M':
+            max_rate = atof(optarg);
+            break;
+        case 'L':
+            loss_limit = atof(optarg);
+            break;
+        case 'h':
+            usage(argv[0]);
+            return 0;
+        default:
+            usage(argv[0]);
+            return 1;
+        }
+    }
+    if (optind < argc)
+    {
+        server_ip = argv[optind];
+    }
+    if (optind + 1 < argc)
+    {
+        port = atoi(argv[optind + 1]);
+    }
+    if (sender_total < 0 || sender_total > user_total)
+    {
+        sender_total = user_total;
+    }
+    if (user_total < 2 || thread_count < 1 || room_count < 1 || room_count > user_total ||
+        sender_total < 1 || rate <= 0 || duration < 1 || wait_secs < 0 ||
+        payload_size < 40 || payload_size > PROTO_MAX_FRAME - 1 || port <= 0 || port > 65535)
+    {
+        fprintf(stderr, "参数无效\n");
+        usage(argv[0]);
+        return 1;
+    }
+    if (thread_count > user_total)
+    {
+        thread_count = user_total;
+    }
+
+    memset(&server_addr, 0, sizeof(server_addr));
+    server_addr.sin_family = AF_INET;
+    server_addr.sin_port = htons(port);
+    if (inet_pton(AF_INET, server_ip, &server_addr.sin_addr) <= 0)
+    {
+        fprintf(stderr, "无效的服务器地址: %s\n", server_ip);
+        return 1;
+    }
+
+    // 每个用户一个套接字，提高文件描述符上限
+    struct rlimit rl;
+    if (getrlimit(RLIMIT_NOFILE, &rl) == 0 && rl.rlim_cur < rl.rlim_max)
+    {
+        rl.rlim_cur = rl.rlim_max;
+        setrlimit(RLIMIT_NOFILE, &rl);
+    }
+    signal(SIGPIPE, SIG_IGN);
+    signal(SIGINT, signal_handler);
+
+    room_members = calloc((size_t)room_count, sizeof(atomic_int));
+    workers = calloc((size_t)thread_count, sizeof(Worker));
+    if (room_members == NULL || workers == NULL)
+    {
+        perror("内存分配失败");
+        return 1;
+    }
+    // 用户 i 属于线程 i % 线程数、房间 i % 房间数；前 sender_total 个用户是发送者
+    for (int t = 0; t < thread_count; t++)
+    {
+        Worker *w = &workers[t];
+        int count = user_total / thread_count + (t < user_total % thread_count);
+        w->id = t;
+        w->epoll_fd = epoll_create1(0);
+        w->users = calloc((size_t)count, sizeof(User));
+        w->senders = calloc((size_t)count, sizeof(int));
+        if (w->epoll_fd < 0 || w->users == NULL || w->senders == NULL ||
+            (use_zip && zip_inflate_init(&w->unzip) < 0))
+        {
+            perror("初始化压测线程失败");
+            return 1;
+        }
+        for (int i = 0; i < count; i++)
+        {
+            User *u = &w->users[i];
+            u->fd = -1;
+            u->index = t + i * thread_count;
+            u->room = u->index % room_count;
+            if (u->index < sender_total)
+            {
+                w->senders[w->sender_count++] = i;
+            }
+        }
+        w->user_count = count;
+    }
+    pthread_barrier_init(&barrier, NULL, (unsigned)thread_count + 1);
+
+    printf("连接 %s:%d，%d 个用户，%d 个房间，%d 个线程，%s协议%s...\n", server_ip, port,
+           user_total, room_count, thread_count, use_binary ? "二进制" : "文本",
+           use_zip ? "，压缩" : "");
+    int64_t t0 = monotonic_ns();
+    for (int t = 0; t < thread_count; t++)
+    {
+        if (pthread_create(&workers[t].thread, NULL, worker_main, &workers[t]) != 0)
+        {
+            perror("创建压测线程失败");
+            return 1;
+        }
+    }
+
+    // 等所有用户都进入房间（服务器的加入通知也在这段时间收完），最多等 30 秒
+    int last = -1, stable = 0;
+    while (!interrupted && stable < 20)
+    {
+        sleep_ms(100);
+        int joined = atomic_load(&joined_count);
+        if (joined == user_total)
+        {
+            break;
+        }
+        stable = joined == last ? stable + 1 : 0;
+        last = joined;
+        if (monotonic_ns() - t0 > 30000000000LL)
+        {
+            break;
+        }
+    }
+    printf("已连接 %d 个，进入房间 %d 个，用时 %.2f 秒\n", atomic_load(&connected_count),
+           atomic_load(&joined_count), (monotonic_ns() - t0) / 1e9);
+    sleep_ms(1000); // 等待加入通知的广播平息
+
+    RoundControl rc;
+    memset(&rc, 0, sizeof(rc));
+    if (max_rate > 0)
+    {
+        printf("\n%10s %10s %12s %9s %9s %9s %9s %9s\n", "目标速率", "发送/秒", "投递/秒",
+               "丢失率", "p50(us)", "p99(us)", "p99.9(us)", "max(us)");
+    }
+    for (int round = 0; round < MAX_ROUNDS && !interrupted; round++)
+    {
+        rc.round = round;
+        rc.rate = rate;
+        sync_workers(round_switch, &rc);
+        sleep_ms((duration + wait_secs) * 1000L + 10);
+        rc.round = -1;
+        sync_workers(round_switch, &rc);
+
+        print_round(rate, &rc.total, max_rate <= 0);
+        if (max_rate <= 0 || loss_percent(&rc.total) > loss_limit || rate * 2 > max_rate)
+        {
+            break;
+        }
+        rate *= 2;
+    }
+
+    rc.round = -1;
+    rc.exit = 1;
+    sync_workers(round_switch, &rc);
+    for (int t = 0; t < thread_count; t++)
+    {
+        pthread_join(workers[t].thread, NULL);
+        close(workers[t].epoll_fd);
+        free(workers[t].users);
+        free(workers[t].senders);
+        if (use_zip)
+        {
+            inflateEnd(&workers[t].unzip);
+        }
+    }
+    pthread_barrier_destroy(&barrier);
+    free(workers);
+    free(room_members);
+    return 0;
+}
@@ -0,0 +1,73 @@
+/**
+ * 二进制聊天协议
+ * 功能：给机器人等程序化客户端使用的紧凑协议，与面向人的文本协议共用同一端口
+ *
+ * 协商：客户端连接后先发送 4 字节魔数 PROTO_MAGIC，服务器回复同样的魔数和一个
+ * OP_WELCOME 帧，之后双方都使用二进制帧；没有发送魔数的连接按文本协议处理。
+ * 魔数到达较晚时服务器可能已经发出了文本欢迎语，客户端应丢弃魔数之前的所有字节。
+ *
+ * 帧格式：2 字节长度（网络字节序，包括类型字节但不包括长度字段本身）
+ *       + 1 字节类型 + 负载。
+ * 带昵称的负载以 1 字节昵称长度开头，后接昵称和消息内容，字符串都不以 '\0' 结尾。
+ *
+ * 会话恢复：服务器在 OP_WELCOME 之后发送 OP_SESSION（会话令牌）。断线后重新连接、
+ * 发送魔数并立即发送 OP_RESUME（同一令牌），成功时服务器回复 OP_WELCOME（原来的昵称），
+ * 之后补发断线期间错过的消息。
+ *
+ * 压缩：客户端发送 OP_COMPRESS 后，服务器回复 OP_COMPRESS_ON，之后发给客户端的字节
+ * 按 chat_zip.h 的格式分批压缩成帧，帧解压后仍是上面的二进制帧。
+ *
+ * 心跳：连接一段时间没有输入时服务器发送 OP_PING，客户端回复 OP_PONG（任何输入都算）。
+ * 回复过心跳的客户端之后连续几次不回复，服务器按断线处理。
+ */
+
+#ifndef CHAT_PROTO_H
+#define CHAT_PROTO_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#define PROTO_MAGIC "\x7f" "CHB"
+#define PROTO_MAGIC_LEN 4
+#define PROTO_LEN_SIZE 2
+#define PROTO_HEADER_SIZE 3   // 长度 + 类型
+#define PROTO_MAX_FRAME 4096  // 长度字段的最大值
+
+enum {
+  // 客户端 -> 服务器
+  OP_CHAT = 0x01,    // 广播：消息内容
+  OP_PRIVATE = 0x02, // 私聊：昵称长度 + 目标昵称 + 消息内容
+  OP_NAME = 0x03,    // 改名：新昵称
+  OP_LIST = 0x04,    // 查看在线用户，回复为若干 OP_SYSTEM 帧
+  OP_QUIT = 0x05,    // 退出
+  OP_JOIN = 0x06,    // 进入房间：房间名
+  OP_PART = 0x07,    // 离开房间，回到大厅
+  OP_RESUME = 0x08,  // 恢复会话：会话令牌，只能作为连接后的第一个帧
+  OP_STATS = 0x09,   // 服务器内部计时（只接受本机连接），回复为 OP_SYSTEM 帧
+  OP_COMPRESS = 0x0A, // 请求压缩服务器发来的数据
+  OP_PONG = 0x0B,     // 回复 OP_PING
+  OP_CLAIM = 0x0C,    // 离线信箱：口令（认领当前昵称的信箱，或核对口令后取回离线私聊）
+  // 服务器 -> 客户端
+  OP_WELCOME = 0x81,      // 协商成功：分配到的昵称
+  OP_CHAT_FROM = 0x82,    // 广播：昵称长度 + 发送者昵称 + 消息内容
+  OP_PRIVATE_FROM = 0x83, // 私聊：格式同 OP_CHAT_FROM
+  OP_SYSTEM = 0x84,       // 系统消息：文本，可能有多行，不以换行结尾
+  OP_SESSION = 0x85,      // 会话令牌：断线后用 OP_RESUME 发回
+  OP_COMPRESS_ON = 0x86,  // 压缩已启用：之后的字节都是压缩帧，没有负载
+  OP_PING = 0x87          // 心跳：连接一段时间没有输入，客户端应回复 OP_PONG，没有负载
+};
+
+// 写入帧头（长度和类型），payload_len 为负载字节数
+static inline void proto_put_header(char *p, uint8_t type, size_t payload_len) {
+  size_t n = payload_len + 1;
+  p[0] = (char)(n >> 8);
+  p[1] = (char)n;
+  p[2] = (char)type;
+}
+
+// 读取长度字段
+static inline size_t proto_get_len(const char *p) {
+  return ((size_t)(unsigned char)p[0] << 8) | (unsigned char)p[1];
+}
+
+#endif // CHAT_PROTO_H
@@ -0,0 +1,152 @@
+/**
+ * 客户端连接的可选压缩：服务器发给客户端的数据按批压缩成帧
+ * 功能：聊天消息短小且高度重复（"[系统] "、"[私聊]"、"]: "、反复出现的昵称），
+ * 逐条原样发送浪费带宽；协商后把一次发送合并的一批消息压缩成一帧
+ *
+ * 协商：文本客户端发送 "/compress"，二进制客户端发送 OP_COMPRESS 帧。服务器先发完
+ * 已经开始发送的那条消息，再回复 ZIP_ACK_TEXT 一行（二进制协议为 OP_COMPRESS_ON 帧），
+ * 之后发给该客户端的所有字节都是压缩帧；客户端发给服务器的数据不压缩。
+ * 断线恢复会话后压缩继续有效：服务器在恢复通知之后重新回复一次确认。
+ *
+ * 帧格式：4 字节负载长度 + 4 字节原始长度（网络字节序）+ 负载，与节点间的帧相同。
+ * 两个长度相等时负载未压缩，否则是 raw deflate 数据（没有 zlib 头和校验和），
+ * 压缩和解压前都装入预置字典 ZIP_DICT。原始数据是按原协议编码的字节流，一条消息
+ * 可能跨两帧（服务器把超长的聊天记录回放拆开发送），原始长度不超过 ZIP_FRAME_MAX。
+ *
+ * 每帧独立压缩（只依赖固定的预置字典，不依赖之前的帧）：流式压缩要为每个连接保存
+ * 几百 KB 的状态，而且同一批广播对每个接收者压缩结果都不同；独立的帧让同一房间、
+ * 同一批广播只压缩一次，压缩后的帧像原始消息一样由所有接收者共享。
+ */
+
+#ifndef CHAT_ZIP_H
+#define CHAT_ZIP_H
+
+#include <arpa/inet.h>
+#include <stdint.h>
+#include <string.h>
+#include <zlib.h>
+
+#define ZIP_FRAME_HEADER 8
+#define ZIP_FRAME_MAX (64 * 1024) // 一帧原始数据的上限
+#define ZIP_STORE_MAX 32          // 不超过此长度的批不压缩
+#define ZIP_LEVEL Z_BEST_SPEED
+#define ZIP_WINDOW_BITS 12 // 压缩端的窗口和哈希表都很小：每帧重置时要清空哈希表
+#define ZIP_MEM_LEVEL 4
+#define ZIP_ACK_TEXT "[系统] 已启用压缩\n"
+
+// 预置字典：服务器的固定文本和默认昵称，越常见的越靠后（离数据越近，匹配距离越短）
+static const char ZIP_DICT[] =
+    "[系统] 服务器关闭\n"
+    "[系统] 用法: /msg <用户名> <消息>\n"
+    "[系统] 会话已恢复，你的昵称是: ，当前房间: \n"
+    "/resume <令牌> 可恢复会话）\n"
+    "[系统] 会话令牌: （断线后  秒内重连并立即发送 "
+    "[系统] 以上是历史消息\n"
+    "[系统] 最近的  条消息:\n"
+    "[系统] 接收过慢，错过了  条消息\n"
+    "[系统] 以上是你离线时收到的  条私聊\n"
+    "[离线私聊][ -> 你] (): "
+    "[系统] 用户 '' 不在线或不存在\n"
+    "[系统] 你已经在房间  中\n"
+    "[系统] 你已进入房间 \n"
+    " 改名为 \n"
+    " 进入了房间 \n"
+    " 离开了房间 \n"
+    " 离开了聊天室\n"
+    " 加入了聊天室\n"
+    "[私聊][你 -> ]: "
+    "[私聊][ -> 你]: "
+    "\n[系统] 用户"
+    "]: \n[用户";
+
+static inline void zip_put32(char *p, uint32_t v) {
+  v = htonl(v);
+  memcpy(p, &v, 4);
+}
+
+static inline uint32_t zip_get32(const char *p) {
+  uint32_t v;
+  memcpy(&v, p, 4);
+  return ntohl(v);
+}
+
+// 编码长度为 len 的原始数据所需的最大帧长度
+static inline size_t zip_bound(size_t len) {
+  return ZIP_FRAME_HEADER + compressBound((uLong)len);
+}
+
+static inline int zip_deflate_init(z_stream *z) {
+  memset(z, 0, sizeof(*z));
+  return deflateInit2(z, ZIP_LEVEL, Z_DEFLATED, -ZIP_WINDOW_BITS,
+                      ZIP_MEM_LEVEL, Z_DEFAULT_STRATEGY) == Z_OK
+             ? 0
+             : -1;
+}
+
+// 把 raw 编码成一帧写入 out（至少 zip_bound(len) 字节），返回帧长度。
+// 太短或压缩后没有变小的批原样存放
+static inline size_t zip_frame(z_stream *z, const char *raw, size_t len,
+                               char *out) {
+  size_t n = 0;
+  if (len > ZIP_STORE_MAX && deflateReset(z) == Z_OK &&
+      deflateSetDictionary(z, (const Bytef *)ZIP_DICT, sizeof(ZIP_DICT) - 1) ==
+          Z_OK) {
+    z->next_in = (Bytef *)raw;
+    z->avail_in = (uInt)len;
+    z->next_out = (Bytef *)out + ZIP_FRAME_HEADER;
+    z->avail_out = (uInt)(zip_bound(len) - ZIP_FRAME_HEADER);
+    if (deflate(z, Z_FINISH) == Z_STREAM_END) {
+      n = (size_t)z->total_out;
+    }
+  }
+  if (n == 0 || n >= len) {
+    memcpy(out + ZIP_FRAME_HEADER, raw, len);
+    n = len;
+  }
+  zip_put32(out, (uint32_t)n);
+  zip_put32(out + 4, (uint32_t)len);
+  return ZIP_FRAME_HEADER + n;
+}
+
+static inline int zip_inflate_init(z_stream *z) {
+  memset(z, 0, sizeof(*z));
+  return inflateInit2(z, -MAX_WBITS) == Z_OK ? 0 : -1;
+}
+
+// 从 data 开头取出一帧，解压到 raw（至少 ZIP_FRAME_MAX 字节），原始长度存入 *raw_len。
+// 返回帧占用的字节数，数据不完整时返回 0，帧损坏时返回 -1
+static inline long zip_unframe(z_stream *z, const char *data, size_t len,
+                               char *raw, size_t *raw_len) {
+  if (len < ZIP_FRAME_HEADER) {
+    return 0;
+  }
+  uint32_t n = zip_get32(data);
+  uint32_t want = zip_get32(data + 4);
+  if (want > ZIP_FRAME_MAX || n > compressBound(want)) {
+    return -1;
+  }
+  if (len < ZIP_FRAME_HEADER + (size_t)n) {
+    return 0;
+  }
+  const char *p = data + ZIP_FRAME_HEADER;
+  if (n == want) {
+    memcpy(raw, p, n);
+  } else {
+    if (inflateReset(z) != Z_OK ||
+        inflateSetDictionary(z, (const Bytef *)ZIP_DICT,
+                             sizeof(ZIP_DICT) - 1) != Z_OK) {
+      return -1;
+    }
+    z->next_in = (Bytef *)p;
+    z->avail_in = n;
+    z->next_out = (Bytef *)raw;
+    z->avail_out = want;
+    if (inflate(z, Z_FINISH) != Z_STREAM_END || z->total_out != want) {
+      return -1;
+    }
+  }
+  *raw_len = want;
+  return (long)(ZIP_FRAME_HEADER + n);
+}
+
+#endif // CHAT_ZIP_H
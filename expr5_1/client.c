@@ -1,66 +1,305 @@
 /**
  * TCP聊天客户端
- * 功能：连接服务器，发送和接收聊天消息
+ * 功能：连接服务器，发送和接收聊天消息；连接意外断开时自动重连并用会话令牌恢复会话；
+ *       /send 发送文件，收发文件各用一条单独的数据连接，不影响聊天；
+ *       /compress 请求服务器压缩发来的数据（帧格式见 chat_zip.h）
+ *
+ * 单线程事件驱动：一个 epoll 同时等待标准输入、聊天连接和文件传输的数据连接，
+ * 套接字都是非阻塞的，重连和机器人的发送节奏由 epoll_wait 的超时驱动。
+ *
+ * 机器人模式（-s 脚本 或 -g 生成规则）：一个进程开 -n 个会话，所有会话合计按 -r 条/秒
+ * 轮流发送脚本中的行或生成的消息；不读标准输入，收到的消息只计数，结束时打印统计。
+ *
+ * 用法：./client [选项] [服务器IP] [端口]
  */
+#define _GNU_SOURCE
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <unistd.h>
 #include <sys/socket.h>
 #include <sys/types.h>
+#include <sys/epoll.h>
 #include <netinet/in.h>
+#include <netinet/tcp.h>
 #include <arpa/inet.h>
-#include <pthread.h>
 #include <signal.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <time.h>
+#include <libgen.h>
+#include <sys/stat.h>
+#include <sys/sendfile.h>
+
+#include "chat_zip.h"
 
 #define BUFFER_SIZE 1024
 #define DEFAULT_PORT 8888
 #define DEFAULT_SERVER "127.0.0.1"
+#define RECONNECT_TRIES 5
+#define RECONNECT_DELAY_MS 1000
+#define TOKEN_PREFIX "[系统] 会话令牌: "
+#define TOKEN_LEN 32
+#define TRANSFER_PREFIX "[文件] 传输令牌: "
+#define TRANSFER_GO "[文件] 开始传输\n"
+#define OFFER_SENT " 发出传输请求 #"   // 服务器确认我们的 /send："[文件] 已向 <用户> 发出传输请求 #<编号>，..."
+#define OFFER_RECEIVED "，输入 /accept " // 别人发来文件："[文件] ... 输入 /accept <编号> 接收，/reject <编号> 拒绝"
+#define HEX_DIGITS "0123456789abcdef"
+#define EXPIRED_TEXT "[系统] 会话已过期或令牌无效"
+#define PING_TEXT "[系统] 心跳\n"
+#define MAX_OUTGOING 8
+#define MAX_OFFERS 16
+#define PATH_SIZE 512
+#define MAX_EVENTS 256
+#define RECV_SIZE 16384                       // 每次从聊天连接读取的字节数
+#define WIRE_SIZE (2 * ZIP_FRAME_MAX)          // 至少能放下一个完整的压缩帧和一次读到的数据
+#define XFER_BUFFER 8192
+#define XFER_CHUNK (1024 * 1024) // 每次 sendfile 最多发送的字节数
+#define OUT_LIMIT (64 * 1024)    // 机器人会话积压超过此字节数时暂时不再发送
+#define BOT_LEN_DEFAULT 32
+
+enum
+{
+    ENDPOINT_SESSION,
+    ENDPOINT_TRANSFER
+};
+
+typedef enum
+{
+    SESSION_CONNECTING, // 非阻塞 connect 尚未完成
+    SESSION_UP,
+    SESSION_WAITING,    // 等待 retry_at 之后重连
+    SESSION_CLOSED
+} SessionState;
+
+// 一个聊天会话：交互模式只有一个，机器人模式有 -n 个
+typedef struct
+{
+    int kind; // ENDPOINT_SESSION，epoll 事件据此区分会话和数据连接
+    int index;
+    int fd;
+    SessionState state;
+    int tries;          // 本次断线后尝试重连的次数
+    long long retry_at; // 毫秒，CLOCK_MONOTONIC
+    int setup_done;     // 机器人：已发送生成规则的改名和进房命令
+    int quitting;       // 已发送 /quit，连接关闭后不再重连
+    int done;           // 机器人：脚本已发完
+    char token[TOKEN_LEN + 1]; // 服务器发来的会话令牌，断线后用于恢复会话
+    // 待发送的数据（发送缓冲区满时暂存）
+    char *out;
+    size_t out_len;
+    size_t out_cap;
+    int want_write;
+    // 还没凑成完整一行的数据（跨两次读取或两个压缩帧的半行）
+    char pending[BUFFER_SIZE + 1];
+    size_t pending_len;
+    // 压缩：0 未压缩，1 等待服务器确认，2 之后都是压缩帧
+    int compress_wanted; // 请求过压缩，重连后继续使用
+    int compress_state;
+    char *wire;          // 还没凑成完整一帧的压缩数据（第一次请求压缩时分配）
+    size_t wire_len;
+    // 机器人
+    size_t script_pos;
+    unsigned long sent;
+    unsigned long lines;     // 收到的行数
+    unsigned long bytes;     // 收到的字节数（解压后）
+    unsigned long reconnects;
+} Session;
+
+typedef enum
+{
+    XFER_CONNECTING, // 非阻塞 connect 尚未完成
+    XFER_WAIT_GO,    // 已发送 /xfer，等待服务器的“开始传输”
+    XFER_RUNNING
+} XferPhase;
+
+// 一次文件传输：数据连接和聊天连接在同一个 epoll 中处理
+typedef struct Transfer
+{
+    int kind; // ENDPOINT_TRANSFER
+    XferPhase phase;
+    int fd;
+    int file;
+    int sending;                  // 1: 发送方，0: 接收方
+    char token[TOKEN_LEN + 1];
+    unsigned long long id;
+    unsigned long long size;
+    unsigned long long done;
+    off_t off;
+    char name[PATH_SIZE];         // 文件名
+    char path[PATH_SIZE];         // 发送方：本地文件路径；接收方：保存的路径
+    char buffer[XFER_BUFFER];     // “开始传输”之前的欢迎语等
+    size_t len;
+    struct Transfer *next;
+} Transfer;
+
+// 已发出 /send、等待对方接收的文件，按文件名找回本地路径
+typedef struct
+{
+    char name[PATH_SIZE];
+    char path[PATH_SIZE];
+} Outgoing;
+
+// 服务器通知过的传输：只有这些编号的传输令牌才会打开数据连接。
+// 别人发来的文件还要等用户 /accept 之后才接受令牌
+typedef struct
+{
+    unsigned long long id; // 0 表示空位
+    int sending;
+    int accepted;
+} Offer;
+
+// 全局变量（只有一个线程）
+volatile sig_atomic_t client_running = 1;
+volatile sig_atomic_t interrupted = 0;
+struct sockaddr_in server_addr;
+int epoll_fd = -1;
+int interactive = 1;  // 交互模式：读标准输入、显示收到的消息、处理文件传输
+int stdin_polled = 0; // 标准输入是普通文件，不能加入 epoll，每轮直接读取
+char input[BUFFER_SIZE];
+size_t input_len = 0;
+Session *sessions = NULL;
+int session_count = 1;
+int waiting_count = 0; // 等待重连的会话数
+Transfer *transfers = NULL;
+Outgoing outgoing[MAX_OUTGOING];
+Offer offers[MAX_OFFERS];
+int offer_next = 0;
+z_stream unzip;
+char recv_buf[RECV_SIZE + 1];
+char raw_buf[ZIP_FRAME_MAX + 1];
 
-// 全局变量
-int client_running = 1;
-int sockfd = -1;
+// 机器人模式的参数和计数
+char **script = NULL;
+size_t script_count = 0;
+int bot_generate = 0;
+int bot_len = BOT_LEN_DEFAULT; // 生成的消息长度
+int bot_rooms = 0;             // 会话 i 进入房间 bot<i % bot_rooms>，0 表示留在大厅
+int bot_private = 0;           // 生成的消息中私聊的百分比
+double bot_rate = 1.0;         // 所有会话合计的消息数/秒
+int bot_duration = 0;          // 秒，0 表示脚本发完为止（生成规则时一直运行）
+long long bot_start;
+unsigned long bot_slots = 0;   // 按速率已经到期的发送次数
+unsigned long bot_skipped = 0; // 到期时没有可发送的会话（未连接或积压）
+int bot_cursor = 0;
 
 // 函数声明
-void *receive_messages(void *arg);
+long long now_ms(void);
+void watch(int fd, void *ptr, uint32_t events, int op);
+int session_open(Session *s);
+void session_connected(Session *s);
+void session_lost(Session *s);
+void session_give_up(Session *s);
+void session_retry(Session *s, long long now);
+void session_event(Session *s, uint32_t events);
+int session_write(Session *s, const char *data, size_t len);
+int session_send_line(Session *s, const char *line, size_t len);
+void session_flush(Session *s);
+void session_read(Session *s);
+void receive_text(Session *s, char *text);
+int receive_line(Session *s, char *line);
+void receive_lines(Session *s, char *data, size_t len);
+void receive_frames(Session *s, const char *data, size_t len);
+void read_input(void);
+void handle_input(Session *s, char *line, size_t len);
+int request_send(Session *s, const char *args);
+void note_offer(const char *line);
+void accept_offer(const char *arg);
+void start_transfer(const char *line);
+void transfer_event(Transfer *t, uint32_t events);
+void transfer_finish(Transfer *t, const char *error);
+int load_script(const char *path);
+int parse_generator(const char *spec);
+void bot_setup(Session *s);
+size_t bot_next_line(Session *s, char *line, size_t cap);
+void bot_send_due(long long now);
+int next_timeout(long long now);
 void signal_handler(int sig);
 void print_usage(const char *program);
 
 int main(int argc, char *argv[])
 {
-    struct sockaddr_in server_addr;
-    pthread_t recv_thread;
-    char buffer[BUFFER_SIZE];
+    struct epoll_event events[MAX_EVENTS];
     char *server_ip = DEFAULT_SERVER;
     int port = DEFAULT_PORT;
+    int opt;
+
+    while ((opt = getopt(argc, argv, "s:g:n:r:d:h")) != -1)
+    {
+        switch (opt)
+        {
+        case 's':
+            if (load_script(optarg) < 0)
+            {
+                exit(EXIT_FAILURE);
+            }
+            interactive = 0;
+            break;
+        case 'g':
+            if (parse_generator(optarg) < 0)
+            {
+                fprintf(stderr, "无效的生成规则: %s\n", optarg);
+                exit(EXIT_FAILURE);
+            }
+            bot_generate = 1;
+            interactive = 0;
+            break;
+        case 'n':
+            session_count = atoi(optarg);
+            break;
+        case 'r':
+            bot_rate = atof(optarg);
+            break;
+        case 'd':
+            bot_duration = atoi(optarg);
+            break;
+        case 'h':
+            print_usage(argv[0]);
+            return 0;
+        default:
+            print_usage(argv[0]);
+            exit(EXIT_FAILURE);
+        }
+    }
 
     // 解析命令行参数
-    if (argc >= 2)
+    if (optind < argc)
     {
-        server_ip = argv[1];
+        server_ip = argv[optind];
     }
-    if (argc >= 3)
+    if (optind + 1 < argc)
     {
-        port = atoi(argv[2]);
+        port = atoi(argv[optind + 1]);
         if (port <= 0 || port > 65535)
         {
-            fprintf(stderr, "无效的端口号: %s\n", argv[2]);
+            fprintf(stderr, "无效的端口号: %s\n", argv[optind + 1]);
             exit(EXIT_FAILURE);
         }
     }
-
-    // 设置信号处理
-    signal(SIGINT, signal_handler);
-    signal(SIGPIPE, SIG_IGN);
-
-    // 创建socket
-    sockfd = socket(AF_INET, SOCK_STREAM, 0);
-    if (sockfd < 0)
+    if (interactive && session_count != 1)
+    {
+        fprintf(stderr, "-n 只能用于机器人模式 (-s 或 -g)\n");
+        exit(EXIT_FAILURE);
+    }
+    if (session_count < 1 || bot_rate <= 0 || bot_duration < 0)
+    {
+        fprintf(stderr, "会话数和发送速率必须为正数\n");
+        exit(EXIT_FAILURE);
+    }
+    if (script != NULL && bot_generate)
     {
-        perror("创建socket失败");
+        fprintf(stderr, "-s 和 -g 不能同时使用\n");
         exit(EXIT_FAILURE);
     }
 
+    // 设置信号处理：不自动重启，epoll_wait 被信号打断后退出事件循环
+    struct sigaction sa;
+    memset(&sa, 0, sizeof(sa));
+    sa.sa_handler = signal_handler;
+    sigaction(SIGINT, &sa, NULL);
+    sigaction(SIGTERM, &sa, NULL);
+    signal(SIGPIPE, SIG_IGN);
+
     // 配置服务器地址
     memset(&server_addr, 0, sizeof(server_addr));
     server_addr.sin_family = AF_INET;
@@ -69,133 +308,1296 @@ int main(int argc, char *argv[])
     if (inet_pton(AF_INET, server_ip, &server_addr.sin_addr) <= 0)
     {
         fprintf(stderr, "无效的服务器地址: %s\n", server_ip);
-        close(sockfd);
         exit(EXIT_FAILURE);
     }
 
-    printf("========================================\n");
-    printf("   TCP聊天客户端\n");
-    printf("   正在连接 %s:%d ...\n", server_ip, port);
-    printf("========================================\n");
-
-    // 连接服务器
-    if (connect(sockfd, (struct sockaddr *)&server_addr, sizeof(server_addr)) < 0)
+    epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+    sessions = calloc(session_count, sizeof(Session));
+    if (epoll_fd < 0 || sessions == NULL || zip_inflate_init(&unzip) < 0)
     {
-        perror("连接服务器失败");
-        close(sockfd);
+        perror("初始化失败");
         exit(EXIT_FAILURE);
     }
 
-    printf("连接成功！\n\n");
+    if (interactive)
+    {
+        printf("========================================\n");
+        printf("   TCP聊天客户端\n");
+        printf("   正在连接 %s:%d ...\n", server_ip, port);
+        printf("========================================\n");
+
+        // 第一次连接失败直接退出，所以这里阻塞等待连接完成
+        Session *s = &sessions[0];
+        s->kind = ENDPOINT_SESSION;
+        s->fd = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
+        if (s->fd < 0)
+        {
+            perror("创建socket失败");
+            exit(EXIT_FAILURE);
+        }
+        if (connect(s->fd, (struct sockaddr *)&server_addr, sizeof(server_addr)) < 0)
+        {
+            perror("连接服务器失败");
+            close(s->fd);
+            exit(EXIT_FAILURE);
+        }
+        printf("连接成功！\n\n");
+        fcntl(s->fd, F_SETFL, fcntl(s->fd, F_GETFL, 0) | O_NONBLOCK);
+        s->state = SESSION_CONNECTING;
+        watch(s->fd, s, EPOLLOUT, EPOLL_CTL_ADD);
+        session_connected(s);
 
-    // 创建接收消息的线程
-    if (pthread_create(&recv_thread, NULL, receive_messages, NULL) != 0)
+        struct epoll_event ev;
+        ev.events = EPOLLIN;
+        ev.data.ptr = NULL;
+        if (epoll_ctl(epoll_fd, EPOLL_CTL_ADD, STDIN_FILENO, &ev) < 0)
+        {
+            stdin_polled = 1; // 重定向自普通文件：总是可读
+        }
+    }
+    else
     {
-        perror("创建接收线程失败");
-        close(sockfd);
-        exit(EXIT_FAILURE);
+        printf("机器人: %d 个会话, 合计每秒 %.1f 条, %s, 连接 %s:%d\n", session_count, bot_rate,
+               bot_generate ? "生成消息" : "脚本", server_ip, port);
+        for (int i = 0; i < session_count; i++)
+        {
+            Session *s = &sessions[i];
+            s->kind = ENDPOINT_SESSION;
+            s->index = i;
+            if (session_open(s) < 0)
+            {
+                session_give_up(s);
+            }
+        }
+        srand((unsigned int)getpid());
+        bot_start = now_ms();
     }
 
-    // 主循环：发送消息
+    // 事件循环
     while (client_running)
     {
-        memset(buffer, 0, sizeof(buffer));
-
-        // 读取用户输入
-        if (fgets(buffer, sizeof(buffer), stdin) == NULL)
+        long long now = now_ms();
+        int timeout = stdin_polled ? 0 : next_timeout(now);
+        int n = epoll_wait(epoll_fd, events, MAX_EVENTS, timeout);
+        if (n < 0)
         {
+            if (errno == EINTR)
+            {
+                continue;
+            }
+            perror("epoll_wait失败");
             break;
         }
+        for (int i = 0; i < n && client_running; i++)
+        {
+            int *kind = events[i].data.ptr;
+            if (kind == NULL)
+            {
+                read_input();
+            }
+            else if (*kind == ENDPOINT_SESSION)
+            {
+                session_event((Session *)kind, events[i].events);
+            }
+            else
+            {
+                transfer_event((Transfer *)kind, events[i].events);
+            }
+        }
+        if (stdin_polled && client_running)
+        {
+            read_input();
+        }
 
-        // 检查是否退出
-        if (strncmp(buffer, "/quit", 5) == 0)
+        now = now_ms();
+        for (int i = 0; i < session_count && waiting_count > 0; i++)
         {
-            printf("正在退出...\n");
-            send(sockfd, buffer, strlen(buffer), 0);
-            break;
+            if (sessions[i].state == SESSION_WAITING && sessions[i].retry_at <= now)
+            {
+                session_retry(&sessions[i], now);
+            }
+        }
+        if (!interactive)
+        {
+            bot_send_due(now);
+            int open = 0;
+            for (int i = 0; i < session_count; i++)
+            {
+                open += sessions[i].state != SESSION_CLOSED;
+            }
+            if (open == 0 || (bot_duration > 0 && now - bot_start >= bot_duration * 1000LL))
+            {
+                client_running = 0;
+            }
         }
+    }
 
-        // 发送消息
-        if (strlen(buffer) > 0)
+    // 清理：正常连接着的会话发送 /quit
+    if (interrupted)
+    {
+        printf("\n接收到退出信号\n");
+    }
+    unsigned long sent = 0, lines = 0, bytes = 0, reconnects = 0;
+    int closed = 0;
+    for (int i = 0; i < session_count; i++)
+    {
+        Session *s = &sessions[i];
+        if (s->state == SESSION_UP)
         {
-            if (send(sockfd, buffer, strlen(buffer), 0) < 0)
+            // 尽量发出积压的数据（如输入结束前的最后几行），不再等待
+            if (s->out_len > 0)
             {
-                if (client_running)
-                {
-                    perror("发送消息失败");
-                }
-                break;
+                send(s->fd, s->out, s->out_len, MSG_NOSIGNAL);
+            }
+            if (!s->quitting)
+            {
+                send(s->fd, "/quit\n", 6, MSG_NOSIGNAL);
             }
         }
+        if (s->fd >= 0 && s->state != SESSION_CLOSED && s->state != SESSION_WAITING)
+        {
+            close(s->fd);
+        }
+        sent += s->sent;
+        lines += s->lines;
+        bytes += s->bytes;
+        reconnects += s->reconnects;
+        closed += s->state == SESSION_CLOSED && !s->quitting;
+        free(s->out);
+        free(s->wire);
+    }
+    while (transfers != NULL)
+    {
+        transfer_finish(transfers, "客户端退出");
+    }
+    if (interactive)
+    {
+        printf("\n已断开连接\n");
+    }
+    else
+    {
+        double secs = (now_ms() - bot_start) / 1000.0;
+        printf("机器人统计: 运行 %.1f 秒, 发送 %lu 条 (%.1f 条/秒), 跳过 %lu 次, "
+               "收到 %lu 行 / %lu 字节, 重连 %lu 次, 断开未恢复 %d 个会话\n",
+               secs, sent, secs > 0 ? sent / secs : 0.0, bot_skipped, lines, bytes, reconnects,
+               closed);
+    }
+    inflateEnd(&unzip);
+    close(epoll_fd);
+    free(sessions);
+    for (size_t i = 0; i < script_count; i++)
+    {
+        free(script[i]);
     }
+    free(script);
+    return 0;
+}
 
-    // 清理
-    client_running = 0;
-    close(sockfd);
-    sockfd = -1;
+long long now_ms(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (long long)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
 
-    // 等待接收线程结束
-    pthread_cancel(recv_thread);
-    pthread_join(recv_thread, NULL);
+// 在 epoll 中添加或修改一个套接字，ptr 指向会话或传输（第一个字段是类型）
+void watch(int fd, void *ptr, uint32_t events, int op)
+{
+    struct epoll_event ev;
+    ev.events = events;
+    ev.data.ptr = ptr;
+    epoll_ctl(epoll_fd, op, fd, &ev);
+}
 
-    printf("\n已断开连接\n");
+// 发起非阻塞连接，完成时 session_connected 接着处理
+int session_open(Session *s)
+{
+    s->fd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (s->fd < 0)
+    {
+        return -1;
+    }
+    if (connect(s->fd, (struct sockaddr *)&server_addr, sizeof(server_addr)) < 0 &&
+        errno != EINPROGRESS)
+    {
+        close(s->fd);
+        s->fd = -1;
+        return -1;
+    }
+    s->state = SESSION_CONNECTING;
+    watch(s->fd, s, EPOLLOUT, EPOLL_CTL_ADD);
     return 0;
 }
 
-// 接收消息的线程函数
-void *receive_messages(void *arg)
+// 连接建立：重连时立即发送 /resume 恢复会话（昵称、房间不变，服务器补发断线期间的消息）；
+// 机器人第一次连接时发送生成规则的改名和进房命令
+void session_connected(Session *s)
 {
-    (void)arg; // 抑制未使用参数警告
-    char buffer[BUFFER_SIZE];
-    int bytes_received;
+    int err = 0;
+    socklen_t len = sizeof(err);
+    if (getsockopt(s->fd, SOL_SOCKET, SO_ERROR, &err, &len) < 0 || err != 0)
+    {
+        close(s->fd);
+        s->fd = -1;
+        if (s->token[0] != '\0')
+        {
+            s->state = SESSION_WAITING;
+            s->retry_at = now_ms() + RECONNECT_DELAY_MS;
+            waiting_count++;
+        }
+        else
+        {
+            session_give_up(s);
+        }
+        return;
+    }
+    int opt = 1;
+    setsockopt(s->fd, IPPROTO_TCP, TCP_NODELAY, &opt, sizeof(opt));
+    s->state = SESSION_UP;
+    s->tries = 0;
+    s->out_len = 0;
+    s->want_write = 0;
+    // 新连接先是普通文本；会话恢复后服务器重新确认压缩，过期时 receive_lines 重新请求
+    s->pending_len = 0;
+    s->wire_len = 0;
+    s->compress_state = s->compress_wanted ? 1 : 0;
+    watch(s->fd, s, EPOLLIN | EPOLLRDHUP, EPOLL_CTL_MOD);
 
-    while (client_running)
+    if (s->token[0] != '\0')
+    {
+        char resume[TOKEN_LEN + 16];
+        int n = snprintf(resume, sizeof(resume), "/resume %s\n", s->token);
+        session_write(s, resume, (size_t)n);
+    }
+    else if (!interactive)
+    {
+        bot_setup(s);
+    }
+}
+
+// 连接意外断开：有令牌时一秒后开始重连，否则放弃
+void session_lost(Session *s)
+{
+    close(s->fd);
+    s->fd = -1;
+    s->out_len = 0;
+    if (s->quitting || !client_running || s->token[0] == '\0')
+    {
+        session_give_up(s);
+        return;
+    }
+    if (interactive)
+    {
+        printf("\n与服务器的连接已断开，正在重新连接...\n");
+        fflush(stdout);
+    }
+    s->state = SESSION_WAITING;
+    s->tries = 0;
+    s->retry_at = now_ms() + RECONNECT_DELAY_MS;
+    s->reconnects++;
+    waiting_count++;
+}
+
+// 不再重连。交互模式随之退出
+void session_give_up(Session *s)
+{
+    s->state = SESSION_CLOSED;
+    if (interactive && client_running && !s->quitting)
+    {
+        printf("\n与服务器的连接已断开\n");
+        client_running = 0;
+    }
+}
+
+// 重连时间到：多次重试都失败时放弃
+void session_retry(Session *s, long long now)
+{
+    waiting_count--;
+    if (s->tries++ >= RECONNECT_TRIES || session_open(s) < 0)
+    {
+        if (s->tries > RECONNECT_TRIES)
+        {
+            session_give_up(s);
+            return;
+        }
+        s->state = SESSION_WAITING;
+        s->retry_at = now + RECONNECT_DELAY_MS;
+        waiting_count++;
+    }
+}
+
+void session_event(Session *s, uint32_t events)
+{
+    if (s->state == SESSION_CONNECTING)
+    {
+        session_connected(s);
+        return;
+    }
+    if (s->state != SESSION_UP)
+    {
+        return;
+    }
+    if (events & EPOLLOUT)
+    {
+        session_flush(s);
+        if (s->state != SESSION_UP)
+        {
+            return; // 发送失败时已按断线处理，连接已关闭
+        }
+    }
+    if (events & (EPOLLIN | EPOLLERR | EPOLLHUP | EPOLLRDHUP))
+    {
+        session_read(s);
+    }
+}
+
+// 发送数据：发送缓冲区满时暂存，可写时继续。连接不可用时返回 -1
+int session_write(Session *s, const char *data, size_t len)
+{
+    if (s->state != SESSION_UP)
+    {
+        return -1;
+    }
+    if (s->out_len == 0)
     {
-        memset(buffer, 0, sizeof(buffer));
-        bytes_received = recv(sockfd, buffer, sizeof(buffer) - 1, 0);
+        ssize_t n = send(s->fd, data, len, MSG_NOSIGNAL);
+        if (n < 0 && errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR)
+        {
+            return -1; // 连接出错，随后的 EPOLLERR 处理断线
+        }
+        if (n > 0)
+        {
+            data += n;
+            len -= (size_t)n;
+        }
+        if (len == 0)
+        {
+            return 0;
+        }
+    }
+    if (s->out_len + len > s->out_cap)
+    {
+        size_t cap = s->out_cap ? s->out_cap : BUFFER_SIZE;
+        while (cap < s->out_len + len)
+        {
+            cap *= 2;
+        }
+        char *out = realloc(s->out, cap);
+        if (out == NULL)
+        {
+            return -1;
+        }
+        s->out = out;
+        s->out_cap = cap;
+    }
+    memcpy(s->out + s->out_len, data, len);
+    s->out_len += len;
+    if (!s->want_write)
+    {
+        s->want_write = 1;
+        watch(s->fd, s, EPOLLIN | EPOLLRDHUP | EPOLLOUT, EPOLL_CTL_MOD);
+    }
+    return 0;
+}
+
+// 发送一行输入或脚本中的一行。请求压缩时先切换到等待确认，确认一行之后的数据按压缩帧解码
+int session_send_line(Session *s, const char *line, size_t len)
+{
+    if (strncmp(line, "/compress", 9) == 0 && s->state == SESSION_UP)
+    {
+        if (s->wire == NULL && (s->wire = malloc(WIRE_SIZE)) == NULL)
+        {
+            return -1;
+        }
+        s->compress_wanted = 1;
+        if (s->compress_state == 0)
+        {
+            s->compress_state = 1;
+        }
+    }
+    if (strncmp(line, "/quit", 5) == 0)
+    {
+        s->quitting = 1; // 服务器随后关闭连接，不要重连
+    }
+    return session_write(s, line, len);
+}
 
-        if (bytes_received <= 0)
+void session_flush(Session *s)
+{
+    while (s->out_len > 0)
+    {
+        ssize_t n = send(s->fd, s->out, s->out_len, MSG_NOSIGNAL);
+        if (n <= 0)
         {
-            if (client_running)
+            if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR))
             {
-                printf("\n与服务器的连接已断开\n");
-                client_running = 0;
+                return;
             }
-            break;
+            session_lost(s);
+            return;
         }
+        memmove(s->out, s->out + n, s->out_len - (size_t)n);
+        s->out_len -= (size_t)n;
+    }
+    s->want_write = 0;
+    watch(s->fd, s, EPOLLIN | EPOLLRDHUP, EPOLL_CTL_MOD);
+}
+
+// 读出连接上已到达的数据，按压缩状态分别处理
+void session_read(Session *s)
+{
+    for (;;)
+    {
+        ssize_t n = recv(s->fd, recv_buf, RECV_SIZE, 0);
+        if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR))
+        {
+            return;
+        }
+        if (n <= 0)
+        {
+            session_lost(s);
+            return;
+        }
+        recv_buf[n] = '\0';
+        if (s->compress_state == 2)
+        {
+            receive_frames(s, recv_buf, (size_t)n);
+        }
+        else
+        {
+            receive_lines(s, recv_buf, (size_t)n);
+        }
+        if (s->state != SESSION_UP || n < RECV_SIZE)
+        {
+            return;
+        }
+    }
+}
+
+// 处理收到的一行（已解压，以 '\0' 结尾；只有超长的行会被拆开）
+void receive_text(Session *s, char *text)
+{
+    // 服务器的心跳：回复 /pong，不显示
+    if (strcmp(text, PING_TEXT) == 0)
+    {
+        session_write(s, "/pong\n", 6);
+        return;
+    }
+
+    // 记下会话令牌（以新连接的欢迎语为准）。只认行首的系统提示：
+    // 其他用户的聊天消息里也可以写出这几个字，不能让它换掉我们的令牌
+    if (strncmp(text, TOKEN_PREFIX, strlen(TOKEN_PREFIX)) == 0)
+    {
+        const char *token = text + strlen(TOKEN_PREFIX);
+        if (strspn(token, "0123456789abcdef") >= TOKEN_LEN)
+        {
+            memcpy(s->token, token, TOKEN_LEN);
+            s->token[TOKEN_LEN] = '\0';
+        }
+    }
+
+    // 文件传输的通知只认行首的 [文件] 系统提示（聊天消息都以 "[昵称]: " 开头）：
+    // 先记下服务器通知的传输编号，对方接收了文件（或我们接收了对方的文件）时开一条数据连接传输
+    if (interactive && strncmp(text, "[文件] ", strlen("[文件] ")) == 0)
+    {
+        if (strncmp(text, TRANSFER_PREFIX, strlen(TRANSFER_PREFIX)) == 0)
+        {
+            start_transfer(text + strlen(TRANSFER_PREFIX));
+        }
+        else
+        {
+            note_offer(text);
+        }
+    }
+
+    if (!interactive)
+    {
+        for (char *p = text; (p = strchr(p, '\n')) != NULL; p++)
+        {
+            s->lines++;
+        }
+        s->bytes += strlen(text);
+        return;
+    }
 
-        // 显示收到的消息
-        printf("%s", buffer);
+    // 显示收到的消息
+    if (text[0] != '\0')
+    {
+        printf("%s", text);
         fflush(stdout);
     }
+}
 
-    return NULL;
+// 处理一个完整的行。等待压缩确认期间，确认一行之后的字节都是压缩帧，返回 1；
+// 重连后会话已过期时服务器不会再确认，重新请求压缩
+int receive_line(Session *s, char *line)
+{
+    receive_text(s, line);
+    if (s->compress_state != 1)
+    {
+        return 0;
+    }
+    if (strncmp(line, EXPIRED_TEXT, strlen(EXPIRED_TEXT)) == 0)
+    {
+        session_write(s, "/compress\n", 10);
+    }
+    if (strcmp(line, ZIP_ACK_TEXT) == 0)
+    {
+        s->compress_state = 2;
+        return 1;
+    }
+    return 0;
 }
 
-// 信号处理函数
-void signal_handler(int sig)
+// 把收到的文本（已解压，data[len] 必须可写）切成行逐行处理。一次读取或一个压缩帧的末尾
+// 可能只有半行，留在 pending 中与之后的数据拼成整行，控制行（令牌、传输、心跳）总是完整地处理
+void receive_lines(Session *s, char *data, size_t len)
 {
-    (void)sig; // 抑制未使用参数警告
-    printf("\n接收到退出信号\n");
-    client_running = 0;
-    if (sockfd >= 0)
+    char *start = data;
+    char *end = data + len;
+    char *newline;
+
+    // 先补全上次留下的半行；超过缓冲区仍没有换行的行按已有的部分处理
+    if (s->pending_len > 0)
+    {
+        newline = memchr(start, '\n', len);
+        size_t take = newline != NULL ? (size_t)(newline + 1 - start) : len;
+        if (s->pending_len + take > BUFFER_SIZE)
+        {
+            take = BUFFER_SIZE - s->pending_len;
+            newline = NULL;
+        }
+        memcpy(s->pending + s->pending_len, start, take);
+        s->pending_len += take;
+        start += take;
+        if (newline == NULL && s->pending_len < BUFFER_SIZE)
+        {
+            return;
+        }
+        s->pending[s->pending_len] = '\0';
+        s->pending_len = 0;
+        if (receive_line(s, s->pending))
+        {
+            receive_frames(s, start, end - start);
+            return;
+        }
+    }
+
+    while ((newline = memchr(start, '\n', end - start)) != NULL)
     {
-        const char *quit_msg = "/quit\n";
-        send(sockfd, quit_msg, strlen(quit_msg), 0);
-        close(sockfd);
-        sockfd = -1;
+        char next = newline[1];
+        newline[1] = '\0';
+        int ack = receive_line(s, start);
+        newline[1] = next;
+        start = newline + 1;
+        if (ack)
+        {
+            receive_frames(s, start, end - start);
+            return;
+        }
     }
-    exit(0);
+
+    // 剩下的半行：太长时直接处理掉
+    *end = '\0';
+    if ((size_t)(end - start) >= BUFFER_SIZE)
+    {
+        receive_text(s, start);
+        return;
+    }
+    s->pending_len = end - start;
+    memcpy(s->pending, start, s->pending_len);
+}
+
+// 解出所有完整的压缩帧并处理，剩下的半帧留到下次。帧损坏时关闭连接，重连恢复会话
+void receive_frames(Session *s, const char *data, size_t len)
+{
+    size_t raw_len;
+    size_t off = 0;
+    long used;
+
+    if (len > 0)
+    {
+        memcpy(s->wire + s->wire_len, data, len);
+        s->wire_len += len;
+    }
+    while ((used = zip_unframe(&unzip, s->wire + off, s->wire_len - off, raw_buf, &raw_len)) > 0)
+    {
+        raw_buf[raw_len] = '\0';
+        receive_lines(s, raw_buf, raw_len);
+        off += used;
+    }
+    if (used < 0)
+    {
+        if (interactive)
+        {
+            printf("\n[系统] 收到损坏的压缩数据\n");
+        }
+        s->wire_len = 0;
+        shutdown(s->fd, SHUT_RDWR);
+        return;
+    }
+    s->wire_len -= off;
+    memmove(s->wire, s->wire + off, s->wire_len);
+}
+
+// 标准输入可读：读出所有完整的行逐行处理；一行超过缓冲区时按已读到的部分发送
+void read_input(void)
+{
+    ssize_t n = read(STDIN_FILENO, input + input_len, sizeof(input) - 1 - input_len);
+    if (n <= 0)
+    {
+        if (n < 0 && (errno == EAGAIN || errno == EINTR))
+        {
+            return;
+        }
+        client_running = 0; // 输入结束
+        return;
+    }
+    input_len += (size_t)n;
+
+    char *start = input;
+    char *end = input + input_len;
+    char *newline;
+    while (client_running && (newline = memchr(start, '\n', end - start)) != NULL)
+    {
+        char next = newline[1];
+        newline[1] = '\0';
+        handle_input(&sessions[0], start, newline + 1 - start);
+        newline[1] = next;
+        start = newline + 1;
+    }
+    input_len = end - start;
+    if (input_len == sizeof(input) - 1)
+    {
+        input[input_len] = '\0';
+        handle_input(&sessions[0], input, input_len);
+        input_len = 0;
+    }
+    memmove(input, start, input_len);
+}
+
+// 处理用户输入的一行（line 以 '\0' 结尾）
+void handle_input(Session *s, char *line, size_t len)
+{
+    // 检查是否退出
+    if (strncmp(line, "/quit", 5) == 0)
+    {
+        printf("正在退出...\n");
+        session_send_line(s, line, len);
+        client_running = 0;
+        return;
+    }
+
+    // 发送文件: /send <用户> <文件路径>，读出文件大小后请求服务器转交
+    if (strncmp(line, "/send ", 6) == 0)
+    {
+        request_send(s, line + 6);
+        return;
+    }
+
+    // 接收文件：记下用户同意的编号，之后只接受这个编号的传输令牌
+    if (strncmp(line, "/accept ", 8) == 0)
+    {
+        accept_offer(line + 8);
+    }
+
+    // 发送消息；正在重连时这条消息丢弃
+    if (session_send_line(s, line, len) < 0)
+    {
+        printf("[系统] 正在重新连接，消息没有发出\n");
+    }
+}
+
+// 处理 /send <用户> <文件路径>：记下路径，向服务器发送 /send <用户> <字节数> <文件名>
+int request_send(Session *s, const char *args)
+{
+    char user[64], path[PATH_SIZE], copy[PATH_SIZE], name[PATH_SIZE], line[BUFFER_SIZE];
+    struct stat st;
+
+    if (sscanf(args, "%63s %511[^\n]", user, path) != 2)
+    {
+        printf("[系统] 用法: /send <用户> <文件路径>\n");
+        return -1;
+    }
+    if (stat(path, &st) < 0 || !S_ISREG(st.st_mode) || st.st_size == 0)
+    {
+        printf("[系统] 无法发送 %s: 不是非空的普通文件\n", path);
+        return -1;
+    }
+    snprintf(copy, sizeof(copy), "%s", path); // basename 可能修改参数
+    snprintf(name, sizeof(name), "%s", basename(copy));
+
+    int slot = -1;
+    for (int i = 0; i < MAX_OUTGOING; i++)
+    {
+        if (outgoing[i].path[0] == '\0' || strcmp(outgoing[i].name, name) == 0)
+        {
+            slot = i;
+            break;
+        }
+    }
+    if (slot < 0)
+    {
+        printf("[系统] 等待接收的文件过多\n");
+        return -1;
+    }
+    snprintf(outgoing[slot].name, sizeof(outgoing[slot].name), "%s", name);
+    snprintf(outgoing[slot].path, sizeof(outgoing[slot].path), "%s", path);
+
+    int n = snprintf(line, sizeof(line), "/send %s %lld %s\n", user, (long long)st.st_size, name);
+    return session_write(s, line, (size_t)n);
+}
+
+// 在 line 中找 needle 最后一次出现的位置（昵称和文件名中也可能有同样的字）
+static const char *find_last(const char *line, const char *needle)
+{
+    const char *last = NULL;
+    for (const char *p = line; (p = strstr(p, needle)) != NULL; p++)
+    {
+        last = p;
+    }
+    return last;
+}
+
+// 记下服务器通知的传输编号：我们发出的请求（之后是发送方）或别人发来的文件（之后是接收方）。
+// 编号都在行尾，从最后一次出现的固定文字开始解析
+void note_offer(const char *line)
+{
+    unsigned long long id = 0, again = 0;
+    int sending = 1, n = -1;
+    const char *p = find_last(line, OFFER_SENT);
+
+    if (p == NULL || sscanf(p, OFFER_SENT "%llu，等待对方接收%n", &id, &n) != 1 || n < 0 ||
+        strcmp(p + n, "\n") != 0)
+    {
+        sending = 0;
+        n = -1;
+        p = find_last(line, OFFER_RECEIVED);
+        if (p == NULL ||
+            sscanf(p, OFFER_RECEIVED "%llu 接收，/reject %llu 拒绝%n", &id, &again, &n) != 2 ||
+            n < 0 || again != id || strcmp(p + n, "\n") != 0)
+        {
+            return;
+        }
+    }
+    if (id == 0)
+    {
+        return;
+    }
+    offers[offer_next].id = id;
+    offers[offer_next].sending = sending;
+    offers[offer_next].accepted = sending; // 自己发起的传输不需要再确认
+    offer_next = (offer_next + 1) % MAX_OFFERS;
+}
+
+void accept_offer(const char *arg)
+{
+    unsigned long long id = strtoull(arg, NULL, 10);
+    for (int i = 0; i < MAX_OFFERS; i++)
+    {
+        if (offers[i].id == id && !offers[i].sending)
+        {
+            offers[i].accepted = 1;
+        }
+    }
+}
+
+// 解析传输令牌一行（"<令牌> 发送|接收 #编号 字节数 文件名"），发起数据连接
+void start_transfer(const char *line)
+{
+    Transfer *t = calloc(1, sizeof(Transfer));
+    char role[16];
+
+    if (t == NULL)
+    {
+        return;
+    }
+    t->kind = ENDPOINT_TRANSFER;
+    t->file = -1;
+    if (sscanf(line, "%32s %15s #%llu %llu %511[^\n]", t->token, role, &t->id, &t->size, t->name) != 5)
+    {
+        free(t);
+        return;
+    }
+    t->sending = strcmp(role, "发送") == 0;
+
+    // 令牌是 16 位十六进制传输编号 + 16 位十六进制随机数，编号必须是服务器通知过、
+    // 我们发起或已经 /accept 的传输
+    unsigned long long token_id = 0;
+    int offer = -1;
+    if (strspn(t->token, HEX_DIGITS) == TOKEN_LEN)
+    {
+        char head[17];
+        memcpy(head, t->token, 16);
+        head[16] = '\0';
+        token_id = strtoull(head, NULL, 16);
+    }
+    for (int i = 0; i < MAX_OFFERS && token_id == t->id; i++)
+    {
+        if (offers[i].id == t->id && offers[i].sending == t->sending && offers[i].accepted)
+        {
+            offer = i;
+            break;
+        }
+    }
+    if (offer < 0)
+    {
+        free(t);
+        return;
+    }
+    offers[offer].id = 0;
+
+    if (t->sending)
+    {
+        // 找回发起时的本地路径
+        for (int i = 0; i < MAX_OUTGOING; i++)
+        {
+            if (outgoing[i].path[0] != '\0' && strcmp(outgoing[i].name, t->name) == 0)
+            {
+                memcpy(t->path, outgoing[i].path, sizeof(t->path));
+                outgoing[i].path[0] = '\0';
+                break;
+            }
+        }
+        if (t->path[0] == '\0')
+        {
+            free(t);
+            return;
+        }
+    }
+    else
+    {
+        // 只保存到当前目录：去掉路径部分，不接受隐藏文件和 . ..
+        char copy[PATH_SIZE];
+        memcpy(copy, t->name, sizeof(copy));
+        snprintf(t->name, sizeof(t->name), "%s", basename(copy));
+        if (t->name[0] == '\0' || t->name[0] == '.' || strchr(t->name, '/') != NULL)
+        {
+            printf("[文件] #%llu 文件名无效，不接收\n", t->id);
+            free(t);
+            return;
+        }
+    }
+    t->next = transfers;
+    transfers = t;
+    t->fd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (t->fd < 0 ||
+        (connect(t->fd, (struct sockaddr *)&server_addr, sizeof(server_addr)) < 0 &&
+         errno != EINPROGRESS))
+    {
+        transfer_finish(t, "无法建立数据连接");
+        return;
+    }
+    t->phase = XFER_CONNECTING;
+    watch(t->fd, t, EPOLLOUT, EPOLL_CTL_ADD);
+}
+
+// 打开接收文件：不覆盖已有文件，重名时加上序号
+static int open_output(const char *name, char *path, size_t size)
+{
+    snprintf(path, size, "%s", name);
+    for (int i = 1; i < 100; i++)
+    {
+        int fd = open(path, O_WRONLY | O_CREAT | O_EXCL | O_CLOEXEC, 0644);
+        if (fd >= 0 || errno != EEXIST)
+        {
+            return fd;
+        }
+        snprintf(path, size, "%s.%d", name, i);
+    }
+    return -1;
+}
+
+// 数据连接的事件：连接后发送 /xfer <令牌>，等到服务器的“开始传输”一行后，
+// 发送方用 sendfile 发出文件，接收方把之后的字节写入文件
+void transfer_event(Transfer *t, uint32_t events)
+{
+    if (t->phase == XFER_CONNECTING)
+    {
+        int err = 0;
+        socklen_t len = sizeof(err);
+        char line[TOKEN_LEN + 16];
+        int n = snprintf(line, sizeof(line), "/xfer %s\n", t->token);
+        if (getsockopt(t->fd, SOL_SOCKET, SO_ERROR, &err, &len) < 0 || err != 0 ||
+            send(t->fd, line, (size_t)n, MSG_NOSIGNAL) != n)
+        {
+            transfer_finish(t, "无法建立数据连接");
+            return;
+        }
+        t->phase = XFER_WAIT_GO;
+        watch(t->fd, t, EPOLLIN | EPOLLRDHUP, EPOLL_CTL_MOD);
+        return;
+    }
+
+    if (t->phase == XFER_WAIT_GO)
+    {
+        // 丢弃“开始传输”之前的欢迎语等，剩下的是文件数据
+        ssize_t n = recv(t->fd, t->buffer + t->len, sizeof(t->buffer) - 1 - t->len, 0);
+        if (n < 0 && (errno == EAGAIN || errno == EINTR))
+        {
+            return;
+        }
+        if (n <= 0)
+        {
+            transfer_finish(t, "服务器没有开始传输");
+            return;
+        }
+        t->len += (size_t)n;
+        t->buffer[t->len] = '\0';
+        char *data = strstr(t->buffer, TRANSFER_GO);
+        if (data == NULL)
+        {
+            if (t->len == sizeof(t->buffer) - 1)
+            {
+                transfer_finish(t, "服务器没有开始传输");
+            }
+            return;
+        }
+        data += strlen(TRANSFER_GO);
+        t->len = t->buffer + t->len - data;
+        t->phase = XFER_RUNNING;
+        if (t->sending)
+        {
+            t->file = open(t->path, O_RDONLY | O_CLOEXEC);
+            if (t->file < 0)
+            {
+                transfer_finish(t, NULL);
+                return;
+            }
+            watch(t->fd, t, EPOLLOUT, EPOLL_CTL_MOD);
+            return;
+        }
+        t->file = open_output(t->name, t->path, sizeof(t->path));
+        if (t->file < 0)
+        {
+            char error[PATH_SIZE + 32];
+            snprintf(error, sizeof(error), "无法创建文件 %s", t->name);
+            transfer_finish(t, error);
+            return;
+        }
+        memmove(t->buffer, data, t->len);
+    }
+
+    if (t->sending)
+    {
+        while (t->done < t->size)
+        {
+            size_t want = t->size - t->done < XFER_CHUNK ? t->size - t->done : XFER_CHUNK;
+            ssize_t n = sendfile(t->fd, t->file, &t->off, want);
+            if (n < 0 && (errno == EAGAIN || errno == EINTR))
+            {
+                return;
+            }
+            if (n <= 0)
+            {
+                break;
+            }
+            t->done += (unsigned long long)n;
+        }
+        transfer_finish(t, NULL);
+        return;
+    }
+
+    // 接收方：先写入“开始传输”之后已经读到的字节，再读出连接上已到达的数据
+    while (t->done < t->size)
+    {
+        if (t->len == 0)
+        {
+            ssize_t n = recv(t->fd, t->buffer, sizeof(t->buffer), 0);
+            if (n < 0 && (errno == EAGAIN || errno == EINTR))
+            {
+                return;
+            }
+            if (n <= 0)
+            {
+                break;
+            }
+            t->len = (size_t)n;
+        }
+        if (t->len > t->size - t->done)
+        {
+            t->len = t->size - t->done;
+        }
+        if (write(t->file, t->buffer, t->len) != (ssize_t)t->len)
+        {
+            break;
+        }
+        t->done += t->len;
+        t->len = 0;
+    }
+    (void)events;
+    transfer_finish(t, NULL);
+}
+
+// 结束传输：报告结果，关闭数据连接和文件
+void transfer_finish(Transfer *t, const char *error)
+{
+    if (error != NULL)
+    {
+        printf("[文件] #%llu %s\n", t->id, error);
+    }
+    else if (t->sending)
+    {
+        printf("[文件] #%llu %s 已发送 %llu/%llu 字节\n", t->id, t->name, t->done, t->size);
+    }
+    else
+    {
+        printf("[文件] #%llu 已保存到 %s (%llu/%llu 字节)\n", t->id, t->path, t->done, t->size);
+    }
+    fflush(stdout);
+
+    Transfer **pp = &transfers;
+    while (*pp != t)
+    {
+        pp = &(*pp)->next;
+    }
+    *pp = t->next;
+    if (t->file >= 0)
+    {
+        close(t->file);
+    }
+    if (t->fd >= 0)
+    {
+        close(t->fd); // 关闭时自动从 epoll 中移除
+    }
+    free(t);
+}
+
+// 读入脚本：每行一条消息或命令，忽略空行和 # 开头的注释行
+int load_script(const char *path)
+{
+    FILE *fp = fopen(path, "r");
+    char line[BUFFER_SIZE];
+    size_t cap = 0;
+
+    if (fp == NULL)
+    {
+        perror("打开脚本失败");
+        return -1;
+    }
+    while (fgets(line, sizeof(line), fp) != NULL)
+    {
+        line[strcspn(line, "\r\n")] = '\0';
+        if (line[0] == '\0' || line[0] == '#')
+        {
+            continue;
+        }
+        if (script_count == cap)
+        {
+            cap = cap ? cap * 2 : 16;
+            char **grown = realloc(script, cap * sizeof(char *));
+            if (grown == NULL)
+            {
+                fclose(fp);
+                return -1;
+            }
+            script = grown;
+        }
+        script[script_count] = strdup(line);
+        if (script[script_count] == NULL)
+        {
+            fclose(fp);
+            return -1;
+        }
+        script_count++;
+    }
+    fclose(fp);
+    if (script_count == 0)
+    {
+        fprintf(stderr, "脚本中没有可发送的行: %s\n", path);
+        return -1;
+    }
+    return 0;
+}
+
+// 解析生成规则：逗号分隔的 len=字节数、rooms=房间数、private=私聊百分比，都可省略
+int parse_generator(const char *spec)
+{
+    char copy[256];
+    char *save = NULL;
+
+    snprintf(copy, sizeof(copy), "%s", spec);
+    for (char *item = strtok_r(copy, ",", &save); item != NULL; item = strtok_r(NULL, ",", &save))
+    {
+        int value;
+        if (sscanf(item, "len=%d", &value) == 1 && value > 0 && value < BUFFER_SIZE - 64)
+        {
+            bot_len = value;
+        }
+        else if (sscanf(item, "rooms=%d", &value) == 1 && value >= 0)
+        {
+            bot_rooms = value;
+        }
+        else if (sscanf(item, "private=%d", &value) == 1 && value >= 0 && value <= 100)
+        {
+            bot_private = value;
+        }
+        else
+        {
+            return -1;
+        }
+    }
+    return 0;
+}
+
+// 生成规则的会话第一次连接后改名为 bot<进程号>_<编号>（私聊时据此找到其他会话），
+// 指定了房间数时进入房间 bot<编号 % 房间数>
+void bot_setup(Session *s)
+{
+    char line[128];
+    int n;
+
+    s->setup_done = 1;
+    if (!bot_generate)
+    {
+        return;
+    }
+    n = snprintf(line, sizeof(line), "/name bot%d_%d\n", (int)getpid(), s->index);
+    session_write(s, line, (size_t)n);
+    if (bot_rooms > 0)
+    {
+        n = snprintf(line, sizeof(line), "/join bot%d\n", s->index % bot_rooms);
+        session_write(s, line, (size_t)n);
+    }
+}
+
+// 会话要发送的下一行（带换行），没有可发送的行时返回 0。脚本中的 %n 替换为会话编号；
+// 脚本发完后，指定了运行时间时从头再来，否则发送 /quit
+size_t bot_next_line(Session *s, char *line, size_t cap)
+{
+    size_t len = 0;
+
+    if (bot_generate)
+    {
+        if (bot_private > 0 && session_count > 1 && rand() % 100 < bot_private)
+        {
+            int to = (s->index + 1 + rand() % (session_count - 1)) % session_count;
+            len = (size_t)snprintf(line, cap, "/msg bot%d_%d ", (int)getpid(), to);
+        }
+        len += (size_t)snprintf(line + len, cap - len, "来自 %d 的第 %lu 条消息 ", s->index, s->sent + 1);
+        while (len < (size_t)bot_len + (line[0] == '/' ? 20 : 0) && len < cap - 2)
+        {
+            line[len++] = 'x';
+        }
+        line[len++] = '\n';
+        return len;
+    }
+
+    if (s->script_pos == script_count)
+    {
+        if (bot_duration == 0)
+        {
+            s->done = 1;
+            return (size_t)snprintf(line, cap, "/quit\n");
+        }
+        s->script_pos = 0;
+    }
+    for (const char *p = script[s->script_pos++]; *p != '\0' && len < cap - 16; p++)
+    {
+        if (p[0] == '%' && p[1] == 'n')
+        {
+            len += (size_t)snprintf(line + len, cap - len, "%d", s->index);
+            p++;
+        }
+        else
+        {
+            line[len++] = *p;
+        }
+    }
+    line[len++] = '\n';
+    return len;
+}
+
+// 按目标速率发送到期的消息：到期次数 = 已过时间 × 速率，会话轮流发送。
+// 没有可发送的会话（未连接、积压过多）时这次发送跳过，不在之后补发
+void bot_send_due(long long now)
+{
+    char line[BUFFER_SIZE + 64];
+    unsigned long due = (unsigned long)((now - bot_start) * bot_rate / 1000.0);
+
+    while (bot_slots < due)
+    {
+        bot_slots++;
+        Session *s = NULL;
+        for (int tried = 0; tried < session_count; tried++)
+        {
+            Session *c = &sessions[bot_cursor];
+            bot_cursor = (bot_cursor + 1) % session_count;
+            if (c->state == SESSION_UP && c->setup_done && !c->done && !c->quitting &&
+                c->out_len < OUT_LIMIT)
+            {
+                s = c;
+                break;
+            }
+        }
+        if (s == NULL)
+        {
+            bot_skipped++;
+            continue;
+        }
+        size_t len = bot_next_line(s, line, sizeof(line));
+        if (session_send_line(s, line, len) == 0 && !s->quitting)
+        {
+            s->sent++;
+        }
+    }
+}
+
+// epoll_wait 的超时：下一次发送、重连或运行结束的时间，最多 1 秒
+int next_timeout(long long now)
+{
+    long long next = now + 1000;
+    if (interactive && waiting_count == 0 && transfers == NULL)
+    {
+        return -1;
+    }
+    if (!interactive)
+    {
+        long long send_at = bot_start + (long long)((bot_slots + 1) * 1000.0 / bot_rate);
+        if (send_at < next)
+        {
+            next = send_at;
+        }
+        if (bot_duration > 0 && bot_start + bot_duration * 1000LL < next)
+        {
+            next = bot_start + bot_duration * 1000LL;
+        }
+    }
+    for (int i = 0; i < session_count && waiting_count > 0; i++)
+    {
+        if (sessions[i].state == SESSION_WAITING && sessions[i].retry_at < next)
+        {
+            next = sessions[i].retry_at;
+        }
+    }
+    return next > now ? (int)(next - now) : 0;
+}
+
+// 信号处理函数：结束事件循环，由主循环之后发送 /quit 并清理
+void signal_handler(int sig)
+{
+    (void)sig; // 抑制未使用参数警告
+    interrupted = 1;
+    client_running = 0;
 }
 
 // 打印使用说明
 void print_usage(const char *program)
 {
-    printf("使用方法: %s [服务器IP] [端口]\n", program);
+    printf("使用方法: %s [选项] [服务器IP] [端口]\n", program);
     printf("  服务器IP: 服务器的IP地址 (默认: %s)\n", DEFAULT_SERVER);
     printf("  端口:     服务器的端口号 (默认: %d)\n", DEFAULT_PORT);
+    printf("\n机器人模式 (不读标准输入，结束时打印统计):\n");
+    printf("  -s 脚本    每个会话依次发送脚本中的行 (空行和 # 开头的行忽略，%%n 替换为会话编号)\n");
+    printf("  -g 规则    生成消息: len=字节数,rooms=房间数,private=私聊百分比 (默认 len=%d)\n",
+           BOT_LEN_DEFAULT);
+    printf("  -n 会话数  一个进程里的会话数 (默认 1)\n");
+    printf("  -r 速率    所有会话合计每秒发送的条数 (默认 1)\n");
+    printf("  -d 秒      运行时间；脚本发完后从头再来 (默认脚本发完即退出，生成规则一直运行)\n");
     printf("\n示例:\n");
     printf("  %s                    # 连接本地服务器\n", program);
     printf("  %s 192.168.1.100      # 连接指定IP\n", program);
     printf("  %s 192.168.1.100 9999 # 连接指定IP和端口\n", program);
+    printf("  %s -g len=64,rooms=4 -n 200 -r 500 -d 60  # 200 个机器人分在 4 个房间\n", program);
+    printf("  %s -s chat.txt -n 10 -r 5                  # 10 个会话各自发完脚本\n", program);
 }
@@ -0,0 +1,235 @@
+/**
+ * 集群节点间协议：几个服务器实例之间用长连接互相转发在线状态、房间广播和私聊
+ * 功能：把一轮事件循环中要发给同一节点的事件打包成一帧，压缩后发送；接收端按消息 ID 去重
+ *
+ * 帧格式：4 字节负载长度 + 4 字节原始长度（网络字节序）+ 负载。两个长度相等时负载未压缩
+ * （太小的批不值得压缩），否则是 zlib 压缩的数据。原始数据是若干事件，每个事件为
+ * 1 字节类型 + 8 字节 ID + 1 字节名字长度 + 2 字节文本长度 + 2 字节二进制帧长度，
+ * 之后依次是名字、文本协议编码和二进制协议编码（两种编码在产生消息的节点各编码一次）。
+ *
+ * 消息 ID：高 8 位是产生消息的节点号，低 56 位是该节点内递增的序号。每个来源节点保存
+ * 见过的最大序号和它之前 64 个序号的位图，同一条消息经两条连接到达（两个节点互相主动连接，
+ * 或连接切换时旧连接上还有未读完的数据）只投递一次；比窗口更旧的消息直接丢弃。
+ */
+
+#ifndef CLUSTER_H
+#define CLUSTER_H
+
+#include <arpa/inet.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <zlib.h>
+
+#define CLUSTER_MAX_NODES 256
+#define CLUSTER_FRAME_HEADER 8
+#define CLUSTER_EVENT_HEADER 14
+#define CLUSTER_FRAME_MAX (4 * 1024 * 1024) // 单帧原始数据的上限
+#define CLUSTER_BATCH_MAX (256 * 1024)      // 一批原始数据超过时立即成帧
+#define CLUSTER_COMPRESS_MIN 256            // 小于此长度的批不压缩
+#define CLUSTER_ID(node, seq) (((uint64_t)(node) << 56) | (seq))
+#define CLUSTER_ID_NODE(id) ((int)((id) >> 56))
+#define CLUSTER_ID_SEQ(id) ((id) & ((1ull << 56) - 1))
+
+enum {
+  CLUSTER_HELLO = 1, // 连接建立后的第一个事件，ID 为发送方的节点号
+  CLUSTER_JOIN,      // 用户上线（或改名后的新昵称），名字为昵称
+  CLUSTER_PART,      // 用户下线（或改名前的旧昵称）
+  CLUSTER_ROOM,      // 房间广播，名字为房间名
+  CLUSTER_PRIVATE    // 私聊，名字为目标昵称
+};
+
+typedef struct ClusterEvent {
+  uint8_t type;
+  uint64_t id;
+  const char *name;
+  size_t name_len;
+  const char *text;
+  size_t text_len;
+  const char *bin;
+  size_t bin_len;
+} ClusterEvent;
+
+// 可增长的字节缓冲区
+typedef struct ClusterBuf {
+  char *data;
+  size_t len;
+  size_t cap;
+} ClusterBuf;
+
+// 每个来源节点的去重窗口
+typedef struct ClusterDedup {
+  uint64_t max_seq; // 见过的最大序号
+  uint64_t window;  // 第 i 位表示 max_seq - i 已经见过
+  int seen;         // 收到过这个节点的消息
+} ClusterDedup;
+
+static inline int cluster_buf_reserve(ClusterBuf *b, size_t extra) {
+  if (b->len + extra <= b->cap) {
+    return 0;
+  }
+  size_t cap = b->cap ? b->cap : 4096;
+  while (cap < b->len + extra) {
+    cap *= 2;
+  }
+  char *grown = realloc(b->data, cap);
+  if (grown == NULL) {
+    return -1;
+  }
+  b->data = grown;
+  b->cap = cap;
+  return 0;
+}
+
+// 丢弃开头已经处理的 n 字节
+static inline void cluster_buf_consume(ClusterBuf *b, size_t n) {
+  memmove(b->data, b->data + n, b->len - n);
+  b->len -= n;
+}
+
+static inline void cluster_buf_free(ClusterBuf *b) {
+  free(b->data);
+  b->data = NULL;
+  b->len = b->cap = 0;
+}
+
+static inline void cluster_put16(char *p, uint16_t v) {
+  v = htons(v);
+  memcpy(p, &v, 2);
+}
+
+static inline void cluster_put32(char *p, uint32_t v) {
+  v = htonl(v);
+  memcpy(p, &v, 4);
+}
+
+static inline uint16_t cluster_get16(const char *p) {
+  uint16_t v;
+  memcpy(&v, p, 2);
+  return ntohs(v);
+}
+
+static inline uint32_t cluster_get32(const char *p) {
+  uint32_t v;
+  memcpy(&v, p, 4);
+  return ntohl(v);
+}
+
+// 把一个事件追加到批中
+static inline int cluster_put_event(ClusterBuf *b, const ClusterEvent *e) {
+  if (e->name_len > 255 || e->text_len > 65535 || e->bin_len > 65535) {
+    return -1;
+  }
+  size_t n = CLUSTER_EVENT_HEADER + e->name_len + e->text_len + e->bin_len;
+  if (cluster_buf_reserve(b, n) < 0) {
+    return -1;
+  }
+  char *p = b->data + b->len;
+  p[0] = (char)e->type;
+  cluster_put32(p + 1, (uint32_t)(e->id >> 32));
+  cluster_put32(p + 5, (uint32_t)e->id);
+  p[9] = (char)e->name_len;
+  cluster_put16(p + 10, (uint16_t)e->text_len);
+  cluster_put16(p + 12, (uint16_t)e->bin_len);
+  p += CLUSTER_EVENT_HEADER;
+  memcpy(p, e->name, e->name_len);
+  memcpy(p + e->name_len, e->text, e->text_len);
+  memcpy(p + e->name_len + e->text_len, e->bin, e->bin_len);
+  b->len += n;
+  return 0;
+}
+
+// 解析批中的下一个事件（指向批内数据，不拷贝），返回占用的字节数，数据不完整时返回 0
+static inline size_t cluster_next_event(const char *p, size_t len,
+                                        ClusterEvent *e) {
+  if (len < CLUSTER_EVENT_HEADER) {
+    return 0;
+  }
+  e->type = (uint8_t)p[0];
+  e->id = ((uint64_t)cluster_get32(p + 1) << 32) | cluster_get32(p + 5);
+  e->name_len = (uint8_t)p[9];
+  e->text_len = cluster_get16(p + 10);
+  e->bin_len = cluster_get16(p + 12);
+  size_t n = CLUSTER_EVENT_HEADER + e->name_len + e->text_len + e->bin_len;
+  if (n > len) {
+    return 0;
+  }
+  e->name = p + CLUSTER_EVENT_HEADER;
+  e->text = e->name + e->name_len;
+  e->bin = e->text + e->text_len;
+  return n;
+}
+
+// 把一批原始事件编码成一帧追加到 out：足够大的批用 zlib 最快档压缩
+static inline int cluster_frame(const ClusterBuf *raw, ClusterBuf *out) {
+  uLongf bound = compressBound((uLong)raw->len);
+  if (cluster_buf_reserve(out, CLUSTER_FRAME_HEADER + bound) < 0) {
+    return -1;
+  }
+  char *p = out->data + out->len;
+  uLongf n = bound;
+  if (raw->len < CLUSTER_COMPRESS_MIN ||
+      compress2((Bytef *)p + CLUSTER_FRAME_HEADER, &n, (const Bytef *)raw->data,
+                (uLong)raw->len, Z_BEST_SPEED) != Z_OK ||
+      n >= raw->len) {
+    memcpy(p + CLUSTER_FRAME_HEADER, raw->data, raw->len);
+    n = (uLongf)raw->len;
+  }
+  cluster_put32(p, (uint32_t)n);
+  cluster_put32(p + 4, (uint32_t)raw->len);
+  out->len += CLUSTER_FRAME_HEADER + n;
+  return 0;
+}
+
+// 从 data 开头取出一帧，解压后的原始事件放入 raw（覆盖原内容）。
+// 返回帧占用的字节数，数据不完整时返回 0，帧损坏时返回 -1
+static inline long cluster_unframe(const char *data, size_t len,
+                                   ClusterBuf *raw) {
+  if (len < CLUSTER_FRAME_HEADER) {
+    return 0;
+  }
+  uint32_t n = cluster_get32(data);
+  uint32_t raw_len = cluster_get32(data + 4);
+  if (raw_len > CLUSTER_FRAME_MAX || n > compressBound(raw_len)) {
+    return -1;
+  }
+  if (len < CLUSTER_FRAME_HEADER + (size_t)n) {
+    return 0;
+  }
+  raw->len = 0;
+  if (cluster_buf_reserve(raw, raw_len) < 0) {
+    return -1;
+  }
+  const char *p = data + CLUSTER_FRAME_HEADER;
+  if (n == raw_len) {
+    memcpy(raw->data, p, n);
+  } else {
+    uLongf out_len = raw_len;
+    if (uncompress((Bytef *)raw->data, &out_len, (const Bytef *)p, n) != Z_OK ||
+        out_len != raw_len) {
+      return -1;
+    }
+  }
+  raw->len = raw_len;
+  return (long)(CLUSTER_FRAME_HEADER + n);
+}
+
+// 检查消息 ID 是否第一次出现，是则记入窗口并返回 1
+static inline int cluster_dedup(ClusterDedup *d, uint64_t seq) {
+  if (!d->seen || seq > d->max_seq) {
+    uint64_t shift = d->seen ? seq - d->max_seq : 64;
+    d->window = shift >= 64 ? 0 : d->window << shift;
+    d->window |= 1;
+    d->max_seq = seq;
+    d->seen = 1;
+    return 1;
+  }
+  uint64_t age = d->max_seq - seq;
+  if (age >= 64 || (d->window & (1ull << age))) {
+    return 0;
+  }
+  d->window |= 1ull << age;
+  return 1;
+}
+
+#endif // CLUSTER_H
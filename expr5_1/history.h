@@ -0,0 +1,346 @@
+/**
+ * 聊天记录：每个房间一组只追加的段文件
+ * 功能：持久保存房间的聊天消息，新成员进入房间时用 sendfile 直接从段文件回放最近的消息
+ *
+ * 实现：段文件创建时扩展到 HISTORY_SEGMENT_SIZE 并用 mmap 映射，追加一条记录就是一次 memcpy；
+ * 段写满或超过 HISTORY_SEGMENT_AGE 秒后换新段（旧段截断到实际长度），
+ * 每个房间只保留最近 HISTORY_KEEP_SEGMENTS 个段。每条记录是以换行结尾的一行文本，
+ * 稀疏索引在每个段的开头和每隔 HISTORY_INDEX_STRIDE 条记录处保存（序号，段，偏移），
+ * 回放时二分查找索引，再用 memchr 数出剩下的几行。
+ *
+ * 追加、换段和刷盘只在历史线程中进行；回放在分片线程中进行，只读取已提交的部分，
+ * 两者通过每个房间的互斥锁同步（追加时 memcpy 在锁外，只有更新长度和索引时持锁）。
+ * 段对象带引用计数，被删除的段在正在回放它的连接发送完之前不会关闭。
+ */
+
+#ifndef HISTORY_H
+#define HISTORY_H
+
+#include <fcntl.h>
+#include <glob.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <time.h>
+#include <unistd.h>
+
+#define HISTORY_SEGMENT_SIZE (4 * 1024 * 1024)
+#define HISTORY_SEGMENT_AGE 3600 // 段最多使用的秒数，之后换新段
+#define HISTORY_KEEP_SEGMENTS 4
+#define HISTORY_INDEX_STRIDE 32
+#define HISTORY_PATH_MAX 512
+
+typedef struct HistorySegment {
+  atomic_int refs;
+  int fd;
+  char *map;
+  size_t size;     // 映射长度
+  size_t tail;     // 已提交的字节数（持锁修改）
+  uint64_t number; // 段号，文件名的一部分
+  time_t created;
+  int dirty;       // 有尚未 fdatasync 的数据（只由历史线程访问）
+} HistorySegment;
+
+// 稀疏索引项：序号为 seq 的记录从 seg 的 off 处开始
+typedef struct HistoryMark {
+  uint64_t seq;
+  HistorySegment *seg;
+  size_t off;
+} HistoryMark;
+
+typedef struct RoomHistory {
+  pthread_mutex_t lock;
+  const char *dir;
+  uint64_t key; // 房间名的哈希，文件名前缀
+  HistorySegment *segs[HISTORY_KEEP_SEGMENTS]; // 从旧到新，最后一个是当前段
+  int seg_count;
+  uint64_t count;     // 下一条记录的序号
+  uint64_t first_seq; // 仍保留的最旧记录的序号
+  HistoryMark *index;
+  size_t index_len;
+  size_t index_cap;
+  int dirty;                       // 在历史线程的待刷盘链表中
+  struct RoomHistory *next_dirty;
+  struct RoomHistory *next_closing; // 房间已回收，在待关闭链表中
+} RoomHistory;
+
+// 回放的一段连续字节
+typedef struct HistoryRange {
+  HistorySegment *seg;
+  off_t off;
+  size_t len;
+} HistoryRange;
+
+static inline HistorySegment *history_seg_get(HistorySegment *seg) {
+  atomic_fetch_add_explicit(&seg->refs, 1, memory_order_relaxed);
+  return seg;
+}
+
+static inline void history_seg_put(HistorySegment *seg) {
+  if (atomic_fetch_sub_explicit(&seg->refs, 1, memory_order_acq_rel) == 1) {
+    munmap(seg->map, seg->size);
+    close(seg->fd);
+    free(seg);
+  }
+}
+
+static inline void history_path(const RoomHistory *h, uint64_t number,
+                                char *path, size_t size) {
+  snprintf(path, size, "%s/%016llx-%08llu.log", h->dir,
+           (unsigned long long)h->key, (unsigned long long)number);
+}
+
+// 打开（或创建并预分配）段文件并映射；已有的段从最后一个换行之后继续写，
+// 崩溃时写了一半的记录会被覆盖
+static inline HistorySegment *history_seg_open(const char *path,
+                                               uint64_t number, int create) {
+  int fd = open(path, O_RDWR | O_CLOEXEC | (create ? O_CREAT | O_EXCL : 0),
+                0644);
+  if (fd < 0) {
+    return NULL;
+  }
+  struct stat st;
+  if ((create && ftruncate(fd, HISTORY_SEGMENT_SIZE) < 0) ||
+      fstat(fd, &st) < 0 || st.st_size == 0) {
+    close(fd);
+    return NULL;
+  }
+  char *map = mmap(NULL, st.st_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+  HistorySegment *seg = calloc(1, sizeof(HistorySegment));
+  if (map == MAP_FAILED || seg == NULL) {
+    if (map != MAP_FAILED) {
+      munmap(map, st.st_size);
+    }
+    free(seg);
+    close(fd);
+    return NULL;
+  }
+  atomic_init(&seg->refs, 1);
+  seg->fd = fd;
+  seg->map = map;
+  seg->size = st.st_size;
+  seg->number = number;
+  seg->created = time(NULL);
+  if (!create) {
+    char *last = memrchr(map, '\n', seg->size);
+    seg->tail = last ? (size_t)(last - map) + 1 : 0;
+  }
+  return seg;
+}
+
+// 添加索引项（调用者持锁）
+static inline int history_mark(RoomHistory *h, HistorySegment *seg, size_t off) {
+  if (h->index_len == h->index_cap) {
+    size_t new_cap = h->index_cap ? h->index_cap * 2 : 64;
+    HistoryMark *grown = realloc(h->index, sizeof(HistoryMark) * new_cap);
+    if (grown == NULL) {
+      return -1;
+    }
+    h->index = grown;
+    h->index_cap = new_cap;
+  }
+  h->index[h->index_len].seq = h->count;
+  h->index[h->index_len].seg = seg;
+  h->index[h->index_len].off = off;
+  h->index_len++;
+  return 0;
+}
+
+// 删除最旧的段和指向它的索引项（调用者持锁）
+static inline void history_drop_oldest(RoomHistory *h) {
+  HistorySegment *old = h->segs[0];
+  char path[HISTORY_PATH_MAX];
+  size_t n = 0;
+  while (n < h->index_len && h->index[n].seg == old) {
+    n++;
+  }
+  memmove(h->index, h->index + n, sizeof(HistoryMark) * (h->index_len - n));
+  h->index_len -= n;
+  h->first_seq = h->index_len > 0 ? h->index[0].seq : h->count;
+  memmove(h->segs, h->segs + 1, sizeof(HistorySegment *) * (h->seg_count - 1));
+  h->seg_count--;
+  history_path(h, old->number, path, sizeof(path));
+  unlink(path); // 正在回放的连接仍持有引用，文件在它们发完后才真正释放
+  history_seg_put(old);
+}
+
+static inline int history_cmp_number(const void *a, const void *b) {
+  uint64_t x = *(const uint64_t *)a, y = *(const uint64_t *)b;
+  return x < y ? -1 : x > y;
+}
+
+// 打开房间的聊天记录：加载目录中已有的段（超出保留数的删除）并重建稀疏索引。
+// name 应是规范化后的房间名，相同的房间名总是对应相同的文件
+static inline RoomHistory *history_open(const char *dir, const char *name) {
+  RoomHistory *h = calloc(1, sizeof(RoomHistory));
+  if (h == NULL) {
+    return NULL;
+  }
+  pthread_mutex_init(&h->lock, NULL);
+  h->dir = dir;
+  h->key = 14695981039346656037ull; // FNV-1a 64 位
+  for (const char *p = name; *p != '\0'; p++) {
+    h->key = (h->key ^ (unsigned char)*p) * 1099511628211ull;
+  }
+
+  char pattern[HISTORY_PATH_MAX];
+  glob_t g;
+  snprintf(pattern, sizeof(pattern), "%s/%016llx-*.log", dir,
+           (unsigned long long)h->key);
+  if (glob(pattern, 0, NULL, &g) != 0) {
+    return h; // 还没有记录
+  }
+  uint64_t *numbers = malloc(sizeof(uint64_t) * g.gl_pathc);
+  size_t count = 0;
+  for (size_t i = 0; numbers != NULL && i < g.gl_pathc; i++) {
+    const char *dash = strrchr(g.gl_pathv[i], '-');
+    if (dash != NULL) {
+      numbers[count++] = strtoull(dash + 1, NULL, 10);
+    }
+  }
+  globfree(&g);
+  qsort(numbers, count, sizeof(uint64_t), history_cmp_number);
+
+  for (size_t i = 0; i < count; i++) {
+    char path[HISTORY_PATH_MAX];
+    history_path(h, numbers[i], path, sizeof(path));
+    if (i + HISTORY_KEEP_SEGMENTS < count) {
+      unlink(path);
+      continue;
+    }
+    HistorySegment *seg = history_seg_open(path, numbers[i], 0);
+    if (seg == NULL) {
+      continue;
+    }
+    h->segs[h->seg_count++] = seg;
+    // 重建索引：逐行计数
+    char *p = seg->map, *end = seg->map + seg->tail;
+    while (p < end) {
+      if (p == seg->map || h->count % HISTORY_INDEX_STRIDE == 0) {
+        history_mark(h, seg, p - seg->map);
+      }
+      p = (char *)memchr(p, '\n', end - p) + 1;
+      h->count++;
+    }
+  }
+  free(numbers);
+  return h;
+}
+
+// 追加一条以换行结尾的记录（只在历史线程调用），返回 -1 表示记录被丢弃
+static inline int history_append(RoomHistory *h, const char *data, size_t len,
+                                 time_t now) {
+  HistorySegment *cur = h->seg_count ? h->segs[h->seg_count - 1] : NULL;
+  if (len == 0 || len > HISTORY_SEGMENT_SIZE) {
+    return -1;
+  }
+  if (cur == NULL || cur->tail + len > cur->size ||
+      now - cur->created >= HISTORY_SEGMENT_AGE) {
+    // 换新段：封存当前段（刷盘并截断到实际长度），超出保留数时删除最旧的段
+    char path[HISTORY_PATH_MAX];
+    uint64_t number = cur ? cur->number + 1 : 1;
+    history_path(h, number, path, sizeof(path));
+    HistorySegment *seg = history_seg_open(path, number, 1);
+    if (seg == NULL) {
+      return -1;
+    }
+    if (cur != NULL) {
+      fdatasync(cur->fd);
+      if (ftruncate(cur->fd, cur->tail) == 0) {
+        cur->dirty = 0;
+      }
+    }
+    pthread_mutex_lock(&h->lock);
+    if (h->seg_count == HISTORY_KEEP_SEGMENTS) {
+      history_drop_oldest(h);
+    }
+    h->segs[h->seg_count++] = seg;
+    pthread_mutex_unlock(&h->lock);
+    cur = seg;
+  }
+
+  // 已提交部分之后的区域不会被读取，拷贝时不需要持锁
+  memcpy(cur->map + cur->tail, data, len);
+  pthread_mutex_lock(&h->lock);
+  if (cur->tail == 0 || h->count % HISTORY_INDEX_STRIDE == 0) {
+    history_mark(h, cur, cur->tail);
+  }
+  cur->tail += len;
+  h->count++;
+  pthread_mutex_unlock(&h->lock);
+  cur->dirty = 1;
+  return 0;
+}
+
+// 把已追加的记录刷到磁盘（只在历史线程调用）
+static inline void history_sync(RoomHistory *h) {
+  for (int i = 0; i < h->seg_count; i++) {
+    if (h->segs[i]->dirty) {
+      fdatasync(h->segs[i]->fd);
+      h->segs[i]->dirty = 0;
+    }
+  }
+}
+
+// 找出最近 n 条记录所在的字节范围（每个段最多一段，各持有一个段引用），
+// 返回范围数，*found 为实际的记录数
+static inline int history_find(RoomHistory *h, uint64_t n,
+                               HistoryRange ranges[HISTORY_KEEP_SEGMENTS],
+                               uint64_t *found) {
+  int count = 0;
+  pthread_mutex_lock(&h->lock);
+  uint64_t avail = h->count - h->first_seq;
+  *found = n < avail ? n : avail;
+  if (*found > 0 && h->index_len > 0) {
+    uint64_t start = h->count - *found;
+    // 二分查找序号不超过 start 的最后一个索引项，它和 start 在同一个段中
+    size_t lo = 0, hi = h->index_len;
+    while (hi - lo > 1) {
+      size_t mid = (lo + hi) / 2;
+      if (h->index[mid].seq <= start) {
+        lo = mid;
+      } else {
+        hi = mid;
+      }
+    }
+    HistoryMark *m = &h->index[lo];
+    const char *p = m->seg->map + m->off;
+    for (uint64_t k = m->seq; k < start; k++) {
+      p = (const char *)memchr(p, '\n', m->seg->map + m->seg->tail - p) + 1;
+    }
+
+    int i = 0;
+    while (h->segs[i] != m->seg) {
+      i++;
+    }
+    for (size_t off = p - m->seg->map; i < h->seg_count; i++, off = 0) {
+      if (h->segs[i]->tail > off) {
+        ranges[count].seg = history_seg_get(h->segs[i]);
+        ranges[count].off = (off_t)off;
+        ranges[count].len = h->segs[i]->tail - off;
+        count++;
+      }
+    }
+  }
+  pthread_mutex_unlock(&h->lock);
+  return count;
+}
+
+// 关闭房间的聊天记录（房间被回收时由历史线程调用，或服务器关闭时历史线程已退出）
+static inline void history_close(RoomHistory *h) {
+  history_sync(h);
+  for (int i = 0; i < h->seg_count; i++) {
+    history_seg_put(h->segs[i]);
+  }
+  free(h->index);
+  pthread_mutex_destroy(&h->lock);
+  free(h);
+}
+
+#endif // HISTORY_H
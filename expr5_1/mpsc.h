@@ -0,0 +1,87 @@
+/**
+ * 有界无锁多生产者单消费者队列
+ * 功能：分片之间传递消息指针，生产者之间用 CAS 竞争写入位置，消费者无需同步
+ *
+ * 实现参考 Dmitry Vyukov 的有界 MPMC 队列：每个槽位带一个序号，
+ * 序号等于写入位置时槽位可写，等于写入位置 + 1 时槽位可读。
+ */
+
+#ifndef MPSC_H
+#define MPSC_H
+
+#include <stdatomic.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdlib.h>
+
+typedef struct {
+  atomic_size_t seq;
+  void *data;
+} MpscCell;
+
+typedef struct {
+  MpscCell *cells;
+  size_t mask;
+  // 生产者与消费者的位置放在不同缓存行，避免伪共享
+  _Alignas(64) atomic_size_t enqueue_pos;
+  _Alignas(64) size_t dequeue_pos; // 只由消费者线程访问
+} MpscQueue;
+
+// 初始化队列，capacity 必须是 2 的幂
+static inline int mpsc_init(MpscQueue *q, size_t capacity) {
+  q->cells = malloc(sizeof(MpscCell) * capacity);
+  if (q->cells == NULL) {
+    return -1;
+  }
+  for (size_t i = 0; i < capacity; i++) {
+    atomic_init(&q->cells[i].seq, i);
+  }
+  q->mask = capacity - 1;
+  atomic_init(&q->enqueue_pos, 0);
+  q->dequeue_pos = 0;
+  return 0;
+}
+
+static inline void mpsc_destroy(MpscQueue *q) {
+  free(q->cells);
+  q->cells = NULL;
+}
+
+// 入队（任意线程），队列满时返回 -1，由调用者决定如何处理
+static inline int mpsc_push(MpscQueue *q, void *data) {
+  size_t pos = atomic_load_explicit(&q->enqueue_pos, memory_order_relaxed);
+  for (;;) {
+    MpscCell *cell = &q->cells[pos & q->mask];
+    size_t seq = atomic_load_explicit(&cell->seq, memory_order_acquire);
+    intptr_t diff = (intptr_t)seq - (intptr_t)pos;
+    if (diff == 0) {
+      if (atomic_compare_exchange_weak_explicit(&q->enqueue_pos, &pos, pos + 1,
+                                                memory_order_relaxed,
+                                                memory_order_relaxed)) {
+        cell->data = data;
+        atomic_store_explicit(&cell->seq, pos + 1, memory_order_release);
+        return 0;
+      }
+    } else if (diff < 0) {
+      return -1; // 队列已满
+    } else {
+      pos = atomic_load_explicit(&q->enqueue_pos, memory_order_relaxed);
+    }
+  }
+}
+
+// 出队（仅消费者线程），队列为空时返回 NULL
+static inline void *mpsc_pop(MpscQueue *q) {
+  MpscCell *cell = &q->cells[q->dequeue_pos & q->mask];
+  size_t seq = atomic_load_explicit(&cell->seq, memory_order_acquire);
+  if (seq != q->dequeue_pos + 1) {
+    return NULL;
+  }
+  void *data = cell->data;
+  atomic_store_explicit(&cell->seq, q->dequeue_pos + q->mask + 1,
+                        memory_order_release);
+  q->dequeue_pos++;
+  return data;
+}
+
+#endif // MPSC_H
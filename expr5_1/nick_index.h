@@ -0,0 +1,281 @@
+/**
+ * 昵称索引：昵称 -> 客户端 ID 的并发哈希表
+ * 功能：O(1) 查找私聊目标，加入/改名时原子地拒绝重复昵称
+ *
+ * 实现：按哈希值高位分成若干段，每段一把读写锁和一张开放寻址（线性探测）表，
+ * 不同分片的查找和改名只在落到同一段时才互相等待。槽位保存预先计算的哈希值，
+ * 探测时先比较哈希再比较字符串。可选忽略大小写（只折叠 ASCII 字母）。
+ */
+
+#ifndef NICK_INDEX_H
+#define NICK_INDEX_H
+
+#include <pthread.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define NICK_MAX_LEN 32
+#define NICK_SEGMENTS 64 // 段数（2 的幂）
+#define NICK_SEGMENT_INIT 16
+
+// 段锁的加锁和解锁。包含本文件之前可以定义成带计时的包装（见 stats.h）
+#ifndef NICK_RDLOCK
+#define NICK_RDLOCK pthread_rwlock_rdlock
+#define NICK_WRLOCK pthread_rwlock_wrlock
+#define NICK_UNLOCK pthread_rwlock_unlock
+#endif
+
+enum { NICK_EMPTY = 0, NICK_USED, NICK_DELETED };
+
+typedef struct {
+  uint32_t hash;
+  uint8_t state;
+  char key[NICK_MAX_LEN]; // 折叠大小写后的昵称
+  uint64_t id;
+} NickSlot;
+
+typedef struct {
+  pthread_rwlock_t lock;
+  NickSlot *slots;
+  uint32_t cap; // 2 的幂
+  uint32_t used;
+  uint32_t deleted;
+} NickSegment;
+
+typedef struct {
+  NickSegment segments[NICK_SEGMENTS];
+  int fold_case;
+} NickIndex;
+
+// 规范化昵称：截断到 NICK_MAX_LEN - 1 字节，按需折叠 ASCII 大小写，返回 FNV-1a 哈希
+static inline uint32_t nick_key(const NickIndex *ix, const char *name,
+                                char key[NICK_MAX_LEN]) {
+  uint32_t h = 2166136261u;
+  size_t i;
+  for (i = 0; i < NICK_MAX_LEN - 1 && name[i] != '\0'; i++) {
+    unsigned char ch = (unsigned char)name[i];
+    if (ix->fold_case && ch >= 'A' && ch <= 'Z') {
+      ch = ch - 'A' + 'a';
+    }
+    key[i] = (char)ch;
+    h = (h ^ ch) * 16777619u;
+  }
+  key[i] = '\0';
+  return h;
+}
+
+static inline NickSegment *nick_segment(NickIndex *ix, uint32_t hash) {
+  return &ix->segments[hash >> (32 - 6)]; // 高 6 位选段，与 NICK_SEGMENTS 对应
+}
+
+static inline int nick_init(NickIndex *ix, int fold_case) {
+  ix->fold_case = fold_case;
+  for (int i = 0; i < NICK_SEGMENTS; i++) {
+    NickSegment *seg = &ix->segments[i];
+    pthread_rwlock_init(&seg->lock, NULL);
+    seg->slots = calloc(NICK_SEGMENT_INIT, sizeof(NickSlot));
+    if (seg->slots == NULL) {
+      return -1;
+    }
+    seg->cap = NICK_SEGMENT_INIT;
+    seg->used = seg->deleted = 0;
+  }
+  return 0;
+}
+
+static inline void nick_destroy(NickIndex *ix) {
+  for (int i = 0; i < NICK_SEGMENTS; i++) {
+    pthread_rwlock_destroy(&ix->segments[i].lock);
+    free(ix->segments[i].slots);
+    ix->segments[i].slots = NULL;
+  }
+}
+
+// 在段内查找（调用者持有锁），找到返回槽位，否则返回 NULL
+static inline NickSlot *nick_find(NickSegment *seg, uint32_t hash,
+                                  const char *key) {
+  uint32_t mask = seg->cap - 1;
+  for (uint32_t i = hash & mask;; i = (i + 1) & mask) {
+    NickSlot *slot = &seg->slots[i];
+    if (slot->state == NICK_EMPTY) {
+      return NULL;
+    }
+    if (slot->state == NICK_USED && slot->hash == hash &&
+        strcmp(slot->key, key) == 0) {
+      return slot;
+    }
+  }
+}
+
+// 按新容量重建段（同时清除删除标记），调用者持有写锁
+static inline int nick_rehash(NickSegment *seg, uint32_t new_cap) {
+  NickSlot *slots = calloc(new_cap, sizeof(NickSlot));
+  if (slots == NULL) {
+    return -1;
+  }
+  for (uint32_t i = 0; i < seg->cap; i++) {
+    if (seg->slots[i].state != NICK_USED) {
+      continue;
+    }
+    uint32_t j = seg->slots[i].hash & (new_cap - 1);
+    while (slots[j].state != NICK_EMPTY) {
+      j = (j + 1) & (new_cap - 1);
+    }
+    slots[j] = seg->slots[i];
+  }
+  free(seg->slots);
+  seg->slots = slots;
+  seg->cap = new_cap;
+  seg->deleted = 0;
+  return 0;
+}
+
+// 在段内插入（调用者持有写锁并已确认不存在），装载率超过 3/4 时扩容或清理删除标记
+static inline int nick_put(NickSegment *seg, uint32_t hash, const char *key,
+                           uint64_t id) {
+  if ((seg->used + seg->deleted + 1) * 4 > seg->cap * 3) {
+    uint32_t new_cap = (seg->used + 1) * 2 > seg->cap ? seg->cap * 2 : seg->cap;
+    if (nick_rehash(seg, new_cap) < 0) {
+      return -1;
+    }
+  }
+  uint32_t mask = seg->cap - 1;
+  uint32_t i = hash & mask;
+  while (seg->slots[i].state == NICK_USED) {
+    i = (i + 1) & mask;
+  }
+  if (seg->slots[i].state == NICK_DELETED) {
+    seg->deleted--;
+  }
+  seg->slots[i].hash = hash;
+  seg->slots[i].state = NICK_USED;
+  memcpy(seg->slots[i].key, key, NICK_MAX_LEN);
+  seg->slots[i].id = id;
+  seg->used++;
+  return 0;
+}
+
+static inline void nick_erase(NickSegment *seg, NickSlot *slot) {
+  slot->state = NICK_DELETED;
+  seg->used--;
+  seg->deleted++;
+}
+
+// 查找昵称对应的客户端 ID，不存在时返回 0
+static inline uint64_t nick_lookup(NickIndex *ix, const char *name) {
+  char key[NICK_MAX_LEN];
+  uint32_t hash = nick_key(ix, name, key);
+  NickSegment *seg = nick_segment(ix, hash);
+
+  NICK_RDLOCK(&seg->lock);
+  NickSlot *slot = nick_find(seg, hash, key);
+  uint64_t id = slot ? slot->id : 0;
+  NICK_UNLOCK(&seg->lock);
+  return id;
+}
+
+// 登记新昵称，昵称已被占用时返回 -1
+static inline int nick_insert(NickIndex *ix, const char *name, uint64_t id) {
+  char key[NICK_MAX_LEN];
+  uint32_t hash = nick_key(ix, name, key);
+  NickSegment *seg = nick_segment(ix, hash);
+  int ret = -1;
+
+  NICK_WRLOCK(&seg->lock);
+  if (nick_find(seg, hash, key) == NULL) {
+    ret = nick_put(seg, hash, key, id);
+  }
+  NICK_UNLOCK(&seg->lock);
+  return ret;
+}
+
+// 注销昵称（只删除属于 id 的登记）
+static inline void nick_remove(NickIndex *ix, const char *name, uint64_t id) {
+  char key[NICK_MAX_LEN];
+  uint32_t hash = nick_key(ix, name, key);
+  NickSegment *seg = nick_segment(ix, hash);
+
+  NICK_WRLOCK(&seg->lock);
+  NickSlot *slot = nick_find(seg, hash, key);
+  if (slot != NULL && slot->id == id) {
+    nick_erase(seg, slot);
+  }
+  NICK_UNLOCK(&seg->lock);
+}
+
+// 原子地改名：同时持有新旧昵称所在段的写锁，新昵称被他人占用或扩容失败时返回 -1 且不做任何修改
+static inline int nick_rename(NickIndex *ix, const char *old_name,
+                              const char *new_name, uint64_t id) {
+  char old_key[NICK_MAX_LEN], new_key[NICK_MAX_LEN];
+  uint32_t old_hash = nick_key(ix, old_name, old_key);
+  uint32_t new_hash = nick_key(ix, new_name, new_key);
+  NickSegment *a = nick_segment(ix, old_hash);
+  NickSegment *b = nick_segment(ix, new_hash);
+  int ret = -1;
+
+  // 按地址顺序加锁，避免两个方向相反的改名互相死锁
+  NickSegment *first = a < b ? a : b;
+  NickSegment *second = a < b ? b : a;
+  NICK_WRLOCK(&first->lock);
+  if (second != first) {
+    NICK_WRLOCK(&second->lock);
+  }
+
+  // 先登记新昵称再删除旧登记：插入时扩容失败则什么都不改，旧昵称仍在索引中。
+  // 只改了大小写（忽略大小写时键相同）的情况下新键就是自己的旧登记，保留即可
+  NickSlot *taken = nick_find(b, new_hash, new_key);
+  if (taken == NULL) {
+    ret = nick_put(b, new_hash, new_key, id);
+  } else if (taken->id == id) {
+    ret = 0;
+  }
+  if (ret == 0) {
+    // 插入可能重建了段，重新查找旧登记
+    NickSlot *old = nick_find(a, old_hash, old_key);
+    if (old != NULL && old->id == id && nick_find(b, new_hash, new_key) != old) {
+      nick_erase(a, old);
+    }
+  }
+
+  if (second != first) {
+    NICK_UNLOCK(&second->lock);
+  }
+  NICK_UNLOCK(&first->lock);
+  return ret;
+}
+
+// 对每个登记调用 fn（传入规范化后的昵称），逐段持读锁，得到的不是整个索引的一致快照
+static inline void nick_each(NickIndex *ix,
+                             void (*fn)(void *arg, const char *key, uint64_t id),
+                             void *arg) {
+  for (int i = 0; i < NICK_SEGMENTS; i++) {
+    NickSegment *seg = &ix->segments[i];
+    NICK_RDLOCK(&seg->lock);
+    for (uint32_t j = 0; j < seg->cap; j++) {
+      if (seg->slots[j].state == NICK_USED) {
+        fn(arg, seg->slots[j].key, seg->slots[j].id);
+      }
+    }
+    NICK_UNLOCK(&seg->lock);
+  }
+}
+
+// 注销属于 id 的全部登记，返回注销的个数
+static inline int nick_remove_all(NickIndex *ix, uint64_t id) {
+  int removed = 0;
+  for (int i = 0; i < NICK_SEGMENTS; i++) {
+    NickSegment *seg = &ix->segments[i];
+    NICK_WRLOCK(&seg->lock);
+    for (uint32_t j = 0; j < seg->cap; j++) {
+      if (seg->slots[j].state == NICK_USED && seg->slots[j].id == id) {
+        nick_erase(seg, &seg->slots[j]);
+        removed++;
+      }
+    }
+    NICK_UNLOCK(&seg->lock);
+  }
+  return removed;
+}
+
+#endif // NICK_INDEX_H
@@ -0,0 +1,632 @@
+/**
+ * 离线私聊：所有收件人共用的日志结构存储
+ * 功能：私聊对象不在线时把消息保存到磁盘，对方以该昵称登录并提供信箱口令时按发送顺序投递。
+ * 昵称本身不需要认证，所以只为用口令认领过信箱的昵称保存消息，投递前核对口令
+ *
+ * 实现：记录追加到预分配并用 mmap 映射的段文件，保存一条消息就是持锁做一次 memcpy，
+ * 请求路径上没有 fsync；落盘线程每隔一段时间把写过的段一起 fdatasync（成组提交）。
+ * 内存中的收件箱表按规范化的昵称索引，每个收件箱按序号保存未投递消息在段中的位置。
+ * 投递时清空收件箱并追加一条 ACK 记录（该收件人序号不超过 seq 的消息都已投递），
+ * 消息所在段的存活字节数随之减少。认领信箱写一条 CLAIM 记录（调用者算好的口令哈希，
+ * 存储只保存和返回这个字符串，不接触口令），
+ * 收件箱因此一直保留，CLAIM 记录和未投递的消息一样算作存活字节。
+ *
+ * 压缩：最旧的段中存活的消息不到一半时，落盘线程把它们复制到当前段末尾（序号不变）、
+ * 更新收件箱中的位置，刷盘后删除整个段。ACK 总是写在它确认的消息之后，
+ * 所以最旧段中的 ACK 只确认同一段中的消息，可以随段一起丢弃。
+ *
+ * 重启时按段号顺序扫描所有段，过滤掉已确认和压缩时重复的消息。每条记录带长度和校验和，
+ * 崩溃时写了一半的记录从那里截断。每个收件人最多保存 OFFLINE_USER_MAX_MSGS 条、
+ * OFFLINE_USER_MAX_BYTES 字节，整个存储最多 OFFLINE_MAX_SEGMENTS 个段。
+ */
+
+#ifndef OFFLINE_H
+#define OFFLINE_H
+
+#include <fcntl.h>
+#include <glob.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <time.h>
+#include <unistd.h>
+
+#define OFFLINE_SEGMENT_SIZE (4 * 1024 * 1024)
+#define OFFLINE_MAX_SEGMENTS 16 // 保存新消息时最多使用的段数
+#define OFFLINE_USER_MAX_MSGS 100
+#define OFFLINE_USER_MAX_BYTES (64 * 1024) // 按记录长度计算
+#define OFFLINE_KEY_MAX 32
+#define OFFLINE_CLAIM_MAX 128 // 口令哈希（含结尾的 '\0'）的最大长度
+#define OFFLINE_PATH_MAX 512
+
+enum { OFFLINE_MSG = 1, OFFLINE_ACK = 2, OFFLINE_CLAIM = 3 };
+
+// 段文件中的记录，按 8 字节对齐
+typedef struct OfflineRecord {
+  uint32_t len;      // 记录总长度，0 表示段中没有更多记录
+  uint32_t check;    // len 之后所有字节的校验和
+  uint64_t seq;      // 消息：全局递增的序号；ACK：已投递到的序号
+  int64_t time;      // 发送时间
+  uint8_t type;      // OFFLINE_MSG / OFFLINE_ACK / OFFLINE_CLAIM
+  uint8_t key_len;   // 收件人（规范化的昵称）
+  uint8_t from_len;  // 发送者昵称
+  uint8_t reserved;
+  uint32_t text_len;
+  char data[];       // 收件人 + 发送者 + 消息内容，都不以 '\0' 结尾
+} OfflineRecord;   // CLAIM 的内容为口令哈希
+
+typedef struct OfflineSegment {
+  int fd;
+  char *map;
+  size_t size;     // 映射长度
+  size_t tail;     // 已写入的字节数
+  size_t live;     // 未投递消息占用的字节数
+  uint64_t number; // 段号，文件名的一部分
+  int dirty;       // 有尚未 fdatasync 的数据
+} OfflineSegment;
+
+// 一条未投递的消息
+typedef struct OfflineRef {
+  uint64_t seq;
+  OfflineSegment *seg;
+  uint32_t off;
+  uint32_t len;
+} OfflineRef;
+
+// 一个收件人的未投递消息，按序号排列
+typedef struct OfflineBox {
+  struct OfflineBox *next; // 哈希链
+  uint32_t hash;
+  char key[OFFLINE_KEY_MAX];
+  OfflineRef *refs;
+  uint32_t count;
+  uint32_t cap;
+  uint32_t bytes;
+  uint64_t acked; // 只在加载时使用：已确认的最大序号
+  int claimed;    // 已认领，收件箱在没有消息时也保留
+  char claim[OFFLINE_CLAIM_MAX]; // 口令哈希
+  OfflineRef claim_ref; // 当前有效的 CLAIM 记录
+} OfflineBox;
+
+typedef struct OfflineStore {
+  pthread_mutex_t lock;
+  const char *dir;
+  // 从旧到新，最后一个是当前段；多出的一个留给 ACK 和压缩，保证它们不会因新消息占满而失败
+  OfflineSegment *segs[OFFLINE_MAX_SEGMENTS + 1];
+  int seg_count;
+  OfflineBox **buckets;
+  uint32_t bucket_mask;
+  uint32_t box_count;
+  uint64_t next_seq;
+  atomic_uint pending; // 未投递的消息总数，为 0 时登录不需要加锁查找
+} OfflineStore;
+
+// 投递回调：在存储的锁内调用，不能再调用存储的函数
+typedef void (*OfflineDeliverFn)(void *arg, const OfflineRecord *r);
+
+static inline const char *offline_from(const OfflineRecord *r) {
+  return r->data + r->key_len;
+}
+
+static inline const char *offline_text(const OfflineRecord *r) {
+  return r->data + r->key_len + r->from_len;
+}
+
+// FNV-1a 32 位，用于收件箱表和记录校验
+static inline uint32_t offline_hash(uint32_t h, const void *data, size_t len) {
+  const unsigned char *p = data;
+  for (size_t i = 0; i < len; i++) {
+    h = (h ^ p[i]) * 16777619u;
+  }
+  return h;
+}
+
+static inline uint32_t offline_check(const OfflineRecord *r) {
+  size_t n = offsetof(OfflineRecord, data) - offsetof(OfflineRecord, seq) +
+             r->key_len + r->from_len + r->text_len;
+  return offline_hash(2166136261u, &r->seq, n);
+}
+
+static inline void offline_path(const OfflineStore *st, uint64_t number,
+                                char *path, size_t size) {
+  snprintf(path, size, "%s/offline-%08llu.log", st->dir,
+           (unsigned long long)number);
+}
+
+// 打开（或创建并预分配）段文件并映射，已有的段扫描时再确定写入位置
+static inline OfflineSegment *offline_seg_open(const char *path,
+                                               uint64_t number, int create) {
+  int fd = open(path, O_RDWR | O_CLOEXEC | (create ? O_CREAT | O_EXCL : 0),
+                0644);
+  if (fd < 0) {
+    return NULL;
+  }
+  struct stat sb;
+  if ((create && ftruncate(fd, OFFLINE_SEGMENT_SIZE) < 0) ||
+      fstat(fd, &sb) < 0 || sb.st_size < (off_t)sizeof(OfflineRecord)) {
+    close(fd);
+    return NULL;
+  }
+  char *map = mmap(NULL, sb.st_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+  OfflineSegment *seg = calloc(1, sizeof(OfflineSegment));
+  if (map == MAP_FAILED || seg == NULL) {
+    if (map != MAP_FAILED) {
+      munmap(map, sb.st_size);
+    }
+    free(seg);
+    close(fd);
+    return NULL;
+  }
+  seg->fd = fd;
+  seg->map = map;
+  seg->size = sb.st_size;
+  seg->number = number;
+  return seg;
+}
+
+static inline void offline_seg_close(OfflineSegment *seg) {
+  munmap(seg->map, seg->size);
+  close(seg->fd);
+  free(seg);
+}
+
+// 查找收件箱，create 非 0 时不存在则创建（调用者持锁）
+static inline OfflineBox *offline_box(OfflineStore *st, const char *key,
+                                      size_t key_len, int create) {
+  uint32_t hash = offline_hash(2166136261u, key, key_len);
+  OfflineBox **pp = &st->buckets[hash & st->bucket_mask];
+  for (OfflineBox *b = *pp; b != NULL; b = b->next) {
+    if (b->hash == hash && strncmp(b->key, key, key_len) == 0 &&
+        b->key[key_len] == '\0') {
+      return b;
+    }
+  }
+  if (!create || key_len >= OFFLINE_KEY_MAX) {
+    return NULL;
+  }
+  if (st->box_count > st->bucket_mask) {
+    // 装载因子超过 1 时加倍
+    uint32_t new_mask = st->bucket_mask * 2 + 1;
+    OfflineBox **grown = calloc(new_mask + 1, sizeof(OfflineBox *));
+    if (grown != NULL) {
+      for (uint32_t i = 0; i <= st->bucket_mask; i++) {
+        OfflineBox *b = st->buckets[i];
+        while (b != NULL) {
+          OfflineBox *next = b->next;
+          b->next = grown[b->hash & new_mask];
+          grown[b->hash & new_mask] = b;
+          b = next;
+        }
+      }
+      free(st->buckets);
+      st->buckets = grown;
+      st->bucket_mask = new_mask;
+      pp = &st->buckets[hash & new_mask];
+    }
+  }
+  OfflineBox *b = calloc(1, sizeof(OfflineBox));
+  if (b == NULL) {
+    return NULL;
+  }
+  b->hash = hash;
+  memcpy(b->key, key, key_len);
+  b->next = *pp;
+  *pp = b;
+  st->box_count++;
+  return b;
+}
+
+static inline void offline_box_free(OfflineStore *st, OfflineBox *box) {
+  OfflineBox **pp = &st->buckets[box->hash & st->bucket_mask];
+  while (*pp != box) {
+    pp = &(*pp)->next;
+  }
+  *pp = box->next;
+  st->box_count--;
+  free(box->refs);
+  free(box);
+}
+
+static inline int offline_box_add(OfflineBox *box, const OfflineRef *ref) {
+  if (box->count == box->cap) {
+    uint32_t new_cap = box->cap ? box->cap * 2 : 8;
+    OfflineRef *grown = realloc(box->refs, sizeof(OfflineRef) * new_cap);
+    if (grown == NULL) {
+      return -1;
+    }
+    box->refs = grown;
+    box->cap = new_cap;
+  }
+  box->refs[box->count++] = *ref;
+  return 0;
+}
+
+// 追加一条记录，段写满时换新段；新消息最多使用 OFFLINE_MAX_SEGMENTS 个段，
+// ACK 和压缩复制的消息可以多用一个（调用者持锁）。成功时 ref 为记录的位置
+static inline int offline_write(OfflineStore *st, uint8_t type, const char *key,
+                                size_t key_len, const char *from,
+                                size_t from_len, const char *text,
+                                size_t text_len, uint64_t seq, int64_t when,
+                                OfflineRef *ref) {
+  size_t len = (offsetof(OfflineRecord, data) + key_len + from_len + text_len +
+                7) & ~(size_t)7;
+  OfflineSegment *cur = st->seg_count ? st->segs[st->seg_count - 1] : NULL;
+  if (len > OFFLINE_SEGMENT_SIZE / 2) {
+    return -1;
+  }
+  if (cur == NULL || cur->tail + len > cur->size) {
+    int limit = type == OFFLINE_ACK || seq < st->next_seq
+                    ? OFFLINE_MAX_SEGMENTS + 1
+                    : OFFLINE_MAX_SEGMENTS;
+    if (st->seg_count >= limit) {
+      return -1;
+    }
+    char path[OFFLINE_PATH_MAX];
+    uint64_t number = cur ? cur->number + 1 : 1;
+    offline_path(st, number, path, sizeof(path));
+    OfflineSegment *seg = offline_seg_open(path, number, 1);
+    if (seg == NULL) {
+      return -1;
+    }
+    st->segs[st->seg_count++] = seg;
+    cur = seg;
+  }
+
+  // 先写内容和校验和，最后写长度
+  OfflineRecord *r = (OfflineRecord *)(cur->map + cur->tail);
+  r->seq = seq;
+  r->time = when;
+  r->type = type;
+  r->key_len = (uint8_t)key_len;
+  r->from_len = (uint8_t)from_len;
+  r->reserved = 0;
+  r->text_len = (uint32_t)text_len;
+  memcpy(r->data, key, key_len);
+  memcpy(r->data + key_len, from, from_len);
+  memcpy(r->data + key_len + from_len, text, text_len);
+  r->check = offline_check(r);
+  r->len = (uint32_t)len;
+  if (ref != NULL) {
+    ref->seq = seq;
+    ref->seg = cur;
+    ref->off = (uint32_t)cur->tail;
+    ref->len = (uint32_t)len;
+  }
+  cur->tail += len;
+  cur->dirty = 1;
+  return 0;
+}
+
+static inline int offline_cmp_ref(const void *a, const void *b) {
+  uint64_t x = ((const OfflineRef *)a)->seq, y = ((const OfflineRef *)b)->seq;
+  return x < y ? -1 : x > y;
+}
+
+// 打开离线私聊存储：按段号顺序扫描已有的段，重建收件箱
+static inline OfflineStore *offline_open(const char *dir) {
+  OfflineStore *st = calloc(1, sizeof(OfflineStore));
+  if (st == NULL) {
+    return NULL;
+  }
+  st->bucket_mask = 63;
+  st->buckets = calloc(st->bucket_mask + 1, sizeof(OfflineBox *));
+  if (st->buckets == NULL) {
+    free(st);
+    return NULL;
+  }
+  pthread_mutex_init(&st->lock, NULL);
+  st->dir = dir;
+  st->next_seq = 1;
+
+  char pattern[OFFLINE_PATH_MAX];
+  glob_t g;
+  snprintf(pattern, sizeof(pattern), "%s/offline-*.log", dir);
+  if (glob(pattern, 0, NULL, &g) != 0) {
+    return st; // 还没有离线消息
+  }
+  // 文件名中的段号是定宽的，glob 的结果已按段号排序
+  for (size_t i = 0; i < g.gl_pathc && st->seg_count <= OFFLINE_MAX_SEGMENTS;
+       i++) {
+    const char *dash = strrchr(g.gl_pathv[i], '-');
+    OfflineSegment *seg =
+        dash ? offline_seg_open(g.gl_pathv[i], strtoull(dash + 1, NULL, 10), 0)
+             : NULL;
+    if (seg == NULL) {
+      continue;
+    }
+    st->segs[st->seg_count++] = seg;
+    size_t off = 0;
+    while (off + sizeof(OfflineRecord) <= seg->size) {
+      OfflineRecord *r = (OfflineRecord *)(seg->map + off);
+      if (r->len < sizeof(OfflineRecord) || r->len > seg->size - off ||
+          offsetof(OfflineRecord, data) + r->key_len + r->from_len +
+                  (size_t)r->text_len > r->len ||
+          r->check != offline_check(r)) {
+        break; // 段的结尾，或者崩溃时写了一半的记录
+      }
+      OfflineBox *box = offline_box(st, r->data, r->key_len, 1);
+      if (box != NULL && r->type == OFFLINE_MSG) {
+        OfflineRef ref = {r->seq, seg, (uint32_t)off, r->len};
+        offline_box_add(box, &ref);
+      } else if (box != NULL && r->type == OFFLINE_ACK && r->seq > box->acked) {
+        box->acked = r->seq;
+      } else if (box != NULL && r->type == OFFLINE_CLAIM &&
+                 r->text_len > 0 && r->text_len < OFFLINE_CLAIM_MAX &&
+                 (!box->claimed || r->seq >= box->claim_ref.seq)) {
+        // 压缩中途崩溃留下的重复副本序号相同，保留较新的一份
+        box->claimed = 1;
+        memcpy(box->claim, offline_text(r), r->text_len);
+        box->claim[r->text_len] = '\0';
+        box->claim_ref = (OfflineRef){r->seq, seg, (uint32_t)off, r->len};
+      }
+      if (r->seq >= st->next_seq) {
+        st->next_seq = r->seq + 1;
+      }
+      off += r->len;
+    }
+    seg->tail = off;
+  }
+  globfree(&g);
+
+  // 去掉已确认的消息和压缩中途崩溃留下的重复副本（保留较新的一份）
+  unsigned pending = 0;
+  for (uint32_t i = 0; i <= st->bucket_mask; i++) {
+    OfflineBox *box = st->buckets[i];
+    while (box != NULL) {
+      OfflineBox *next = box->next;
+      if (box->count > 1) {
+        qsort(box->refs, box->count, sizeof(OfflineRef), offline_cmp_ref);
+      }
+      uint32_t n = 0;
+      for (uint32_t k = 0; k < box->count; k++) {
+        if (box->refs[k].seq <= box->acked) {
+          continue;
+        }
+        if (n > 0 && box->refs[n - 1].seq == box->refs[k].seq) {
+          n--;
+        }
+        box->refs[n++] = box->refs[k];
+      }
+      box->count = n;
+      box->bytes = 0;
+      for (uint32_t k = 0; k < n; k++) {
+        box->bytes += box->refs[k].len;
+        box->refs[k].seg->live += box->refs[k].len;
+      }
+      pending += n;
+      if (box->claimed) {
+        box->claim_ref.seg->live += box->claim_ref.len;
+      } else if (n == 0) {
+        offline_box_free(st, box);
+      }
+      box = next;
+    }
+  }
+  atomic_init(&st->pending, pending);
+  return st;
+}
+
+// 保存一条离线私聊，key 为规范化的收件人昵称。返回 0 表示已保存，-1 表示对方的离线消息已满，
+// -2 表示存储已满或写入失败，-3 表示对方没有认领信箱
+static inline int offline_put(OfflineStore *st, const char *key,
+                              const char *from, const char *text,
+                              size_t text_len, time_t when) {
+  size_t key_len = strlen(key), from_len = strlen(from);
+  int ret = -2;
+  if (key_len >= OFFLINE_KEY_MAX || from_len > UINT8_MAX) {
+    return -2;
+  }
+  pthread_mutex_lock(&st->lock);
+  OfflineBox *box = offline_box(st, key, key_len, 0);
+  if (box == NULL || !box->claimed) {
+    ret = -3;
+  } else {
+    size_t len = (offsetof(OfflineRecord, data) + key_len + from_len +
+                  text_len + 7) & ~(size_t)7;
+    OfflineRef ref;
+    if (box->count >= OFFLINE_USER_MAX_MSGS ||
+        box->bytes + len > OFFLINE_USER_MAX_BYTES) {
+      ret = -1;
+    } else if (offline_write(st, OFFLINE_MSG, key, key_len, from, from_len,
+                             text, text_len, st->next_seq, when, &ref) == 0 &&
+               offline_box_add(box, &ref) == 0) {
+      st->next_seq++;
+      box->bytes += ref.len;
+      ref.seg->live += ref.len;
+      atomic_fetch_add_explicit(&st->pending, 1, memory_order_relaxed);
+      ret = 0;
+    }
+  }
+  pthread_mutex_unlock(&st->lock);
+  return ret;
+}
+
+// 按顺序把收件箱中的消息交给 fn（为 NULL 时丢弃）并写入 ACK，返回条数（调用者持锁）
+static inline int offline_box_take(OfflineStore *st, OfflineBox *box,
+                                   OfflineDeliverFn fn, void *arg) {
+  int n = (int)box->count;
+  if (n == 0) {
+    return 0;
+  }
+  for (uint32_t i = 0; i < box->count; i++) {
+    OfflineRef *ref = &box->refs[i];
+    if (fn != NULL) {
+      fn(arg, (const OfflineRecord *)(ref->seg->map + ref->off));
+    }
+    ref->seg->live -= ref->len;
+  }
+  // ACK 写入失败时消息在重启后会再投递一次
+  offline_write(st, OFFLINE_ACK, box->key, strlen(box->key), "", 0, "", 0,
+                box->refs[n - 1].seq, time(NULL), NULL);
+  atomic_fetch_sub_explicit(&st->pending, (unsigned)n, memory_order_relaxed);
+  box->count = 0;
+  box->bytes = 0;
+  return n;
+}
+
+// 取出 key 的信箱的口令哈希（hash 至少 OFFLINE_CLAIM_MAX 字节），返回 0 表示信箱未认领
+static inline int offline_claim_get(OfflineStore *st, const char *key,
+                                    char *hash) {
+  pthread_mutex_lock(&st->lock);
+  OfflineBox *box = offline_box(st, key, strlen(key), 0);
+  int claimed = box != NULL && box->claimed;
+  if (claimed) {
+    memcpy(hash, box->claim, OFFLINE_CLAIM_MAX);
+  }
+  pthread_mutex_unlock(&st->lock);
+  return claimed;
+}
+
+// 用口令哈希认领 key 的信箱。返回 0 表示已认领，1 表示信箱已被别人认领，-2 表示写入失败
+static inline int offline_claim_set(OfflineStore *st, const char *key,
+                                    const char *hash) {
+  size_t key_len = strlen(key), hash_len = strlen(hash);
+  int ret = -2;
+  if (key_len >= OFFLINE_KEY_MAX || hash_len == 0 ||
+      hash_len >= OFFLINE_CLAIM_MAX) {
+    return -2;
+  }
+  pthread_mutex_lock(&st->lock);
+  OfflineBox *box = offline_box(st, key, key_len, 1);
+  if (box != NULL && box->claimed) {
+    ret = 1;
+  } else if (box != NULL) {
+    if (offline_write(st, OFFLINE_CLAIM, key, key_len, "", 0, hash, hash_len,
+                      st->next_seq, time(NULL), &box->claim_ref) == 0) {
+      st->next_seq++;
+      box->claim_ref.seg->live += box->claim_ref.len;
+      memcpy(box->claim, hash, hash_len + 1);
+      box->claimed = 1;
+      // 认领之前保存的消息（旧版本不要求认领）无法确认收件人，丢弃
+      offline_box_take(st, box, NULL, NULL);
+      ret = 0;
+    } else if (box->count == 0) {
+      offline_box_free(st, box);
+    }
+  }
+  pthread_mutex_unlock(&st->lock);
+  return ret;
+}
+
+// 已认领的信箱中未投递的消息数，未认领时返回 0
+static inline int offline_pending(OfflineStore *st, const char *key) {
+  pthread_mutex_lock(&st->lock);
+  OfflineBox *box = offline_box(st, key, strlen(key), 0);
+  int n = box != NULL && box->claimed ? (int)box->count : 0;
+  pthread_mutex_unlock(&st->lock);
+  return n;
+}
+
+// 按顺序投递 key 的所有离线私聊并写入 ACK，返回投递的条数（调用者已核对口令）
+static inline int offline_take(OfflineStore *st, const char *key,
+                               OfflineDeliverFn fn, void *arg) {
+  int n = 0;
+  pthread_mutex_lock(&st->lock);
+  OfflineBox *box = offline_box(st, key, strlen(key), 0);
+  if (box != NULL) {
+    n = offline_box_take(st, box, fn, arg);
+  }
+  pthread_mutex_unlock(&st->lock);
+  return n;
+}
+
+// 把写过的段刷到磁盘（只在落盘线程调用）。fdatasync 在锁外进行，
+// 段只会被压缩删除，而压缩也在落盘线程中
+static inline void offline_sync(OfflineStore *st) {
+  OfflineSegment *dirty[OFFLINE_MAX_SEGMENTS + 1];
+  int n = 0;
+  pthread_mutex_lock(&st->lock);
+  for (int i = 0; i < st->seg_count; i++) {
+    if (st->segs[i]->dirty) {
+      st->segs[i]->dirty = 0;
+      dirty[n++] = st->segs[i];
+    }
+  }
+  pthread_mutex_unlock(&st->lock);
+  for (int i = 0; i < n; i++) {
+    fdatasync(dirty[i]->fd);
+  }
+}
+
+// 压缩最旧的段（只在落盘线程调用）：存活的消息不到一半时复制到当前段，
+// 复制的消息刷盘后再删除旧段。返回 1 表示删除了一个段
+static inline int offline_compact(OfflineStore *st) {
+  pthread_mutex_lock(&st->lock);
+  OfflineSegment *old = st->segs[0];
+  if (st->seg_count < 2 || (old->live > 0 && old->live * 2 >= old->tail)) {
+    pthread_mutex_unlock(&st->lock);
+    return 0;
+  }
+  for (size_t off = 0; off < old->tail;) {
+    OfflineRecord *r = (OfflineRecord *)(old->map + off);
+    size_t at = off;
+    off += r->len;
+    if (r->type != OFFLINE_MSG && r->type != OFFLINE_CLAIM) {
+      continue;
+    }
+    OfflineBox *box = offline_box(st, r->data, r->key_len, 0);
+    OfflineRef *ref = NULL;
+    if (r->type == OFFLINE_CLAIM) {
+      if (box != NULL && box->claimed && box->claim_ref.seg == old &&
+          box->claim_ref.off == at) {
+        ref = &box->claim_ref; // 仍然有效的认领，和消息一样复制
+      }
+    } else if (box != NULL) {
+      OfflineRef probe = {r->seq, NULL, 0, 0};
+      ref = bsearch(&probe, box->refs, box->count, sizeof(OfflineRef),
+                    offline_cmp_ref);
+    }
+    if (ref == NULL || ref->seg != old) {
+      continue; // 已投递
+    }
+    OfflineRef moved;
+    if (offline_write(st, r->type, r->data, r->key_len, offline_from(r),
+                      r->from_len, offline_text(r), r->text_len, r->seq,
+                      r->time, &moved) < 0) {
+      pthread_mutex_unlock(&st->lock); // 没有空间，下次再试
+      return 0;
+    }
+    old->live -= ref->len;
+    moved.seg->live += moved.len;
+    *ref = moved;
+  }
+  memmove(st->segs, st->segs + 1, sizeof(OfflineSegment *) * (st->seg_count - 1));
+  st->seg_count--;
+  pthread_mutex_unlock(&st->lock);
+
+  offline_sync(st);
+  char path[OFFLINE_PATH_MAX];
+  offline_path(st, old->number, path, sizeof(path));
+  unlink(path);
+  offline_seg_close(old);
+  return 1;
+}
+
+// 关闭存储（服务器关闭时，分片和落盘线程都已退出）
+static inline void offline_close(OfflineStore *st) {
+  offline_sync(st);
+  for (int i = 0; i < st->seg_count; i++) {
+    offline_seg_close(st->segs[i]);
+  }
+  for (uint32_t i = 0; i <= st->bucket_mask; i++) {
+    OfflineBox *box = st->buckets[i];
+    while (box != NULL) {
+      OfflineBox *next = box->next;
+      free(box->refs);
+      free(box);
+      box = next;
+    }
+  }
+  free(st->buckets);
+  pthread_mutex_destroy(&st->lock);
+  free(st);
+}
+
+#endif // OFFLINE_H
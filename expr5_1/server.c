@@ -1,387 +1,5611 @@
 /**
  * TCP聊天服务器
  * 功能：接受多个客户端连接，转发消息给其他客户端
+ *
+ * 架构：每个 CPU 核心一个分片（shard），每个分片是一个独立的 epoll reactor
+ *   - 各分片用 SO_REUSEPORT 监听同一端口，由内核把新连接分散到各分片
+ *   - 客户端只属于接受它的分片，它的套接字、昵称和待发送数据只由该分片线程访问
+ *   - 跨分片的广播、私聊、/list 通过每个分片的有界无锁 MPSC 队列传递，
+ *     用 eventfd 唤醒目标分片，消息路径上没有全局锁
+ *   - 客户端表按需动态增长，没有固定的连接上限（受 RLIMIT_NOFILE 限制）
+ *   - 聊天按房间进行：每个房间在每个分片有自己的成员数组和广播环，广播只发给
+ *     有该房间成员的分片，扇出的代价与房间人数成正比，与在线总人数无关；
+ *     没有成员的房间被回收，ID 和聊天记录的文件描述符随之释放
+ *   - 启用聊天记录（-H）时，落盘线程把聊天消息追加到每个房间的 mmap 段文件并成组刷盘，
+ *     新成员进入房间时用 sendfile 从段文件回放最近的消息
+ *   - 启用离线私聊（-O）时，发给不在线用户的私聊保存到日志结构的存储（见 offline.h），
+ *     只为用 /claim 口令认领过信箱的昵称保存，对方以该昵称登录并核对口令后按顺序投递
+ *   - 启用集群（-N）时，几个服务器实例之间用长连接组成集群：在线用户目录复制到每个节点，
+ *     房间广播和发给其他节点用户的私聊由集群线程按节点成批压缩后转发（见 cluster.h），
+ *     客户端连接任一节点都能和其他节点的用户聊天
+ *   - 同一端口同时支持文本协议（给人用）和二进制协议（给机器人用，见 chat_proto.h）
+ *   - 连接意外断开时会话保留一段时间（-g），客户端用加入时得到的令牌重连后保持昵称和房间，
+ *     从房间环中的游标继续接收错过的消息，不产生离开/加入通知
+ *   - 每个线程记录消息路径各阶段和昵称索引段锁的耗时直方图（见 stats.h），本机连接用
+ *     /stats 按需汇总；编译时 CHAT_STATS=0（make STATS=0）则完全去掉
+ *   - 没有输入的连接定期收到心跳（见 timer_wheel.h 的时间轮），回复过心跳的客户端不再回复时
+ *     按断线处理；内核保活和 TCP_USER_TIMEOUT 让对端掉线的连接在有限时间内报错
+ *   - 客户端可以协商压缩（/compress，见 chat_zip.h）：一次发送合并的一批消息压缩成一帧，
+ *     同一房间同一批广播只压缩一次，压缩后的帧由所有接收者共享
+ *   - 启用热升级（-U）时，新进程启动后从旧进程接过监听套接字、客户端连接和会话状态
+ *     （见 upgrade.h），旧进程随即退出，用户感觉不到重启
  */
 
+#define _GNU_SOURCE
+#include "stats.h"
+// 昵称索引的段锁换成带计时的包装，必须在包含 nick_index.h 之前定义
+#define NICK_RDLOCK stats_rdlock
+#define NICK_WRLOCK stats_wrlock
+#define NICK_UNLOCK stats_unlock
+#include "chat_proto.h"
+#include "chat_zip.h"
+#include "cluster.h"
+#include "history.h"
+#include "mpsc.h"
+#include "nick_index.h"
+#include "offline.h"
+#include "timer_wheel.h"
+#include "upgrade.h"
 #include <arpa/inet.h>
+#include <crypt.h>
+#include <errno.h>
+#include <fcntl.h>
 #include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <poll.h>
 #include <pthread.h>
+#include <sched.h>
 #include <signal.h>
+#include <stdatomic.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/random.h>
+#include <sys/resource.h>
+#include <sys/sendfile.h>
+#include <sys/signalfd.h>
 #include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/timerfd.h>
 #include <sys/types.h>
+#include <sys/uio.h>
+#include <sys/un.h>
 #include <unistd.h>
 
-#define MAX_CLIENTS 10
 #define BUFFER_SIZE 1024
+#define RX_BUFFER_SIZE 65536              // 每次 recv 最多读取的字节数
+#define MAX_LINE_LENGTH (BUFFER_SIZE - 1) // 单条消息的最大长度
 #define PORT 8888
+#define LISTEN_BACKLOG 4096
+#define MAX_EVENTS 256
+#define CLIENT_TABLE_INIT 64
+#define MAX_PENDING_OUTPUT (256 * 1024) // 单个客户端允许积压的最大待发送字节数
+#define OUT_QUEUE_DEFAULT 1024          // 单个客户端默认最多积压的私聊消息数
+#define RING_SIZE_DEFAULT 4096          // 每个分片广播环默认保留的消息数
+#define OUT_QUEUE_INIT 8
+#define FLUSH_IOV_MAX 64 // 一次 writev 最多发送的消息数
+#define MAX_SHARDS 64
+#define SHARD_QUEUE_SIZE 65536 // 每个分片收件队列的容量（2 的幂）
+#define SHARD_DRAIN_BATCH 4096 // 每轮事件循环最多处理的跨分片消息数
+#define LIST_CHUNK_SIZE 2048   // 跨分片用户列表每条消息的最大字节数
+#define ROOM_TABLE_INIT 16
+#define ROOM_MAX 1024          // 同时存在的房间数上限（启用 -H 时每个房间占用段文件和映射）
+#define ROOM_RING_INIT 64      // 房间广播环的初始大小，成员跟不上时扩容到 ring_size
+#define ROOM_MEMBERS_INIT 8
+#define LOBBY_NAME "大厅"      // 新连接所在的默认房间
+#define HISTORY_QUEUE_SIZE 65536 // 待写入聊天记录的消息队列容量（2 的幂）
+#define HISTORY_SYNC_MS 100      // 成组刷盘的间隔（毫秒）
+#define HISTORY_REPLAY_DEFAULT 20
+#define SESSION_GRACE_DEFAULT 60 // 断线后保留会话的秒数
+#define CLAIM_SECRET_MIN 6       // 离线信箱口令的最短字节数
+#define CLAIM_TRIES 3            // 每个连接允许输错口令的次数
+#define CLAIM_HASH_ROUNDS 20000  // 口令哈希（crypt SHA-512）的轮数，一次约 15 毫秒
+#define ANNOUNCE_DELAY_MS 200    // 新连接的加入通知最多推迟的毫秒数，留给重连的客户端恢复会话
+#define SESSION_TOKEN_LEN 32     // 会话令牌：16 位十六进制客户端 ID + 16 位十六进制随机数
+#define TRANSFER_MAX_SIZE (1ull << 40)   // 单个文件的大小上限
+#define TRANSFER_NAME_MAX 128
+#define TRANSFER_PER_USER 4              // 每个用户同时发起的传输数
+#define TRANSFER_OFFER_MS 60000          // 传输请求等待对方接收的毫秒数
+#define TRANSFER_IDLE_MS 30000           // 等待数据连接、传输没有进展的最长毫秒数
+#define TRANSFER_PIPE_SIZE (1024 * 1024) // splice 中转管道的容量
+#define TRANSFER_BATCH (256 * 1024)      // 每次事件最多搬运的字节数，其余留到下一轮
+#define TRANSFER_TAG 1 // epoll 数据最低位为 1 表示传输的数据连接（第 1 位区分两端）
+#define CLUSTER_QUEUE_SIZE 65536 // 发往其他节点的事件队列容量（2 的幂）
+#define CLUSTER_RETRY_MS 1000    // 节点连接断开后重连的间隔（毫秒）
+#define CLUSTER_OUT_MAX (64 * 1024 * 1024) // 节点连接允许积压的最大字节数，超过时断开重连
+#define CLUSTER_USER_BASE 1000000 // 集群中每个节点默认昵称编号的起点间隔
+#define HEARTBEAT_DEFAULT 30    // 连接没有输入多少秒后发送心跳
+#define HEARTBEAT_TICK_MS 500   // 心跳时间轮的刻度
+#define HEARTBEAT_MISSES 2      // 回复过心跳的客户端连续这么多次没有回应即按断线处理
+#define HEARTBEAT_PING "[系统] 心跳\n" // 文本协议的心跳，客户端回复 /pong
+
+// 客户端 ID：高 8 位为分片号，中间 24 位为槽位代数，低 32 位为槽位下标。
+// 连接关闭后槽位代数加一，迟到的跨分片消息不会投递给复用该槽位的新连接
+#define CLIENT_ID(shard, gen, idx)                                             \
+  (((uint64_t)(shard) << 56) | ((uint64_t)(gen) << 32) | (uint32_t)(idx))
+#define CLIENT_ID_SHARD(id) ((int)((id) >> 56))
+#define CLIENT_ID_INDEX(id) ((uint32_t)(id))
+#define CLIENT_GEN_MASK 0xFFFFFFu
+// 传输编号：低位是所在分片，用户输入的编号较短
+#define TRANSFER_ID(shard, seq) ((uint64_t)(seq) * MAX_SHARDS + (uint64_t)(shard))
+#define TRANSFER_ID_SHARD(id) ((int)((id) % MAX_SHARDS))
+
+struct Shard;
+
+// 慢客户端策略：待发送队列满时如何处理
+typedef enum {
+  SLOW_DISCONNECT,  // 断开连接
+  SLOW_DROP_OLDEST, // 丢弃最旧的未发送消息
+  SLOW_PAUSE        // 暂停投递，队列降到一半以下后恢复
+} SlowPolicy;
+
+// 不可变的消息内容，编码一次后由所有接收者（包括其他分片）共享，最后一个使用者释放
+typedef struct MsgBuf {
+  atomic_int refs;
+  size_t len;
+  int binary;           // data 是二进制协议帧
+  HistorySegment *seg;  // 不为空时内容是聊天记录段文件中从 file_off 开始的 len 字节，
+  off_t file_off;       // 用 sendfile 发送，data 为空
+  char data[];
+} MsgBuf;
+
+// 私聊队列中的一条消息，seq 为入队时分片广播环的写入位置
+typedef struct OutEntry {
+  MsgBuf *buf;
+  uint64_t seq;
+} OutEntry;
+
+// 广播环中的一条消息，每种协议各编码一份
+typedef struct RingSlot {
+  MsgBuf *buf[2]; // [0] 文本，[1] 二进制帧
+  uint64_t exclude_id; // 不发给该客户端（发送者自己）
+} RingSlot;
+
+// 房间：全局只保存名字和“哪些分片有成员”的位图，成员和广播环由各分片分别保存。
+// 引用计数归零（没有任何分片有成员，也没有待落盘的消息）时回收，结构体和 ID 留给下一个新房间
+typedef struct Room {
+  char name[32];
+  uint32_t id;                   // 各分片房间表中的下标
+  uint32_t gen;                  // 每次回收加一，丢弃发给已回收房间的在途广播
+  atomic_uint_fast64_t shards;   // 有成员的分片位图（MAX_SHARDS 不超过 64）
+  atomic_int refs;               // 各分片的房间部分、待落盘的消息和正在使用的查找者各一个
+  int retired;                   // 已回收，在空闲链表中（room_lock 保护）
+  RoomHistory *history;          // 聊天记录，未启用时为 NULL
+  struct Room *next;             // 全部房间的链表，服务器关闭时释放
+  struct Room *next_free;        // 已回收房间的空闲链表
+} Room;
+
+// 房间在一个分片内的部分：本分片成员的紧凑数组和只属于这个房间的广播环
+typedef struct RoomShard {
+  Room *room;
+  struct ClientInfo **members;
+  int member_count;
+  int member_cap;
+  RingSlot *ring;                // 按需扩容，最大 ring_size
+  uint64_t ring_head;            // 下一条广播的序号
+  uint64_t ring_mask;
+  int dirty;                     // 本轮有新广播，需要发送所有成员
+  struct RoomShard *next_dirty;
+  // 最近压缩的一批广播 [zip_start, zip_end)，每种协议一帧，游标相同的成员直接共享
+  MsgBuf *zip_batch[2];
+  uint64_t zip_start[2];
+  uint64_t zip_end[2];
+} RoomShard;
 
 // 客户端信息结构体
-typedef struct {
+typedef struct ClientInfo {
   int sockfd;
+  int slot;    // 在所属分片 clients[] 中的下标
+  uint64_t id; // 全局唯一的客户端 ID，跨分片投递时使用
+  struct Shard *shard;
   struct sockaddr_in addr;
   char name[32];
   int active;
+  int want_write; // 是否已注册 EPOLLOUT
+  int binary;     // 使用二进制协议，同时作为 RingSlot.buf 的下标
+  int negotiated; // 已确定协议（收到过输入）
+  // 预编码的消息头：广播时直接拷贝，不再格式化昵称
+  char text_hdr[NICK_MAX_LEN + 4]; // "[昵称]: "
+  char bin_hdr[PROTO_HEADER_SIZE + 1 + NICK_MAX_LEN]; // 帧头（发送时填写）+ 昵称长度 + 昵称
+  uint8_t text_hdr_len;
+  uint8_t bin_hdr_len;
+  // 未凑成完整一行的输入（按需分配，处理完即释放）
+  char *in_buf;
+  size_t in_len;
+  size_t in_cap;
+  int in_discard; // 正在丢弃超长行的剩余部分
+  // 所在房间；广播只保存房间广播环中的读游标（下一条要发送的序号）
+  RoomShard *room;
+  int room_slot; // 在 room->members[] 中的下标
+  uint64_t cursor;
+  // 只发给这个客户端的消息：有界私聊队列（环形数组，首次发送时分配）
+  OutEntry *out_q;
+  uint32_t out_head;
+  uint32_t out_count;
+  uint32_t out_cap;
+  size_t out_bytes; // 私聊队列中的字节数
+  MsgBuf *partial;  // 已发出一部分的消息（广播或私聊）
+  size_t partial_off;
+  uint32_t dropped; // 因接收过慢被丢弃、尚未通知客户端的消息数
+  int paused;       // SLOW_PAUSE 策略下暂停投递
+  int compress;     // 压缩：0 未启用，1 已请求、等待发出确认，2 之后的输出都是压缩帧
+  size_t zip_off;   // 私聊队首已压缩发出的字节数（超长的消息分几帧发送）
+  struct ClientInfo *next_flush;   // 本轮有新数据的客户端链表
+  struct ClientInfo **flush_pprev; // 指向链表中指向自己的指针，不在链表中时为 NULL
+  struct ClientInfo *next_closing; // 延迟关闭链表
+  // 会话：连接断开后会话可以保留，令牌用于重连时找回
+  uint64_t secret;   // 会话令牌中的随机部分
+  int announced;     // 已广播加入通知；新连接先等待 ANNOUNCE_DELAY_MS，看是否是在恢复会话
+  int detached;      // 没有可用的连接（断线等待恢复，或正在把连接转交给原会话）
+  uint64_t deadline; // 所在定时链表的到期时间（毫秒，CLOCK_MONOTONIC）
+  struct ClientList *timer_list;   // 所在的定时链表，不在链表中时为 NULL
+  struct ClientInfo *next_timer;
+  struct ClientInfo **timer_pprev;
+  // 心跳：heard 是最后一次收到输入的时间（毫秒），之后发出了 pings 次心跳
+  uint64_t heard;
+  uint32_t pings;
+  int pong;              // 回复过心跳：之后不回复就说明对端已经不在
+  int claim_failures;    // /claim 口令错误的次数，达到 CLAIM_TRIES 时断开
+  WheelNode heartbeat;   // 在分片心跳时间轮中的节点，连接存在期间一直在轮中
 } ClientInfo;
 
-// 全局变量
-ClientInfo clients[MAX_CLIENTS];
-pthread_mutex_t clients_mutex = PTHREAD_MUTEX_INITIALIZER;
-int server_running = 1;
+#define HEARTBEAT_CLIENT(n)                                                    \
+  ((ClientInfo *)((char *)(n) - offsetof(ClientInfo, heartbeat)))
+
+// 按到期时间排列的客户端链表：每个链表的时长固定，追加到尾部即保持有序
+typedef struct ClientList {
+  ClientInfo *head;
+  ClientInfo **tail;
+} ClientList;
+
+typedef enum {
+  XMSG_BROADCAST, // 广播给本分片所有客户端（client_id 为排除的发送者）
+  XMSG_PRIVATE,   // 私聊投递给 client_id，对方已离线时通知 sender_id
+  XMSG_LIST,      // 把本分片的在线用户发回给 client_id
+  XMSG_DELIVER,   // 投递给本分片的指定客户端
+  XMSG_RESUME,    // 把新连接 fd 交给会话 client_id（令牌校验在会话所在分片进行）
+  XMSG_RESUME_DONE, // 恢复结果发回新连接 client_id 所在分片：fd 为 -1 表示已被接管
+  XMSG_XFER_ACCEPT, // sender_id 接收传输 client_id（发到传输所在分片）
+  XMSG_XFER_REJECT, // sender_id 拒绝传输 client_id
+  XMSG_XFER_ATTACH  // 把数据连接 fd 交给传输 client_id，secret 区分发送方和接收方
+} XMsgType;
+
+// 跨分片消息
+typedef struct XMsg {
+  XMsgType type;
+  uint64_t client_id;
+  uint64_t sender_id;
+  MsgBuf *buf;
+  MsgBuf *bin;       // 广播和私聊同时携带二进制帧，由目标分片按接收者协议选择
+  uint32_t room;     // XMSG_BROADCAST 的目标房间 ID
+  uint32_t room_gen; // 目标房间发出时的代数，房间已被回收重用时丢弃
+  int fd;            // XMSG_RESUME / XMSG_RESUME_DONE / XMSG_XFER_ATTACH：转交的连接
+  int binary;        // 转交的连接使用二进制协议
+  uint64_t secret;   // XMSG_RESUME / XMSG_XFER_ATTACH：令牌中的随机部分
+  struct sockaddr_in addr;
+  struct XMsg *next; // 目标队列满时在发送方暂存
+} XMsg;
+
+// 慢客户端计数（每个分片各自统计，关闭时汇总）
+typedef struct SlowStats {
+  unsigned long dropped;     // 丢弃的消息数
+  unsigned long disconnects; // 因接收过慢被断开的连接数
+  unsigned long pauses;      // 进入暂停状态的次数
+} SlowStats;
+
+typedef enum {
+  XFER_OFFERED,  // 等待接收方 /accept
+  XFER_ACCEPTED, // 等待双方的数据连接
+  XFER_RUNNING,  // 正在搬运数据
+  XFER_DONE      // 已结束，本轮事件处理完后释放
+} XferState;
+
+// 文件传输：发送方和接收方各开一条数据连接，数据用 splice 经管道在两个套接字之间搬运，
+// 不经过用户态；聊天连接不受影响。传输属于发起方所在的分片，两条数据连接都转交到这里
+typedef struct Transfer {
+  uint64_t id;
+  XferState state;
+  uint64_t sender_id;    // 双方的聊天连接，用于通知
+  uint64_t recipient_id;
+  uint64_t secret[2];    // 发送方、接收方数据连接的令牌
+  int fd[2];             // 发送方、接收方的数据连接
+  uint32_t events[2];    // 在 epoll 中关注的事件，0 表示没有注册
+  int pipe[2];
+  size_t pipe_cap;
+  uint64_t size;
+  uint64_t received;     // 已从发送方读入管道的字节数
+  uint64_t sent;         // 已写给接收方的字节数
+  uint64_t started;      // 开始搬运的时间（毫秒）
+  uint64_t deadline;     // 当前阶段的到期时间（毫秒）
+  char name[TRANSFER_NAME_MAX];
+  char sender_name[NICK_MAX_LEN];
+  char recipient_name[NICK_MAX_LEN];
+  struct Transfer *next;
+} Transfer;
+
+// 发往其他节点的一个事件：分片放入集群队列，集群线程编码后按节点成批发送
+typedef struct ClusterItem {
+  uint8_t type;
+  int node;   // CLUSTER_PRIVATE 的目标节点，其他事件发给所有节点
+  uint64_t id;
+  char name[NICK_MAX_LEN];
+  MsgBuf *text;
+  MsgBuf *bin;
+} ClusterItem;
+
+// 到另一个节点的连接：-J 指定的由本节点主动连接，断开后定时重连；对方连过来的断开即释放
+typedef struct Peer {
+  int fd;
+  int node;         // 对方节点号，收到 HELLO 之前为 0
+  int last_node;    // 主动连接上次连到的节点号，已有到该节点的连接时不再重连
+  int dial;
+  int connecting;   // 非阻塞 connect 尚未完成
+  uint32_t events;  // 在 epoll 中关注的事件，0 表示没有注册
+  struct sockaddr_in addr;
+  uint64_t retry_at; // 下一次重连的时间（毫秒）
+  ClusterBuf in;     // 未凑成完整一帧的输入
+  ClusterBuf batch;  // 本轮待成帧的事件
+  ClusterBuf out;    // 待发送的帧
+  size_t out_off;
+} Peer;
+
+// 集群线程的状态（只由集群线程访问，关闭时主线程读取统计）
+typedef struct Cluster {
+  int epoll_fd;
+  int listen_fd;
+  Peer **peers;
+  int peer_count;
+  int peer_cap;
+  ClusterDedup dedup[CLUSTER_MAX_NODES]; // 每个来源节点的去重窗口
+  ClusterBuf raw;                        // 解压后的一帧
+  unsigned long frames;                  // 发出的帧数
+  unsigned long raw_bytes;               // 成帧前的字节数
+  unsigned long wire_bytes;              // 成帧后的字节数
+  unsigned long duplicates;              // 去重丢弃的事件数
+  ThreadStats stats;                     // 集群线程的锁计时
+} Cluster;
+
+// 分片：一个线程、一个 epoll 实例和它拥有的全部客户端
+typedef struct Shard {
+  int index;
+  pthread_t thread;
+  int epoll_fd;
+  int listen_fd;
+  int event_fd;              // 跨分片消息到达时被唤醒
+  atomic_int wake_pending;   // 已写 eventfd 但尚未被处理，避免重复唤醒
+  MpscQueue inbox;           // 其他分片发来的消息
+  ClientInfo **clients;      // 在线客户端的紧凑数组
+  int client_count;
+  int client_cap;
+  ClientInfo **handles;      // 按客户端 ID 的槽位下标查找
+  uint32_t *handle_gen;
+  int *handle_free;          // 空闲槽位栈
+  int handle_used;
+  int handle_free_count;
+  int handle_cap;
+  ClientInfo *closing_list;  // 本轮事件处理结束后统一关闭的客户端
+  ClientInfo *flush_list;    // 本轮收到私聊消息的客户端
+  RoomShard **rooms;         // 按房间 ID 查找本分片的房间部分，没有成员时为 NULL
+  uint32_t room_cap;
+  RoomShard *dirty_rooms;    // 本轮有新广播的房间
+  ClientList announcing;     // 等待广播加入通知的新连接
+  ClientList suspended;      // 断线后保留中的会话
+  SlowStats slow;
+  int timer_fd;              // 发送合并窗口到期
+  int coalesce_armed;        // 合并窗口计时中
+  unsigned long delivered;   // 写入套接字的消息数
+  unsigned long write_calls; // 发送数据的系统调用次数
+  XMsg **outbox_head;        // 目标分片收件队列满时暂存的消息，按目标分片排队
+  XMsg **outbox_tail;
+  int outbox_pending;
+  Transfer *transfers;       // 本分片发起的文件传输
+  uint64_t transfer_seq;
+  z_stream zip;              // 压缩帧的 deflate 状态，第一次压缩时初始化，每帧重置
+  int zip_ready;
+  ClusterBuf zip_raw;        // 正在拼装的一批原始消息
+  unsigned long zip_frames;  // 压缩的帧数
+  unsigned long zip_shared;  // 直接共享房间里已压缩的帧的次数
+  unsigned long zip_in;      // 压缩前的字节数
+  unsigned long zip_out;     // 压缩后的字节数（包括帧头）
+  uint64_t zip_ns;           // 压缩耗时（纳秒）
+  TimerWheel heartbeats;     // 各连接下一次检查心跳的时间
+  uint64_t now_ms;           // 本轮事件开始的时间，记录输入时间用
+  unsigned long pings;       // 发出的心跳数
+  unsigned long dead_peers;  // 心跳超时按断线处理的连接数
+  ThreadStats stats;         // 本分片线程的阶段和锁计时
+  char rx_buf[RX_BUFFER_SIZE]; // 本分片共享的读缓冲区
+} Shard;
+
+// 全局变量：分片数组在启动后只读，计数器使用原子操作
+Shard *shards = NULL;
+int shard_count = 0;
+int server_port = PORT;
+atomic_int server_running = 1;
+atomic_int next_user_id = 1;
+atomic_int online_count = 0;
+NickIndex nicknames; // 全局昵称索引，保证昵称唯一
+NickIndex room_names; // 房间名 -> Room 指针（复用昵称索引的实现）
+_Atomic(Room *) room_list = NULL;
+atomic_uint next_room_id = 0;
+pthread_mutex_t room_lock = PTHREAD_MUTEX_INITIALIZER; // 房间的创建、查找和回收
+Room *room_free = NULL;          // 已回收的房间
+RoomHistory *history_closing = NULL; // 已回收房间的聊天记录，由落盘线程关闭
+Room *lobby = NULL;
+SlowPolicy slow_policy = SLOW_DISCONNECT;
+uint32_t out_queue_limit = OUT_QUEUE_DEFAULT;
+uint64_t ring_size = RING_SIZE_DEFAULT;
+long coalesce_us = 0; // 发送合并窗口（微秒），0 表示每轮事件处理结束立即发送
+int session_grace = SESSION_GRACE_DEFAULT; // 断线后保留会话的秒数，0 表示不保留
+int heartbeat_interval = HEARTBEAT_DEFAULT; // 发送心跳前允许没有输入的秒数，0 表示不检测
+// 聊天记录：分片把消息放入无锁队列，由落盘线程追加到段文件，广播路径不做磁盘 I/O
+const char *history_dir = NULL;
+int history_replay = HISTORY_REPLAY_DEFAULT; // 进入房间时回放的消息数
+MpscQueue history_queue;
+int history_event_fd = -1;
+atomic_int history_wake_pending = 0;
+pthread_t disk_thread;
+atomic_ulong history_dropped = 0; // 队列满或写入失败而没有记录的消息数
+// 离线私聊：分片持锁追加到 mmap 段，刷盘和压缩由落盘线程进行
+const char *offline_dir = NULL;
+OfflineStore *offline_store = NULL;
+
+// 集群：分片把发往其他节点的事件放入无锁队列，由集群线程成批压缩后发送
+int node_id = 0; // 本节点编号，0 表示不组成集群
+int cluster_port = 0;
+char *cluster_peers = NULL;
+NickIndex remote_names; // 其他节点的在线用户：昵称 -> 节点号
+MpscQueue cluster_queue;
+int cluster_event_fd = -1;
+atomic_int cluster_wake_pending = 0;
+pthread_t cluster_thread;
+Cluster cluster;
+atomic_ulong cluster_seq;         // 本节点的消息序号
+atomic_ulong cluster_dropped = 0; // 队列满、没有到目标节点的连接而没有送出的事件数
+
+// 从旧进程接过的一个客户端：会话记录、连接（没有时为 -1）和之后的输入、输出字节
+typedef struct Inherited {
+  UpgradeClient rec;
+  int fd;
+  char *data;
+  int placed; // 已恢复到分片（或已放弃）
+} Inherited;
+
+// 热升级：旧进程在 upgrade_path 上等待新进程，新进程接过监听套接字和客户端后再接着等待
+const char *upgrade_path = NULL;
+int upgrade_listen_fd = -1;
+atomic_int upgrading = 0; // 正在把连接交给新进程，分片退出时不关闭客户端
+int inherited_fds[UPGRADE_MAX_FDS]; // 从旧进程接过的各分片监听套接字
+int inherited_fd_count = 0;
+Inherited *inherited = NULL;
+int inherited_count = 0;
+
+// 待写入聊天记录的一条消息
+typedef struct HistoryItem {
+  Room *room; // 持有一个引用，写完之前房间不会被回收
+  MsgBuf *buf;
+} HistoryItem;
 
 // 函数声明
-void *handle_client(void *arg);
-void broadcast_message(const char *message, int sender_idx);
-void send_private_message(const char *message, const char *target_name,
-                          int sender_idx);
-void remove_client(int idx);
+int shard_init(Shard *s, int index);
+void *shard_main(void *arg);
+void shard_wake(Shard *s);
+void shard_post(Shard *from, int to, XMsg *m);
+void flush_outbox(Shard *s);
+int drain_inbox(Shard *s);
+int handle_xmsg(Shard *s, XMsg *m);
+void release_xmsg(XMsg *m);
+MsgBuf *msgbuf_alloc(size_t len, int binary);
+MsgBuf *msgbuf_new(const char *data, size_t len);
+MsgBuf *msgbuf_frame(uint8_t type, const ClientInfo *from, const char *text,
+                     size_t len);
+MsgBuf *msgbuf_system(const char *text, size_t len);
+MsgBuf *msgbuf_file(HistorySegment *seg, off_t off, size_t len);
+MsgBuf *msgbuf_get(MsgBuf *b);
+void msgbuf_put(MsgBuf *b);
+void *disk_main(void *arg);
+void history_post(Room *r, MsgBuf *b);
+void history_replay_to(ClientInfo *c);
+void offline_deliver(ClientInfo *c);
+void claim_mailbox(ClientInfo *c, const char *secret, size_t len);
+int cluster_init();
+void *cluster_main(void *arg);
+void cluster_post(uint8_t type, int node, const char *name, MsgBuf *text,
+                  MsgBuf *bin);
+void accept_clients(Shard *s);
+ClientInfo *client_lookup(Shard *s, uint64_t id);
+Room *room_get(const char *name, size_t len);
+Room *room_find(const char *name);
+Room *room_hold(Room *r);
+void room_put(Room *r);
+int room_join(ClientInfo *c, Room *r);
+void room_leave(ClientInfo *c);
+void room_release(Shard *s, RoomShard *rs);
+void change_room(ClientInfo *c, const char *name, size_t len);
+void encode_name_headers(ClientInfo *c);
+void switch_to_binary(ClientInfo *c);
+void handle_client(ClientInfo *c);
+size_t process_lines(ClientInfo *c, char *data, size_t len);
+size_t process_frames(ClientInfo *c, char *data, size_t len);
+void handle_message(ClientInfo *c, char *buffer, size_t len);
+void change_name(ClientInfo *c, const char *name, size_t len);
+void client_send(ClientInfo *c, const char *data, size_t len);
+void client_send_buf(ClientInfo *c, MsgBuf *b);
+void flush_client(ClientInfo *c);
+void flush_pending_clients(Shard *s);
+void free_out_queue(ClientInfo *c);
+void broadcast_local(Shard *s, uint32_t room_id, uint32_t gen, MsgBuf *text,
+                     MsgBuf *bin, uint64_t exclude_id);
+void broadcast_bufs(Shard *s, Room *r, MsgBuf *text, MsgBuf *bin,
+                    uint64_t exclude_id);
+void broadcast_message(Shard *s, Room *r, const char *message,
+                       ClientInfo *sender);
+void broadcast_chat(ClientInfo *sender, const char *text, size_t len);
+void send_private_message(ClientInfo *sender, const char *target_name,
+                          size_t target_len, const char *text, size_t len);
+void send_user_list(ClientInfo *c);
+void send_stats(ClientInfo *c);
+void compress_request(ClientInfo *c);
+void remove_client(ClientInfo *c);
+void client_lost(ClientInfo *c);
+void client_announce(ClientInfo *c);
+void send_session_token(ClientInfo *c);
+void resume_request(ClientInfo *c, const char *token, size_t len);
+int session_resume(Shard *s, XMsg *m);
+void resume_done(Shard *s, XMsg *m);
+void transfer_offer(ClientInfo *c, char *args, size_t len);
+void transfer_reply(ClientInfo *c, const char *arg, int accept);
+void transfer_answer(Shard *s, XMsg *m);
+void transfer_request(ClientInfo *c, const char *token, size_t len);
+void transfer_attach(Shard *s, XMsg *m);
+void transfer_event(Shard *s, Transfer *t, int end, uint32_t events);
+void transfer_finish(Shard *s, Transfer *t, const char *error);
+int expire_transfers(Shard *s);
+int expire_clients(Shard *s);
+void heartbeat_start(ClientInfo *c, uint64_t now);
+int expire_heartbeats(Shard *s);
+void close_pending_clients(Shard *s);
+int upgrade_receive();
+void upgrade_restore();
+int upgrade_listen();
+int upgrade_wait(sigset_t *mask);
+void upgrade_quiesce();
+int upgrade_send_state(int conn);
 int get_client_count();
-void signal_handler(int sig);
+void raise_fd_limit();
+void print_usage(const char *prog);
 
-int main() {
-  int server_fd, client_fd;
-  struct sockaddr_in server_addr, client_addr;
-  socklen_t client_len = sizeof(client_addr);
-  pthread_t tid;
+int main(int argc, char *argv[]) {
+  int opt;
+  int fold_case = 0;
+  long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+  shard_count = cpus > 0 ? (int)cpus : 1;
+
+  while ((opt = getopt(argc, argv, "p:n:s:q:b:c:iH:r:g:k:O:N:L:J:U:h")) != -1) {
+    switch (opt) {
+    case 'p':
+      server_port = atoi(optarg);
+      break;
+    case 'n':
+      shard_count = atoi(optarg);
+      break;
+    case 's':
+      if (strcmp(optarg, "disconnect") == 0) {
+        slow_policy = SLOW_DISCONNECT;
+      } else if (strcmp(optarg, "drop-oldest") == 0) {
+        slow_policy = SLOW_DROP_OLDEST;
+      } else if (strcmp(optarg, "pause") == 0) {
+        slow_policy = SLOW_PAUSE;
+      } else {
+        fprintf(stderr, "未知的慢客户端策略: %s\n", optarg);
+        return 1;
+      }
+      break;
+    case 'q':
+      out_queue_limit = (uint32_t)atoi(optarg);
+      break;
+    case 'b':
+      ring_size = (uint64_t)atol(optarg);
+      break;
+    case 'c':
+      coalesce_us = atol(optarg);
+      break;
+    case 'i':
+      fold_case = 1;
+      break;
+    case 'H':
+      history_dir = optarg;
+      break;
+    case 'r':
+      history_replay = atoi(optarg);
+      break;
+    case 'g':
+      session_grace = atoi(optarg);
+      break;
+    case 'k':
+      heartbeat_interval = atoi(optarg);
+      break;
+    case 'O':
+      offline_dir = optarg;
+      break;
+    case 'N':
+      node_id = atoi(optarg);
+      break;
+    case 'L':
+      cluster_port = atoi(optarg);
+      break;
+    case 'J':
+      cluster_peers = optarg;
+      break;
+    case 'U':
+      upgrade_path = optarg;
+      break;
+    case 'h':
+      print_usage(argv[0]);
+      return 0;
+    default:
+      print_usage(argv[0]);
+      return 1;
+    }
+  }
+  if (server_port <= 0 || server_port > 65535) {
+    fprintf(stderr, "无效的端口号: %d\n", server_port);
+    return 1;
+  }
+  if (shard_count < 1 || shard_count > MAX_SHARDS) {
+    fprintf(stderr, "分片数必须在 1-%d 之间\n", MAX_SHARDS);
+    return 1;
+  }
+  if (out_queue_limit < 2) {
+    fprintf(stderr, "待发送队列长度至少为 2\n");
+    return 1;
+  }
+  if (ring_size < 2 || (ring_size & (ring_size - 1)) != 0) {
+    fprintf(stderr, "广播环大小必须是不小于 2 的 2 的幂\n");
+    return 1;
+  }
+  if (coalesce_us < 0 || coalesce_us >= 1000000) {
+    fprintf(stderr, "合并窗口必须在 0-999999 微秒之间\n");
+    return 1;
+  }
+  if (history_replay < 0 || history_replay > 1000) {
+    fprintf(stderr, "回放条数必须在 0-1000 之间\n");
+    return 1;
+  }
+  if (session_grace < 0 || session_grace > 86400) {
+    fprintf(stderr, "会话保留时间必须在 0-86400 秒之间\n");
+    return 1;
+  }
+  if (heartbeat_interval < 0 || heartbeat_interval > 3600) {
+    fprintf(stderr, "心跳间隔必须在 0-3600 秒之间\n");
+    return 1;
+  }
+  if (node_id < 0 || node_id >= CLUSTER_MAX_NODES) {
+    fprintf(stderr, "节点编号必须在 1-%d 之间\n", CLUSTER_MAX_NODES - 1);
+    return 1;
+  }
+  if (node_id == 0 && (cluster_port != 0 || cluster_peers != NULL)) {
+    fprintf(stderr, "组成集群时必须用 -N 指定节点编号\n");
+    return 1;
+  }
+  if (cluster_port < 0 || cluster_port > 65535) {
+    fprintf(stderr, "无效的节点间端口: %d\n", cluster_port);
+    return 1;
+  }
+  if (upgrade_path != NULL &&
+      strlen(upgrade_path) >= sizeof(((struct sockaddr_un *)0)->sun_path)) {
+    fprintf(stderr, "升级套接字路径过长: %s\n", upgrade_path);
+    return 1;
+  }
 
-  // 设置信号处理
-  signal(SIGINT, signal_handler);
+  // 所有线程屏蔽 SIGINT/SIGTERM，由主线程 sigwait 统一处理
+  sigset_t mask;
+  sigemptyset(&mask);
+  sigaddset(&mask, SIGINT);
+  sigaddset(&mask, SIGTERM);
+  pthread_sigmask(SIG_BLOCK, &mask, NULL);
   signal(SIGPIPE, SIG_IGN); // 忽略SIGPIPE信号
 
-  // 初始化客户端数组
-  for (int i = 0; i < MAX_CLIENTS; i++) {
-    clients[i].sockfd = -1;
-    clients[i].active = 0;
-  }
+  raise_fd_limit();
+  stats_init();
 
-  // 创建socket
-  server_fd = socket(AF_INET, SOCK_STREAM, 0);
-  if (server_fd < 0) {
-    perror("创建socket失败");
+  if (nick_init(&nicknames, fold_case) < 0 ||
+      nick_init(&room_names, fold_case) < 0 ||
+      nick_init(&remote_names, fold_case) < 0) {
+    perror("分配昵称索引失败");
     exit(EXIT_FAILURE);
   }
-
-  // 设置socket选项，允许地址重用
-  int opt = 1;
-  if (setsockopt(server_fd, SOL_SOCKET, SO_REUSEADDR, &opt, sizeof(opt)) < 0) {
-    perror("设置socket选项失败");
-    close(server_fd);
+  // 有旧进程在运行时先接过它的状态：旧进程交出之后才关闭聊天记录、离线私聊和节点间端口，
+  // 下面才能打开它们
+  if (upgrade_path != NULL && upgrade_receive() < 0) {
     exit(EXIT_FAILURE);
   }
-
-  // 配置服务器地址
-  memset(&server_addr, 0, sizeof(server_addr));
-  server_addr.sin_family = AF_INET;
-  server_addr.sin_addr.s_addr = INADDR_ANY;
-  server_addr.sin_port = htons(PORT);
-
-  // 绑定
-  if (bind(server_fd, (struct sockaddr *)&server_addr, sizeof(server_addr)) <
-      0) {
-    perror("绑定失败");
-    close(server_fd);
+  if (history_dir != NULL) {
+    if (mkdir(history_dir, 0755) < 0 && errno != EEXIST) {
+      perror("创建聊天记录目录失败");
+      exit(EXIT_FAILURE);
+    }
+    history_event_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (history_event_fd < 0 ||
+        mpsc_init(&history_queue, HISTORY_QUEUE_SIZE) < 0) {
+      perror("初始化聊天记录失败");
+      exit(EXIT_FAILURE);
+    }
+  }
+  if (offline_dir != NULL) {
+    if (mkdir(offline_dir, 0755) < 0 && errno != EEXIST) {
+      perror("创建离线私聊目录失败");
+      exit(EXIT_FAILURE);
+    }
+    offline_store = offline_open(offline_dir);
+    if (offline_store == NULL) {
+      perror("初始化离线私聊失败");
+      exit(EXIT_FAILURE);
+    }
+  }
+  if (node_id != 0) {
+    if (cluster_init() < 0) {
+      exit(EXIT_FAILURE);
+    }
+    // 各节点的默认昵称编号错开，避免不同节点的新用户重名
+    atomic_store(&next_user_id, node_id * CLUSTER_USER_BASE + 1);
+  }
+  lobby = room_get(LOBBY_NAME, strlen(LOBBY_NAME)); // 一直持有这个引用，大厅不会被回收
+  if (lobby == NULL) {
+    perror("创建大厅失败");
     exit(EXIT_FAILURE);
   }
 
-  // 监听
-  if (listen(server_fd, MAX_CLIENTS) < 0) {
-    perror("监听失败");
-    close(server_fd);
+  shards = calloc(shard_count, sizeof(Shard));
+  if (shards == NULL) {
+    perror("分配分片失败");
+    exit(EXIT_FAILURE);
+  }
+  for (int i = 0; i < shard_count; i++) {
+    if (shard_init(&shards[i], i) < 0) {
+      exit(EXIT_FAILURE);
+    }
+  }
+  // 分片多于旧进程时新建的监听套接字和接过来的在同一个 SO_REUSEPORT 组里；
+  // 少于旧进程时多出的套接字关闭，其中尚未接受的连接被内核重置
+  for (int i = shard_count; i < inherited_fd_count; i++) {
+    close(inherited_fds[i]);
+  }
+  if (inherited != NULL) {
+    upgrade_restore();
+  }
+  if (upgrade_path != NULL && upgrade_listen() < 0) {
     exit(EXIT_FAILURE);
   }
 
   printf("========================================\n");
   printf("   TCP聊天服务器已启动\n");
-  printf("   监听端口: %d\n", PORT);
-  printf("   最大连接数: %d\n", MAX_CLIENTS);
+  printf("   监听端口: %d\n", server_port);
+  printf("   事件模型: epoll (%d 个分片)\n", shard_count);
+  printf("   慢客户端策略: %s (私聊队列 %u 条, 广播环 %lu 条)\n",
+         slow_policy == SLOW_DISCONNECT    ? "断开连接"
+         : slow_policy == SLOW_DROP_OLDEST ? "丢弃最旧消息"
+                                           : "暂停投递",
+         out_queue_limit, (unsigned long)ring_size);
+  if (coalesce_us > 0) {
+    printf("   发送合并窗口: %ld 微秒\n", coalesce_us);
+  }
+  if (history_dir != NULL) {
+    printf("   聊天记录: %s (进入房间时回放 %d 条)\n", history_dir,
+           history_replay);
+  }
+  if (session_grace > 0) {
+    printf("   断线会话保留: %d 秒\n", session_grace);
+  }
+  if (heartbeat_interval > 0) {
+    printf("   心跳: 没有输入 %d 秒后发送\n", heartbeat_interval);
+  }
+  if (offline_store != NULL) {
+    printf("   离线私聊: %s (待投递 %u 条)\n", offline_dir,
+           atomic_load(&offline_store->pending));
+  }
+  if (node_id != 0) {
+    printf("   集群: 节点 %d (节点间端口 %s%d, 连接 %d 个节点)\n", node_id,
+           cluster_port ? "" : "未监听 ", cluster_port, cluster.peer_count);
+  }
+  if (upgrade_path != NULL) {
+    printf("   热升级: %s (用相同参数启动新进程即可接管)\n", upgrade_path);
+  }
   printf("   按 Ctrl+C 关闭服务器\n");
   printf("========================================\n\n");
 
-  // 主循环：接受客户端连接
-  while (server_running) {
-    client_fd = accept(server_fd, (struct sockaddr *)&client_addr, &client_len);
-    if (client_fd < 0) {
-      if (server_running) {
-        perror("接受连接失败");
-      }
-      continue;
+  if ((history_dir != NULL || offline_store != NULL) &&
+      pthread_create(&disk_thread, NULL, disk_main, NULL) != 0) {
+    perror("创建落盘线程失败");
+    exit(EXIT_FAILURE);
+  }
+  if (node_id != 0 &&
+      pthread_create(&cluster_thread, NULL, cluster_main, NULL) != 0) {
+    perror("创建集群线程失败");
+    exit(EXIT_FAILURE);
+  }
+  for (int i = 0; i < shard_count; i++) {
+    if (pthread_create(&shards[i].thread, NULL, shard_main, &shards[i]) != 0) {
+      perror("创建分片线程失败");
+      exit(EXIT_FAILURE);
     }
+  }
 
-    // 检查是否达到最大连接数
-    pthread_mutex_lock(&clients_mutex);
-    int idx = -1;
-    for (int i = 0; i < MAX_CLIENTS; i++) {
-      if (clients[i].active == 0) {
-        idx = i;
-        break;
+  int upgrade_conn = -1;
+  if (upgrade_path != NULL) {
+    upgrade_conn = upgrade_wait(&mask);
+  } else {
+    int sig;
+    sigwait(&mask, &sig);
+  }
+  if (upgrade_conn >= 0) {
+    printf("\n新进程请求接管，正在交出连接...\n");
+    atomic_store(&upgrading, 1);
+  } else {
+    printf("\n接收到关闭信号，正在关闭服务器...\n");
+  }
+  atomic_store(&server_running, 0);
+  for (int i = 0; i < shard_count; i++) {
+    shard_wake(&shards[i]);
+  }
+  for (int i = 0; i < shard_count; i++) {
+    pthread_join(shards[i].thread, NULL);
+  }
+  // 分片都已退出，集群线程发出最后一批事件后退出（它还会向落盘线程提交聊天记录）
+  if (node_id != 0) {
+    uint64_t one = 1;
+    ssize_t ret = write(cluster_event_fd, &one, sizeof(one));
+    (void)ret;
+    pthread_join(cluster_thread, NULL);
+  }
+  // 交出连接之前处理完分片之间还在路上的消息，让它们进入各客户端的待发送数据
+  if (upgrade_conn >= 0) {
+    upgrade_quiesce();
+  }
+  // 落盘线程写完队列中剩下的消息并刷盘后退出
+  if (history_dir != NULL) {
+    uint64_t one = 1;
+    ssize_t ret = write(history_event_fd, &one, sizeof(one));
+    (void)ret;
+  }
+  if (history_dir != NULL || offline_store != NULL) {
+    pthread_join(disk_thread, NULL);
+  }
+  int handed = upgrade_conn >= 0 ? upgrade_send_state(upgrade_conn) : 0;
+
+  // 所有分片线程已退出，汇总慢客户端计数并释放残留的跨分片消息
+  SlowStats total = {0, 0, 0};
+  unsigned long delivered = 0, write_calls = 0;
+  unsigned long zip_frames = 0, zip_shared = 0, zip_in = 0, zip_out = 0;
+  unsigned long pings = 0, dead_peers = 0;
+  uint64_t zip_ns = 0;
+  for (int i = 0; i < shard_count; i++) {
+    Shard *s = &shards[i];
+    XMsg *m;
+    delivered += s->delivered;
+    write_calls += s->write_calls;
+    zip_frames += s->zip_frames;
+    zip_shared += s->zip_shared;
+    zip_in += s->zip_in;
+    zip_out += s->zip_out;
+    zip_ns += s->zip_ns;
+    pings += s->pings;
+    dead_peers += s->dead_peers;
+    total.dropped += s->slow.dropped;
+    total.disconnects += s->slow.disconnects;
+    total.pauses += s->slow.pauses;
+    while ((m = mpsc_pop(&s->inbox)) != NULL) {
+      release_xmsg(m);
+    }
+    for (int j = 0; j < shard_count; j++) {
+      while ((m = s->outbox_head[j]) != NULL) {
+        s->outbox_head[j] = m->next;
+        release_xmsg(m);
       }
     }
+    for (uint32_t j = 0; j < s->room_cap; j++) {
+      if (s->rooms[j] != NULL) {
+        room_release(s, s->rooms[j]);
+      }
+    }
+    free(s->rooms);
+    mpsc_destroy(&s->inbox);
+    close(s->listen_fd);
+    close(s->epoll_fd);
+    close(s->event_fd);
+    close(s->timer_fd);
+    free(s->clients);
+    free(s->handles);
+    free(s->handle_gen);
+    free(s->handle_free);
+    free(s->outbox_head);
+    free(s->outbox_tail);
+    if (s->zip_ready) {
+      deflateEnd(&s->zip);
+    }
+    cluster_buf_free(&s->zip_raw);
+  }
+  free(shards);
+  nick_destroy(&nicknames);
+  nick_destroy(&room_names);
+  nick_destroy(&remote_names);
+  Room *r = atomic_load(&room_list);
+  while (r != NULL) {
+    Room *next = r->next;
+    if (r->history != NULL) {
+      history_close(r->history);
+    }
+    free(r);
+    r = next;
+  }
+  while (history_closing != NULL) {
+    RoomHistory *next = history_closing->next_closing;
+    history_close(history_closing);
+    history_closing = next;
+  }
+  if (history_dir != NULL) {
+    mpsc_destroy(&history_queue);
+    close(history_event_fd);
+    printf("聊天记录: 未能记录的消息 %lu 条\n", atomic_load(&history_dropped));
+  }
+  if (node_id != 0) {
+    mpsc_destroy(&cluster_queue);
+    close(cluster_event_fd);
+    close(cluster.epoll_fd);
+    if (cluster.listen_fd >= 0) {
+      close(cluster.listen_fd);
+    }
+    printf("集群: 发出 %lu 帧 (原始 %lu 字节, 压缩后 %lu 字节), "
+           "去重丢弃 %lu 条, 未送出 %lu 条\n",
+           cluster.frames, cluster.raw_bytes, cluster.wire_bytes,
+           cluster.duplicates, atomic_load(&cluster_dropped));
+  }
+  if (offline_store != NULL) {
+    printf("离线私聊: 待投递 %u 条\n", atomic_load(&offline_store->pending));
+    offline_close(offline_store);
+  }
 
-    if (idx == -1) {
-      pthread_mutex_unlock(&clients_mutex);
-      printf("连接已满，拒绝新连接: %s:%d\n", inet_ntoa(client_addr.sin_addr),
-             ntohs(client_addr.sin_port));
-      const char *msg = "服务器已满，请稍后再试。\n";
-      send(client_fd, msg, strlen(msg), 0);
-      close(client_fd);
-      continue;
+  printf("\n慢客户端统计: 丢弃消息 %lu 条, 断开连接 %lu 次, 暂停投递 %lu 次\n",
+         total.dropped, total.disconnects, total.pauses);
+  printf("发送统计: 投递消息 %lu 条, 写系统调用 %lu 次 (%.2f 条/次)\n",
+         delivered, write_calls,
+         write_calls ? (double)delivered / write_calls : 0.0);
+  if (zip_frames > 0) {
+    printf("压缩统计: 压缩 %lu 帧, 共享已压缩的帧 %lu 次, 原始 %lu 字节 -> %lu 字节 "
+           "(%.1f%%), 耗时 %.1f 毫秒 (%.1f MB/s)\n",
+           zip_frames, zip_shared, zip_in, zip_out, 100.0 * zip_out / zip_in,
+           zip_ns / 1e6, zip_ns ? zip_in * 1e3 / zip_ns : 0.0);
+  }
+  if (heartbeat_interval > 0) {
+    printf("心跳统计: 发出心跳 %lu 次, 超时按断线处理 %lu 个连接\n", pings,
+           dead_peers);
+  }
+  if (upgrade_conn >= 0) {
+    // 存储都已关闭，新进程收到 END 后打开它们
+    uint32_t end = UPGRADE_END;
+    if (handed < 0 || upgrade_send(upgrade_conn, &end, sizeof(end), NULL, 0) < 0) {
+      perror("交出状态失败");
+    } else {
+      printf("[升级] 已把 %d 个客户端交给新进程\n", handed);
     }
+    close(upgrade_conn);
+  }
+  printf("服务器已关闭\n");
+  return 0;
+}
 
-    // 添加新客户端
-    clients[idx].sockfd = client_fd;
-    clients[idx].addr = client_addr;
-    clients[idx].active = 1;
-    snprintf(clients[idx].name, sizeof(clients[idx].name), "用户%d", idx + 1);
-    pthread_mutex_unlock(&clients_mutex);
+static uint64_t monotonic_ms(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000 + (uint64_t)ts.tv_nsec / 1000000;
+}
 
-    printf("[+] 新客户端连接: %s:%d (分配为 %s)\n",
-           inet_ntoa(client_addr.sin_addr), ntohs(client_addr.sin_port),
-           clients[idx].name);
-    printf("    当前在线人数: %d\n", get_client_count());
+static uint64_t monotonic_ns(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000000000ull + (uint64_t)ts.tv_nsec;
+}
 
-    // 创建线程处理客户端
-    int *client_idx = malloc(sizeof(int));
-    *client_idx = idx;
-    if (pthread_create(&tid, NULL, handle_client, client_idx) != 0) {
-      perror("创建线程失败");
-      remove_client(idx);
-      free(client_idx);
-      continue;
-    }
-    pthread_detach(tid);
+// 创建监听套接字：SO_REUSEPORT 让每个分片监听同一端口，由内核分配新连接
+static int listen_socket(void) {
+  struct sockaddr_in server_addr;
+
+  // 创建socket
+  int fd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+  if (fd < 0) {
+    perror("创建socket失败");
+    return -1;
   }
 
-  // 清理
-  close(server_fd);
-  printf("\n服务器已关闭\n");
-  return 0;
+  // 允许地址重用
+  int opt = 1;
+  if (setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &opt, sizeof(opt)) < 0 ||
+      setsockopt(fd, SOL_SOCKET, SO_REUSEPORT, &opt, sizeof(opt)) < 0) {
+    perror("设置socket选项失败");
+    close(fd);
+    return -1;
+  }
+
+  // 配置服务器地址
+  memset(&server_addr, 0, sizeof(server_addr));
+  server_addr.sin_family = AF_INET;
+  server_addr.sin_addr.s_addr = INADDR_ANY;
+  server_addr.sin_port = htons(server_port);
+
+  // 绑定
+  if (bind(fd, (struct sockaddr *)&server_addr, sizeof(server_addr)) < 0) {
+    perror("绑定失败");
+    close(fd);
+    return -1;
+  }
+
+  // 监听
+  if (listen(fd, LISTEN_BACKLOG) < 0) {
+    perror("监听失败");
+    close(fd);
+    return -1;
+  }
+  return fd;
 }
 
-// 处理客户端消息的线程函数
-void *handle_client(void *arg) {
-  int idx = *((int *)arg);
-  free(arg);
+// 初始化分片：独立的监听套接字、epoll 实例、eventfd 和收件队列
+int shard_init(Shard *s, int index) {
+  struct epoll_event ev;
 
-  char buffer[BUFFER_SIZE];
-  char message[BUFFER_SIZE + 64];
-  int bytes_received;
+  s->index = index;
+  atomic_init(&s->wake_pending, 0);
+  s->announcing.tail = &s->announcing.head;
+  s->suspended.tail = &s->suspended.head;
+  wheel_init(&s->heartbeats, HEARTBEAT_TICK_MS, monotonic_ms());
 
-  // 发送欢迎消息
-  snprintf(buffer, sizeof(buffer),
-           "欢迎来到聊天室！你的昵称是: %s\n"
-           "命令列表:\n"
-           "  /quit          - 退出聊天室\n"
-           "  /name <昵称>   - 修改昵称\n"
-           "  /list          - 查看在线用户\n"
-           "  /msg <用户> <消息> - 私聊指定用户\n"
-           "直接输入消息则广播给所有人\n",
-           clients[idx].name);
-  send(clients[idx].sockfd, buffer, strlen(buffer), 0);
+  if (index < inherited_fd_count) {
+    // 旧进程的监听套接字已经在监听，排队中尚未接受的连接也一并接过
+    s->listen_fd = inherited_fds[index];
+  } else if ((s->listen_fd = listen_socket()) < 0) {
+    return -1;
+  }
 
-  // 通知其他用户
-  snprintf(message, sizeof(message), "[系统] %s 加入了聊天室\n",
-           clients[idx].name);
-  broadcast_message(message, idx);
+  s->event_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+  s->timer_fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+  s->epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+  if (s->event_fd < 0 || s->timer_fd < 0 || s->epoll_fd < 0) {
+    perror("创建epoll失败");
+    return -1;
+  }
+  if (mpsc_init(&s->inbox, SHARD_QUEUE_SIZE) < 0) {
+    perror("分配分片队列失败");
+    return -1;
+  }
+  s->outbox_head = calloc(shard_count, sizeof(XMsg *));
+  s->outbox_tail = calloc(shard_count, sizeof(XMsg *));
+  if (s->outbox_head == NULL || s->outbox_tail == NULL) {
+    perror("分配分片队列失败");
+    return -1;
+  }
 
-  // 接收并转发消息
-  while (server_running && clients[idx].active) {
-    memset(buffer, 0, sizeof(buffer));
-    bytes_received = recv(clients[idx].sockfd, buffer, sizeof(buffer) - 1, 0);
+  // 监听套接字的 data.ptr 为 NULL，eventfd 和 timerfd 用其地址区分
+  ev.events = EPOLLIN;
+  ev.data.ptr = NULL;
+  epoll_ctl(s->epoll_fd, EPOLL_CTL_ADD, s->listen_fd, &ev);
+  ev.events = EPOLLIN;
+  ev.data.ptr = &s->event_fd;
+  epoll_ctl(s->epoll_fd, EPOLL_CTL_ADD, s->event_fd, &ev);
+  ev.events = EPOLLIN;
+  ev.data.ptr = &s->timer_fd;
+  epoll_ctl(s->epoll_fd, EPOLL_CTL_ADD, s->timer_fd, &ev);
+  return 0;
+}
 
-    if (bytes_received <= 0) {
-      // 客户端断开连接
-      break;
-    }
+// 分片线程：事件驱动处理本分片的连接、消息和跨分片队列
+void *shard_main(void *arg) {
+  Shard *s = arg;
+  struct epoll_event events[MAX_EVENTS];
+  int backlog = 0;
+  int expire = 0; // 距离最早的定时到期的毫秒数；第一轮不阻塞，先算出接过来的连接的定时
 
-    // 移除末尾的换行符
-    buffer[strcspn(buffer, "\r\n")] = '\0';
+  // 绑定到对应的 CPU 核心，失败（如受 cpuset 限制）时不影响运行
+  cpu_set_t cpus;
+  CPU_ZERO(&cpus);
+  CPU_SET(s->index, &cpus);
+  pthread_setaffinity_np(pthread_self(), sizeof(cpus), &cpus);
+  stats_register(&s->stats);
 
-    if (strlen(buffer) == 0) {
-      continue;
+  while (atomic_load(&server_running)) {
+    // 收件队列未处理完时不阻塞；有暂存的外发消息时定期重试；
+    // 有等待中的加入通知或保留中的会话时最多等到最早的到期时间
+    int timeout = backlog ? 0 : (s->outbox_pending ? 1 : -1);
+    if (expire >= 0 && (timeout < 0 || expire < timeout)) {
+      timeout = expire;
+    }
+    int n = epoll_wait(s->epoll_fd, events, MAX_EVENTS, timeout);
+    if (n < 0) {
+      if (errno == EINTR) {
+        continue;
+      }
+      perror("epoll_wait失败");
+      break;
+    }
+    if (heartbeat_interval > 0) {
+      s->now_ms = monotonic_ms();
     }
 
-    // 处理命令
-    if (strncmp(buffer, "/quit", 5) == 0) {
-      break;
-    } else if (strncmp(buffer, "/name ", 6) == 0) {
-      // 修改昵称
-      char old_name[32];
-      pthread_mutex_lock(&clients_mutex);
-      strncpy(old_name, clients[idx].name, sizeof(old_name) - 1);
-      strncpy(clients[idx].name, buffer + 6, sizeof(clients[idx].name) - 1);
-      clients[idx].name[sizeof(clients[idx].name) - 1] = '\0';
-      pthread_mutex_unlock(&clients_mutex);
-
-      snprintf(message, sizeof(message), "[系统] %s 改名为 %s\n", old_name,
-               clients[idx].name);
-      broadcast_message(message, -1);
-      printf("[*] %s 改名为 %s\n", old_name, clients[idx].name);
-    } else if (strncmp(buffer, "/list", 5) == 0) {
-      // 显示在线用户
-      char list_msg[BUFFER_SIZE] = "[在线用户列表]\n";
-      pthread_mutex_lock(&clients_mutex);
-      for (int i = 0; i < MAX_CLIENTS; i++) {
-        if (clients[i].active) {
-          char user_info[64];
-          snprintf(user_info, sizeof(user_info), "  - %s%s\n", clients[i].name,
-                   (i == idx) ? " (你)" : "");
-          strncat(list_msg, user_info, sizeof(list_msg) - strlen(list_msg) - 1);
-        }
+    for (int i = 0; i < n; i++) {
+      if (events[i].data.ptr == NULL) {
+        accept_clients(s);
+        continue;
       }
-      pthread_mutex_unlock(&clients_mutex);
-      send(clients[idx].sockfd, list_msg, strlen(list_msg), 0);
-    } else if (strncmp(buffer, "/msg ", 5) == 0) {
-      // 私聊功能: /msg <用户名> <消息>
-      char *cmd_content = buffer + 5;
-      char target_name[32] = {0};
-      char *space_pos = strchr(cmd_content, ' ');
-
-      if (space_pos == NULL) {
-        const char *usage = "[系统] 用法: /msg <用户名> <消息>\n";
-        send(clients[idx].sockfd, usage, strlen(usage), 0);
-      } else {
-        // 提取目标用户名
-        size_t name_len = space_pos - cmd_content;
-        if (name_len >= sizeof(target_name)) {
-          name_len = sizeof(target_name) - 1;
+      if (events[i].data.ptr == &s->event_fd) {
+        uint64_t value;
+        while (read(s->event_fd, &value, sizeof(value)) == sizeof(value)) {
         }
-        strncpy(target_name, cmd_content, name_len);
-        target_name[name_len] = '\0';
+        // 先清除标志再处理队列，之后入队的消息会重新写 eventfd
+        atomic_store(&s->wake_pending, 0);
+        continue;
+      }
+      if (events[i].data.ptr == &s->timer_fd) {
+        // 合并窗口到期，发送窗口内积累的消息
+        uint64_t expirations;
+        ssize_t ret = read(s->timer_fd, &expirations, sizeof(expirations));
+        (void)ret;
+        s->coalesce_armed = 0;
+        flush_pending_clients(s);
+        continue;
+      }
 
-        // 提取消息内容
-        char *private_msg = space_pos + 1;
+      if (events[i].data.u64 & TRANSFER_TAG) {
+        uintptr_t tag = (uintptr_t)events[i].data.u64;
+        transfer_event(s, (Transfer *)(tag & ~(uintptr_t)3), (int)(tag >> 1) & 1,
+                       events[i].events);
+        continue;
+      }
 
-        if (strlen(private_msg) == 0) {
-          const char *empty_msg = "[系统] 消息内容不能为空\n";
-          send(clients[idx].sockfd, empty_msg, strlen(empty_msg), 0);
-        } else {
-          // 构建私聊消息
-          snprintf(message, sizeof(message), "[私聊][%s -> 你]: %s\n",
-                   clients[idx].name, private_msg);
-          send_private_message(message, target_name, idx);
-
-          // 给发送者确认
-          snprintf(message, sizeof(message), "[私聊][你 -> %s]: %s\n",
-                   target_name, private_msg);
-          send(clients[idx].sockfd, message, strlen(message), 0);
-
-          printf("[私聊] %s -> %s: %s\n", clients[idx].name, target_name,
-                 private_msg);
-        }
+      ClientInfo *c = events[i].data.ptr;
+      if (!c->active) {
+        continue; // 本轮已被标记关闭
+      }
+      if (events[i].events & (EPOLLERR | EPOLLHUP)) {
+        client_lost(c);
+        continue;
+      }
+      if (events[i].events & EPOLLOUT) {
+        flush_client(c);
+      }
+      if ((events[i].events & EPOLLIN) && c->active) {
+        handle_client(c);
       }
-    } else if (strncmp(buffer, "/msg", 4) == 0) {
-      // 用户输入了 /msg 但格式不对（如 /msg用户2）
-      const char *usage =
-          "[系统] 私聊格式错误！正确用法: /msg 用户名 消息内容\n"
-          "[系统] 注意: /msg 后面必须有空格\n"
-          "[系统] 示例: /msg 用户2 你好\n";
-      send(clients[idx].sockfd, usage, strlen(usage), 0);
-    } else {
-      // 广播普通消息
-      snprintf(message, sizeof(message), "[%s]: %s\n", clients[idx].name,
-               buffer);
-      broadcast_message(message, idx);
-      printf("[消息] %s: %s\n", clients[idx].name, buffer);
     }
-  }
 
-  // 客户端断开连接
-  char name_copy[32];
-  strncpy(name_copy, clients[idx].name, sizeof(name_copy) - 1);
-  name_copy[sizeof(name_copy) - 1] = '\0';
+    backlog = drain_inbox(s);
+    expire = expire_clients(s);
+    int transfer_expire = expire_transfers(s);
+    if (transfer_expire >= 0 && (expire < 0 || transfer_expire < expire)) {
+      expire = transfer_expire;
+    }
+    int heartbeat_expire = expire_heartbeats(s);
+    if (heartbeat_expire >= 0 && (expire < 0 || heartbeat_expire < expire)) {
+      expire = heartbeat_expire;
+    }
+    // 关闭连接会广播离开消息，发送失败又会关闭连接，直到两者都处理完
+    do {
+      close_pending_clients(s);
+      if (coalesce_us == 0) {
+        flush_pending_clients(s);
+      }
+    } while (s->closing_list != NULL);
+    if (coalesce_us > 0 && (s->flush_list != NULL || s->dirty_rooms != NULL) &&
+        !s->coalesce_armed) {
+      // 开始合并窗口：窗口内到达的消息一起用 writev 发送
+      struct itimerspec its = {{0, 0}, {0, coalesce_us * 1000}};
+      timerfd_settime(s->timer_fd, 0, &its, NULL);
+      s->coalesce_armed = 1;
+    }
+    flush_outbox(s);
+  }
 
-  remove_client(idx);
+  // 关闭本分片的客户端连接；热升级时客户端留给主线程交给新进程
+  const char *msg = "[系统] 服务器关闭\n";
+  char frame[64];
+  proto_put_header(frame, OP_SYSTEM, strlen(msg) - 1);
+  memcpy(frame + PROTO_HEADER_SIZE, msg, strlen(msg) - 1);
+  int upgrade = atomic_load(&upgrading);
+  for (int i = 0; i < s->client_count && !upgrade; i++) {
+    if (s->clients[i]->sockfd < 0) {
+      // 断线保留中或正在转交连接
+    } else if (s->clients[i]->binary) {
+      send(s->clients[i]->sockfd, frame, PROTO_HEADER_SIZE + strlen(msg) - 1,
+           MSG_NOSIGNAL | MSG_DONTWAIT);
+    } else {
+      send(s->clients[i]->sockfd, msg, strlen(msg),
+           MSG_NOSIGNAL | MSG_DONTWAIT);
+    }
+    if (s->clients[i]->sockfd >= 0) {
+      close(s->clients[i]->sockfd);
+    }
+    free_out_queue(s->clients[i]);
+    free(s->clients[i]->in_buf);
+    free(s->clients[i]);
+  }
+  if (!upgrade) {
+    s->client_count = 0;
+  }
+  // 文件传输的数据连接不交给新进程；升级时通知双方，通知随待发送数据一起交出
+  while (s->transfers != NULL) {
+    Transfer *t = s->transfers;
+    s->transfers = t->next;
+    if (upgrade && t->state != XFER_DONE) {
+      transfer_finish(s, t, "服务器升级");
+    }
+    for (int end = 0; end < 2; end++) {
+      if (t->fd[end] >= 0) {
+        close(t->fd[end]);
+      }
+      if (t->pipe[end] >= 0) {
+        close(t->pipe[end]);
+      }
+    }
+    free(t);
+  }
+  return NULL;
+}
 
-  printf("[-] %s 已断开连接\n", name_copy);
-  printf("    当前在线人数: %d\n", get_client_count());
+// 唤醒分片：同一轮内多次入队只写一次 eventfd
+void shard_wake(Shard *s) {
+  if (!atomic_exchange(&s->wake_pending, 1)) {
+    uint64_t one = 1;
+    ssize_t ret = write(s->event_fd, &one, sizeof(one));
+    (void)ret;
+  }
+}
 
-  snprintf(message, sizeof(message), "[系统] %s 离开了聊天室\n", name_copy);
-  broadcast_message(message, -1);
+// 把消息发给其他分片；目标队列满时暂存在本分片，不阻塞事件循环
+void shard_post(Shard *from, int to, XMsg *m) {
+  Shard *dst = &shards[to];
 
-  return NULL;
+  m->next = NULL;
+  // 已有暂存消息时必须排在后面，保证同一对分片之间的消息顺序
+  if (from->outbox_head[to] == NULL && mpsc_push(&dst->inbox, m) == 0) {
+    shard_wake(dst);
+    return;
+  }
+  if (from->outbox_head[to] == NULL) {
+    from->outbox_head[to] = m;
+  } else {
+    from->outbox_tail[to]->next = m;
+  }
+  from->outbox_tail[to] = m;
+  from->outbox_pending++;
 }
 
-// 广播消息给所有客户端（除了发送者）
-void broadcast_message(const char *message, int sender_idx) {
-  pthread_mutex_lock(&clients_mutex);
-  for (int i = 0; i < MAX_CLIENTS; i++) {
-    if (clients[i].active && i != sender_idx) {
-      if (send(clients[i].sockfd, message, strlen(message), 0) < 0) {
-        // 发送失败，标记为不活跃
-        clients[i].active = 0;
+// 重试暂存的外发消息
+void flush_outbox(Shard *s) {
+  if (s->outbox_pending == 0) {
+    return;
+  }
+  for (int to = 0; to < shard_count; to++) {
+    int pushed = 0;
+    XMsg *m;
+    while ((m = s->outbox_head[to]) != NULL) {
+      if (mpsc_push(&shards[to].inbox, m) < 0) {
+        break;
       }
+      s->outbox_head[to] = m->next;
+      s->outbox_pending--;
+      pushed = 1;
+    }
+    if (pushed) {
+      shard_wake(&shards[to]);
     }
   }
-  pthread_mutex_unlock(&clients_mutex);
 }
 
-// 发送私聊消息给指定用户
-void send_private_message(const char *message, const char *target_name,
-                          int sender_idx) {
-  int found = 0;
-  pthread_mutex_lock(&clients_mutex);
-  for (int i = 0; i < MAX_CLIENTS; i++) {
-    if (clients[i].active && strcmp(clients[i].name, target_name) == 0) {
-      if (send(clients[i].sockfd, message, strlen(message), 0) < 0) {
-        clients[i].active = 0;
+// 处理收件队列，返回非零表示本轮没有处理完
+int drain_inbox(Shard *s) {
+  for (int i = 0; i < SHARD_DRAIN_BATCH; i++) {
+    XMsg *m = mpsc_pop(&s->inbox);
+    if (m == NULL) {
+      return 0;
+    }
+    if (handle_xmsg(s, m) == 0) {
+      release_xmsg(m);
+    }
+  }
+  return 1;
+}
+
+// 把消息投递给其他分片（或本分片）的指定客户端，接管 b 的引用
+static void post_deliver(Shard *s, uint64_t client_id, MsgBuf *b) {
+  XMsg *m = calloc(1, sizeof(XMsg));
+  if (m == NULL) {
+    msgbuf_put(b);
+    return;
+  }
+  m->type = XMSG_DELIVER;
+  m->client_id = client_id;
+  m->buf = b;
+  shard_post(s, CLIENT_ID_SHARD(client_id), m);
+}
+
+// 处理一条其他分片发来的消息，返回非零表示 m 已作为回复转发，调用者不要释放
+int handle_xmsg(Shard *s, XMsg *m) {
+  switch (m->type) {
+  case XMSG_BROADCAST:
+    broadcast_local(s, m->room, m->room_gen, m->buf, m->bin, m->client_id);
+    break;
+  case XMSG_DELIVER: {
+    ClientInfo *c = client_lookup(s, m->client_id);
+    if (c != NULL) {
+      client_send_buf(c, m->buf);
+    }
+    break;
+  }
+  case XMSG_LIST: {
+    if (s->client_count == 0) {
+      break;
+    }
+    // 本分片的用户列表，每行 "  - 昵称\n"；分块发回，每块不超过一个二进制帧
+    MsgBuf *b = NULL;
+    for (int i = 0; i < s->client_count; i++) {
+      if (!s->clients[i]->active) {
+        continue;
       }
-      found = 1;
+      if (b == NULL) {
+        if ((b = msgbuf_alloc(LIST_CHUNK_SIZE, 0)) == NULL) {
+          break;
+        }
+        b->len = 0;
+      }
+      b->len += snprintf(b->data + b->len, LIST_CHUNK_SIZE - b->len, "  - %s%s\n",
+                         s->clients[i]->name,
+                         s->clients[i]->detached ? " (断线)" : "");
+      if (b->len + sizeof(s->clients[i]->name) + 8 > LIST_CHUNK_SIZE) {
+        post_deliver(s, m->client_id, b);
+        b = NULL;
+      }
+    }
+    if (b != NULL) {
+      post_deliver(s, m->client_id, b);
+    }
+    break;
+  }
+  case XMSG_RESUME:
+    return session_resume(s, m);
+  case XMSG_RESUME_DONE:
+    resume_done(s, m);
+    break;
+  case XMSG_XFER_ACCEPT:
+  case XMSG_XFER_REJECT:
+    transfer_answer(s, m);
+    break;
+  case XMSG_XFER_ATTACH:
+    transfer_attach(s, m);
+    break;
+  case XMSG_PRIVATE: {
+    ClientInfo *c = client_lookup(s, m->client_id);
+    if (c != NULL) {
+      client_send_buf(c, c->binary ? m->bin : m->buf);
+      break;
+    }
+    // 查索引之后对方已经离线；其他节点转来的私聊没有本节点的发送者可以通知
+    if (m->sender_id == 0) {
       break;
     }
+    const char *gone = "[系统] 对方已离线，私聊未送达\n";
+    MsgBuf *b = msgbuf_new(gone, strlen(gone));
+    if (b != NULL) {
+      post_deliver(s, m->sender_id, b);
+    }
+    break;
+  }
+  }
+  return 0;
+}
+
+// 释放跨分片消息（处理完毕或服务器关闭时丢弃）
+void release_xmsg(XMsg *m) {
+  if ((m->type == XMSG_RESUME || m->type == XMSG_RESUME_DONE ||
+       m->type == XMSG_XFER_ATTACH) &&
+      m->fd >= 0) {
+    close(m->fd);
+  }
+  if (m->buf != NULL) {
+    msgbuf_put(m->buf);
+  }
+  if (m->bin != NULL) {
+    msgbuf_put(m->bin);
   }
-  pthread_mutex_unlock(&clients_mutex);
+  free(m);
+}
 
-  // 如果目标用户不存在，通知发送者
-  if (!found) {
-    char error_msg[128];
-    snprintf(error_msg, sizeof(error_msg), "[系统] 用户 '%s' 不在线或不存在\n",
-             target_name);
-    send(clients[sender_idx].sockfd, error_msg, strlen(error_msg), 0);
+// 分配 len 字节的消息缓冲区，内容由调用者填写
+MsgBuf *msgbuf_alloc(size_t len, int binary) {
+  MsgBuf *b = malloc(sizeof(MsgBuf) + len);
+  if (b == NULL) {
+    return NULL;
   }
+  atomic_init(&b->refs, 1);
+  b->len = len;
+  b->binary = binary;
+  b->seg = NULL;
+  return b;
 }
 
-// 移除客户端
-void remove_client(int idx) {
-  pthread_mutex_lock(&clients_mutex);
-  if (clients[idx].active) {
-    close(clients[idx].sockfd);
-    clients[idx].sockfd = -1;
-    clients[idx].active = 0;
-    memset(clients[idx].name, 0, sizeof(clients[idx].name));
+MsgBuf *msgbuf_new(const char *data, size_t len) {
+  MsgBuf *b = msgbuf_alloc(len, 0);
+  if (b != NULL) {
+    memcpy(b->data, data, len);
   }
-  pthread_mutex_unlock(&clients_mutex);
+  return b;
 }
 
-// 获取当前在线客户端数量
-int get_client_count() {
-  int count = 0;
-  pthread_mutex_lock(&clients_mutex);
-  for (int i = 0; i < MAX_CLIENTS; i++) {
-    if (clients[i].active) {
-      count++;
-    }
+// 编码二进制帧：from 不为空时负载以发送者预编码的昵称开头，之后是消息内容
+MsgBuf *msgbuf_frame(uint8_t type, const ClientInfo *from, const char *text,
+                     size_t len) {
+  size_t hdr_len = from ? from->bin_hdr_len : PROTO_HEADER_SIZE;
+  MsgBuf *b = msgbuf_alloc(hdr_len + len, 1);
+  if (b == NULL) {
+    return NULL;
+  }
+  if (from != NULL) {
+    memcpy(b->data, from->bin_hdr, hdr_len);
   }
-  pthread_mutex_unlock(&clients_mutex);
-  return count;
+  proto_put_header(b->data, type, hdr_len - PROTO_HEADER_SIZE + len);
+  memcpy(b->data + hdr_len, text, len);
+  return b;
 }
 
-// 信号处理函数
-void signal_handler(int sig) {
-  (void)sig; // 抑制未使用参数警告
-  printf("\n接收到关闭信号，正在关闭服务器...\n");
-  server_running = 0;
+// 把文本协议的系统消息编码为 OP_SYSTEM 帧（去掉结尾的换行，过长时截断）
+MsgBuf *msgbuf_system(const char *text, size_t len) {
+  if (len > 0 && text[len - 1] == '\n') {
+    len--;
+  }
+  if (len > PROTO_MAX_FRAME - 1) {
+    len = PROTO_MAX_FRAME - 1;
+  }
+  return msgbuf_frame(OP_SYSTEM, NULL, text, len);
+}
 
-  // 关闭所有客户端连接
-  pthread_mutex_lock(&clients_mutex);
-  for (int i = 0; i < MAX_CLIENTS; i++) {
-    if (clients[i].active) {
-      const char *msg = "[系统] 服务器关闭\n";
-      send(clients[i].sockfd, msg, strlen(msg), 0);
-      close(clients[i].sockfd);
-      clients[i].active = 0;
-    }
+// 引用聊天记录段文件中的一段字节，发送时用 sendfile，不拷贝到用户态
+MsgBuf *msgbuf_file(HistorySegment *seg, off_t off, size_t len) {
+  MsgBuf *b = msgbuf_alloc(0, 0);
+  if (b == NULL) {
+    return NULL;
   }
-  pthread_mutex_unlock(&clients_mutex);
+  b->len = len;
+  b->seg = history_seg_get(seg);
+  b->file_off = off;
+  return b;
+}
+
+// 消息占用的内存字节数，引用段文件的消息不计入客户端的积压上限
+static inline size_t msgbuf_mem(const MsgBuf *b) {
+  return b->seg != NULL ? 0 : b->len;
+}
+
+MsgBuf *msgbuf_get(MsgBuf *b) {
+  atomic_fetch_add_explicit(&b->refs, 1, memory_order_relaxed);
+  return b;
+}
+
+void msgbuf_put(MsgBuf *b) {
+  if (atomic_fetch_sub_explicit(&b->refs, 1, memory_order_acq_rel) == 1) {
+    if (b->seg != NULL) {
+      history_seg_put(b->seg);
+    }
+    free(b);
+  }
+}
+
+// 把消息从 off 开始的 len 字节追加到 out（引用段文件的消息用 pread 读出）
+static int msgbuf_append(ClusterBuf *out, const MsgBuf *b, size_t off,
+                         size_t len) {
+  if (cluster_buf_reserve(out, len) < 0) {
+    return -1;
+  }
+  if (b->seg != NULL) {
+    if (pread(b->seg->fd, out->data + out->len, len, b->file_off + (off_t)off) !=
+        (ssize_t)len) {
+      return -1;
+    }
+  } else {
+    memcpy(out->data + out->len, b->data + off, len);
+  }
+  out->len += len;
+  return 0;
+}
+
+// 把客户端追加到定时链表尾部，delay_ms 毫秒后到期
+static void client_timer_add(ClientList *l, ClientInfo *c, uint64_t delay_ms) {
+  c->deadline = monotonic_ms() + delay_ms;
+  c->timer_list = l;
+  c->next_timer = NULL;
+  c->timer_pprev = l->tail;
+  *l->tail = c;
+  l->tail = &c->next_timer;
+}
+
+// 从所在的定时链表中摘除
+static void client_timer_cancel(ClientInfo *c) {
+  ClientList *l = c->timer_list;
+  if (l == NULL) {
+    return;
+  }
+  *c->timer_pprev = c->next_timer;
+  if (c->next_timer != NULL) {
+    c->next_timer->timer_pprev = c->timer_pprev;
+  } else {
+    l->tail = c->timer_pprev;
+  }
+  c->timer_list = NULL;
+}
+
+// 槽位表扩容到至少 need 个，按倍数增长
+static int handle_reserve(Shard *s, int need) {
+  if (need <= s->handle_cap) {
+    return 0;
+  }
+  int new_cap = s->handle_cap ? s->handle_cap * 2 : CLIENT_TABLE_INIT;
+  while (new_cap < need) {
+    new_cap *= 2;
+  }
+  ClientInfo **handles = realloc(s->handles, sizeof(ClientInfo *) * new_cap);
+  if (handles == NULL) {
+    return -1;
+  }
+  s->handles = handles;
+  uint32_t *gen = realloc(s->handle_gen, sizeof(uint32_t) * new_cap);
+  if (gen == NULL) {
+    return -1;
+  }
+  s->handle_gen = gen;
+  int *free_list = realloc(s->handle_free, sizeof(int) * new_cap);
+  if (free_list == NULL) {
+    return -1;
+  }
+  s->handle_free = free_list;
+  s->handle_cap = new_cap;
+  return 0;
+}
+
+// 为新客户端分配槽位，表满时按倍数扩容
+static int handle_alloc(Shard *s, ClientInfo *c) {
+  int idx;
+  if (s->handle_free_count > 0) {
+    idx = s->handle_free[--s->handle_free_count];
+  } else {
+    if (handle_reserve(s, s->handle_used + 1) < 0) {
+      return -1;
+    }
+    idx = s->handle_used++;
+    s->handle_gen[idx] = 1; // 代数从 1 开始，ID 0 表示“无客户端”
+  }
+  s->handles[idx] = c;
+  c->id = CLIENT_ID(s->index, s->handle_gen[idx], idx);
+  return 0;
+}
+
+// 热升级时按旧进程中的 ID 占用原来的槽位，会话令牌因此继续有效。
+// 跳过的槽位暂时空着，全部恢复完再由 handle_rebuild_free 放入空闲栈
+static int handle_restore(Shard *s, ClientInfo *c, uint64_t id) {
+  uint32_t idx = CLIENT_ID_INDEX(id);
+  uint32_t gen = (uint32_t)(id >> 32) & CLIENT_GEN_MASK;
+  if (CLIENT_ID_SHARD(id) != s->index || gen == 0 || idx >= INT32_MAX ||
+      (idx < (uint32_t)s->handle_used && s->handles[idx] != NULL) ||
+      handle_reserve(s, (int)idx + 1) < 0) {
+    return -1;
+  }
+  while ((uint32_t)s->handle_used <= idx) {
+    s->handles[s->handle_used] = NULL;
+    s->handle_gen[s->handle_used++] = 1;
+  }
+  s->handles[idx] = c;
+  s->handle_gen[idx] = gen;
+  c->id = id;
+  return 0;
+}
+
+static void handle_rebuild_free(Shard *s) {
+  s->handle_free_count = 0;
+  for (int i = 0; i < s->handle_used; i++) {
+    if (s->handles[i] == NULL) {
+      s->handle_free[s->handle_free_count++] = i;
+    }
+  }
+}
+
+static void handle_release(Shard *s, ClientInfo *c) {
+  uint32_t idx = CLIENT_ID_INDEX(c->id);
+  s->handles[idx] = NULL;
+  s->handle_gen[idx] = (s->handle_gen[idx] + 1) & CLIENT_GEN_MASK;
+  if (s->handle_gen[idx] == 0) {
+    s->handle_gen[idx] = 1;
+  }
+  s->handle_free[s->handle_free_count++] = idx;
+}
+
+// 按 ID 查找本分片的在线客户端，ID 已失效时返回 NULL
+ClientInfo *client_lookup(Shard *s, uint64_t id) {
+  uint32_t idx = CLIENT_ID_INDEX(id);
+  if (CLIENT_ID_SHARD(id) != s->index || idx >= (uint32_t)s->handle_used) {
+    return NULL;
+  }
+  ClientInfo *c = s->handles[idx];
+  if (c == NULL || c->id != id || !c->active) {
+    return NULL;
+  }
+  return c;
+}
+
+// 客户端表满时按倍数扩容
+static int clients_reserve(Shard *s) {
+  if (s->client_count < s->client_cap) {
+    return 0;
+  }
+  int new_cap = s->client_cap ? s->client_cap * 2 : CLIENT_TABLE_INIT;
+  ClientInfo **grown = realloc(s->clients, sizeof(ClientInfo *) * new_cap);
+  if (grown == NULL) {
+    return -1;
+  }
+  s->clients = grown;
+  s->client_cap = new_cap;
+  return 0;
+}
+
+// 接受所有排队的新连接
+void accept_clients(Shard *s) {
+  struct sockaddr_in client_addr;
+  socklen_t client_len;
+  char buffer[BUFFER_SIZE];
+
+  while (1) {
+    client_len = sizeof(client_addr);
+    int client_fd = accept4(s->listen_fd, (struct sockaddr *)&client_addr,
+                            &client_len, SOCK_NONBLOCK | SOCK_CLOEXEC);
+    if (client_fd < 0) {
+      if (errno == EINTR || errno == ECONNABORTED) {
+        continue;
+      }
+      if (errno != EAGAIN && errno != EWOULDBLOCK) {
+        perror("接受连接失败");
+      }
+      return;
+    }
+
+    if (clients_reserve(s) < 0) {
+      printf("内存不足，拒绝新连接: %s:%d\n", inet_ntoa(client_addr.sin_addr),
+             ntohs(client_addr.sin_port));
+      close(client_fd);
+      continue;
+    }
+    // 会话令牌的随机部分，可预测时别人就能冒领断线的会话，取不到随机数时拒绝连接
+    uint64_t secret;
+    if (getrandom(&secret, sizeof(secret), 0) != sizeof(secret)) {
+      printf("取不到随机数，拒绝新连接: %s:%d\n", inet_ntoa(client_addr.sin_addr),
+             ntohs(client_addr.sin_port));
+      close(client_fd);
+      continue;
+    }
+
+    ClientInfo *c = calloc(1, sizeof(ClientInfo));
+    if (c == NULL || handle_alloc(s, c) < 0) {
+      free(c);
+      close(client_fd);
+      continue;
+    }
+
+    // 添加新客户端
+    c->sockfd = client_fd;
+    c->shard = s;
+    c->addr = client_addr;
+    c->active = 1;
+    c->secret = secret;
+    // 默认昵称可能已被别人改名占用，顺延到下一个编号
+    do {
+      snprintf(c->name, sizeof(c->name), "用户%d",
+               atomic_fetch_add(&next_user_id, 1));
+    } while (nick_insert(&nicknames, c->name, c->id) < 0);
+    encode_name_headers(c);
+
+    struct epoll_event ev;
+    ev.events = EPOLLIN | EPOLLRDHUP;
+    ev.data.ptr = c;
+    // 新连接进入大厅，只接收之后的广播
+    if (room_join(c, lobby) < 0 ||
+        epoll_ctl(s->epoll_fd, EPOLL_CTL_ADD, client_fd, &ev) < 0) {
+      perror("注册客户端失败");
+      room_leave(c);
+      nick_remove(&nicknames, c->name, c->id);
+      handle_release(s, c);
+      close(client_fd);
+      free(c);
+      continue;
+    }
+    c->slot = s->client_count;
+    s->clients[s->client_count++] = c;
+    atomic_fetch_add(&online_count, 1);
+    cluster_post(CLUSTER_JOIN, 0, c->name, NULL, NULL);
+    heartbeat_start(c, monotonic_ms());
+
+    printf("[+] 新客户端连接: %s:%d (分配为 %s)\n",
+           inet_ntoa(client_addr.sin_addr), ntohs(client_addr.sin_port),
+           c->name);
+    printf("    当前在线人数: %d\n", get_client_count());
+
+    // 连接后立即发来魔数的客户端（通常在 accept 时已经到达）直接切换到二进制协议，
+    // 不发送文本欢迎语；魔数来得晚的在第一次读取时再切换
+    char magic[PROTO_MAGIC_LEN];
+    if (recv(client_fd, magic, sizeof(magic), MSG_PEEK) == PROTO_MAGIC_LEN &&
+        memcmp(magic, PROTO_MAGIC, PROTO_MAGIC_LEN) == 0) {
+      ssize_t ret = recv(client_fd, magic, sizeof(magic), 0);
+      (void)ret;
+      switch_to_binary(c);
+    }
+
+    // 发送欢迎消息
+    snprintf(buffer, sizeof(buffer),
+             "欢迎来到聊天室！你的昵称是: %s，当前房间: %s\n"
+             "命令列表:\n"
+             "  /quit          - 退出聊天室\n"
+             "  /name <昵称>   - 修改昵称\n"
+             "  /list          - 查看在线用户\n"
+             "  /msg <用户> <消息> - 私聊指定用户\n"
+             "  /join <房间>   - 进入房间（不存在时创建）\n"
+             "  /part          - 离开房间，回到" LOBBY_NAME "\n"
+             "  /send <用户> <文件> - 发送文件，对方 /accept <编号> 接收\n"
+             "  /claim <口令>  - 认领当前昵称的离线信箱，或取回离线私聊\n"
+             "直接输入消息则广播给同一房间的所有人\n",
+             c->name, lobby->name);
+    if (!c->binary) {
+      client_send(c, buffer, strlen(buffer));
+      send_session_token(c);
+      history_replay_to(c);
+    }
+
+    // 通知其他用户。启用会话恢复时推迟到第一条输入或 ANNOUNCE_DELAY_MS 之后：
+    // 重连的客户端紧接着发送 /resume，恢复成功就不必广播这个临时身份
+    if (session_grace > 0) {
+      client_timer_add(&s->announcing, c, ANNOUNCE_DELAY_MS);
+    } else {
+      client_announce(c);
+    }
+  }
+}
+
+// 按名字查找房间，不存在时创建，返回一个引用（调用者用 room_put 归还）。
+// 房间数达到 ROOM_MAX 时返回 NULL，errno 为 ENOSPC
+Room *room_get(const char *name, size_t len) {
+  char key[NICK_MAX_LEN];
+  if (len > sizeof(key) - 1) {
+    len = sizeof(key) - 1;
+  }
+  memcpy(key, name, len);
+  key[len] = '\0';
+
+  pthread_mutex_lock(&room_lock);
+  Room *r = (Room *)(uintptr_t)nick_lookup(&room_names, key);
+  if (r != NULL) {
+    atomic_fetch_add(&r->refs, 1);
+    pthread_mutex_unlock(&room_lock);
+    return r;
+  }
+  if (room_free != NULL) {
+    // 重用已回收的房间和它的 ID，各分片的房间表不随创建过的房间总数增长
+    r = room_free;
+    room_free = r->next_free;
+  } else if (atomic_load(&next_room_id) >= ROOM_MAX) {
+    pthread_mutex_unlock(&room_lock);
+    errno = ENOSPC;
+    return NULL;
+  } else if ((r = calloc(1, sizeof(Room))) != NULL) {
+    atomic_init(&r->shards, 0);
+    r->id = atomic_fetch_add(&next_room_id, 1);
+    r->next = atomic_load(&room_list);
+    atomic_store(&room_list, r);
+  } else {
+    pthread_mutex_unlock(&room_lock);
+    return NULL;
+  }
+  memcpy(r->name, key, len + 1);
+  atomic_store(&r->refs, 1);
+  r->retired = 0;
+  if (history_dir != NULL) {
+    // 加载已有的聊天记录（只在创建房间时发生一次）；按规范化的房间名找文件。
+    // 同名房间刚被回收时旧的记录可能还没关闭，但已不会再追加，可以直接重新打开
+    char norm[NICK_MAX_LEN];
+    nick_key(&room_names, key, norm);
+    r->history = history_open(history_dir, norm);
+  }
+  if (nick_insert(&room_names, key, (uint64_t)(uintptr_t)r) < 0) {
+    if (r->history != NULL) {
+      history_close(r->history);
+      r->history = NULL;
+    }
+    r->retired = 1;
+    r->next_free = room_free;
+    room_free = r;
+    r = NULL;
+  }
+  pthread_mutex_unlock(&room_lock);
+  return r;
+}
+
+// 按名字查找已有的房间，返回一个引用，不存在时返回 NULL
+Room *room_find(const char *name) {
+  pthread_mutex_lock(&room_lock);
+  Room *r = (Room *)(uintptr_t)nick_lookup(&room_names, name);
+  if (r != NULL) {
+    atomic_fetch_add(&r->refs, 1);
+  }
+  pthread_mutex_unlock(&room_lock);
+  return r;
+}
+
+Room *room_hold(Room *r) {
+  atomic_fetch_add(&r->refs, 1);
+  return r;
+}
+
+// 归还房间的引用。最后一个引用归还时回收房间：从索引中删除，代数加一让在途的广播失效，
+// 聊天记录交给落盘线程关闭，ID 放入空闲链表。归零之后、取得锁之前房间可能又被查到，
+// 所以在锁内重新检查
+void room_put(Room *r) {
+  if (atomic_fetch_sub(&r->refs, 1) != 1) {
+    return;
+  }
+  pthread_mutex_lock(&room_lock);
+  if (atomic_load(&r->refs) == 0 && !r->retired) {
+    nick_remove(&room_names, r->name, (uint64_t)(uintptr_t)r);
+    r->gen++;
+    r->retired = 1;
+    if (r->history != NULL) {
+      // 可能还在落盘线程的待刷盘链表中，由落盘线程刷盘之后再关闭
+      r->history->next_closing = history_closing;
+      history_closing = r->history;
+      r->history = NULL;
+    }
+    r->next_free = room_free;
+    room_free = r;
+  }
+  pthread_mutex_unlock(&room_lock);
+}
+
+// 取得房间在本分片的部分，不存在时创建（持有房间的一个引用，释放时归还）
+static RoomShard *room_local(Shard *s, Room *r) {
+  if (r->id >= s->room_cap) {
+    uint32_t new_cap = s->room_cap ? s->room_cap : ROOM_TABLE_INIT;
+    while (new_cap <= r->id) {
+      new_cap *= 2;
+    }
+    RoomShard **grown = realloc(s->rooms, sizeof(RoomShard *) * new_cap);
+    if (grown == NULL) {
+      return NULL;
+    }
+    memset(grown + s->room_cap, 0, sizeof(RoomShard *) * (new_cap - s->room_cap));
+    s->rooms = grown;
+    s->room_cap = new_cap;
+  }
+  if (s->rooms[r->id] != NULL) {
+    return s->rooms[r->id];
+  }
+
+  RoomShard *rs = calloc(1, sizeof(RoomShard));
+  uint64_t cap = ring_size < ROOM_RING_INIT ? ring_size : ROOM_RING_INIT;
+  if (rs == NULL || (rs->ring = calloc(cap, sizeof(RingSlot))) == NULL) {
+    free(rs);
+    return NULL;
+  }
+  rs->room = room_hold(r);
+  rs->ring_mask = cap - 1;
+  s->rooms[r->id] = rs;
+  return rs;
+}
+
+// 加入房间：追加到本分片的成员数组，第一个成员在房间的分片位图中登记本分片
+int room_join(ClientInfo *c, Room *r) {
+  Shard *s = c->shard;
+  RoomShard *rs = room_local(s, r);
+  if (rs == NULL) {
+    return -1;
+  }
+  if (rs->member_count == rs->member_cap) {
+    int new_cap = rs->member_cap ? rs->member_cap * 2 : ROOM_MEMBERS_INIT;
+    ClientInfo **grown = realloc(rs->members, sizeof(ClientInfo *) * new_cap);
+    if (grown == NULL) {
+      if (rs->member_count == 0 && !rs->dirty) {
+        room_release(s, rs);
+      }
+      return -1;
+    }
+    rs->members = grown;
+    rs->member_cap = new_cap;
+  }
+  c->room = rs;
+  c->room_slot = rs->member_count;
+  c->cursor = rs->ring_head;
+  rs->members[rs->member_count++] = c;
+  if (rs->member_count == 1) {
+    atomic_fetch_or(&r->shards, (uint_fast64_t)1 << s->index);
+  }
+  return 0;
+}
+
+// 离开所在房间：用最后一个成员填补空位，本分片最后一个成员离开时释放房间的分片部分
+void room_leave(ClientInfo *c) {
+  RoomShard *rs = c->room;
+  if (rs == NULL) {
+    return;
+  }
+  rs->members[c->room_slot] = rs->members[--rs->member_count];
+  rs->members[c->room_slot]->room_slot = c->room_slot;
+  c->room = NULL;
+  if (rs->member_count == 0) {
+    atomic_fetch_and(&rs->room->shards, ~((uint_fast64_t)1 << c->shard->index));
+    if (!rs->dirty) {
+      room_release(c->shard, rs); // 在待发送链表中的由 flush_pending_clients 释放
+    }
+  }
+}
+
+// 释放房间在本分片的部分（成员已全部离开，或服务器关闭）
+void room_release(Shard *s, RoomShard *rs) {
+  for (uint64_t i = 0; i <= rs->ring_mask; i++) {
+    for (int k = 0; k < 2; k++) {
+      if (rs->ring[i].buf[k] != NULL) {
+        msgbuf_put(rs->ring[i].buf[k]);
+      }
+    }
+  }
+  for (int k = 0; k < 2; k++) {
+    if (rs->zip_batch[k] != NULL) {
+      msgbuf_put(rs->zip_batch[k]);
+    }
+  }
+  Room *r = rs->room;
+  s->rooms[r->id] = NULL;
+  free(rs->ring);
+  free(rs->members);
+  free(rs);
+  room_put(r);
+}
+
+// 把一条聊天消息交给落盘线程（持有一个引用），队列满时不记录，不阻塞广播
+void history_post(Room *r, MsgBuf *b) {
+  HistoryItem *item = malloc(sizeof(HistoryItem));
+  if (item == NULL) {
+    atomic_fetch_add(&history_dropped, 1);
+    return;
+  }
+  item->room = room_hold(r);
+  item->buf = msgbuf_get(b);
+  if (mpsc_push(&history_queue, item) < 0) {
+    msgbuf_put(b);
+    room_put(r);
+    free(item);
+    atomic_fetch_add(&history_dropped, 1);
+    return;
+  }
+  if (!atomic_exchange(&history_wake_pending, 1)) {
+    uint64_t one = 1;
+    ssize_t ret = write(history_event_fd, &one, sizeof(one));
+    (void)ret;
+  }
+}
+
+// 落盘线程：把队列中的消息加上时间追加到各房间的段文件，
+// 每 HISTORY_SYNC_MS 毫秒把这段时间内写过的房间和离线私聊的段一起刷盘（成组提交），
+// 并压缩离线私聊最旧的段
+void *disk_main(void *arg) {
+  (void)arg;
+  RoomHistory *dirty = NULL;
+  struct timespec last_sync;
+  clock_gettime(CLOCK_MONOTONIC, &last_sync);
+  char record[BUFFER_SIZE + 128];
+  char stamp[32] = "";
+  time_t stamp_time = 0;
+  size_t stamp_len = 0;
+
+  for (;;) {
+    int running = atomic_load(&server_running);
+    struct pollfd pfd = {history_event_fd, POLLIN, 0};
+    poll(&pfd, 1, running ? HISTORY_SYNC_MS : 0);
+    uint64_t value;
+    while (read(history_event_fd, &value, sizeof(value)) == sizeof(value)) {
+    }
+    atomic_store(&history_wake_pending, 0);
+
+    HistoryItem *item;
+    while (history_dir != NULL && (item = mpsc_pop(&history_queue)) != NULL) {
+      time_t now = time(NULL);
+      if (now != stamp_time) {
+        struct tm tm;
+        localtime_r(&now, &tm);
+        stamp_len = strftime(stamp, sizeof(stamp), "[%m-%d %H:%M] ", &tm);
+        stamp_time = now;
+      }
+      size_t len = item->buf->len;
+      if (stamp_len + len > sizeof(record)) {
+        len = sizeof(record) - stamp_len;
+      }
+      memcpy(record, stamp, stamp_len);
+      memcpy(record + stamp_len, item->buf->data, len);
+      RoomHistory *h = item->room->history;
+      if (history_append(h, record, stamp_len + len, now) < 0) {
+        atomic_fetch_add(&history_dropped, 1);
+      } else if (!h->dirty) {
+        h->dirty = 1;
+        h->next_dirty = dirty;
+        dirty = h;
+      }
+      msgbuf_put(item->buf);
+      room_put(item->room);
+      free(item);
+    }
+
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    long elapsed_ms = (now.tv_sec - last_sync.tv_sec) * 1000 +
+                      (now.tv_nsec - last_sync.tv_nsec) / 1000000;
+    if (elapsed_ms >= HISTORY_SYNC_MS || !running) {
+      // 先取出已回收房间的聊天记录，再刷盘：它们最后的消息在回收之前已经追加，
+      // 如果还在待刷盘链表中，下面刷盘时离开链表，之后才能关闭
+      pthread_mutex_lock(&room_lock);
+      RoomHistory *closing = history_closing;
+      history_closing = NULL;
+      pthread_mutex_unlock(&room_lock);
+      while (dirty != NULL) {
+        history_sync(dirty);
+        dirty->dirty = 0;
+        dirty = dirty->next_dirty;
+      }
+      while (closing != NULL) {
+        RoomHistory *next = closing->next_closing;
+        history_close(closing);
+        closing = next;
+      }
+      if (offline_store != NULL) {
+        offline_sync(offline_store);
+        if (running) {
+          offline_compact(offline_store);
+        }
+      }
+      last_sync = now;
+    }
+    if (!running) {
+      return NULL;
+    }
+  }
+}
+
+// 回放所在房间最近的聊天记录：直接引用段文件中的字节放入私聊队列，由 sendfile 发送。
+// 只回放给文本客户端
+void history_replay_to(ClientInfo *c) {
+  RoomHistory *h = c->room->room->history;
+  HistoryRange ranges[HISTORY_KEEP_SEGMENTS];
+  uint64_t found;
+  if (h == NULL || c->binary || history_replay == 0) {
+    return;
+  }
+  int n = history_find(h, (uint64_t)history_replay, ranges, &found);
+  if (n == 0) {
+    return;
+  }
+  char notice[128];
+  int len = snprintf(notice, sizeof(notice), "[系统] 最近的 %llu 条消息:\n",
+                     (unsigned long long)found);
+  client_send(c, notice, len);
+  for (int i = 0; i < n; i++) {
+    MsgBuf *b = msgbuf_file(ranges[i].seg, ranges[i].off, ranges[i].len);
+    if (b != NULL) {
+      client_send_buf(c, b);
+      msgbuf_put(b);
+    }
+    history_seg_put(ranges[i].seg);
+  }
+  const char *end = "[系统] 以上是历史消息\n";
+  client_send(c, end, strlen(end));
+}
+
+// 把一条离线私聊按客户端的协议放入它的私聊队列（在离线存储的锁内调用）
+static void offline_deliver_one(void *arg, const OfflineRecord *r) {
+  ClientInfo *c = arg;
+  if (c->binary) {
+    size_t payload = 1 + r->from_len + r->text_len;
+    MsgBuf *b = msgbuf_alloc(PROTO_HEADER_SIZE + payload, 1);
+    if (b == NULL) {
+      return;
+    }
+    proto_put_header(b->data, OP_PRIVATE_FROM, payload);
+    b->data[PROTO_HEADER_SIZE] = (char)r->from_len;
+    memcpy(b->data + PROTO_HEADER_SIZE + 1, offline_from(r), r->from_len);
+    memcpy(b->data + PROTO_HEADER_SIZE + 1 + r->from_len, offline_text(r),
+           r->text_len);
+    client_send_buf(c, b);
+    msgbuf_put(b);
+    return;
+  }
+  char message[BUFFER_SIZE + 128];
+  char stamp[32];
+  time_t when = (time_t)r->time;
+  struct tm tm;
+  localtime_r(&when, &tm);
+  strftime(stamp, sizeof(stamp), "%m-%d %H:%M", &tm);
+  int n = snprintf(message, sizeof(message), "[离线私聊][%.*s -> 你] (%s): %.*s\n",
+                   (int)r->from_len, offline_from(r), stamp, (int)r->text_len,
+                   offline_text(r));
+  client_send(c, message, (size_t)n < sizeof(message) ? (size_t)n
+                                                      : sizeof(message) - 1);
+}
+
+// 改名后提示新昵称的信箱里有离线私聊：昵称不需要认证，核对口令之后才投递。
+// 没有待投递的消息时只读一个原子计数，不加锁
+void offline_deliver(ClientInfo *c) {
+  char key[NICK_MAX_LEN];
+  char notice[BUFFER_SIZE];
+  if (offline_store == NULL ||
+      atomic_load_explicit(&offline_store->pending, memory_order_relaxed) == 0) {
+    return;
+  }
+  nick_key(&nicknames, c->name, key);
+  if (offline_pending(offline_store, key) > 0) {
+    int len = snprintf(notice, sizeof(notice),
+                       "[系统] 昵称 %s 的信箱中有离线私聊，输入 /claim <口令> 取回\n",
+                       c->name);
+    client_send(c, notice, len);
+  }
+}
+
+// 定长时间比较两个字符串，耗时不随第一个不同字节的位置变化
+static int claim_equal(const char *a, const char *b) {
+  size_t len = strlen(a);
+  unsigned char diff = len != strlen(b);
+  if (diff) {
+    return 0;
+  }
+  for (size_t i = 0; i < len; i++) {
+    diff |= (unsigned char)(a[i] ^ b[i]);
+  }
+  return diff == 0;
+}
+
+// /claim：当前昵称的信箱未认领时用口令认领，之后只为认领过的昵称保存离线私聊；
+// 已认领时核对口令，正确则按顺序投递以该昵称保存的离线私聊。
+// 口令用 crypt(3) 的 SHA-512 加随机盐算 CLAIM_HASH_ROUNDS 轮，分片线程为此停顿约 15 毫秒，
+// 每个连接最多输错 CLAIM_TRIES 次
+void claim_mailbox(ClientInfo *c, const char *secret, size_t len) {
+  char key[NICK_MAX_LEN];
+  char message[BUFFER_SIZE];
+  char pass[BUFFER_SIZE];
+  char stored[OFFLINE_CLAIM_MAX];
+  char setting[CRYPT_GENSALT_OUTPUT_SIZE];
+  unsigned char rnd[16];
+  const char *reply = NULL;
+  struct crypt_data *cd = NULL;
+  int ret = -2;
+
+  if (offline_store == NULL) {
+    reply = "[系统] 服务器未启用离线私聊\n";
+  } else if (len < CLAIM_SECRET_MIN) {
+    snprintf(message, sizeof(message), "[系统] 口令至少 %d 个字符\n",
+             CLAIM_SECRET_MIN);
+    reply = message;
+  } else if (len >= sizeof(pass)) {
+    reply = "[系统] 口令过长\n";
+  } else if (memchr(secret, '\0', len) != NULL) {
+    reply = "[系统] 口令不能包含空字符\n";
+  }
+  if (reply != NULL) {
+    client_send(c, reply, strlen(reply));
+    return;
+  }
+  memcpy(pass, secret, len);
+  pass[len] = '\0';
+  nick_key(&nicknames, c->name, key);
+  cd = calloc(1, sizeof(*cd)); // crypt_data 有几十 KB，不放在栈上
+  if (cd == NULL) {
+    // 按写入失败处理
+  } else if (!offline_claim_get(offline_store, key, stored)) {
+    // 取不到随机盐时不认领：可预测的盐让预先算好的口令表可用
+    const char *hash = NULL;
+    if (getrandom(rnd, sizeof(rnd), 0) == sizeof(rnd) &&
+        crypt_gensalt_rn("$6$", CLAIM_HASH_ROUNDS, (const char *)rnd,
+                         sizeof(rnd), setting, sizeof(setting)) != NULL) {
+      hash = crypt_r(pass, setting, cd);
+    }
+    if (hash != NULL && hash[0] != '*') {
+      ret = offline_claim_set(offline_store, key, hash);
+    }
+    if (ret == 1) {
+      // 同一昵称在别的分片上刚刚认领（改名竞争），按已认领核对
+      ret = offline_claim_get(offline_store, key, stored) ? -3 : -2;
+    }
+  } else {
+    ret = -3;
+  }
+  if (ret == -3) {
+    const char *hash = crypt_r(pass, stored, cd);
+    ret = hash != NULL && claim_equal(hash, stored) ? 1 : -1;
+  }
+  explicit_bzero(pass, sizeof(pass));
+  free(cd);
+  if (ret == 0) {
+    snprintf(message, sizeof(message),
+             "[系统] 已认领昵称 %s 的离线信箱：你不在线时发给 %s 的私聊会保存，"
+             "之后以该昵称登录并输入 /claim <口令> 取回\n",
+             c->name, c->name);
+    client_send(c, message, strlen(message));
+    printf("[离线] %s 认领了离线信箱\n", c->name);
+    return;
+  }
+  if (ret < 0) {
+    reply = ret == -1 ? "[系统] 口令错误\n" : "[系统] 认领离线信箱失败\n";
+    client_send(c, reply, strlen(reply));
+    if (ret == -1 && ++c->claim_failures >= CLAIM_TRIES) {
+      remove_client(c); // 限制猜测口令的速度
+    }
+    return;
+  }
+  int n = offline_take(offline_store, key, offline_deliver_one, c);
+  int n_len = n > 0 ? snprintf(message, sizeof(message),
+                               "[系统] 以上是你离线时收到的 %d 条私聊\n", n)
+                    : snprintf(message, sizeof(message), "[系统] 没有离线私聊\n");
+  client_send(c, message, n_len);
+  if (n > 0) {
+    printf("[离线] 向 %s 投递 %d 条离线私聊\n", c->name, n);
+  }
+}
+
+// 初始化集群：节点间监听套接字、epoll、事件队列，解析 -J 指定的节点地址
+int cluster_init() {
+  struct epoll_event ev;
+  atomic_init(&cluster_seq, (uint64_t)time(NULL) * 1000000); // 重启后序号仍然递增
+  cluster.listen_fd = -1;
+  cluster.epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+  cluster_event_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+  if (cluster.epoll_fd < 0 || cluster_event_fd < 0 ||
+      mpsc_init(&cluster_queue, CLUSTER_QUEUE_SIZE) < 0) {
+    perror("初始化集群失败");
+    return -1;
+  }
+  ev.events = EPOLLIN;
+  ev.data.ptr = &cluster_event_fd;
+  epoll_ctl(cluster.epoll_fd, EPOLL_CTL_ADD, cluster_event_fd, &ev);
+
+  if (cluster_port > 0) {
+    struct sockaddr_in addr;
+    int opt = 1;
+    cluster.listen_fd =
+        socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = INADDR_ANY;
+    addr.sin_port = htons(cluster_port);
+    if (cluster.listen_fd < 0 ||
+        setsockopt(cluster.listen_fd, SOL_SOCKET, SO_REUSEADDR, &opt,
+                   sizeof(opt)) < 0 ||
+        bind(cluster.listen_fd, (struct sockaddr *)&addr, sizeof(addr)) < 0 ||
+        listen(cluster.listen_fd, LISTEN_BACKLOG) < 0) {
+      perror("节点间端口监听失败");
+      return -1;
+    }
+    ev.events = EPOLLIN;
+    ev.data.ptr = &cluster.listen_fd;
+    epoll_ctl(cluster.epoll_fd, EPOLL_CTL_ADD, cluster.listen_fd, &ev);
+  }
+
+  // 节点地址列表 "IP:端口,IP:端口"
+  char *save = NULL;
+  for (char *item = cluster_peers ? strtok_r(cluster_peers, ",", &save) : NULL;
+       item != NULL; item = strtok_r(NULL, ",", &save)) {
+    char *colon = strrchr(item, ':');
+    Peer *p = calloc(1, sizeof(Peer));
+    if (p == NULL) {
+      return -1;
+    }
+    p->fd = -1;
+    p->dial = 1;
+    p->addr.sin_family = AF_INET;
+    if (colon != NULL) {
+      *colon = '\0';
+      p->addr.sin_port = htons(atoi(colon + 1));
+    }
+    if (colon == NULL || p->addr.sin_port == 0 ||
+        inet_pton(AF_INET, item, &p->addr.sin_addr) != 1) {
+      fprintf(stderr, "无效的节点地址: %s\n", item);
+      free(p);
+      return -1;
+    }
+    if (cluster.peer_count == cluster.peer_cap) {
+      int new_cap = cluster.peer_cap ? cluster.peer_cap * 2 : 8;
+      Peer **grown = realloc(cluster.peers, sizeof(Peer *) * new_cap);
+      if (grown == NULL) {
+        free(p);
+        return -1;
+      }
+      cluster.peers = grown;
+      cluster.peer_cap = new_cap;
+    }
+    cluster.peers[cluster.peer_count++] = p;
+  }
+  return 0;
+}
+
+static void cluster_item_free(ClusterItem *item) {
+  if (item->text != NULL) {
+    msgbuf_put(item->text);
+  }
+  if (item->bin != NULL) {
+    msgbuf_put(item->bin);
+  }
+  free(item);
+}
+
+// 把事件交给集群线程发往其他节点（分片线程调用），未组成集群时什么也不做。
+// 广播和私聊共享分片已经编码好的两份消息，队列满时丢弃
+void cluster_post(uint8_t type, int node, const char *name, MsgBuf *text,
+                  MsgBuf *bin) {
+  if (node_id == 0) {
+    return;
+  }
+  ClusterItem *item = malloc(sizeof(ClusterItem));
+  if (item == NULL) {
+    atomic_fetch_add(&cluster_dropped, 1);
+    return;
+  }
+  item->type = type;
+  item->node = node;
+  item->id = CLUSTER_ID(node_id, atomic_fetch_add(&cluster_seq, 1));
+  snprintf(item->name, sizeof(item->name), "%s", name);
+  item->text = text ? msgbuf_get(text) : NULL;
+  item->bin = bin ? msgbuf_get(bin) : NULL;
+  if (mpsc_push(&cluster_queue, item) < 0) {
+    cluster_item_free(item);
+    atomic_fetch_add(&cluster_dropped, 1);
+    return;
+  }
+  if (!atomic_exchange(&cluster_wake_pending, 1)) {
+    uint64_t one = 1;
+    ssize_t ret = write(cluster_event_fd, &one, sizeof(one));
+    (void)ret;
+  }
+}
+
+static void peer_watch(Peer *p, uint32_t events) {
+  struct epoll_event ev;
+  if (p->events == events) {
+    return;
+  }
+  ev.events = events;
+  ev.data.ptr = p;
+  epoll_ctl(cluster.epoll_fd, p->events ? EPOLL_CTL_MOD : EPOLL_CTL_ADD, p->fd,
+            &ev);
+  p->events = events;
+}
+
+// 有没有其他已经确认身份的连接通往节点 node
+static Peer *peer_find(int node, const Peer *except) {
+  for (int i = 0; i < cluster.peer_count; i++) {
+    Peer *q = cluster.peers[i];
+    if (q != except && q->fd >= 0 && q->node == node) {
+      return q;
+    }
+  }
+  return NULL;
+}
+
+// 关闭节点连接：到该节点已经没有其他连接时移除它的在线用户。
+// 主动连接的稍后重连，对方连过来的在本轮结束时释放
+static void peer_close(Peer *p) {
+  if (p->fd < 0) {
+    return;
+  }
+  close(p->fd);
+  p->fd = -1;
+  p->events = 0;
+  p->connecting = 0;
+  p->out_off = 0;
+  cluster_buf_free(&p->in);
+  cluster_buf_free(&p->batch);
+  cluster_buf_free(&p->out);
+  p->retry_at = monotonic_ms() + CLUSTER_RETRY_MS;
+  if (p->node != 0 && peer_find(p->node, p) == NULL) {
+    int removed = nick_remove_all(&remote_names, (uint64_t)p->node);
+    printf("[集群] 与节点 %d 的连接断开，移除 %d 个远程用户\n", p->node,
+           removed);
+  }
+  p->node = 0;
+}
+
+// 把帧追加到待发送数据，批中的事件全部成帧
+static void peer_frame(Peer *p) {
+  if (p->batch.len == 0) {
+    return;
+  }
+  size_t before = p->out.len;
+  if (cluster_frame(&p->batch, &p->out) < 0 ||
+      p->out.len - p->out_off > CLUSTER_OUT_MAX) {
+    printf("[集群] 节点 %d 接收过慢，断开重连\n", p->node);
+    peer_close(p);
+    return;
+  }
+  cluster.frames++;
+  cluster.raw_bytes += p->batch.len;
+  cluster.wire_bytes += p->out.len - before;
+  p->batch.len = 0;
+}
+
+// 把事件加入发给 p 的批，批足够大时立即成帧
+static void peer_put(Peer *p, const ClusterEvent *e) {
+  if (p->fd < 0 || p->connecting) {
+    return;
+  }
+  if (cluster_put_event(&p->batch, e) < 0) {
+    atomic_fetch_add(&cluster_dropped, 1);
+    return;
+  }
+  if (p->batch.len >= CLUSTER_BATCH_MAX) {
+    peer_frame(p);
+  }
+}
+
+// 尽量发送积压的帧，发不完时等待 EPOLLOUT
+static void peer_flush(Peer *p) {
+  while (p->fd >= 0 && p->out_off < p->out.len) {
+    ssize_t n = send(p->fd, p->out.data + p->out_off, p->out.len - p->out_off,
+                     MSG_NOSIGNAL | MSG_DONTWAIT);
+    if (n < 0) {
+      if (errno == EINTR) {
+        continue;
+      }
+      if (errno == EAGAIN || errno == EWOULDBLOCK) {
+        peer_watch(p, EPOLLIN | EPOLLRDHUP | EPOLLOUT);
+        return;
+      }
+      peer_close(p);
+      return;
+    }
+    p->out_off += (size_t)n;
+  }
+  if (p->fd >= 0) {
+    p->out.len = p->out_off = 0;
+    peer_watch(p, EPOLLIN | EPOLLRDHUP);
+  }
+}
+
+static void peer_snapshot_one(void *arg, const char *key, uint64_t id) {
+  ClusterEvent e = {CLUSTER_JOIN, 0, key, strlen(key), "", 0, "", 0};
+  (void)id;
+  peer_put(arg, &e);
+}
+
+// 连接建立：先发 HELLO，再发本节点全部在线用户的快照
+static void peer_up(Peer *p) {
+  ClusterEvent e = {CLUSTER_HELLO, (uint64_t)node_id, "", 0, "", 0, "", 0};
+  int opt = 1;
+  setsockopt(p->fd, IPPROTO_TCP, TCP_NODELAY, &opt, sizeof(opt));
+  p->connecting = 0;
+  peer_watch(p, EPOLLIN | EPOLLRDHUP);
+  peer_put(p, &e);
+  nick_each(&nicknames, peer_snapshot_one, p);
+}
+
+static void peer_dial(Peer *p) {
+  p->fd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+  if (p->fd < 0) {
+    p->retry_at = monotonic_ms() + CLUSTER_RETRY_MS;
+    return;
+  }
+  if (connect(p->fd, (struct sockaddr *)&p->addr, sizeof(p->addr)) == 0) {
+    peer_up(p);
+  } else if (errno == EINPROGRESS) {
+    p->connecting = 1;
+    peer_watch(p, EPOLLOUT);
+  } else {
+    peer_close(p);
+  }
+}
+
+static void cluster_accept() {
+  while (1) {
+    int fd = accept4(cluster.listen_fd, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC);
+    if (fd < 0) {
+      if (errno == EINTR || errno == ECONNABORTED) {
+        continue;
+      }
+      return;
+    }
+    if (cluster.peer_count == cluster.peer_cap) {
+      int new_cap = cluster.peer_cap ? cluster.peer_cap * 2 : 8;
+      Peer **grown = realloc(cluster.peers, sizeof(Peer *) * new_cap);
+      if (grown == NULL) {
+        close(fd);
+        continue;
+      }
+      cluster.peers = grown;
+      cluster.peer_cap = new_cap;
+    }
+    Peer *p = calloc(1, sizeof(Peer));
+    if (p == NULL) {
+      close(fd);
+      continue;
+    }
+    p->fd = fd;
+    cluster.peers[cluster.peer_count++] = p;
+    peer_up(p);
+  }
+}
+
+// 把对方节点的房间广播交给有该房间成员的分片；本节点没有成员的房间已被回收，查不到时丢弃
+static void cluster_room(const ClusterEvent *e) {
+  char name[NICK_MAX_LEN];
+  snprintf(name, sizeof(name), "%.*s", (int)e->name_len, e->name);
+  Room *r = room_find(name);
+  if (r == NULL) {
+    return;
+  }
+  if (e->bin_len < PROTO_HEADER_SIZE) {
+    room_put(r);
+    return;
+  }
+  MsgBuf *text = msgbuf_new(e->text, e->text_len);
+  MsgBuf *bin = msgbuf_alloc(e->bin_len, 1);
+  if (text != NULL && bin != NULL) {
+    memcpy(bin->data, e->bin, e->bin_len);
+    uint_fast64_t targets = atomic_load(&r->shards);
+    while (targets != 0) {
+      int i = __builtin_ctzll(targets);
+      targets &= targets - 1;
+      XMsg *m = calloc(1, sizeof(XMsg));
+      if (m == NULL) {
+        continue;
+      }
+      m->type = XMSG_BROADCAST;
+      m->room = r->id;
+      m->room_gen = r->gen;
+      m->buf = msgbuf_get(text);
+      m->bin = msgbuf_get(bin);
+      if (mpsc_push(&shards[i].inbox, m) < 0) {
+        release_xmsg(m);
+        atomic_fetch_add(&cluster_dropped, 1);
+        continue;
+      }
+      shard_wake(&shards[i]);
+    }
+    // 聊天消息（不含系统通知）也记入本节点的聊天记录
+    if (r->history != NULL && (uint8_t)bin->data[2] == OP_CHAT_FROM) {
+      history_post(r, text);
+    }
+  }
+  if (text != NULL) {
+    msgbuf_put(text);
+  }
+  if (bin != NULL) {
+    msgbuf_put(bin);
+  }
+  room_put(r);
+}
+
+// 把对方节点转来的私聊投递给本节点的用户
+static void cluster_private(const ClusterEvent *e) {
+  char name[NICK_MAX_LEN];
+  snprintf(name, sizeof(name), "%.*s", (int)e->name_len, e->name);
+  uint64_t target_id = nick_lookup(&nicknames, name);
+  if (target_id == 0) {
+    atomic_fetch_add(&cluster_dropped, 1);
+    return;
+  }
+  XMsg *m = calloc(1, sizeof(XMsg));
+  if (m == NULL) {
+    return;
+  }
+  m->type = XMSG_PRIVATE;
+  m->client_id = target_id;
+  m->buf = msgbuf_new(e->text, e->text_len);
+  m->bin = msgbuf_alloc(e->bin_len, 1);
+  if (m->bin != NULL) {
+    memcpy(m->bin->data, e->bin, e->bin_len);
+  }
+  Shard *dst = &shards[CLIENT_ID_SHARD(target_id)];
+  if (m->buf == NULL || m->bin == NULL || mpsc_push(&dst->inbox, m) < 0) {
+    release_xmsg(m);
+    atomic_fetch_add(&cluster_dropped, 1);
+    return;
+  }
+  shard_wake(dst);
+}
+
+// 处理对方节点发来的一个事件，返回 -1 表示协议错误，应断开连接
+static int cluster_receive(Peer *p, const ClusterEvent *e) {
+  char name[NICK_MAX_LEN];
+  if (e->type == CLUSTER_HELLO) {
+    int node = (int)e->id;
+    if (p->node != 0 || node <= 0 || node >= CLUSTER_MAX_NODES) {
+      return -1;
+    }
+    p->last_node = node;
+    if (node == node_id) {
+      return -1; // 连到了自己（各节点使用同一份节点列表时）
+    }
+    // 两个节点互相主动连接时只保留由编号小的一方发起的那条
+    Peer *q = peer_find(node, p);
+    if (q != NULL && (p->dial != (node_id < node) || q->dial == p->dial)) {
+      return -1;
+    }
+    p->node = node;
+    if (q != NULL) {
+      peer_close(q);
+    } else {
+      printf("[集群] 节点 %d 已连接\n", node);
+    }
+    return 0;
+  }
+  if (p->node == 0 || e->name_len >= NICK_MAX_LEN) {
+    return -1;
+  }
+  // 快照中的用户 ID 为 0，不参与去重
+  int origin = CLUSTER_ID_NODE(e->id);
+  if (e->id != 0 &&
+      (origin != p->node ||
+       !cluster_dedup(&cluster.dedup[origin], CLUSTER_ID_SEQ(e->id)))) {
+    cluster.duplicates++;
+    return 0;
+  }
+  switch (e->type) {
+  case CLUSTER_JOIN:
+    memcpy(name, e->name, e->name_len);
+    name[e->name_len] = '\0';
+    // 与本节点用户同名时以本节点为准
+    if (nick_lookup(&nicknames, name) == 0) {
+      nick_insert(&remote_names, name, (uint64_t)p->node);
+    }
+    break;
+  case CLUSTER_PART:
+    memcpy(name, e->name, e->name_len);
+    name[e->name_len] = '\0';
+    nick_remove(&remote_names, name, (uint64_t)p->node);
+    break;
+  case CLUSTER_ROOM:
+    cluster_room(e);
+    break;
+  case CLUSTER_PRIVATE:
+    cluster_private(e);
+    break;
+  default:
+    return -1;
+  }
+  return 0;
+}
+
+// 读取对方节点发来的帧并逐个处理其中的事件
+static void peer_read(Peer *p) {
+  for (;;) {
+    if (cluster_buf_reserve(&p->in, RX_BUFFER_SIZE) < 0) {
+      peer_close(p);
+      return;
+    }
+    ssize_t n = recv(p->fd, p->in.data + p->in.len, p->in.cap - p->in.len, 0);
+    if (n == 0 || (n < 0 && errno != EAGAIN && errno != EWOULDBLOCK &&
+                   errno != EINTR)) {
+      peer_close(p);
+      return;
+    }
+    if (n < 0) {
+      break;
+    }
+    p->in.len += (size_t)n;
+  }
+  size_t off = 0;
+  long used;
+  while ((used = cluster_unframe(p->in.data + off, p->in.len - off,
+                                 &cluster.raw)) > 0) {
+    off += (size_t)used;
+    ClusterEvent e;
+    size_t pos = 0, n;
+    while ((n = cluster_next_event(cluster.raw.data + pos,
+                                   cluster.raw.len - pos, &e)) > 0) {
+      pos += n;
+      if (cluster_receive(p, &e) < 0) {
+        peer_close(p);
+        return;
+      }
+    }
+    if (pos != cluster.raw.len) {
+      used = -1;
+      break;
+    }
+  }
+  if (used < 0) {
+    printf("[集群] 节点 %d 发来的数据损坏，断开连接\n", p->node);
+    peer_close(p);
+    return;
+  }
+  cluster_buf_consume(&p->in, off);
+}
+
+static void peer_event(Peer *p, uint32_t events) {
+  if (p->fd < 0) {
+    return;
+  }
+  if (p->connecting) {
+    int err = 0;
+    socklen_t len = sizeof(err);
+    getsockopt(p->fd, SOL_SOCKET, SO_ERROR, &err, &len);
+    if (err != 0 || (events & (EPOLLERR | EPOLLHUP))) {
+      peer_close(p);
+    } else {
+      peer_up(p);
+    }
+    return;
+  }
+  if (events & (EPOLLIN | EPOLLRDHUP | EPOLLHUP | EPOLLERR)) {
+    peer_read(p);
+  }
+  if (p->fd >= 0 && (events & EPOLLOUT)) {
+    peer_flush(p);
+  }
+}
+
+// 把队列中的事件编码进各节点连接的批：私聊只发给目标节点，其他事件发给所有节点
+static void cluster_drain() {
+  ClusterItem *item;
+  while ((item = mpsc_pop(&cluster_queue)) != NULL) {
+    ClusterEvent e = {item->type,
+                      item->id,
+                      item->name,
+                      strlen(item->name),
+                      item->text ? item->text->data : "",
+                      item->text ? item->text->len : 0,
+                      item->bin ? item->bin->data : "",
+                      item->bin ? item->bin->len : 0};
+    Peer *target = NULL;
+    if (item->type == CLUSTER_PRIVATE) {
+      // 查目标时对方节点的连接刚好断开
+      if ((target = peer_find(item->node, NULL)) == NULL) {
+        atomic_fetch_add(&cluster_dropped, 1);
+      }
+    }
+    for (int i = 0; i < cluster.peer_count; i++) {
+      if (item->type != CLUSTER_PRIVATE || cluster.peers[i] == target) {
+        peer_put(cluster.peers[i], &e);
+      }
+    }
+    cluster_item_free(item);
+  }
+}
+
+// 集群线程：收发节点间的帧。每轮把分片放入队列的事件按节点各打包成一帧，
+// 一次 send 发出；断开的主动连接每 CLUSTER_RETRY_MS 毫秒重连一次
+void *cluster_main(void *arg) {
+  (void)arg;
+  struct epoll_event events[MAX_EVENTS];
+  stats_register(&cluster.stats);
+
+  for (;;) {
+    int running = atomic_load(&server_running);
+    int n = epoll_wait(cluster.epoll_fd, events, MAX_EVENTS,
+                       running ? CLUSTER_RETRY_MS : 0);
+    for (int i = 0; i < n; i++) {
+      if (events[i].data.ptr == &cluster.listen_fd) {
+        cluster_accept();
+      } else if (events[i].data.ptr == &cluster_event_fd) {
+        uint64_t value;
+        while (read(cluster_event_fd, &value, sizeof(value)) == sizeof(value)) {
+        }
+        atomic_store(&cluster_wake_pending, 0);
+      } else {
+        peer_event(events[i].data.ptr, events[i].events);
+      }
+    }
+    cluster_drain();
+
+    uint64_t now = monotonic_ms();
+    for (int i = 0; i < cluster.peer_count; i++) {
+      Peer *p = cluster.peers[i];
+      if (p->fd >= 0 && !p->connecting) {
+        peer_frame(p);
+        peer_flush(p);
+      }
+      if (p->fd < 0 && !p->dial) {
+        // 对方连过来的连接已关闭，释放（本轮的事件都已处理完）
+        cluster.peers[i--] = cluster.peers[--cluster.peer_count];
+        free(p);
+      } else if (p->fd < 0 && running && now >= p->retry_at) {
+        // 对方已经连过来时不必再连，连到的是自己时不再连
+        if (p->last_node == node_id) {
+          p->retry_at = UINT64_MAX;
+        } else if (p->last_node != 0 && peer_find(p->last_node, p) != NULL) {
+          p->retry_at = now + CLUSTER_RETRY_MS;
+        } else {
+          peer_dial(p);
+        }
+      }
+    }
+    if (!running) {
+      break;
+    }
+  }
+
+  ClusterItem *item;
+  while ((item = mpsc_pop(&cluster_queue)) != NULL) {
+    cluster_item_free(item);
+  }
+  for (int i = 0; i < cluster.peer_count; i++) {
+    peer_close(cluster.peers[i]);
+  }
+  for (int i = 0; i < cluster.peer_count; i++) {
+    free(cluster.peers[i]);
+  }
+  free(cluster.peers);
+  cluster_buf_free(&cluster.raw);
+  return NULL;
+}
+
+// 按当前昵称预编码广播头，加入和改名时调用
+void encode_name_headers(ClientInfo *c) {
+  size_t n = strlen(c->name);
+  c->text_hdr_len = (uint8_t)snprintf(c->text_hdr, sizeof(c->text_hdr),
+                                      "[%s]: ", c->name);
+  c->bin_hdr[PROTO_HEADER_SIZE] = (char)n;
+  memcpy(c->bin_hdr + PROTO_HEADER_SIZE + 1, c->name, n);
+  c->bin_hdr_len = (uint8_t)(PROTO_HEADER_SIZE + 1 + n);
+}
+
+// 切换到二进制协议并回复魔数和 OP_WELCOME 帧。之前排队的文本消息不再发送
+// （客户端会丢弃魔数之前的字节），广播从当前位置开始按二进制帧接收
+void switch_to_binary(ClientInfo *c) {
+  c->binary = 1;
+  c->negotiated = 1;
+  c->cursor = c->room->ring_head;
+  free_out_queue(c);
+
+  size_t n = strlen(c->name);
+  MsgBuf *b = msgbuf_alloc(PROTO_MAGIC_LEN + PROTO_HEADER_SIZE + n, 1);
+  if (b == NULL) {
+    remove_client(c);
+    return;
+  }
+  memcpy(b->data, PROTO_MAGIC, PROTO_MAGIC_LEN);
+  proto_put_header(b->data + PROTO_MAGIC_LEN, OP_WELCOME, n);
+  memcpy(b->data + PROTO_MAGIC_LEN + PROTO_HEADER_SIZE, c->name, n);
+  client_send_buf(c, b);
+  msgbuf_put(b);
+  send_session_token(c);
+}
+
+// 把数据追加到客户端的输入缓冲区，按需扩容
+static int in_append(ClientInfo *c, const char *data, size_t len) {
+  if (c->in_len + len > c->in_cap) {
+    size_t new_cap = c->in_cap ? c->in_cap : BUFFER_SIZE;
+    while (new_cap < c->in_len + len) {
+      new_cap *= 2;
+    }
+    char *grown = realloc(c->in_buf, new_cap);
+    if (grown == NULL) {
+      return -1;
+    }
+    c->in_buf = grown;
+    c->in_cap = new_cap;
+  }
+  memcpy(c->in_buf + c->in_len, data, len);
+  c->in_len += len;
+  return 0;
+}
+
+// 处理客户端可读事件：一次读取尽可能多的数据，取出其中所有完整的行（或二进制帧）
+// 依次处理，不完整的部分留在输入缓冲区等下次读取
+void handle_client(ClientInfo *c) {
+  Shard *s = c->shard;
+
+  STATS_START(recv_start);
+  ssize_t bytes_received = recv(c->sockfd, s->rx_buf, RX_BUFFER_SIZE, 0);
+  STATS_END(STAT_RECV, recv_start);
+  if (bytes_received < 0 && (errno == EAGAIN || errno == EWOULDBLOCK ||
+                             errno == EINTR)) {
+    return;
+  }
+  if (bytes_received <= 0) {
+    // 客户端断开连接
+    client_lost(c);
+    return;
+  }
+  c->heard = s->now_ms;
+  c->pings = 0;
+
+  char *data = s->rx_buf;
+  size_t len = (size_t)bytes_received;
+  if (c->in_len > 0) {
+    // 上次剩下半行：拼接后从输入缓冲区解析
+    if (in_append(c, data, len) < 0) {
+      remove_client(c);
+      return;
+    }
+    data = c->in_buf;
+    len = c->in_len;
+  }
+
+  STATS_START(parse_start);
+  size_t used = 0;
+  if (!c->negotiated) {
+    // 第一批输入决定协议：以魔数开头则切换到二进制协议，只收到魔数的前几个字节时继续等待
+    size_t n = len < PROTO_MAGIC_LEN ? len : PROTO_MAGIC_LEN;
+    if (memcmp(data, PROTO_MAGIC, n) != 0) {
+      c->negotiated = 1;
+    } else if (n == PROTO_MAGIC_LEN) {
+      switch_to_binary(c);
+      used = PROTO_MAGIC_LEN;
+    }
+  }
+  if (c->binary) {
+    used += process_frames(c, data + used, len - used);
+  } else if (c->negotiated) {
+    used += process_lines(c, data + used, len - used);
+  }
+  STATS_END(STAT_PARSE, parse_start);
+  if (!c->active) {
+    return;
+  }
+
+  size_t rest = len - used;
+  if (c->in_discard) {
+    rest = 0;
+  } else if (!c->binary && rest > MAX_LINE_LENGTH) {
+    // 超长且还没有换行：丢弃已收到的部分，直到下一个换行
+    const char *too_long = "[系统] 消息过长，已丢弃\n";
+    client_send(c, too_long, strlen(too_long));
+    c->in_discard = 1;
+    rest = 0;
+  }
+
+  if (data == c->in_buf) {
+    memmove(c->in_buf, c->in_buf + used, rest);
+    c->in_len = rest;
+  } else if (rest > 0 && in_append(c, data + used, rest) < 0) {
+    remove_client(c);
+    return;
+  }
+  if (c->in_len == 0) {
+    free(c->in_buf);
+    c->in_buf = NULL;
+    c->in_cap = 0;
+  }
+}
+
+// 依次处理 data 中所有以换行结尾的行（原地改写为字符串），返回已处理的字节数
+size_t process_lines(ClientInfo *c, char *data, size_t len) {
+  char *p = data;
+  char *end = data + len;
+
+  while (c->active && !c->detached && p < end) {
+    // glibc 的 memchr 按机器字/向量寄存器批量比较，比逐字节扫描快得多
+    char *nl = memchr(p, '\n', end - p);
+    if (nl == NULL) {
+      break;
+    }
+    char *line = p;
+    size_t line_len = nl - p;
+    p = nl + 1;
+
+    if (c->in_discard) {
+      c->in_discard = 0; // 超长行在这里结束
+      continue;
+    }
+    *nl = '\0';
+    if (line_len > 0 && line[line_len - 1] == '\r') {
+      line[--line_len] = '\0';
+    }
+    if (line_len > MAX_LINE_LENGTH) {
+      const char *too_long = "[系统] 消息过长，已丢弃\n";
+      client_send(c, too_long, strlen(too_long));
+      continue;
+    }
+    if (line_len > 0) {
+      handle_message(c, line, line_len);
+    }
+  }
+  return p - data;
+}
+
+// 二进制帧处理函数，payload 不以 '\0' 结尾
+typedef void (*FrameHandler)(ClientInfo *c, const char *payload, size_t len);
+
+// 检查客户端发来的消息内容：不能为空、不能超长，也不能含换行（否则能在文本客户端
+// 那里伪造出另一行消息）。不合法时回复原因并返回 -1
+static int check_text(ClientInfo *c, const char *text, size_t len) {
+  const char *reason = NULL;
+  if (len == 0) {
+    reason = "[系统] 消息内容不能为空\n";
+  } else if (len > MAX_LINE_LENGTH) {
+    reason = "[系统] 消息过长，已丢弃\n";
+  } else if (memchr(text, '\n', len) != NULL) {
+    reason = "[系统] 消息不能包含换行\n";
+  }
+  if (reason != NULL) {
+    client_send(c, reason, strlen(reason));
+    return -1;
+  }
+  return 0;
+}
+
+static void frame_chat(ClientInfo *c, const char *payload, size_t len) {
+  if (check_text(c, payload, len) == 0) {
+    broadcast_chat(c, payload, len);
+  }
+}
+
+static void frame_private(ClientInfo *c, const char *payload, size_t len) {
+  size_t name_len = len > 0 ? (unsigned char)payload[0] : 0;
+  if (name_len == 0 || 1 + name_len > len) {
+    const char *usage = "[系统] 私聊帧格式错误\n";
+    client_send(c, usage, strlen(usage));
+    return;
+  }
+  const char *text = payload + 1 + name_len;
+  size_t text_len = len - 1 - name_len;
+  if (check_text(c, text, text_len) == 0) {
+    send_private_message(c, payload + 1, name_len, text, text_len);
+  }
+}
+
+static void frame_name(ClientInfo *c, const char *payload, size_t len) {
+  if (memchr(payload, '\n', len) != NULL) {
+    const char *bad = "[系统] 昵称不能包含换行\n";
+    client_send(c, bad, strlen(bad));
+    return;
+  }
+  change_name(c, payload, len);
+}
+
+static void frame_join(ClientInfo *c, const char *payload, size_t len) {
+  if (memchr(payload, '\n', len) != NULL) {
+    const char *bad = "[系统] 房间名不能包含换行\n";
+    client_send(c, bad, strlen(bad));
+    return;
+  }
+  change_room(c, payload, len);
+}
+
+static void frame_part(ClientInfo *c, const char *payload, size_t len) {
+  (void)payload;
+  (void)len;
+  change_room(c, lobby->name, strlen(lobby->name));
+}
+
+static void frame_list(ClientInfo *c, const char *payload, size_t len) {
+  (void)payload;
+  (void)len;
+  send_user_list(c);
+}
+
+static void frame_stats(ClientInfo *c, const char *payload, size_t len) {
+  (void)payload;
+  (void)len;
+  send_stats(c);
+}
+
+static void frame_compress(ClientInfo *c, const char *payload, size_t len) {
+  (void)payload;
+  (void)len;
+  compress_request(c);
+}
+
+static void frame_resume(ClientInfo *c, const char *payload, size_t len) {
+  resume_request(c, payload, len);
+}
+
+static void frame_claim(ClientInfo *c, const char *payload, size_t len) {
+  claim_mailbox(c, payload, len);
+}
+
+static void frame_pong(ClientInfo *c, const char *payload, size_t len) {
+  (void)payload;
+  (void)len;
+  c->pong = 1;
+}
+
+static void frame_quit(ClientInfo *c, const char *payload, size_t len) {
+  (void)payload;
+  (void)len;
+  remove_client(c);
+}
+
+// 按帧类型直接查表分派，未列出的类型为 NULL
+static const FrameHandler frame_handlers[256] = {
+    [OP_CHAT] = frame_chat, [OP_PRIVATE] = frame_private,
+    [OP_NAME] = frame_name, [OP_LIST] = frame_list,
+    [OP_QUIT] = frame_quit, [OP_JOIN] = frame_join,
+    [OP_PART] = frame_part, [OP_RESUME] = frame_resume,
+    [OP_STATS] = frame_stats, [OP_COMPRESS] = frame_compress,
+    [OP_PONG] = frame_pong, [OP_CLAIM] = frame_claim,
+};
+
+// 依次处理 data 中所有完整的二进制帧，返回已处理的字节数；
+// 长度字段不合法时无法再找到下一帧的边界，断开连接
+size_t process_frames(ClientInfo *c, char *data, size_t len) {
+  size_t off = 0;
+
+  while (c->active && !c->detached && len - off >= PROTO_LEN_SIZE) {
+    size_t frame_len = proto_get_len(data + off);
+    if (frame_len == 0 || frame_len > PROTO_MAX_FRAME) {
+      printf("[!] %s 发送了无效的帧，断开连接\n", c->name);
+      remove_client(c);
+      break;
+    }
+    if (len - off - PROTO_LEN_SIZE < frame_len) {
+      break; // 帧还没收完
+    }
+    uint8_t type = (uint8_t)data[off + PROTO_LEN_SIZE];
+    FrameHandler handler = frame_handlers[type];
+    if (type != OP_RESUME) {
+      client_announce(c); // 第一帧不是恢复会话，立即发出加入通知
+    }
+    if (handler != NULL) {
+      handler(c, data + off + PROTO_HEADER_SIZE, frame_len - 1);
+    } else {
+      const char *unknown = "[系统] 未知的帧类型\n";
+      client_send(c, unknown, strlen(unknown));
+    }
+    off += PROTO_LEN_SIZE + frame_len;
+  }
+  return off;
+}
+
+// 修改昵称：先在昵称索引中原子地占用新昵称，重名时拒绝
+void change_name(ClientInfo *c, const char *name, size_t len) {
+  char message[BUFFER_SIZE + 64];
+  char old_name[32];
+  char new_name[32];
+  if (len > sizeof(new_name) - 1) {
+    len = sizeof(new_name) - 1;
+  }
+  memcpy(new_name, name, len);
+  new_name[len] = '\0';
+
+  if (new_name[0] == '\0') {
+    const char *empty_name = "[系统] 昵称不能为空\n";
+    client_send(c, empty_name, strlen(empty_name));
+  } else if ((node_id != 0 && nick_lookup(&remote_names, new_name) != 0) ||
+             nick_rename(&nicknames, c->name, new_name, c->id) < 0) {
+    snprintf(message, sizeof(message), "[系统] 昵称 '%s' 已被使用\n", new_name);
+    client_send(c, message, strlen(message));
+  } else {
+    memcpy(old_name, c->name, sizeof(old_name));
+    memcpy(c->name, new_name, sizeof(c->name));
+    encode_name_headers(c);
+    cluster_post(CLUSTER_PART, 0, old_name, NULL, NULL);
+    cluster_post(CLUSTER_JOIN, 0, c->name, NULL, NULL);
+
+    snprintf(message, sizeof(message), "[系统] %s 改名为 %s\n", old_name,
+             c->name);
+    broadcast_message(c->shard, c->room->room, message, NULL);
+    printf("[*] %s 改名为 %s\n", old_name, c->name);
+    offline_deliver(c);
+  }
+}
+
+// 换到另一个房间（不存在时创建），通知新旧房间的成员
+void change_room(ClientInfo *c, const char *name, size_t len) {
+  char message[BUFFER_SIZE + 64];
+  Room *old = c->room->room;
+
+  if (len == 0) {
+    const char *empty_name = "[系统] 房间名不能为空\n";
+    client_send(c, empty_name, strlen(empty_name));
+    return;
+  }
+  Room *r = room_get(name, len);
+  if (r == NULL) {
+    if (errno == ENOSPC) {
+      snprintf(message, sizeof(message),
+               "[系统] 房间数已达上限 (%d)，只能进入已有的房间\n", ROOM_MAX);
+      client_send(c, message, strlen(message));
+    } else {
+      remove_client(c);
+    }
+    return;
+  }
+  if (r == old) {
+    snprintf(message, sizeof(message), "[系统] 你已经在房间 %s 中\n", r->name);
+    client_send(c, message, strlen(message));
+    room_put(r);
+    return;
+  }
+
+  // 离开通知发出之前旧房间不能被回收
+  room_hold(old);
+  room_leave(c);
+  if (room_join(c, r) < 0) {
+    room_put(old);
+    room_put(r);
+    remove_client(c);
+    return;
+  }
+  // 私聊队列中的消息都早于新房间的广播
+  for (uint32_t i = 0; i < c->out_count; i++) {
+    c->out_q[(c->out_head + i) % c->out_cap].seq = 0;
+  }
+
+  snprintf(message, sizeof(message), "[系统] %s 离开了房间 %s\n", c->name,
+           old->name);
+  broadcast_message(c->shard, old, message, NULL);
+  snprintf(message, sizeof(message), "[系统] %s 进入了房间 %s\n", c->name,
+           r->name);
+  broadcast_message(c->shard, r, message, c);
+  snprintf(message, sizeof(message), "[系统] 你已进入房间 %s\n", r->name);
+  client_send(c, message, strlen(message));
+  history_replay_to(c);
+  printf("[*] %s 进入房间 %s\n", c->name, r->name);
+  room_put(old);
+  room_put(r);
+}
+
+// 处理一条文本协议的客户端消息（命令或聊天内容），len 为不含 '\0' 的长度
+void handle_message(ClientInfo *c, char *buffer, size_t len) {
+  if (strncmp(buffer, "/resume ", 8) == 0) {
+    resume_request(c, buffer + 8, len - 8);
+    return;
+  }
+  if (strncmp(buffer, "/xfer ", 6) == 0) {
+    transfer_request(c, buffer + 6, len - 6);
+    return;
+  }
+  client_announce(c); // 第一条输入不是恢复会话，立即发出加入通知
+
+  // 处理命令
+  if (strcmp(buffer, "/pong") == 0) {
+    c->pong = 1; // 心跳的回复，收到输入时已经重新计时
+  } else if (strncmp(buffer, "/quit", 5) == 0) {
+    remove_client(c);
+  } else if (strncmp(buffer, "/name ", 6) == 0) {
+    change_name(c, buffer + 6, len - 6);
+  } else if (strncmp(buffer, "/list", 5) == 0) {
+    // 显示在线用户
+    send_user_list(c);
+  } else if (strncmp(buffer, "/join ", 6) == 0) {
+    change_room(c, buffer + 6, len - 6);
+  } else if (strncmp(buffer, "/part", 5) == 0) {
+    change_room(c, lobby->name, strlen(lobby->name));
+  } else if (strncmp(buffer, "/stats", 6) == 0) {
+    send_stats(c);
+  } else if (strncmp(buffer, "/compress", 9) == 0) {
+    compress_request(c);
+  } else if (strncmp(buffer, "/send ", 6) == 0) {
+    transfer_offer(c, buffer + 6, len - 6);
+  } else if (strncmp(buffer, "/accept ", 8) == 0) {
+    transfer_reply(c, buffer + 8, 1);
+  } else if (strncmp(buffer, "/reject ", 8) == 0) {
+    transfer_reply(c, buffer + 8, 0);
+  } else if (strncmp(buffer, "/claim ", 7) == 0) {
+    claim_mailbox(c, buffer + 7, len - 7);
+  } else if (strncmp(buffer, "/msg ", 5) == 0) {
+    // 私聊功能: /msg <用户名> <消息>
+    char *cmd_content = buffer + 5;
+    char *space_pos = memchr(cmd_content, ' ', len - 5);
+
+    if (space_pos == NULL) {
+      const char *usage = "[系统] 用法: /msg <用户名> <消息>\n";
+      client_send(c, usage, strlen(usage));
+    } else {
+      // 提取消息内容
+      char *private_msg = space_pos + 1;
+      size_t msg_len = buffer + len - private_msg;
+
+      if (msg_len == 0) {
+        const char *empty_msg = "[系统] 消息内容不能为空\n";
+        client_send(c, empty_msg, strlen(empty_msg));
+      } else {
+        send_private_message(c, cmd_content, space_pos - cmd_content,
+                             private_msg, msg_len);
+      }
+    }
+  } else if (strncmp(buffer, "/msg", 4) == 0) {
+    // 用户输入了 /msg 但格式不对（如 /msg用户2）
+    const char *usage =
+        "[系统] 私聊格式错误！正确用法: /msg 用户名 消息内容\n"
+        "[系统] 注意: /msg 后面必须有空格\n"
+        "[系统] 示例: /msg 用户2 你好\n";
+    client_send(c, usage, strlen(usage));
+  } else {
+    // 广播普通消息
+    broadcast_chat(c, buffer, len);
+  }
+}
+
+// 私聊队列中第 i 条消息（从队首算起）
+static OutEntry *out_slot(ClientInfo *c, uint32_t i) {
+  return &c->out_q[(c->out_head + i) % c->out_cap];
+}
+
+// 私聊队列是否放不下一条长度为 len 的新消息
+static int out_queue_full(ClientInfo *c, size_t len) {
+  return c->out_count >= out_queue_limit ||
+         c->out_bytes + len > MAX_PENDING_OUTPUT;
+}
+
+// 丢弃私聊队列中最旧的一条消息（正在发送的消息已移到 partial，不受影响）
+static int out_drop_oldest(ClientInfo *c) {
+  if (c->out_count == 0) {
+    return -1;
+  }
+  OutEntry *e = out_slot(c, 0);
+  c->out_bytes -= msgbuf_mem(e->buf);
+  msgbuf_put(e->buf);
+  c->out_head = (c->out_head + 1) % c->out_cap;
+  c->out_count--;
+  return 0;
+}
+
+// 追加到私聊队列尾部（持有一个引用），记录当时的广播环位置以保持先后顺序；
+// 容量不足时按倍数扩容（不超过 out_queue_limit）
+static int out_push(ClientInfo *c, MsgBuf *b) {
+  if (c->out_count == c->out_cap) {
+    uint32_t new_cap = c->out_cap ? c->out_cap * 2 : OUT_QUEUE_INIT;
+    if (new_cap > out_queue_limit) {
+      new_cap = out_queue_limit;
+    }
+    OutEntry *grown = malloc(sizeof(OutEntry) * new_cap);
+    if (grown == NULL) {
+      return -1;
+    }
+    for (uint32_t i = 0; i < c->out_count; i++) {
+      grown[i] = *out_slot(c, i);
+    }
+    free(c->out_q);
+    c->out_q = grown;
+    c->out_cap = new_cap;
+    c->out_head = 0;
+  }
+
+  OutEntry *e = out_slot(c, c->out_count);
+  e->buf = msgbuf_get(b);
+  e->seq = c->room->ring_head;
+  c->out_count++;
+  c->out_bytes += msgbuf_mem(b);
+  return 0;
+}
+
+// 弹出私聊队首，返回它持有的引用
+static MsgBuf *out_pop(ClientInfo *c) {
+  MsgBuf *b = out_slot(c, 0)->buf;
+  c->out_bytes -= msgbuf_mem(b);
+  c->out_head = (c->out_head + 1) % c->out_cap;
+  c->out_count--;
+  return b;
+}
+
+// 发送只给一个客户端的消息（欢迎语、命令回复等），二进制客户端收到 OP_SYSTEM 帧
+void client_send(ClientInfo *c, const char *data, size_t len) {
+  if (!c->active || len == 0) {
+    return;
+  }
+  MsgBuf *b = c->binary ? msgbuf_system(data, len) : msgbuf_new(data, len);
+  if (b == NULL) {
+    remove_client(c);
+    return;
+  }
+  client_send_buf(c, b);
+  msgbuf_put(b);
+}
+
+// 加入分片的待发送链表
+static void flush_list_add(Shard *s, ClientInfo *c) {
+  c->next_flush = s->flush_list;
+  if (s->flush_list != NULL) {
+    s->flush_list->flush_pprev = &c->next_flush;
+  }
+  s->flush_list = c;
+  c->flush_pprev = &s->flush_list;
+}
+
+// 从待发送链表中摘除（客户端关闭时可能还在链表中）
+static void flush_list_remove(ClientInfo *c) {
+  if (c->flush_pprev == NULL) {
+    return;
+  }
+  *c->flush_pprev = c->next_flush;
+  if (c->next_flush != NULL) {
+    c->next_flush->flush_pprev = c->flush_pprev;
+  }
+  c->flush_pprev = NULL;
+}
+
+// 把只发给这个客户端的共享消息放入私聊队列，由事件循环在本轮结束或可写时发送；
+// 队列满时按慢客户端策略处理，不影响其他客户端
+void client_send_buf(ClientInfo *c, MsgBuf *b) {
+  Shard *s = c->shard;
+  size_t len = msgbuf_mem(b);
+  if (!c->active || b->len == 0) {
+    return;
+  }
+  if (c->binary && !b->binary) {
+    // 其他分片发来的文本回复（用户列表、离线通知）转成 OP_SYSTEM 帧
+    if (b->seg == NULL) {
+      client_send(c, b->data, b->len);
+    }
+    return;
+  }
+
+  if (c->paused) {
+    c->dropped++;
+    s->slow.dropped++;
+    return;
+  }
+  if (out_queue_full(c, len)) {
+    switch (slow_policy) {
+    case SLOW_DISCONNECT:
+      // 积压超过上限说明对端长期不读，断开连接以免拖垮服务器内存
+      printf("[!] %s 接收过慢，断开连接\n", c->name);
+      s->slow.disconnects++;
+      remove_client(c);
+      return;
+    case SLOW_PAUSE:
+      c->paused = 1;
+      c->dropped++;
+      s->slow.pauses++;
+      s->slow.dropped++;
+      return;
+    case SLOW_DROP_OLDEST:
+      while (out_queue_full(c, len) && out_drop_oldest(c) == 0) {
+        c->dropped++;
+        s->slow.dropped++;
+      }
+      if (out_queue_full(c, len)) {
+        // 单条消息本身超过上限
+        c->dropped++;
+        s->slow.dropped++;
+        return;
+      }
+      break;
+    }
+  }
+
+  if (out_push(c, b) < 0) {
+    remove_client(c);
+    return;
+  }
+
+  // 已注册 EPOLLOUT 的客户端等可写事件，其余的在本轮事件处理结束时统一发送
+  if (!c->want_write && c->flush_pprev == NULL) {
+    flush_list_add(s, c);
+  }
+}
+
+// 检查客户端是否落后于房间的广播环：序号差超过环大小说明未读的广播已被覆盖，按策略处理。
+// 返回 -1 表示客户端已被断开
+static int ring_check_gap(ClientInfo *c) {
+  Shard *s = c->shard;
+  uint64_t cap = c->room->ring_mask + 1;
+  uint64_t lag = c->room->ring_head - c->cursor;
+  if (lag <= cap) {
+    return 0;
+  }
+
+  uint64_t skipped;
+  switch (slow_policy) {
+  case SLOW_DISCONNECT:
+    printf("[!] %s 接收过慢，断开连接\n", c->name);
+    s->slow.disconnects++;
+    remove_client(c);
+    return -1;
+  case SLOW_DROP_OLDEST:
+    // 从环中仍保留的最旧消息继续
+    skipped = lag - cap;
+    break;
+  case SLOW_PAUSE:
+  default:
+    // 跳过积压的全部广播，从最新消息继续
+    skipped = lag;
+    s->slow.pauses++;
+    break;
+  }
+  c->cursor += skipped;
+  c->dropped += (uint32_t)skipped;
+  s->slow.dropped += skipped;
+  return 0;
+}
+
+// 队列降到一半以下：恢复投递，并告诉客户端错过了多少条消息
+static void notify_dropped(ClientInfo *c) {
+  if (c->dropped == 0 || c->out_count > out_queue_limit / 2) {
+    return;
+  }
+  char notice[128];
+  int len = snprintf(notice, sizeof(notice),
+                     "[系统] 接收过慢，错过了 %u 条消息\n", c->dropped);
+  MsgBuf *b = c->binary ? msgbuf_system(notice, len) : msgbuf_new(notice, len);
+  c->paused = 0;
+  c->dropped = 0;
+  if (b != NULL) {
+    out_push(c, b);
+    msgbuf_put(b);
+  }
+}
+
+// 还有待发送的数据时注册 EPOLLOUT，发完后取消
+static void update_want_write(ClientInfo *c) {
+  int want_write = c->partial != NULL || c->out_count > 0 ||
+                   c->cursor < c->room->ring_head;
+  if (want_write != c->want_write) {
+    struct epoll_event ev;
+    ev.events = EPOLLIN | EPOLLRDHUP | (want_write ? EPOLLOUT : 0);
+    ev.data.ptr = c;
+    epoll_ctl(c->shard->epoll_fd, EPOLL_CTL_MOD, c->sockfd, &ev);
+    c->want_write = want_write;
+  }
+}
+
+// 本分片的 deflate 状态，第一次使用时初始化
+static z_stream *zip_deflater(Shard *s) {
+  if (!s->zip_ready) {
+    if (zip_deflate_init(&s->zip) < 0) {
+      return NULL;
+    }
+    s->zip_ready = 1;
+  }
+  return &s->zip;
+}
+
+// 把一批原始消息压缩成一帧
+static MsgBuf *zip_encode(Shard *s, const char *raw, size_t len, int binary) {
+  z_stream *z = zip_deflater(s);
+  MsgBuf *f = z != NULL ? msgbuf_alloc(zip_bound(len), binary) : NULL;
+  if (f == NULL) {
+    return NULL;
+  }
+  uint64_t since = monotonic_ns();
+  STATS_START(start);
+  f->len = zip_frame(z, raw, len, f->data);
+  STATS_END(STAT_COMPRESS, start);
+  s->zip_ns += monotonic_ns() - since;
+  s->zip_frames++;
+  s->zip_in += len;
+  s->zip_out += f->len;
+  MsgBuf *shrunk = realloc(f, sizeof(MsgBuf) + f->len); // 帧可能在房间里缓存一段时间
+  return shrunk != NULL ? shrunk : f;
+}
+
+// 房间里 [start, end) 这批广播按协议 k 压缩成的帧（返回一个引用）。与房间最近压缩的
+// 一批相同时直接共享；到达环头的批留在房间里，游标相同的其他成员不再压缩
+static MsgBuf *room_zip_batch(Shard *s, RoomShard *rs, int k, uint64_t start,
+                              uint64_t end) {
+  if (rs->zip_batch[k] != NULL && rs->zip_start[k] == start &&
+      rs->zip_end[k] == end) {
+    s->zip_shared++;
+    return msgbuf_get(rs->zip_batch[k]);
+  }
+  ClusterBuf *raw = &s->zip_raw;
+  raw->len = 0;
+  for (uint64_t seq = start; seq < end; seq++) {
+    const MsgBuf *b = rs->ring[seq & rs->ring_mask].buf[k];
+    if (msgbuf_append(raw, b, 0, b->len) < 0) {
+      return NULL;
+    }
+  }
+  MsgBuf *f = zip_encode(s, raw->data, raw->len, k);
+  if (f != NULL && end == rs->ring_head) {
+    if (rs->zip_batch[k] != NULL) {
+      msgbuf_put(rs->zip_batch[k]);
+    }
+    rs->zip_batch[k] = msgbuf_get(f);
+    rs->zip_start[k] = start;
+    rs->zip_end[k] = end;
+  }
+  return f;
+}
+
+// 取出客户端接下来的一批消息（原始数据不超过 ZIP_FRAME_MAX），压缩成一帧放入 partial。
+// 返回 1 表示有新的帧，0 表示没有待发送的消息，-1 表示客户端已被断开
+static int zip_next_frame(ClientInfo *c) {
+  Shard *s = c->shard;
+  RoomShard *rs = c->room;
+  int k = c->binary;
+  if (ring_check_gap(c) < 0) {
+    return -1;
+  }
+  while (c->cursor < rs->ring_head &&
+         rs->ring[c->cursor & rs->ring_mask].exclude_id == c->id) {
+    c->cursor++;
+  }
+
+  // 只有广播、其中也没有自己发出的：和同一房间游标相同的成员是同一批，共享一帧
+  if (c->out_count == 0 && c->cursor < rs->ring_head) {
+    uint64_t end = c->cursor;
+    size_t bytes = 0;
+    while (end < rs->ring_head) {
+      const RingSlot *slot = &rs->ring[end & rs->ring_mask];
+      if (slot->exclude_id == c->id ||
+          (bytes > 0 && bytes + slot->buf[k]->len > ZIP_FRAME_MAX)) {
+        break;
+      }
+      bytes += slot->buf[k]->len;
+      end++;
+    }
+    if (end == rs->ring_head ||
+        rs->ring[end & rs->ring_mask].exclude_id != c->id) {
+      c->partial = room_zip_batch(s, rs, k, c->cursor, end);
+      if (c->partial == NULL) {
+        remove_client(c);
+        return -1;
+      }
+      c->partial_off = 0;
+      s->delivered += end - c->cursor;
+      c->cursor = end;
+      return 1;
+    }
+  }
+
+  // 其余情况和 flush_client_io 一样按序号合并私聊队列和广播环，为这个客户端单独压缩
+  ClusterBuf *raw = &s->zip_raw;
+  unsigned long count = 0;
+  raw->len = 0;
+  for (;;) {
+    while (c->cursor < rs->ring_head &&
+           rs->ring[c->cursor & rs->ring_mask].exclude_id == c->id) {
+      c->cursor++;
+    }
+    int has_private = c->out_count > 0;
+    int has_bcast = c->cursor < rs->ring_head;
+    if (!has_private && !has_bcast) {
+      break;
+    }
+    int queued =
+        has_private && (!has_bcast || out_slot(c, 0)->seq <= c->cursor);
+    MsgBuf *b = queued ? out_slot(c, 0)->buf
+                        : rs->ring[c->cursor & rs->ring_mask].buf[k];
+    size_t off = queued ? c->zip_off : 0;
+    size_t len = b->len - off;
+    if (raw->len > 0 && raw->len + len > ZIP_FRAME_MAX) {
+      break;
+    }
+    if (len > ZIP_FRAME_MAX) {
+      len = ZIP_FRAME_MAX; // 超长的聊天记录回放分几帧发送
+    }
+    if (msgbuf_append(raw, b, off, len) < 0) {
+      remove_client(c);
+      return -1;
+    }
+    if (!queued) {
+      c->cursor++;
+      count++;
+      continue;
+    }
+    c->zip_off += len;
+    if (c->zip_off < b->len) {
+      break;
+    }
+    msgbuf_put(out_pop(c));
+    c->zip_off = 0;
+    count++;
+  }
+  if (raw->len == 0) {
+    return 0;
+  }
+  c->partial = zip_encode(s, raw->data, raw->len, k);
+  if (c->partial == NULL) {
+    remove_client(c);
+    return -1;
+  }
+  c->partial_off = 0;
+  s->delivered += count;
+  return 1;
+}
+
+// 发送 partial 的剩余部分（引用段文件的用 sendfile）。返回 1 表示已发完，
+// 0 表示发送缓冲区已满，-1 表示连接已断开
+static int send_partial(ClientInfo *c) {
+  Shard *s = c->shard;
+  MsgBuf *b = c->partial;
+  while (c->partial_off < b->len) {
+    size_t left = b->len - c->partial_off;
+    ssize_t n;
+    if (b->seg != NULL) {
+      off_t off = b->file_off + (off_t)c->partial_off;
+      n = sendfile(c->sockfd, b->seg->fd, &off, left);
+    } else {
+      n = write(c->sockfd, b->data + c->partial_off, left);
+    }
+    s->write_calls++;
+    if (n < 0) {
+      if (errno == EINTR) {
+        continue;
+      }
+      if (errno == EAGAIN || errno == EWOULDBLOCK) {
+        return 0;
+      }
+      client_lost(c);
+      return -1;
+    }
+    c->partial_off += (size_t)n;
+  }
+  msgbuf_put(b);
+  c->partial = NULL;
+  c->partial_off = 0;
+  return 1;
+}
+
+// 启用压缩的客户端：先发完请求压缩之前已经开始发送的消息和压缩确认，之后每次取出
+// 一批消息压缩成一帧放入 partial 再发送，发送缓冲区满时剩下的留到可写时继续
+static void flush_client_zip(ClientInfo *c) {
+  for (;;) {
+    if (c->partial == NULL) {
+      if (c->compress == 1) {
+        c->partial = c->binary ? msgbuf_frame(OP_COMPRESS_ON, NULL, "", 0)
+                               : msgbuf_new(ZIP_ACK_TEXT, strlen(ZIP_ACK_TEXT));
+        c->partial_off = 0;
+        c->compress = 2;
+        if (c->partial == NULL) {
+          remove_client(c);
+          return;
+        }
+      } else {
+        int ret = zip_next_frame(c);
+        if (ret < 0) {
+          return;
+        }
+        if (ret == 0) {
+          break;
+        }
+      }
+    }
+    int ret = send_partial(c);
+    if (ret < 0) {
+      return;
+    }
+    if (ret == 0) {
+      break;
+    }
+    notify_dropped(c);
+  }
+  update_want_write(c);
+}
+
+// 发送客户端的待发送数据：按顺序合并所在房间的广播环（从游标开始）和私聊队列，
+// 每次用一个 writev 发出多条消息；发送缓冲区满时注册 EPOLLOUT，发完后取消
+static void flush_client_io(ClientInfo *c) {
+  Shard *s = c->shard;
+  RoomShard *rs = c->room;
+  if (c->detached) {
+    return; // 没有连接，消息留在环和私聊队列中等待恢复
+  }
+  if (c->compress) {
+    flush_client_zip(c);
+    return;
+  }
+  struct iovec iov[FLUSH_IOV_MAX];
+  // 每个 iovec 的来源：0 表示 partial，1 表示私聊队首，2 表示广播环中的序号
+  int src[FLUSH_IOV_MAX];
+  uint64_t src_seq[FLUSH_IOV_MAX];
+  MsgBuf *src_buf[FLUSH_IOV_MAX];
+
+  for (;;) {
+    if (ring_check_gap(c) < 0) {
+      return;
+    }
+
+    // 引用聊天记录文件的消息（历史回放）单独用 sendfile 发送，不与内存中的消息合并
+    int iovcnt = 0;
+    int use_sendfile = 0;
+    if (c->partial != NULL) {
+      use_sendfile = c->partial->seg != NULL;
+      iov[0].iov_base = use_sendfile ? NULL : c->partial->data + c->partial_off;
+      iov[0].iov_len = c->partial->len - c->partial_off;
+      src[0] = 0;
+      src_buf[0] = c->partial;
+      iovcnt = 1;
+    }
+
+    uint32_t pi = 0;
+    uint64_t seq = c->cursor;
+    while (iovcnt < FLUSH_IOV_MAX && !use_sendfile) {
+      // 跳过客户端自己发出的广播
+      while (seq < rs->ring_head &&
+             rs->ring[seq & rs->ring_mask].exclude_id == c->id) {
+        seq++;
+      }
+      int has_private = pi < c->out_count;
+      int has_bcast = seq < rs->ring_head;
+      if (!has_private && !has_bcast) {
+        break;
+      }
+      // 私聊消息排在入队时已写入环的广播之后
+      if (has_private && (!has_bcast || out_slot(c, pi)->seq <= seq)) {
+        if (out_slot(c, pi)->buf->seg != NULL) {
+          if (iovcnt > 0) {
+            break;
+          }
+          use_sendfile = 1;
+        }
+        src[iovcnt] = 1;
+        src_buf[iovcnt] = out_slot(c, pi)->buf;
+        pi++;
+      } else {
+        src[iovcnt] = 2;
+        src_seq[iovcnt] = seq;
+        src_buf[iovcnt] = rs->ring[seq & rs->ring_mask].buf[c->binary];
+        seq++;
+      }
+      iov[iovcnt].iov_base = src_buf[iovcnt]->data;
+      iov[iovcnt].iov_len = src_buf[iovcnt]->len;
+      iovcnt++;
+    }
+    if (iovcnt == 0) {
+      c->cursor = seq; // 剩下的都是自己发出的广播
+      break;
+    }
+
+    ssize_t n;
+    if (use_sendfile) {
+      MsgBuf *b = src_buf[0];
+      off_t off = b->file_off + (off_t)(b->len - iov[0].iov_len);
+      n = sendfile(c->sockfd, b->seg->fd, &off, iov[0].iov_len);
+    } else {
+      n = writev(c->sockfd, iov, iovcnt);
+    }
+    s->write_calls++;
+    if (n < 0) {
+      if (errno == EINTR) {
+        continue;
+      }
+      if (errno == EAGAIN || errno == EWOULDBLOCK) {
+        break;
+      }
+      client_lost(c);
+      return;
+    }
+
+    // 按 iovec 顺序推进私聊队列和游标；只发出一部分的消息转入 partial，
+    // 它持有引用，之后即使环中的槽位被覆盖也能继续发送
+    size_t sent = (size_t)n;
+    int k;
+    for (k = 0; k < iovcnt; k++) {
+      int whole = sent >= iov[k].iov_len;
+      size_t used = whole ? iov[k].iov_len : sent;
+      if (used == 0) {
+        break;
+      }
+      sent -= used;
+      if (src[k] == 0) {
+        if (whole) {
+          msgbuf_put(c->partial);
+          c->partial = NULL;
+          c->partial_off = 0;
+        } else {
+          c->partial_off += used;
+        }
+      } else {
+        MsgBuf *b = src[k] == 1 ? out_pop(c) : msgbuf_get(src_buf[k]);
+        if (src[k] == 2) {
+          c->cursor = src_seq[k] + 1;
+        }
+        if (whole) {
+          msgbuf_put(b);
+        } else {
+          c->partial = b;
+          c->partial_off = used;
+        }
+      }
+      if (!whole) {
+        break;
+      }
+      s->delivered++;
+    }
+    if (k < iovcnt) {
+      break; // 发送缓冲区已满
+    }
+    notify_dropped(c);
+  }
+  update_want_write(c);
+}
+
+void flush_client(ClientInfo *c) {
+  STATS_START(start);
+  flush_client_io(c);
+  STATS_END(STAT_FLUSH, start);
+}
+
+// 发送本轮有新数据的客户端：有新广播的房间遍历其在本分片的成员，
+// 再处理收到私聊消息的客户端；其他房间的成员不受影响
+void flush_pending_clients(Shard *s) {
+  while (s->dirty_rooms != NULL) {
+    RoomShard *rs = s->dirty_rooms;
+    s->dirty_rooms = rs->next_dirty;
+    rs->dirty = 0;
+    for (int i = 0; i < rs->member_count; i++) {
+      ClientInfo *c = rs->members[i];
+      if (c->active && !c->want_write) {
+        flush_list_remove(c);
+        flush_client(c);
+      }
+    }
+    if (rs->member_count == 0) {
+      room_release(s, rs);
+    }
+  }
+  while (s->flush_list != NULL) {
+    ClientInfo *c = s->flush_list;
+    flush_list_remove(c);
+    if (c->active) {
+      flush_client(c);
+    }
+  }
+}
+
+// 释放私聊队列和正在发送的消息
+void free_out_queue(ClientInfo *c) {
+  while (c->out_count > 0) {
+    msgbuf_put(out_pop(c));
+  }
+  free(c->out_q);
+  c->out_q = NULL;
+  c->out_cap = 0;
+  c->zip_off = 0;
+  if (c->partial != NULL) {
+    msgbuf_put(c->partial);
+    c->partial = NULL;
+  }
+}
+
+// 房间广播环写满时，如果还有成员没读到将被覆盖的最旧消息，就把环扩大一倍
+// （不超过 ring_size），小房间和安静的房间只占用很小的环
+static void room_ring_reserve(RoomShard *rs) {
+  uint64_t cap = rs->ring_mask + 1;
+  if (rs->ring_head < cap || cap >= ring_size) {
+    return;
+  }
+  uint64_t oldest = rs->ring_head - cap;
+  int i;
+  for (i = 0; i < rs->member_count; i++) {
+    if (rs->members[i]->active && rs->members[i]->cursor <= oldest) {
+      break;
+    }
+  }
+  if (i == rs->member_count) {
+    return;
+  }
+  RingSlot *ring = calloc(cap * 2, sizeof(RingSlot));
+  if (ring == NULL) {
+    return; // 照常覆盖，落后的成员按慢客户端策略处理
+  }
+  for (uint64_t seq = oldest; seq < rs->ring_head; seq++) {
+    ring[seq & (cap * 2 - 1)] = rs->ring[seq & rs->ring_mask];
+  }
+  free(rs->ring);
+  rs->ring = ring;
+  rs->ring_mask = cap * 2 - 1;
+}
+
+// 发给房间在本分片的所有成员（除了 exclude_id）：消息只写入房间的广播环一次，
+// 各成员在可写时从自己的游标处读取，广播的内存开销与成员数无关
+void broadcast_local(Shard *s, uint32_t room_id, uint32_t gen, MsgBuf *text,
+                     MsgBuf *bin, uint64_t exclude_id) {
+  if (room_id >= s->room_cap || s->rooms[room_id] == NULL ||
+      s->rooms[room_id]->member_count == 0 ||
+      s->rooms[room_id]->room->gen != gen) {
+    return; // 本分片已经没有这个房间的成员，或 ID 已属于回收后新建的房间
+  }
+  RoomShard *rs = s->rooms[room_id];
+  room_ring_reserve(rs);
+  RingSlot *slot = &rs->ring[rs->ring_head & rs->ring_mask];
+  // 覆盖最旧的消息，落后的客户端在发送时检测到序号缺口
+  for (int k = 0; k < 2; k++) {
+    if (slot->buf[k] != NULL) {
+      msgbuf_put(slot->buf[k]);
+    }
+  }
+  slot->buf[0] = msgbuf_get(text);
+  slot->buf[1] = msgbuf_get(bin);
+  slot->exclude_id = exclude_id;
+  rs->ring_head++;
+  if (!rs->dirty) {
+    rs->dirty = 1;
+    rs->next_dirty = s->dirty_rooms;
+    s->dirty_rooms = rs;
+  }
+}
+
+// 广播已编码好的文本和二进制两份消息到房间：只发给分片位图中有成员的分片，
+// 各分片并行地向自己的成员扇出，共享同一份内容，调用者保留自己的引用。
+// 组成集群时同一份内容也交给集群线程转发给其他节点
+void broadcast_bufs(Shard *s, Room *r, MsgBuf *text, MsgBuf *bin,
+                    uint64_t exclude_id) {
+  STATS_START(start);
+  broadcast_local(s, r->id, r->gen, text, bin, exclude_id);
+  cluster_post(CLUSTER_ROOM, 0, r->name, text, bin);
+  uint_fast64_t targets = atomic_load(&r->shards) & ~((uint_fast64_t)1 << s->index);
+  while (targets != 0) {
+    int i = __builtin_ctzll(targets);
+    targets &= targets - 1;
+    XMsg *m = calloc(1, sizeof(XMsg));
+    if (m == NULL) {
+      continue;
+    }
+    m->type = XMSG_BROADCAST;
+    m->client_id = exclude_id;
+    m->room = r->id;
+    m->room_gen = r->gen;
+    m->buf = msgbuf_get(text);
+    m->bin = msgbuf_get(bin);
+    shard_post(s, i, m);
+  }
+  STATS_END(STAT_FANOUT, start);
+}
+
+// 广播系统消息给房间的所有成员（除了发送者），二进制客户端收到 OP_SYSTEM 帧
+void broadcast_message(Shard *s, Room *r, const char *message,
+                       ClientInfo *sender) {
+  size_t len = strlen(message);
+  MsgBuf *text = msgbuf_new(message, len);
+  MsgBuf *bin = msgbuf_system(message, len);
+  if (text != NULL && bin != NULL) {
+    broadcast_bufs(s, r, text, bin, sender ? sender->id : 0);
+  }
+  if (text != NULL) {
+    msgbuf_put(text);
+  }
+  if (bin != NULL) {
+    msgbuf_put(bin);
+  }
+}
+
+// 广播聊天消息（热路径）：拷贝发送者预编码的消息头和内容，不再格式化或计算长度
+void broadcast_chat(ClientInfo *sender, const char *text, size_t len) {
+  MsgBuf *t = msgbuf_alloc(sender->text_hdr_len + len + 1, 0);
+  MsgBuf *b = msgbuf_frame(OP_CHAT_FROM, sender, text, len);
+  if (t != NULL && b != NULL) {
+    memcpy(t->data, sender->text_hdr, sender->text_hdr_len);
+    memcpy(t->data + sender->text_hdr_len, text, len);
+    t->data[t->len - 1] = '\n';
+    broadcast_bufs(sender->shard, sender->room->room, t, b, sender->id);
+    if (sender->room->room->history != NULL) {
+      history_post(sender->room->room, t);
+    }
+    printf("[消息] %s: %.*s\n", sender->name, (int)len, text);
+  }
+  if (t != NULL) {
+    msgbuf_put(t);
+  }
+  if (b != NULL) {
+    msgbuf_put(b);
+  }
+}
+
+// 发送私聊消息给指定用户：通过昵称索引 O(1) 找到目标，目标在其他分片时投递过去。
+// 文本和二进制两种编码都带上，由目标所在分片按对方协议选择
+void send_private_message(ClientInfo *sender, const char *target_name,
+                          size_t target_len, const char *text, size_t len) {
+  Shard *s = sender->shard;
+  char name[32];
+  char message[BUFFER_SIZE + 64];
+
+  if (target_len > sizeof(name) - 1) {
+    target_len = sizeof(name) - 1;
+  }
+  memcpy(name, target_name, target_len);
+  name[target_len] = '\0';
+
+  uint64_t target_id = nick_lookup(&nicknames, name);
+  ClientInfo *target = client_lookup(s, target_id);
+  // 本节点没有这个用户时查其他节点的在线用户目录
+  int node = target_id == 0 && node_id != 0
+                 ? (int)nick_lookup(&remote_names, name)
+                 : 0;
+  if (target == NULL && node == 0 &&
+      (target_id == 0 || CLIENT_ID_SHARD(target_id) == s->index)) {
+    if (offline_store == NULL) {
+      snprintf(message, sizeof(message), "[系统] 用户 '%s' 不在线或不存在\n",
+               name);
+    } else {
+      // 保存为离线私聊：只做一次 memcpy，由落盘线程成组刷盘
+      char key[NICK_MAX_LEN];
+      nick_key(&nicknames, name, key);
+      // 没有认领信箱的昵称不保存（可能从未存在过，也无法确认登录者就是收件人）
+      int ret = offline_put(offline_store, key, sender->name, text, len,
+                            time(NULL));
+      snprintf(message, sizeof(message),
+               ret == 0    ? "[系统] 用户 '%s' 不在线，消息已保存，对方登录后送达\n"
+               : ret == -1 ? "[系统] 用户 '%s' 的离线消息已满，消息未保存\n"
+               : ret == -3 ? "[系统] 用户 '%s' 不在线或不存在\n"
+                           : "[系统] 离线消息存储已满，发给 '%s' 的消息未保存\n",
+               name);
+      if (ret == 0) {
+        printf("[离线] %s -> %s: %.*s\n", sender->name, name, (int)len, text);
+      }
+    }
+    client_send(sender, message, strlen(message));
+    return;
+  }
+
+  int n = snprintf(message, sizeof(message), "[私聊][%s -> 你]: %.*s\n",
+                   sender->name, (int)len, text);
+  MsgBuf *t = msgbuf_new(message, (size_t)n);
+  MsgBuf *b = msgbuf_frame(OP_PRIVATE_FROM, sender, text, len);
+  if (t == NULL || b == NULL) {
+    if (t != NULL) {
+      msgbuf_put(t);
+    }
+    if (b != NULL) {
+      msgbuf_put(b);
+    }
+    return;
+  }
+
+  if (target != NULL) {
+    client_send_buf(target, target->binary ? b : t);
+    msgbuf_put(t);
+    msgbuf_put(b);
+  } else if (node != 0) {
+    cluster_post(CLUSTER_PRIVATE, node, name, t, b);
+    msgbuf_put(t);
+    msgbuf_put(b);
+  } else {
+    XMsg *m = calloc(1, sizeof(XMsg));
+    if (m == NULL) {
+      msgbuf_put(t);
+      msgbuf_put(b);
+      return;
+    }
+    m->type = XMSG_PRIVATE;
+    m->client_id = target_id;
+    m->sender_id = sender->id;
+    m->buf = t;
+    m->bin = b;
+    shard_post(s, CLIENT_ID_SHARD(target_id), m);
+  }
+
+  // 给发送者确认（只对文本客户端，程序化客户端不需要回显）
+  if (!sender->binary) {
+    n = snprintf(message, sizeof(message), "[私聊][你 -> %s]: %.*s\n", name,
+                 (int)len, text);
+    client_send(sender, message, (size_t)n);
+  }
+  printf("[私聊] %s -> %s: %.*s\n", sender->name, name, (int)len, text);
+}
+
+// 其他节点的在线用户列表，攒满一块发送一次
+typedef struct RemoteList {
+  ClientInfo *c;
+  size_t len;
+  char buf[LIST_CHUNK_SIZE];
+} RemoteList;
+
+static void remote_list_one(void *arg, const char *key, uint64_t id) {
+  RemoteList *l = arg;
+  if (l->len + NICK_MAX_LEN + 32 > sizeof(l->buf)) {
+    client_send(l->c, l->buf, l->len);
+    l->len = 0;
+  }
+  l->len += snprintf(l->buf + l->len, sizeof(l->buf) - l->len,
+                     "  - %s (节点 %d)\n", key, (int)id);
+}
+
+// 在线用户列表：本分片的用户立即发送，其他分片各自把自己的用户发回来，
+// 组成集群时再附上其他节点的用户（来自本节点复制的目录）
+void send_user_list(ClientInfo *c) {
+  Shard *s = c->shard;
+  char list_msg[BUFFER_SIZE] = "[在线用户列表]\n";
+  for (int i = 0; i < s->client_count; i++) {
+    if (s->clients[i]->active) {
+      char user_info[64];
+      snprintf(user_info, sizeof(user_info), "  - %s%s\n", s->clients[i]->name,
+               (s->clients[i] == c)         ? " (你)"
+               : s->clients[i]->detached ? " (断线)"
+                                         : "");
+      strncat(list_msg, user_info, sizeof(list_msg) - strlen(list_msg) - 1);
+    }
+  }
+  client_send(c, list_msg, strlen(list_msg));
+
+  for (int i = 0; i < shard_count; i++) {
+    if (i == s->index) {
+      continue;
+    }
+    XMsg *m = calloc(1, sizeof(XMsg));
+    if (m == NULL) {
+      continue;
+    }
+    m->type = XMSG_LIST;
+    m->client_id = c->id;
+    shard_post(s, i, m);
+  }
+
+  if (node_id != 0) {
+    RemoteList *l = malloc(sizeof(RemoteList));
+    if (l == NULL) {
+      return;
+    }
+    l->c = c;
+    l->len = 0;
+    nick_each(&remote_names, remote_list_one, l);
+    if (l->len > 0) {
+      client_send(c, l->buf, l->len);
+    }
+    free(l);
+  }
+}
+
+// 服务器内部计时（管理命令，只接受本机连接）：汇总所有线程的阶段和段锁直方图，单位纳秒
+void send_stats(ClientInfo *c) {
+  if ((ntohl(c->addr.sin_addr.s_addr) >> 24) != 127) {
+    const char *denied = "[系统] /stats 只能从本机连接使用\n";
+    client_send(c, denied, strlen(denied));
+    return;
+  }
+#if CHAT_STATS
+  static const char *const names[STAT_COUNT] = {
+      "接收 recv", "解析分派", "扇出入队", "写套接字", "压缩成帧",
+      "索引锁等待", "索引锁持有"};
+  ThreadStats *total = malloc(sizeof(ThreadStats));
+  if (total == NULL) {
+    return;
+  }
+  stats_collect(total);
+  double scale = stats_ns_per_tick();
+  char buf[BUFFER_SIZE * 2];
+  size_t len = snprintf(
+      buf, sizeof(buf),
+      "[服务器统计] %d 个线程, 计时器 %s (1 单位 = %.3f 纳秒)\n"
+      "  项目 (纳秒)        次数     平均      p50      p99    p99.9       最大\n",
+      atomic_load(&stats_thread_count),
+#if defined(__x86_64__)
+      "rdtsc",
+#else
+      "CLOCK_MONOTONIC_RAW",
+#endif
+      scale);
+  for (int k = 0; k < STAT_COUNT && len < sizeof(buf); k++) {
+    const StatHist *h = &total->hist[k];
+    // 按显示宽度补齐项目名：UTF-8 的三字节汉字占两列
+    int width = 0;
+    for (const char *p = names[k]; *p != '\0'; p++) {
+      unsigned char ch = (unsigned char)*p;
+      width += (ch & 0xC0) == 0x80 ? 0 : (ch >= 0xE0 ? 2 : 1);
+    }
+    len += snprintf(buf + len, sizeof(buf) - len,
+                    "  %s%*s %10lu %8.0f %8.0f %8.0f %8.0f %10.0f\n", names[k],
+                    12 - width, "", (unsigned long)h->total,
+                    h->total ? (double)h->sum / h->total * scale : 0.0,
+                    stats_percentile(h, 50.0) * scale,
+                    stats_percentile(h, 99.0) * scale,
+                    stats_percentile(h, 99.9) * scale, h->max * scale);
+  }
+  if (len < sizeof(buf)) {
+    len += snprintf(buf + len, sizeof(buf) - len,
+                    "  索引锁争用 %lu 次 (占加锁次数 %.3f%%)\n",
+                    (unsigned long)total->lock_contended,
+                    total->hist[STAT_LOCK_WAIT].total
+                        ? 100.0 * total->lock_contended /
+                              total->hist[STAT_LOCK_WAIT].total
+                        : 0.0);
+  }
+  free(total);
+  client_send(c, buf, len < sizeof(buf) ? len : sizeof(buf) - 1);
+#else
+  const char *disabled = "[系统] 服务器编译时未启用统计 (make STATS=1)\n";
+  client_send(c, disabled, strlen(disabled));
+#endif
+}
+
+// 客户端请求压缩：之前开始发送的消息照常发完，再由 flush_client_zip 发出确认，
+// 确认之后的输出都是压缩帧
+void compress_request(ClientInfo *c) {
+  if (c->compress) {
+    const char *already = "[系统] 已经启用了压缩\n";
+    client_send(c, already, strlen(already));
+    return;
+  }
+  c->compress = 1;
+  if (!c->want_write && c->flush_pprev == NULL) {
+    flush_list_add(c->shard, c);
+  }
+}
+
+// 移除客户端：立即标记为不活跃，实际关闭推迟到本轮事件处理结束，
+// 避免在遍历 clients[] 广播时修改数组
+void remove_client(ClientInfo *c) {
+  if (!c->active) {
+    return;
+  }
+  c->active = 0;
+  if (c->sockfd >= 0) {
+    epoll_ctl(c->shard->epoll_fd, EPOLL_CTL_DEL, c->sockfd, NULL);
+  }
+  c->next_closing = c->shard->closing_list;
+  c->shard->closing_list = c;
+}
+
+// 连接意外断开（对端关闭、出错或写失败）。启用会话恢复时保留会话：昵称、房间成员身份、
+// 房间环游标和私聊队列都不变，广播照常写入环中，也不通知其他用户；
+// 超过 session_grace 秒没有恢复才真正移除。环被覆盖或私聊队列满时按慢客户端策略处理
+void client_lost(ClientInfo *c) {
+  Shard *s = c->shard;
+  if (session_grace == 0 || !c->announced || c->detached || !c->active) {
+    remove_client(c);
+    return;
+  }
+  epoll_ctl(s->epoll_fd, EPOLL_CTL_DEL, c->sockfd, NULL);
+  close(c->sockfd);
+  c->sockfd = -1;
+  c->detached = 1;
+  c->want_write = 0;
+  flush_list_remove(c);
+  // 发了一半的消息恢复后从头重发；没凑成一行的输入丢弃
+  c->partial_off = 0;
+  free(c->in_buf);
+  c->in_buf = NULL;
+  c->in_len = 0;
+  c->in_cap = 0;
+  c->in_discard = 0;
+  client_timer_add(&s->suspended, c, (uint64_t)session_grace * 1000);
+  printf("[~] %s 连接断开，保留会话 %d 秒\n", c->name, session_grace);
+}
+
+// 广播新连接的加入通知（只发一次）
+void client_announce(ClientInfo *c) {
+  char message[BUFFER_SIZE + 64];
+  if (c->announced) {
+    return;
+  }
+  c->announced = 1;
+  client_timer_cancel(c);
+  snprintf(message, sizeof(message), "[系统] %s 加入了聊天室\n", c->name);
+  broadcast_message(c->shard, c->room->room, message, c);
+}
+
+// 发送会话令牌（未启用会话恢复时不发送）
+void send_session_token(ClientInfo *c) {
+  char token[SESSION_TOKEN_LEN + 1];
+  char message[256];
+  if (session_grace == 0) {
+    return;
+  }
+  snprintf(token, sizeof(token), "%016llx%016llx", (unsigned long long)c->id,
+           (unsigned long long)c->secret);
+  if (c->binary) {
+    MsgBuf *b = msgbuf_frame(OP_SESSION, NULL, token, SESSION_TOKEN_LEN);
+    if (b != NULL) {
+      client_send_buf(c, b);
+      msgbuf_put(b);
+    }
+    return;
+  }
+  int len = snprintf(message, sizeof(message),
+                     "[系统] 会话令牌: %s（断线后 %d 秒内重连并立即发送 "
+                     "/resume <令牌> 可恢复会话）\n",
+                     token, session_grace);
+  client_send(c, message, len);
+}
+
+// 解析 16 位十六进制数，格式不对时返回 -1
+static int parse_hex64(const char *p, uint64_t *value) {
+  uint64_t v = 0;
+  for (int i = 0; i < 16; i++) {
+    char ch = p[i];
+    int d = ch >= '0' && ch <= '9'   ? ch - '0'
+            : ch >= 'a' && ch <= 'f' ? ch - 'a' + 10
+                                     : -1;
+    if (d < 0) {
+      return -1;
+    }
+    v = (v << 4) | (uint64_t)d;
+  }
+  *value = v;
+  return 0;
+}
+
+// 新连接请求恢复会话，只能作为连接后的第一条输入（加入通知发出之前）。
+// 令牌前半部分是会话的客户端 ID，指明会话所在的分片；把连接交给该分片校验令牌，
+// 结果回来之前这个临时身份不再收发数据
+void resume_request(ClientInfo *c, const char *token, size_t len) {
+  Shard *s = c->shard;
+  const char *error = NULL;
+  uint64_t id = 0, secret = 0;
+  XMsg *m = NULL;
+
+  if (session_grace == 0) {
+    error = "[系统] 服务器未启用会话恢复\n";
+  } else if (c->announced) {
+    error = "[系统] 只能在连接后立即恢复会话\n";
+  } else if (len != SESSION_TOKEN_LEN || parse_hex64(token, &id) < 0 ||
+             parse_hex64(token + 16, &secret) < 0 ||
+             CLIENT_ID_SHARD(id) >= shard_count) {
+    error = "[系统] 无效的会话令牌\n";
+  } else if ((m = calloc(1, sizeof(XMsg))) == NULL) {
+    error = "[系统] 恢复会话失败\n";
+  }
+  if (error != NULL) {
+    client_send(c, error, strlen(error));
+    client_announce(c);
+    return;
+  }
+
+  // 先把已排队的欢迎语（二进制客户端还有魔数回复）发出去，之后连接归恢复的会话所有
+  flush_client(c);
+  if (!c->active || c->detached) {
+    free(m);
+    return;
+  }
+  client_timer_cancel(c);
+  epoll_ctl(s->epoll_fd, EPOLL_CTL_DEL, c->sockfd, NULL);
+  flush_list_remove(c);
+  m->type = XMSG_RESUME;
+  m->client_id = id;
+  m->sender_id = c->id;
+  m->secret = secret;
+  m->fd = c->sockfd;
+  m->binary = c->binary;
+  m->addr = c->addr;
+  c->sockfd = -1;
+  c->detached = 1;
+  c->want_write = 0;
+  shard_post(s, CLIENT_ID_SHARD(id), m);
+}
+
+// 会话所在分片：校验令牌，把转交来的连接接到会话上（原连接还没发现断开时替换掉它），
+// 从断开时的游标继续发送房间广播，私聊队列照常发送。m 改为 XMSG_RESUME_DONE 发回，返回 1
+int session_resume(Shard *s, XMsg *m) {
+  ClientInfo *c = client_lookup(s, m->client_id);
+  int to = CLIENT_ID_SHARD(m->sender_id);
+  struct epoll_event ev;
+  m->type = XMSG_RESUME_DONE;
+  m->client_id = m->sender_id;
+
+  ev.events = EPOLLIN | EPOLLRDHUP;
+  ev.data.ptr = c;
+  if (c == NULL || !c->announced || c->secret != m->secret ||
+      epoll_ctl(s->epoll_fd, EPOLL_CTL_ADD, m->fd, &ev) < 0) {
+    shard_post(s, to, m); // 连接原样退回
+    return 1;
+  }
+  if (c->sockfd >= 0) {
+    epoll_ctl(s->epoll_fd, EPOLL_CTL_DEL, c->sockfd, NULL);
+    close(c->sockfd);
+  }
+  client_timer_cancel(c);
+  c->sockfd = m->fd;
+  c->addr = m->addr;
+  c->detached = 0;
+  c->heard = monotonic_ms();
+  c->pings = 0;
+  c->want_write = 0;
+  c->negotiated = 1;
+  free(c->in_buf);
+  c->in_buf = NULL;
+  c->in_len = 0;
+  c->in_cap = 0;
+  c->in_discard = 0;
+  m->fd = -1;
+  if (m->binary != c->binary) {
+    // 换了协议：按旧协议编码的私聊消息作废；广播环中两种编码都有，不受影响
+    free_out_queue(c);
+    c->binary = m->binary;
+  } else {
+    c->partial_off = 0;
+  }
+  // 错过的广播超出环的容量时从环中最旧的开始，并告诉客户端丢了多少
+  RoomShard *rs = c->room;
+  uint64_t cap = rs->ring_mask + 1;
+  if (rs->ring_head - c->cursor > cap) {
+    uint64_t skipped = rs->ring_head - c->cursor - cap;
+    c->cursor += skipped;
+    c->dropped += (uint32_t)skipped;
+    s->slow.dropped += skipped;
+  }
+
+  // 恢复结果直接写入新连接，排在补发的消息之前。已启用压缩时随后重新确认一次，
+  // 之后从头重发发了一半的压缩帧
+  char notice[BUFFER_SIZE];
+  char out[PROTO_HEADER_SIZE * 3 + NICK_MAX_LEN + BUFFER_SIZE];
+  size_t n = (size_t)snprintf(notice, sizeof(notice),
+                              "[系统] 会话已恢复，你的昵称是: %s，当前房间: %s\n",
+                              c->name, rs->room->name);
+  const char *data = notice;
+  if (c->binary) {
+    size_t name_len = strlen(c->name);
+    proto_put_header(out, OP_WELCOME, name_len);
+    memcpy(out + PROTO_HEADER_SIZE, c->name, name_len);
+    size_t off = PROTO_HEADER_SIZE + name_len;
+    proto_put_header(out + off, OP_SYSTEM, n - 1);
+    memcpy(out + off + PROTO_HEADER_SIZE, notice, n - 1);
+    n = off + PROTO_HEADER_SIZE + n - 1;
+    if (c->compress == 2) {
+      proto_put_header(out + n, OP_COMPRESS_ON, 0);
+      n += PROTO_HEADER_SIZE;
+    }
+    data = out;
+  } else if (c->compress == 2) {
+    n += (size_t)snprintf(notice + n, sizeof(notice) - n, "%s", ZIP_ACK_TEXT);
+  }
+  ssize_t ret = send(c->sockfd, data, n, MSG_NOSIGNAL | MSG_DONTWAIT);
+  (void)ret;
+  send_session_token(c); // 覆盖临时身份收到的令牌
+  if (c->flush_pprev == NULL) {
+    flush_list_add(s, c);
+  }
+  printf("[~] %s 恢复了会话: %s:%d\n", c->name, inet_ntoa(c->addr.sin_addr),
+         ntohs(c->addr.sin_port));
+  shard_post(s, to, m);
+  return 1;
+}
+
+// 新连接所在分片收到恢复结果：成功时悄悄释放临时身份（它的加入通知从未发出）；
+// 失败时连接退回，作为新用户继续
+void resume_done(Shard *s, XMsg *m) {
+  ClientInfo *c = client_lookup(s, m->client_id);
+  if (m->fd < 0) {
+    if (c != NULL) {
+      remove_client(c);
+    }
+    return;
+  }
+  if (c == NULL) {
+    return; // 临时身份已被移除，release_xmsg 关闭连接
+  }
+  struct epoll_event ev;
+  ev.events = EPOLLIN | EPOLLRDHUP;
+  ev.data.ptr = c;
+  if (epoll_ctl(s->epoll_fd, EPOLL_CTL_ADD, m->fd, &ev) < 0) {
+    remove_client(c);
+    return;
+  }
+  c->sockfd = m->fd;
+  c->detached = 0;
+  m->fd = -1;
+  const char *expired = "[系统] 会话已过期或令牌无效，以新身份加入\n";
+  client_send(c, expired, strlen(expired));
+  client_announce(c);
+}
+
+// 把一条系统通知发给任意分片上的客户端
+static void transfer_notify(Shard *s, uint64_t client_id, const char *text) {
+  MsgBuf *b = msgbuf_new(text, strlen(text));
+  if (b != NULL) {
+    post_deliver(s, client_id, b);
+  }
+}
+
+static Transfer *transfer_find(Shard *s, uint64_t id) {
+  for (Transfer *t = s->transfers; t != NULL; t = t->next) {
+    if (t->id == id && t->state != XFER_DONE) {
+      return t;
+    }
+  }
+  return NULL;
+}
+
+// 发起文件传输: /send <用户> <字节数> <文件名>（客户端读取文件后代为发送这一行）。
+// 只登记请求并通知接收方，数据在双方建立数据连接后才开始流动
+void transfer_offer(ClientInfo *c, char *args, size_t len) {
+  Shard *s = c->shard;
+  char message[BUFFER_SIZE];
+  char *end = args + len;
+  char *space = memchr(args, ' ', len);
+  char *size_end = NULL;
+  unsigned long long size = 0;
+  if (space != NULL) {
+    *space = '\0';
+    size = strtoull(space + 1, &size_end, 10);
+  }
+  const char *name = size_end != NULL && *size_end == ' ' ? size_end + 1 : NULL;
+  if (name == NULL || name == end || space == args || size == 0 ||
+      size > TRANSFER_MAX_SIZE || end - name >= TRANSFER_NAME_MAX ||
+      memchr(name, '/', end - name) != NULL) {
+    const char *usage = "[系统] 用法: /send <用户> <文件>\n";
+    client_send(c, usage, strlen(usage));
+    return;
+  }
+
+  uint64_t target_id = nick_lookup(&nicknames, args);
+  if (target_id == 0) {
+    snprintf(message, sizeof(message), "[系统] 用户 '%.31s' 不在线或不存在\n", args);
+    client_send(c, message, strlen(message));
+    return;
+  }
+  if (target_id == c->id) {
+    const char *self = "[系统] 不能给自己发送文件\n";
+    client_send(c, self, strlen(self));
+    return;
+  }
+  int active = 0;
+  for (Transfer *t = s->transfers; t != NULL; t = t->next) {
+    active += t->sender_id == c->id && t->state != XFER_DONE;
+  }
+  Transfer *t = active < TRANSFER_PER_USER ? calloc(1, sizeof(Transfer)) : NULL;
+  if (t == NULL) {
+    const char *busy = "[系统] 进行中的传输过多，请稍后再试\n";
+    client_send(c, busy, strlen(busy));
+    return;
+  }
+  // 传输令牌可预测时别人就能冒充任一端接入，取不到随机数时不登记
+  if (getrandom(t->secret, sizeof(t->secret), 0) != sizeof(t->secret)) {
+    const char *fail = "[系统] 发起传输失败，请稍后再试\n";
+    client_send(c, fail, strlen(fail));
+    free(t);
+    return;
+  }
+  t->id = TRANSFER_ID(s->index, ++s->transfer_seq);
+  t->state = XFER_OFFERED;
+  t->sender_id = c->id;
+  t->recipient_id = target_id;
+  t->fd[0] = t->fd[1] = t->pipe[0] = t->pipe[1] = -1;
+  t->size = size;
+  t->deadline = monotonic_ms() + TRANSFER_OFFER_MS;
+  memcpy(t->name, name, end - name);
+  snprintf(t->sender_name, sizeof(t->sender_name), "%s", c->name);
+  snprintf(t->recipient_name, sizeof(t->recipient_name), "%s", args);
+  t->next = s->transfers;
+  s->transfers = t;
+
+  snprintf(message, sizeof(message),
+           "[文件] %s 想发送 %s (%llu 字节)，输入 /accept %llu 接收，"
+           "/reject %llu 拒绝\n",
+           c->name, t->name, size, (unsigned long long)t->id,
+           (unsigned long long)t->id);
+  transfer_notify(s, target_id, message);
+  snprintf(message, sizeof(message),
+           "[文件] 已向 %s 发出传输请求 #%llu，等待对方接收\n", t->recipient_name,
+           (unsigned long long)t->id);
+  client_send(c, message, strlen(message));
+  printf("[文件] #%llu %s -> %s: %s (%llu 字节)\n", (unsigned long long)t->id,
+         c->name, t->recipient_name, t->name, size);
+}
+
+// 接收方回复 /accept 或 /reject，转给传输所在的分片处理
+void transfer_reply(ClientInfo *c, const char *arg, int accept) {
+  char *end;
+  unsigned long long id = strtoull(arg, &end, 10);
+  XMsg *m = NULL;
+  if (end == arg || *end != '\0' || TRANSFER_ID_SHARD(id) >= shard_count ||
+      (m = calloc(1, sizeof(XMsg))) == NULL) {
+    const char *usage = "[系统] 用法: /accept <编号> 或 /reject <编号>\n";
+    client_send(c, usage, strlen(usage));
+    return;
+  }
+  m->type = accept ? XMSG_XFER_ACCEPT : XMSG_XFER_REJECT;
+  m->client_id = id;
+  m->sender_id = c->id;
+  m->fd = -1;
+  shard_post(c->shard, TRANSFER_ID_SHARD(id), m);
+}
+
+// 传输所在分片：接收方同意后给双方各发一个数据连接的令牌
+void transfer_answer(Shard *s, XMsg *m) {
+  Transfer *t = transfer_find(s, m->client_id);
+  char message[BUFFER_SIZE];
+  if (t == NULL || t->state != XFER_OFFERED || t->recipient_id != m->sender_id) {
+    snprintf(message, sizeof(message), "[系统] 没有等待你接收的传输 #%llu\n",
+             (unsigned long long)m->client_id);
+    transfer_notify(s, m->sender_id, message);
+    return;
+  }
+  if (m->type == XMSG_XFER_REJECT) {
+    transfer_finish(s, t, "对方拒绝");
+    return;
+  }
+  t->state = XFER_ACCEPTED;
+  t->deadline = monotonic_ms() + TRANSFER_IDLE_MS;
+  // 令牌：16 位十六进制传输编号 + 16 位十六进制随机数，数据连接发送 /xfer <令牌>
+  for (int end = 0; end < 2; end++) {
+    snprintf(message, sizeof(message),
+             "[文件] 传输令牌: %016llx%016llx %s #%llu %llu %s\n",
+             (unsigned long long)t->id, (unsigned long long)t->secret[end],
+             end == 0 ? "发送" : "接收", (unsigned long long)t->id,
+             (unsigned long long)t->size, t->name);
+    transfer_notify(s, end == 0 ? t->sender_id : t->recipient_id, message);
+  }
+}
+
+// 新连接声明自己是某个传输的数据连接：连接转交给传输所在的分片，这个临时身份悄悄移除。
+// 之后连接上只有文件数据，连接前排队的欢迎语等由客户端丢弃（以“开始传输”一行为界）
+void transfer_request(ClientInfo *c, const char *token, size_t len) {
+  Shard *s = c->shard;
+  uint64_t id = 0, secret = 0;
+  XMsg *m = NULL;
+  if (len != SESSION_TOKEN_LEN || parse_hex64(token, &id) < 0 ||
+      parse_hex64(token + 16, &secret) < 0 ||
+      TRANSFER_ID_SHARD(id) >= shard_count ||
+      (m = calloc(1, sizeof(XMsg))) == NULL) {
+    const char *error = "[系统] 无效的传输令牌\n";
+    client_send(c, error, strlen(error));
+    client_announce(c);
+    return;
+  }
+  client_timer_cancel(c);
+  epoll_ctl(s->epoll_fd, EPOLL_CTL_DEL, c->sockfd, NULL);
+  flush_list_remove(c);
+  m->type = XMSG_XFER_ATTACH;
+  m->client_id = id;
+  m->secret = secret;
+  m->fd = c->sockfd;
+  c->sockfd = -1;
+  c->want_write = 0;
+  remove_client(c);
+  shard_post(s, TRANSFER_ID_SHARD(id), m);
+}
+
+// 修改数据连接在 epoll 中关注的事件；不需要的一端从 epoll 删除，
+// 避免对端已关闭（EPOLLHUP 总会报告）时空转
+static int transfer_watch(Shard *s, Transfer *t, int end, uint32_t events) {
+  if (t->events[end] == events) {
+    return 0;
+  }
+  struct epoll_event ev;
+  ev.events = events;
+  ev.data.u64 = (uintptr_t)t | TRANSFER_TAG | ((uintptr_t)end << 1);
+  int op = t->events[end] == 0 ? EPOLL_CTL_ADD
+           : events == 0       ? EPOLL_CTL_DEL
+                               : EPOLL_CTL_MOD;
+  t->events[end] = events;
+  return epoll_ctl(s->epoll_fd, op, t->fd[end], &ev);
+}
+
+// 数据连接转交过来：令牌对上时接到传输的一端，两端都到齐就开始搬运
+void transfer_attach(Shard *s, XMsg *m) {
+  Transfer *t = transfer_find(s, m->client_id);
+  if (t == NULL || t->state != XFER_ACCEPTED) {
+    return; // release_xmsg 关闭连接
+  }
+  for (int end = 0; end < 2; end++) {
+    if (t->secret[end] == m->secret && t->fd[end] < 0) {
+      t->fd[end] = m->fd;
+      m->fd = -1;
+      break;
+    }
+  }
+  if (t->fd[0] < 0 || t->fd[1] < 0) {
+    return;
+  }
+
+  if (pipe2(t->pipe, O_NONBLOCK | O_CLOEXEC) < 0) {
+    t->pipe[0] = t->pipe[1] = -1;
+    transfer_finish(s, t, "创建管道失败");
+    return;
+  }
+  // 管道越大每次 splice 搬得越多；超过系统上限时保持默认大小
+  fcntl(t->pipe[1], F_SETPIPE_SZ, TRANSFER_PIPE_SIZE);
+  int cap = fcntl(t->pipe[1], F_GETPIPE_SZ);
+  t->pipe_cap = cap > 0 ? (size_t)cap : 65536;
+  const char *go = "[文件] 开始传输\n";
+  for (int end = 0; end < 2; end++) {
+    ssize_t ret = send(t->fd[end], go, strlen(go), MSG_NOSIGNAL | MSG_DONTWAIT);
+    (void)ret;
+  }
+  t->state = XFER_RUNNING;
+  t->started = monotonic_ms();
+  t->deadline = t->started + TRANSFER_IDLE_MS;
+  if (transfer_watch(s, t, 0, EPOLLIN | EPOLLRDHUP) < 0) {
+    transfer_finish(s, t, "注册数据连接失败");
+    return;
+  }
+  printf("[文件] #%llu 开始传输 (管道 %zu 字节)\n", (unsigned long long)t->id,
+         t->pipe_cap);
+}
+
+// 数据连接可读/可写：发送方套接字 -> 管道 -> 接收方套接字，全程 splice。
+// 管道满时不再读发送方，管道空时不再等接收方可写，由 TCP 窗口把背压传回发送方；
+// 每次最多搬运 TRANSFER_BATCH 字节，同一分片上的聊天连接不会被大文件饿死
+void transfer_event(Shard *s, Transfer *t, int end, uint32_t events) {
+  if (t->state != XFER_RUNNING) {
+    return; // 本轮已结束
+  }
+  if (end == 1 && (events & (EPOLLERR | EPOLLHUP))) {
+    transfer_finish(s, t, "接收方断开");
+    return;
+  }
+
+  uint64_t moved = 0;
+  int progress = 0, in_blocked = 0;
+  while (moved < TRANSFER_BATCH) {
+    ssize_t in = -1, out = -1;
+    size_t piped = t->received - t->sent;
+    if (t->received < t->size && piped < t->pipe_cap) {
+      size_t want = t->pipe_cap - piped;
+      if (want > t->size - t->received) {
+        want = t->size - t->received;
+      }
+      in = splice(t->fd[0], NULL, t->pipe[1], NULL, want,
+                  SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+      if (in == 0) {
+        transfer_finish(s, t, "发送方提前断开");
+        return;
+      }
+      if (in < 0 && errno != EAGAIN) {
+        transfer_finish(s, t, "读取发送方失败");
+        return;
+      }
+      if (in > 0) {
+        t->received += (uint64_t)in;
+      }
+      // 管道里还有数据时 EAGAIN 也可能是管道的缓冲槽用完了，等接收方取走一些再读
+      in_blocked = in < 0 && piped > 0;
+    }
+    piped = t->received - t->sent;
+    if (piped > 0) {
+      out = splice(t->pipe[0], NULL, t->fd[1], NULL, piped,
+                   SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+      if (out < 0 && errno != EAGAIN) {
+        transfer_finish(s, t, "接收方断开");
+        return;
+      }
+      if (out > 0) {
+        t->sent += (uint64_t)out;
+        moved += (uint64_t)out;
+        in_blocked = 0;
+      }
+    }
+    if (in <= 0 && out <= 0) {
+      break;
+    }
+    progress = 1;
+  }
+
+  if (t->sent == t->size) {
+    transfer_finish(s, t, NULL);
+    return;
+  }
+  if (progress) {
+    t->deadline = monotonic_ms() + TRANSFER_IDLE_MS;
+  }
+  size_t piped = t->received - t->sent;
+  int want_in = t->received < t->size && piped < t->pipe_cap && !in_blocked;
+  if (transfer_watch(s, t, 0, want_in ? EPOLLIN | EPOLLRDHUP : 0) < 0 ||
+      transfer_watch(s, t, 1, piped > 0 ? EPOLLOUT : 0) < 0) {
+    transfer_finish(s, t, "注册数据连接失败");
+  }
+}
+
+// 结束传输（error 为空表示成功）：关闭数据连接和管道，把结果和吞吐量通知双方。
+// 传输对象本轮事件处理完后才释放，同一批事件中另一端的事件不会访问已释放的内存
+void transfer_finish(Shard *s, Transfer *t, const char *error) {
+  char message[BUFFER_SIZE];
+  for (int end = 0; end < 2; end++) {
+    if (t->fd[end] >= 0) {
+      close(t->fd[end]);
+      t->fd[end] = -1;
+    }
+    if (t->pipe[end] >= 0) {
+      close(t->pipe[end]);
+      t->pipe[end] = -1;
+    }
+  }
+  if (error == NULL) {
+    uint64_t ms = monotonic_ms() - t->started;
+    double seconds = ms > 0 ? ms / 1000.0 : 0.001;
+    snprintf(message, sizeof(message),
+             "[文件] #%llu %s 传输完成: %llu 字节，用时 %.3f 秒，%.2f MB/s\n",
+             (unsigned long long)t->id, t->name, (unsigned long long)t->size,
+             ms / 1000.0, t->size / seconds / (1024 * 1024));
+  } else {
+    snprintf(message, sizeof(message),
+             "[文件] #%llu %s 传输失败: %s（已传输 %llu/%llu 字节）\n",
+             (unsigned long long)t->id, t->name, error,
+             (unsigned long long)t->sent, (unsigned long long)t->size);
+  }
+  transfer_notify(s, t->sender_id, message);
+  if (t->state != XFER_OFFERED || error == NULL) {
+    transfer_notify(s, t->recipient_id, message);
+  }
+  printf("%s", message);
+  t->state = XFER_DONE;
+}
+
+// 释放已结束的传输，结束超时的传输。返回距离下一个到期时间的毫秒数，没有时返回 -1
+int expire_transfers(Shard *s) {
+  if (s->transfers == NULL) {
+    return -1;
+  }
+  uint64_t now = monotonic_ms();
+  uint64_t next = UINT64_MAX;
+  Transfer **pp = &s->transfers;
+  while (*pp != NULL) {
+    Transfer *t = *pp;
+    if (t->state != XFER_DONE && t->deadline <= now) {
+      transfer_finish(s, t,
+                      t->state == XFER_OFFERED    ? "对方没有回应"
+                      : t->state == XFER_ACCEPTED ? "数据连接没有建立"
+                                                  : "传输停滞");
+    }
+    if (t->state == XFER_DONE) {
+      *pp = t->next;
+      free(t);
+      continue;
+    }
+    if (t->deadline < next) {
+      next = t->deadline;
+    }
+    pp = &t->next;
+  }
+  return next == UINT64_MAX ? -1 : (int)(next - now);
+}
+
+// 处理到期的定时链表：推迟的加入通知发出，保留超时的会话移除。
+// 返回距离下一个到期时间的毫秒数，没有时返回 -1
+int expire_clients(Shard *s) {
+  ClientInfo *c;
+  if (s->announcing.head == NULL && s->suspended.head == NULL) {
+    return -1;
+  }
+  uint64_t now = monotonic_ms();
+  while ((c = s->announcing.head) != NULL && c->deadline <= now) {
+    client_announce(c);
+  }
+  while ((c = s->suspended.head) != NULL && c->deadline <= now) {
+    client_timer_cancel(c);
+    remove_client(c);
+  }
+
+  uint64_t next = UINT64_MAX;
+  if (s->announcing.head != NULL) {
+    next = s->announcing.head->deadline;
+  }
+  if (s->suspended.head != NULL && s->suspended.head->deadline < next) {
+    next = s->suspended.head->deadline;
+  }
+  return next == UINT64_MAX ? -1 : (int)(next - now);
+}
+
+// 设置内核保活和 TCP_USER_TIMEOUT：对端掉线时，空闲的连接由保活探测发现，
+// 发出的数据（包括心跳）超过 heartbeat_interval 秒没有被确认的连接直接报错，
+// 不必等内核默认的十几分钟重传
+static void heartbeat_tune(int fd) {
+  int on = 1;
+  int idle = heartbeat_interval;
+  int interval = heartbeat_interval / 3 > 0 ? heartbeat_interval / 3 : 1;
+  int count = HEARTBEAT_MISSES;
+  unsigned int user_timeout = (unsigned int)heartbeat_interval * 1000;
+  setsockopt(fd, SOL_SOCKET, SO_KEEPALIVE, &on, sizeof(on));
+  setsockopt(fd, IPPROTO_TCP, TCP_KEEPIDLE, &idle, sizeof(idle));
+  setsockopt(fd, IPPROTO_TCP, TCP_KEEPINTVL, &interval, sizeof(interval));
+  setsockopt(fd, IPPROTO_TCP, TCP_KEEPCNT, &count, sizeof(count));
+  setsockopt(fd, IPPROTO_TCP, TCP_USER_TIMEOUT, &user_timeout,
+             sizeof(user_timeout));
+}
+
+// 新连接（或从旧进程接过的连接）加入心跳时间轮，之后一直留在轮中直到关闭
+void heartbeat_start(ClientInfo *c, uint64_t now) {
+  if (heartbeat_interval == 0) {
+    return;
+  }
+  if (c->sockfd >= 0) {
+    heartbeat_tune(c->sockfd);
+  }
+  c->heard = now;
+  wheel_add(&c->shard->heartbeats, &c->heartbeat,
+            now + (uint64_t)heartbeat_interval * 1000);
+}
+
+// 处理到期的心跳检查。收到输入只更新 heard，不动时间轮，到期时才按 heard 重新排上：
+// 期间有过输入的顺延；空闲的发一次心跳；回复过心跳的客户端连续 HEARTBEAT_MISSES 次
+// 没有回应时按连接断开处理（会话照常保留）。从不回复心跳的旧客户端只靠内核发现掉线。
+// 返回距离下一个刻度的毫秒数，没有连接时返回 -1
+int expire_heartbeats(Shard *s) {
+  if (heartbeat_interval == 0) {
+    return -1;
+  }
+  uint64_t now = monotonic_ms();
+  uint64_t idle_ms = (uint64_t)heartbeat_interval * 1000;
+  uint64_t reply_ms = idle_ms / 3 > 1000 ? idle_ms / 3 : 1000;
+  WheelNode *n;
+  while ((n = wheel_expired(&s->heartbeats, now)) != NULL) {
+    ClientInfo *c = HEARTBEAT_CLIENT(n);
+    if (!c->active) {
+      continue; // 本轮已被标记关闭
+    }
+    if (c->sockfd < 0 || c->detached) {
+      // 断线保留中或正在转交连接，恢复时重新记录 heard
+      wheel_add(&s->heartbeats, n, now + idle_ms);
+      continue;
+    }
+    if (c->pings == 0 && c->heard + idle_ms > now) {
+      wheel_add(&s->heartbeats, n, c->heard + idle_ms);
+      continue;
+    }
+    if (c->pong && c->pings >= HEARTBEAT_MISSES) {
+      printf("[!] %s 连续 %d 次没有回应心跳，按断线处理\n", c->name,
+             HEARTBEAT_MISSES);
+      s->dead_peers++;
+      client_lost(c);
+      if (c->active) {
+        wheel_add(&s->heartbeats, n, now + idle_ms);
+      }
+      continue;
+    }
+    MsgBuf *b = c->binary ? msgbuf_frame(OP_PING, NULL, "", 0)
+                          : msgbuf_new(HEARTBEAT_PING, strlen(HEARTBEAT_PING));
+    if (b == NULL) {
+      remove_client(c);
+      continue;
+    }
+    client_send_buf(c, b);
+    msgbuf_put(b);
+    c->pings++;
+    s->pings++;
+    wheel_add(&s->heartbeats, n, now + (c->pong ? reply_ms : idle_ms));
+  }
+  return wheel_timeout(&s->heartbeats, now);
+}
+
+// 关闭本轮被标记移除的客户端，并通知其他用户
+void close_pending_clients(Shard *s) {
+  char message[BUFFER_SIZE + 64];
+
+  while (s->closing_list != NULL) {
+    ClientInfo *c = s->closing_list;
+    s->closing_list = c->next_closing;
+
+    // 从紧凑数组中删除：用最后一个元素填补空位
+    int slot = c->slot;
+    s->clients[slot] = s->clients[--s->client_count];
+    s->clients[slot]->slot = slot;
+    // 换房间失败时已不在任何房间；没有发出过加入通知的也不通知离开
+    Room *room = c->room && c->announced ? room_hold(c->room->room) : NULL;
+    room_leave(c);
+    nick_remove(&nicknames, c->name, c->id);
+    cluster_post(CLUSTER_PART, 0, c->name, NULL, NULL);
+    handle_release(s, c);
+    flush_list_remove(c);
+    client_timer_cancel(c);
+    wheel_del(&s->heartbeats, &c->heartbeat);
+    atomic_fetch_sub(&online_count, 1);
+
+    // 连接已转交给恢复的会话时只释放临时身份
+    if (c->sockfd >= 0 || c->announced) {
+      if (c->sockfd >= 0) {
+        close(c->sockfd);
+      }
+      printf("[-] %s 已断开连接\n", c->name);
+      printf("    当前在线人数: %d\n", get_client_count());
+    }
+
+    snprintf(message, sizeof(message), "[系统] %s 离开了聊天室\n", c->name);
+    free_out_queue(c);
+    free(c->in_buf);
+    free(c);
+
+    // 广播可能再把其他客户端加入 closing_list，循环会继续处理
+    if (room != NULL) {
+      broadcast_message(s, room, message, NULL);
+      room_put(room);
+    }
+  }
+}
+
+// 旧进程：处理完分片之间还在路上的消息（恢复会话、私聊、广播、离开通知……），
+// 直到所有收件队列和暂存队列都空了。分片线程都已退出，由主线程代为处理
+void upgrade_quiesce() {
+  int busy = 1;
+  while (busy) {
+    busy = 0;
+    for (int i = 0; i < shard_count; i++) {
+      Shard *s = &shards[i];
+      XMsg *m;
+      while ((m = mpsc_pop(&s->inbox)) != NULL) {
+        busy = 1;
+        if (handle_xmsg(s, m) == 0) {
+          release_xmsg(m);
+        }
+      }
+      close_pending_clients(s);
+      if (s->outbox_pending > 0) {
+        flush_outbox(s);
+        busy = 1;
+      }
+    }
+  }
+}
+
+// 按发送顺序拼出客户端尚未发出的数据：发了一半的消息的剩余部分，然后和 flush_client_io
+// 一样按序号合并房间广播环（从游标开始，跳过自己发出的）和私聊队列。
+// 已启用压缩时只有 partial 是压缩帧，它的长度存入 *wire_len，之后的都是原始消息
+static int upgrade_pending_output(ClientInfo *c, ClusterBuf *out,
+                                  uint64_t *wire_len) {
+  RoomShard *rs = c->room;
+  if (c->partial != NULL &&
+      msgbuf_append(out, c->partial, c->partial_off,
+                    c->partial->len - c->partial_off) < 0) {
+    return -1;
+  }
+  *wire_len = out->len;
+  uint64_t seq = c->cursor;
+  if (rs != NULL && rs->ring_head - seq > rs->ring_mask + 1) {
+    // 未读的广播已被覆盖：从环中最旧的开始，缺口计入错过的消息数
+    uint64_t oldest = rs->ring_head - (rs->ring_mask + 1);
+    c->dropped += (uint32_t)(oldest - seq);
+    seq = oldest;
+  }
+  uint32_t pi = 0;
+  for (;;) {
+    while (rs != NULL && seq < rs->ring_head &&
+           rs->ring[seq & rs->ring_mask].exclude_id == c->id) {
+      seq++;
+    }
+    int has_private = pi < c->out_count;
+    int has_bcast = rs != NULL && seq < rs->ring_head;
+    if (!has_private && !has_bcast) {
+      return 0;
+    }
+    MsgBuf *b;
+    size_t off = 0;
+    if (has_private && (!has_bcast || out_slot(c, pi)->seq <= seq)) {
+      off = pi == 0 ? c->zip_off : 0;
+      b = out_slot(c, pi++)->buf;
+    } else {
+      b = rs->ring[seq++ & rs->ring_mask].buf[c->binary];
+    }
+    if (msgbuf_append(out, b, off, b->len - off) < 0) {
+      return -1;
+    }
+  }
+}
+
+// 发送一个客户端：会话记录附带连接，之后是输入和待发送输出的字节
+static int upgrade_send_client(int conn, ClientInfo *c, ClusterBuf *out) {
+  UpgradeClient rec;
+  uint64_t wire_len;
+  memset(&rec, 0, sizeof(rec));
+  out->len = 0;
+  if (upgrade_pending_output(c, out, &wire_len) < 0) {
+    return -1;
+  }
+  rec.type = UPGRADE_CLIENT;
+  rec.binary = (uint8_t)c->binary;
+  rec.negotiated = (uint8_t)c->negotiated;
+  rec.announced = (uint8_t)c->announced;
+  rec.detached = c->sockfd < 0;
+  rec.in_discard = (uint8_t)c->in_discard;
+  rec.compress = (uint8_t)c->compress;
+  rec.pong = (uint8_t)c->pong;
+  rec.dropped = c->dropped;
+  rec.id = c->id;
+  rec.secret = c->secret;
+  rec.addr = c->addr;
+  memcpy(rec.name, c->name, sizeof(rec.name));
+  snprintf(rec.room, sizeof(rec.room), "%s",
+           c->room != NULL ? c->room->room->name : LOBBY_NAME);
+  if (c->timer_list != NULL) {
+    uint64_t now = monotonic_ms();
+    rec.timer_ms = c->deadline > now ? (uint32_t)(c->deadline - now) : 0;
+  }
+  rec.in_len = c->in_len;
+  rec.out_len = out->len;
+  // 还没发出压缩确认时，之前的输出都按原样发送
+  rec.wire_len = c->compress == 2 ? wire_len : out->len;
+  if (upgrade_send(conn, &rec, sizeof(rec), &c->sockfd, c->sockfd >= 0) < 0 ||
+      upgrade_send_data(conn, c->in_buf, c->in_len) < 0 ||
+      upgrade_send_data(conn, out->data, out->len) < 0) {
+    return -1;
+  }
+  return 0;
+}
+
+// 旧进程：交出监听套接字和全部客户端，然后释放客户端（连接由新进程持有，不会断开）。
+// 返回交出的客户端数，中途失败时返回 -1，剩下的连接就此关闭
+int upgrade_send_state(int conn) {
+  UpgradeState st = {UPGRADE_STATE, shard_count, server_port,
+                     atomic_load(&next_user_id), 0};
+  int fds[MAX_SHARDS];
+  for (int i = 0; i < shard_count; i++) {
+    st.client_count += (uint32_t)shards[i].client_count;
+    fds[i] = shards[i].listen_fd;
+  }
+  int ok = upgrade_send(conn, &st, sizeof(st), fds, shard_count) == 0;
+  int handed = 0;
+  ClusterBuf out = {NULL, 0, 0};
+  for (int i = 0; i < shard_count; i++) {
+    Shard *s = &shards[i];
+    for (int j = 0; j < s->client_count; j++) {
+      ClientInfo *c = s->clients[j];
+      if (ok && (ok = upgrade_send_client(conn, c, &out) == 0)) {
+        handed++;
+      }
+      if (c->sockfd >= 0) {
+        close(c->sockfd);
+      }
+      free_out_queue(c);
+      free(c->in_buf);
+      free(c);
+    }
+    s->client_count = 0;
+  }
+  cluster_buf_free(&out);
+  return ok ? handed : -1;
+}
+
+// 旧进程：核对接管请求来自同一用户、版本相同
+static int upgrade_check_peer(int conn) {
+  struct ucred cred;
+  socklen_t len = sizeof(cred);
+  UpgradeHello hello;
+  int fds[UPGRADE_MAX_FDS];
+  int nfds = 0;
+  struct pollfd pfd = {conn, POLLIN, 0};
+
+  if (getsockopt(conn, SOL_SOCKET, SO_PEERCRED, &cred, &len) < 0 ||
+      cred.uid != geteuid()) {
+    printf("[升级] 拒绝其他用户的接管请求\n");
+    return -1;
+  }
+  ssize_t n = poll(&pfd, 1, UPGRADE_TIMEOUT_MS) == 1
+                  ? upgrade_recv(conn, &hello, sizeof(hello), fds, &nfds)
+                  : -1;
+  for (int i = 0; i < nfds; i++) {
+    close(fds[i]);
+  }
+  if (n != sizeof(hello) || hello.type != UPGRADE_HELLO ||
+      hello.version != UPGRADE_VERSION ||
+      hello.record_size != sizeof(UpgradeClient)) {
+    printf("[升级] 新进程的版本不同或请求无效，拒绝接管\n");
+    return -1;
+  }
+  return 0;
+}
+
+// 旧进程主线程：等待关闭信号或新进程的接管请求。返回接管连接，收到信号时返回 -1。
+// 两种情况都删除升级套接字文件，新进程收到 END 后再创建自己的
+int upgrade_wait(sigset_t *mask) {
+  int sig_fd = signalfd(-1, mask, SFD_CLOEXEC);
+  int conn = -1;
+  if (sig_fd < 0) {
+    perror("创建signalfd失败");
+    int sig;
+    sigwait(mask, &sig);
+  }
+  struct pollfd pfd[2] = {{sig_fd, POLLIN, 0}, {upgrade_listen_fd, POLLIN, 0}};
+  while (sig_fd >= 0 && conn < 0) {
+    if (poll(pfd, 2, -1) < 0) {
+      if (errno == EINTR) {
+        continue;
+      }
+      perror("poll失败");
+      break;
+    }
+    if (pfd[0].revents & POLLIN) {
+      break;
+    }
+    if (pfd[1].revents & POLLIN) {
+      conn = accept4(upgrade_listen_fd, NULL, NULL, SOCK_CLOEXEC);
+      if (conn >= 0 && upgrade_check_peer(conn) < 0) {
+        close(conn);
+        conn = -1;
+      }
+    }
+  }
+  if (sig_fd >= 0) {
+    close(sig_fd);
+  }
+  close(upgrade_listen_fd);
+  upgrade_listen_fd = -1;
+  unlink(upgrade_path);
+  return conn;
+}
+
+static void upgrade_addr(struct sockaddr_un *addr) {
+  memset(addr, 0, sizeof(*addr));
+  addr->sun_family = AF_UNIX;
+  memcpy(addr->sun_path, upgrade_path, strlen(upgrade_path)); // 长度已在启动时检查
+}
+
+// 在升级套接字上等待下一个新进程，只有同一用户可以连接（accept 后还会核对对方的 uid）
+int upgrade_listen() {
+  struct sockaddr_un addr;
+  upgrade_addr(&addr);
+  upgrade_listen_fd = socket(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0);
+  if (upgrade_listen_fd < 0 ||
+      bind(upgrade_listen_fd, (struct sockaddr *)&addr, sizeof(addr)) < 0 ||
+      listen(upgrade_listen_fd, 4) < 0) {
+    perror("升级套接字监听失败");
+    return -1;
+  }
+  chmod(upgrade_path, 0600);
+  return 0;
+}
+
+// 新进程：连接旧进程的升级套接字，接过监听套接字和全部客户端，先存起来，
+// 分片初始化之后由 upgrade_restore 恢复。没有旧进程在运行时返回 0，照常启动
+int upgrade_receive() {
+  static char msg[sizeof(UpgradeClient) + sizeof(uint32_t) + UPGRADE_CHUNK];
+  int fds[UPGRADE_MAX_FDS];
+  int nfds;
+  struct sockaddr_un addr;
+  upgrade_addr(&addr);
+
+  int conn = socket(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0);
+  if (conn < 0) {
+    perror("创建升级套接字失败");
+    return -1;
+  }
+  if (connect(conn, (struct sockaddr *)&addr, sizeof(addr)) < 0) {
+    int err = errno;
+    close(conn);
+    if (err == ECONNREFUSED) {
+      unlink(upgrade_path); // 上次异常退出留下的套接字文件
+    }
+    if (err == ENOENT || err == ECONNREFUSED) {
+      return 0;
+    }
+    errno = err;
+    perror("连接旧进程失败");
+    return -1;
+  }
+
+  UpgradeHello hello = {UPGRADE_HELLO, UPGRADE_VERSION, sizeof(UpgradeClient)};
+  UpgradeState st;
+  ssize_t n = -1;
+  if (upgrade_send(conn, &hello, sizeof(hello), NULL, 0) == 0) {
+    n = upgrade_recv(conn, &st, sizeof(st), fds, &nfds);
+  }
+  if (n != sizeof(st) || st.type != UPGRADE_STATE) {
+    fprintf(stderr, "旧进程拒绝了接管请求（版本不同或不是同一用户）\n");
+    close(conn);
+    return -1;
+  }
+  if (st.port == server_port) {
+    memcpy(inherited_fds, fds, sizeof(int) * nfds);
+    inherited_fd_count = nfds;
+  } else {
+    // 换了端口：已连接的客户端照样接过，旧端口不再监听
+    printf("[升级] 旧进程监听端口 %d，新进程改为监听 %d\n", st.port, server_port);
+    for (int i = 0; i < nfds; i++) {
+      close(fds[i]);
+    }
+  }
+  if (st.next_user_id > atomic_load(&next_user_id)) {
+    atomic_store(&next_user_id, st.next_user_id);
+  }
+  inherited = calloc(st.client_count + 1, sizeof(Inherited));
+  if (inherited == NULL) {
+    perror("分配客户端失败");
+    close(conn);
+    return -1;
+  }
+
+  const char *error = NULL;
+  for (;;) {
+    uint32_t type = 0;
+    n = upgrade_recv(conn, msg, sizeof(msg), fds, &nfds);
+    if (n >= (ssize_t)sizeof(type)) {
+      memcpy(&type, msg, sizeof(type));
+    }
+    if (type == UPGRADE_END) {
+      break;
+    }
+    if (type != UPGRADE_CLIENT || n != sizeof(UpgradeClient) ||
+        (uint32_t)inherited_count >= st.client_count) {
+      error = n == 0 ? "旧进程中途退出" : "收到无效的消息";
+      break;
+    }
+    Inherited *e = &inherited[inherited_count++];
+    memcpy(&e->rec, msg, sizeof(e->rec));
+    e->fd = nfds > 0 ? fds[0] : -1;
+    for (int i = 1; i < nfds; i++) {
+      close(fds[i]);
+    }
+    size_t total = e->rec.in_len + e->rec.out_len;
+    size_t got = 0;
+    if (total > 0 && (e->data = malloc(total)) == NULL) {
+      error = "内存不足";
+      break;
+    }
+    while (got < total) {
+      n = upgrade_recv(conn, msg, sizeof(msg), fds, &nfds);
+      if (n > (ssize_t)sizeof(type)) {
+        memcpy(&type, msg, sizeof(type));
+      }
+      if (n <= (ssize_t)sizeof(type) || nfds > 0 || type != UPGRADE_DATA ||
+          (size_t)n - sizeof(type) > total - got) {
+        error = "收到无效的数据";
+        break;
+      }
+      memcpy(e->data + got, msg + sizeof(type), (size_t)n - sizeof(type));
+      got += (size_t)n - sizeof(type);
+    }
+    if (error != NULL) {
+      break;
+    }
+  }
+  close(conn);
+  if (error != NULL) {
+    fprintf(stderr, "接管失败: %s\n", error);
+    return -1;
+  }
+  printf("[升级] 从旧进程接过 %d 个监听套接字和 %d 个客户端\n",
+         inherited_fd_count, inherited_count);
+  return 0;
+}
+
+// 接过来的待发送输出：开头可以原样发送的部分之后，其余的原始消息在这里压缩成帧
+static MsgBuf *upgrade_output(Shard *s, int binary, const char *data,
+                              const UpgradeClient *rec) {
+  size_t wire = rec->wire_len < rec->out_len ? rec->wire_len : rec->out_len;
+  size_t size = wire;
+  for (size_t off = wire; off < rec->out_len; off += ZIP_FRAME_MAX) {
+    size_t n = rec->out_len - off;
+    size += zip_bound(n < ZIP_FRAME_MAX ? n : ZIP_FRAME_MAX);
+  }
+  z_stream *z = wire < rec->out_len ? zip_deflater(s) : NULL;
+  MsgBuf *b = msgbuf_alloc(size, binary);
+  if (b == NULL || (wire < rec->out_len && z == NULL)) {
+    free(b);
+    return NULL;
+  }
+  memcpy(b->data, data, wire);
+  b->len = wire;
+  for (size_t off = wire; off < rec->out_len; off += ZIP_FRAME_MAX) {
+    size_t n = rec->out_len - off;
+    b->len += zip_frame(z, data + off, n < ZIP_FRAME_MAX ? n : ZIP_FRAME_MAX,
+                        b->data + b->len);
+  }
+  return b;
+}
+
+// 把接过来的一个客户端恢复到分片 s。keep_id 时占用旧进程中的槽位（会话令牌继续有效），
+// 槽位不可用时返回 1；出错时返回 -1，由调用者关闭连接
+static int upgrade_adopt(Shard *s, Inherited *e, int keep_id) {
+  UpgradeClient *rec = &e->rec;
+  if (!keep_id && rec->detached) {
+    return -1; // 换了 ID 的断线会话无法再用原令牌恢复
+  }
+  ClientInfo *c = calloc(1, sizeof(ClientInfo));
+  if (c == NULL || clients_reserve(s) < 0) {
+    free(c);
+    return -1;
+  }
+  if ((keep_id ? handle_restore(s, c, rec->id) : handle_alloc(s, c)) < 0) {
+    free(c);
+    return keep_id ? 1 : -1;
+  }
+  c->sockfd = e->fd;
+  c->shard = s;
+  c->addr = rec->addr;
+  c->active = 1;
+  c->binary = rec->binary;
+  c->negotiated = rec->negotiated;
+  c->announced = rec->announced;
+  c->detached = rec->detached;
+  c->in_discard = rec->in_discard;
+  c->compress = rec->compress;
+  c->dropped = rec->dropped;
+  c->secret = rec->secret;
+  memcpy(c->name, rec->name, sizeof(c->name));
+  c->name[sizeof(c->name) - 1] = '\0';
+  rec->room[sizeof(rec->room) - 1] = '\0';
+  if (nick_insert(&nicknames, c->name, c->id) < 0) {
+    handle_release(s, c);
+    free(c);
+    return -1;
+  }
+  encode_name_headers(c);
+  // 待发送的输出放不下时按接管失败处理，不能丢掉一段输出后继续在这个连接上发送
+  if (rec->out_len > 0 &&
+      (c->partial = upgrade_output(s, c->binary, e->data + rec->in_len, rec)) ==
+          NULL) {
+    nick_remove(&nicknames, c->name, c->id);
+    handle_release(s, c);
+    free(c);
+    return -1;
+  }
+
+  // 还有待发送的输出时注册 EPOLLOUT，分片线程开始运行后马上发送
+  struct epoll_event ev;
+  c->want_write = c->sockfd >= 0 && rec->out_len > 0;
+  ev.events = EPOLLIN | EPOLLRDHUP | (c->want_write ? EPOLLOUT : 0);
+  ev.data.ptr = c;
+  Room *r = room_get(rec->room, strlen(rec->room));
+  int joined = r != NULL && room_join(c, r) == 0;
+  if (r != NULL) {
+    room_put(r); // 加入后由房间在本分片的部分持有
+  }
+  if (!joined || (c->sockfd >= 0 &&
+                  epoll_ctl(s->epoll_fd, EPOLL_CTL_ADD, c->sockfd, &ev) < 0)) {
+    room_leave(c);
+    nick_remove(&nicknames, c->name, c->id);
+    handle_release(s, c);
+    if (c->partial != NULL) {
+      msgbuf_put(c->partial);
+    }
+    free(c);
+    return -1;
+  }
+  if (rec->in_len > 0 && (c->in_buf = malloc(rec->in_len)) != NULL) {
+    memcpy(c->in_buf, e->data, rec->in_len);
+    c->in_len = c->in_cap = rec->in_len;
+  }
+  c->slot = s->client_count;
+  s->clients[s->client_count++] = c;
+  atomic_fetch_add(&online_count, 1);
+  if (c->detached) {
+    client_timer_add(&s->suspended, c, rec->timer_ms);
+  } else if (!c->announced) {
+    client_timer_add(&s->announcing, c, rec->timer_ms);
+  }
+  c->pong = rec->pong;
+  heartbeat_start(c, monotonic_ms());
+  if (!keep_id) {
+    send_session_token(c); // 原令牌中的 ID 已失效
+  }
+  e->fd = -1;
+  return 0;
+}
+
+// 新进程：分片初始化之后、线程启动之前恢复接过来的客户端。先按原 ID 恢复，
+// 分片数变少或槽位冲突的再分配新 ID。昵称、房间和会话都不变，也不广播加入通知
+void upgrade_restore() {
+  int restored = 0, renumbered = 0;
+  for (int pass = 0; pass < 2; pass++) {
+    for (int i = 0; i < inherited_count; i++) {
+      Inherited *e = &inherited[i];
+      int index = CLIENT_ID_SHARD(e->rec.id);
+      if (e->placed || (pass == 0 && index >= shard_count)) {
+        continue;
+      }
+      int ret = upgrade_adopt(&shards[pass == 0 ? index : i % shard_count], e,
+                              pass == 0);
+      if (ret > 0) {
+        continue;
+      }
+      e->placed = 1;
+      if (ret == 0) {
+        restored++;
+        renumbered += pass;
+      } else if (e->fd >= 0) {
+        close(e->fd);
+        e->fd = -1;
+      }
+    }
+    if (pass == 0) {
+      for (int i = 0; i < shard_count; i++) {
+        handle_rebuild_free(&shards[i]);
+      }
+    }
+  }
+  for (int i = 0; i < inherited_count; i++) {
+    free(inherited[i].data);
+  }
+  free(inherited);
+  inherited = NULL;
+  printf("[升级] 恢复了 %d 个客户端 (其中 %d 个分配了新的会话令牌, 放弃 %d 个)\n",
+         restored, renumbered, inherited_count - restored);
+  inherited_count = 0;
+}
+
+// 获取当前在线客户端数量（所有分片合计）
+int get_client_count() { return atomic_load(&online_count); }
+
+// 提高文件描述符上限，以支持大量并发连接
+void raise_fd_limit() {
+  struct rlimit rl;
+  if (getrlimit(RLIMIT_NOFILE, &rl) == 0 && rl.rlim_cur < rl.rlim_max) {
+    rl.rlim_cur = rl.rlim_max;
+    setrlimit(RLIMIT_NOFILE, &rl);
+  }
+}
+
+void print_usage(const char *prog) {
+  printf("用法: %s [-p 端口] [-n 分片数] [-s 策略] [-q 队列长度] [-b 环大小]\n"
+         "          [-c 微秒] [-i] [-H 目录] [-r 条数] [-g 秒] [-k 秒] [-O 目录]\n"
+         "          [-N 节点号 [-L 端口] [-J 地址:端口,...]] [-U 路径]\n",
+         prog);
+  printf("  -p 端口      监听端口 (默认 %d)\n", PORT);
+  printf("  -n 分片数    reactor 线程数 (默认等于 CPU 核心数)\n");
+  printf("  -s 策略      慢客户端策略: disconnect | drop-oldest | pause "
+         "(默认 disconnect)\n");
+  printf("  -q 队列长度  每个客户端最多积压的私聊消息数 (默认 %d)\n",
+         OUT_QUEUE_DEFAULT);
+  printf("  -b 环大小    每个房间广播环最多保留的消息数，2 的幂 (默认 %d)\n",
+         RING_SIZE_DEFAULT);
+  printf("  -c 微秒      发送合并窗口，窗口内的消息合并为一次 writev (默认 0)\n");
+  printf("  -i           昵称忽略 ASCII 大小写 (Alice 与 alice 视为同一昵称)\n");
+  printf("  -H 目录      把各房间的聊天记录保存到该目录，重启后仍可回放 (默认不保存)\n");
+  printf("  -r 条数      进入房间时回放的历史消息条数，0 表示不回放 (默认 %d)\n",
+         HISTORY_REPLAY_DEFAULT);
+  printf("  -g 秒        断线后保留会话的时间，0 表示断线即离开 (默认 %d)\n",
+         SESSION_GRACE_DEFAULT);
+  printf("  -k 秒        连接没有输入多长时间后发送心跳，也是内核判定对端掉线的时间，"
+         "0 表示不检测 (默认 %d)\n",
+         HEARTBEAT_DEFAULT);
+  printf("  -O 目录      保存发给离线用户的私聊，对方以该昵称登录时投递 (默认不保存)\n");
+  printf("  -N 节点号    以该编号 (1-%d) 加入集群，各节点编号不同 (默认单机运行)\n",
+         CLUSTER_MAX_NODES - 1);
+  printf("  -L 端口      在该端口接受其他节点的连接\n");
+  printf("  -J 地址列表  主动连接的其他节点，如 127.0.0.1:9101,127.0.0.1:9102\n");
+  printf("  -U 路径      热升级的 UNIX 套接字：已有进程在运行时接过它的连接，"
+         "之后等待下一个新进程\n");
 }
@@ -0,0 +1,260 @@
+/**
+ * 服务器内部计时：消息路径各阶段的耗时和共享锁的等待/持有时间
+ * 功能：找出时间花在哪里（等锁、解析分派、扇出入队还是写套接字），由 /stats 按需汇总
+ *
+ * 实现：x86-64 上用 rdtsc 读时间戳计数器（约 20 个周期，不进内核），其他平台用
+ * CLOCK_MONOTONIC_RAW。直方图直接记录计数器的差值，只在汇总时按启动以来的两种时钟
+ * 换算成纳秒，热路径上没有除法。每个线程一份计数，只由本线程写入（非原子的读-改-写，
+ * 用 relaxed 原子存取避免撕裂），汇总时逐个线程读取，不同线程之间不共享缓存行。
+ *
+ * 编译时定义 CHAT_STATS=0 时计时宏展开为空、加锁包装直接调用 pthread，没有任何开销。
+ */
+
+#ifndef STATS_H
+#define STATS_H
+
+#ifndef CHAT_STATS
+#define CHAT_STATS 1
+#endif
+
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdint.h>
+#include <string.h>
+#include <time.h>
+#if CHAT_STATS && defined(__x86_64__)
+#include <x86intrin.h>
+#endif
+
+#define STATS_MAX_THREADS 80 // 分片线程（最多 64 个）加上集群等后台线程
+#define STATS_SUB_BITS 2     // 每个 2 的幂区间再分 4 个子桶
+#define STATS_SUB (1 << STATS_SUB_BITS)
+#define STATS_BUCKETS (STATS_SUB * 2 + STATS_SUB * 60)
+
+// 计时项：前五个是消息路径的阶段，后两个是昵称索引的段锁
+enum {
+  STAT_RECV,      // recv 系统调用
+  STAT_PARSE,     // 切分行（帧）并分派命令，包含其中的扇出入队
+  STAT_FANOUT,    // 广播写入房间环、投递到其他分片和集群队列
+  STAT_FLUSH,     // 把待发送的消息写入套接字
+  STAT_COMPRESS,  // 把一批消息压缩成帧（启用压缩的连接，包含在 STAT_FLUSH 中）
+  STAT_LOCK_WAIT, // 等待昵称索引的段锁
+  STAT_LOCK_HOLD, // 持有昵称索引的段锁
+  STAT_COUNT
+};
+
+#if CHAT_STATS
+
+typedef struct StatHist {
+  uint64_t counts[STATS_BUCKETS];
+  uint64_t total;
+  uint64_t sum;
+  uint64_t max;
+} StatHist;
+
+typedef struct ThreadStats {
+  StatHist hist[STAT_COUNT];
+  uint64_t lock_contended; // 加锁时锁已被占用的次数
+} ThreadStats;
+
+// 读取当前时间（计数器单位）
+static inline uint64_t stats_now(void) {
+#if defined(__x86_64__)
+  return __rdtsc();
+#else
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC_RAW, &ts);
+  return (uint64_t)ts.tv_sec * 1000000000ull + (uint64_t)ts.tv_nsec;
+#endif
+}
+
+static __thread ThreadStats *stats_self;  // 当前线程的计数，未登记的线程为 NULL
+static __thread int stats_lock_depth;     // 当前线程持有的段锁数（改名时同时持有两把）
+static __thread uint64_t stats_lock_since;
+static ThreadStats *stats_threads[STATS_MAX_THREADS];
+static atomic_int stats_thread_count;
+static uint64_t stats_tick0; // 启动时的计数器和 CLOCK_MONOTONIC_RAW，用于换算
+static uint64_t stats_ns0;
+
+static inline uint64_t stats_raw_ns(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC_RAW, &ts);
+  return (uint64_t)ts.tv_sec * 1000000000ull + (uint64_t)ts.tv_nsec;
+}
+
+// 启动时调用一次，记录换算基准
+static inline void stats_init(void) {
+  stats_tick0 = stats_now();
+  stats_ns0 = stats_raw_ns();
+}
+
+// 登记当前线程的计数（线程开始时调用）
+static inline void stats_register(ThreadStats *t) {
+  int i = atomic_fetch_add(&stats_thread_count, 1);
+  if (i < STATS_MAX_THREADS) {
+    stats_threads[i] = t;
+    stats_self = t;
+  }
+}
+
+// 单写者计数器：普通加法，relaxed 存取保证汇总线程不会读到撕裂的值
+static inline void stats_add(uint64_t *p, uint64_t v) {
+  __atomic_store_n(p, __atomic_load_n(p, __ATOMIC_RELAXED) + v, __ATOMIC_RELAXED);
+}
+
+static inline uint64_t stats_load(const uint64_t *p) {
+  return __atomic_load_n(p, __ATOMIC_RELAXED);
+}
+
+static inline int stats_bucket(uint64_t v) {
+  if (v < 2 * STATS_SUB) {
+    return (int)v;
+  }
+  int msb = 63 - __builtin_clzll(v);
+  int sub = (int)((v >> (msb - STATS_SUB_BITS)) & (STATS_SUB - 1));
+  int idx = 2 * STATS_SUB + (msb - STATS_SUB_BITS - 1) * STATS_SUB + sub;
+  return idx < STATS_BUCKETS ? idx : STATS_BUCKETS - 1;
+}
+
+// 桶的上界（计数器单位）
+static inline uint64_t stats_bucket_upper(int idx) {
+  if (idx < 2 * STATS_SUB) {
+    return (uint64_t)idx;
+  }
+  int msb = (idx - 2 * STATS_SUB) / STATS_SUB + STATS_SUB_BITS + 1;
+  int sub = (idx - 2 * STATS_SUB) % STATS_SUB;
+  return (1ull << msb) + (uint64_t)(sub + 1) * (1ull << (msb - STATS_SUB_BITS)) - 1;
+}
+
+static inline void stats_record(int item, uint64_t ticks) {
+  ThreadStats *t = stats_self;
+  if (t == NULL) {
+    return;
+  }
+  StatHist *h = &t->hist[item];
+  stats_add(&h->counts[stats_bucket(ticks)], 1);
+  stats_add(&h->total, 1);
+  stats_add(&h->sum, ticks);
+  if (ticks > stats_load(&h->max)) {
+    __atomic_store_n(&h->max, ticks, __ATOMIC_RELAXED);
+  }
+}
+
+#define STATS_START(var) uint64_t var = stats_now()
+#define STATS_END(item, var) stats_record(item, stats_now() - (var))
+
+// 加锁包装：先尝试加锁，锁被占用时才计时等待；最外层的锁从拿到起计算持有时间
+static inline void stats_locked(void) {
+  if (stats_lock_depth++ == 0) {
+    stats_lock_since = stats_now();
+  }
+}
+
+static inline void stats_wait_done(int contended, uint64_t since) {
+  if (contended && stats_self != NULL) {
+    stats_add(&stats_self->lock_contended, 1);
+  }
+  stats_record(STAT_LOCK_WAIT, contended ? stats_now() - since : 0);
+  stats_locked();
+}
+
+static inline int stats_rdlock(pthread_rwlock_t *l) {
+  if (pthread_rwlock_tryrdlock(l) == 0) {
+    stats_wait_done(0, 0);
+    return 0;
+  }
+  uint64_t since = stats_now();
+  int ret = pthread_rwlock_rdlock(l);
+  stats_wait_done(1, since);
+  return ret;
+}
+
+static inline int stats_wrlock(pthread_rwlock_t *l) {
+  if (pthread_rwlock_trywrlock(l) == 0) {
+    stats_wait_done(0, 0);
+    return 0;
+  }
+  uint64_t since = stats_now();
+  int ret = pthread_rwlock_wrlock(l);
+  stats_wait_done(1, since);
+  return ret;
+}
+
+static inline int stats_unlock(pthread_rwlock_t *l) {
+  if (--stats_lock_depth == 0) {
+    stats_record(STAT_LOCK_HOLD, stats_now() - stats_lock_since);
+  }
+  return pthread_rwlock_unlock(l);
+}
+
+// 汇总所有线程的计数到 total（逐个字段读取，不是同一时刻的快照）
+static inline void stats_collect(ThreadStats *total) {
+  memset(total, 0, sizeof(*total));
+  int n = atomic_load(&stats_thread_count);
+  if (n > STATS_MAX_THREADS) {
+    n = STATS_MAX_THREADS;
+  }
+  for (int i = 0; i < n; i++) {
+    const ThreadStats *t = stats_threads[i];
+    for (int k = 0; k < STAT_COUNT; k++) {
+      const StatHist *h = &t->hist[k];
+      StatHist *d = &total->hist[k];
+      for (int b = 0; b < STATS_BUCKETS; b++) {
+        d->counts[b] += stats_load(&h->counts[b]);
+      }
+      d->total += stats_load(&h->total);
+      d->sum += stats_load(&h->sum);
+      uint64_t max = stats_load(&h->max);
+      if (max > d->max) {
+        d->max = max;
+      }
+    }
+    total->lock_contended += stats_load(&t->lock_contended);
+  }
+}
+
+// 每个计数器单位对应的纳秒数
+static inline double stats_ns_per_tick(void) {
+  uint64_t ticks = stats_now() - stats_tick0;
+  uint64_t ns = stats_raw_ns() - stats_ns0;
+  return ticks > 0 ? (double)ns / (double)ticks : 1.0;
+}
+
+// 第 pct 百分位所在桶的上界（计数器单位，不超过最大值）
+static inline uint64_t stats_percentile(const StatHist *h, double pct) {
+  if (h->total == 0) {
+    return 0;
+  }
+  uint64_t target = (uint64_t)(h->total * pct / 100.0);
+  if (target >= h->total) {
+    target = h->total - 1;
+  }
+  uint64_t seen = 0;
+  for (int i = 0; i < STATS_BUCKETS; i++) {
+    seen += h->counts[i];
+    if (seen > target) {
+      uint64_t upper = stats_bucket_upper(i);
+      return upper < h->max ? upper : h->max;
+    }
+  }
+  return h->max;
+}
+
+#else // !CHAT_STATS
+
+typedef struct ThreadStats {
+  char unused;
+} ThreadStats;
+
+static inline void stats_init(void) {}
+static inline void stats_register(ThreadStats *t) { (void)t; }
+
+#define STATS_START(var)
+#define STATS_END(item, var)
+#define stats_rdlock pthread_rwlock_rdlock
+#define stats_wrlock pthread_rwlock_wrlock
+#define stats_unlock pthread_rwlock_unlock
+
+#endif // CHAT_STATS
+
+#endif // STATS_H
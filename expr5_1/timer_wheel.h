@@ -0,0 +1,100 @@
+/**
+ * 单层哈希时间轮
+ * 功能：大量连接各自的超时（如心跳），加入、删除都是 O(1)，到期处理只看当前刻度的槽
+ *
+ * 时间按 tick_ms 划分刻度，到期刻度为 t 的节点挂在第 t % WHEEL_SLOTS 个槽的双向链表上。
+ * 轮转一圈之内的节点在所在槽被处理时一定到期；超过一圈的节点留在槽中，等之后经过时再判断。
+ * 节点嵌入在使用者的结构体中，轮本身不分配内存。只由所属线程访问。
+ */
+
+#ifndef TIMER_WHEEL_H
+#define TIMER_WHEEL_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#define WHEEL_SLOTS 256 // 2 的幂
+
+typedef struct WheelNode {
+  struct WheelNode *next;
+  struct WheelNode **pprev; // 指向链表中指向自己的指针，不在轮中时为 NULL
+  uint64_t expires;         // 到期的刻度
+} WheelNode;
+
+typedef struct TimerWheel {
+  WheelNode *slots[WHEEL_SLOTS];
+  uint64_t tick_ms;
+  uint64_t current; // 下一个要处理的刻度
+  size_t count;
+} TimerWheel;
+
+static inline void wheel_init(TimerWheel *w, uint64_t tick_ms, uint64_t now_ms) {
+  for (int i = 0; i < WHEEL_SLOTS; i++) {
+    w->slots[i] = NULL;
+  }
+  w->tick_ms = tick_ms;
+  w->current = now_ms / tick_ms;
+  w->count = 0;
+}
+
+static inline int wheel_pending(const WheelNode *n) { return n->pprev != NULL; }
+
+// 在 when_ms 或之后不超过一个刻度时到期；已经过去的时间在下一次处理时到期
+static inline void wheel_add(TimerWheel *w, WheelNode *n, uint64_t when_ms) {
+  uint64_t t = (when_ms + w->tick_ms - 1) / w->tick_ms;
+  if (t < w->current) {
+    t = w->current;
+  }
+  WheelNode **head = &w->slots[t & (WHEEL_SLOTS - 1)];
+  n->expires = t;
+  n->next = *head;
+  n->pprev = head;
+  if (*head != NULL) {
+    (*head)->pprev = &n->next;
+  }
+  *head = n;
+  w->count++;
+}
+
+static inline void wheel_del(TimerWheel *w, WheelNode *n) {
+  if (n->pprev == NULL) {
+    return;
+  }
+  *n->pprev = n->next;
+  if (n->next != NULL) {
+    n->next->pprev = n->pprev;
+  }
+  n->next = NULL;
+  n->pprev = NULL;
+  w->count--;
+}
+
+// 取出一个已到期的节点，没有时返回 NULL。调用者处理完后可以重新加入
+static inline WheelNode *wheel_expired(TimerWheel *w, uint64_t now_ms) {
+  uint64_t now = now_ms / w->tick_ms;
+  while (w->count > 0 && w->current <= now) {
+    for (WheelNode *n = w->slots[w->current & (WHEEL_SLOTS - 1)]; n != NULL;
+         n = n->next) {
+      if (n->expires <= w->current) {
+        wheel_del(w, n);
+        return n;
+      }
+    }
+    w->current++;
+  }
+  if (w->count == 0 && w->current <= now) {
+    w->current = now + 1; // 空轮直接跳到现在，不逐个经过中间的刻度
+  }
+  return NULL;
+}
+
+// 距离下一个要处理的刻度的毫秒数，轮为空时返回 -1
+static inline int wheel_timeout(const TimerWheel *w, uint64_t now_ms) {
+  if (w->count == 0) {
+    return -1;
+  }
+  uint64_t at = w->current * w->tick_ms;
+  return at > now_ms ? (int)(at - now_ms) : 0;
+}
+
+#endif // TIMER_WHEEL_H
@@ -0,0 +1,168 @@
+/**
+ * 热升级：运行中的服务器把监听套接字、客户端连接和会话状态交给新启动的进程
+ * 功能：新进程用相同的参数加上 -U <路径> 启动，连接旧进程在该路径上的 UNIX 套接字；
+ * 旧进程停止处理事件，交出全部状态后退出，客户端的 TCP 连接始终不断开
+ *
+ * 传输：SOCK_SEQPACKET（保留消息边界），套接字描述符用 SCM_RIGHTS 随消息传递。
+ * 两端是同一个程序（HELLO 中校验版本号和记录大小），结构体按本机字节序直接发送。
+ * 顺序：新进程发 HELLO；旧进程发 STATE（附带各分片的监听套接字），然后每个客户端
+ * 一条 CLIENT（附带连接，断线保留中的会话没有）和若干 DATA（先是未凑成完整一行的输入，
+ * 再是按该客户端协议编码、尚未发出的输出，启用了压缩的客户端开头可能是发了一半的压缩帧）；
+ * 最后关闭聊天记录和离线私聊存储，发 END。
+ * 新进程收到 END 之后才打开这些存储和节点间端口。
+ */
+
+#ifndef UPGRADE_H
+#define UPGRADE_H
+
+#include <errno.h>
+#include <netinet/in.h>
+#include <stdint.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/types.h>
+#include <unistd.h>
+
+#define UPGRADE_VERSION 3
+#define UPGRADE_CHUNK 65536 // 每条 DATA 最多携带的字节数
+#define UPGRADE_MAX_FDS 64  // 一条消息最多附带的描述符数（不少于分片数上限）
+#define UPGRADE_NAME_MAX 32 // 与昵称、房间名的缓冲区大小相同
+#define UPGRADE_TIMEOUT_MS 1000 // 等待新进程发来 HELLO 的毫秒数
+
+enum {
+  UPGRADE_HELLO = 1, // 新进程 -> 旧进程：请求接管
+  UPGRADE_STATE,     // 全局状态，附带各分片的监听套接字
+  UPGRADE_CLIENT,    // 一个客户端的会话，附带它的连接
+  UPGRADE_DATA,      // 紧跟 CLIENT 的输入、输出字节
+  UPGRADE_END        // 全部交出，存储已关闭
+};
+
+typedef struct UpgradeHello {
+  uint32_t type;
+  uint32_t version;
+  uint32_t record_size; // sizeof(UpgradeClient)，防止两端的结构体不一致
+} UpgradeHello;
+
+typedef struct UpgradeState {
+  uint32_t type;
+  int32_t shard_count; // 附带的监听套接字个数
+  int32_t port;
+  int32_t next_user_id;
+  uint32_t client_count;
+} UpgradeState;
+
+typedef struct UpgradeClient {
+  uint32_t type;
+  uint8_t binary;
+  uint8_t negotiated;
+  uint8_t announced;
+  uint8_t detached; // 断线保留中，没有附带连接
+  uint8_t in_discard;
+  uint8_t compress; // 压缩协商的状态（见 chat_zip.h）
+  uint8_t pong;     // 回复过心跳
+  uint32_t dropped;
+  uint32_t timer_ms; // 加入通知推迟或会话保留的剩余毫秒数
+  uint64_t id;
+  uint64_t secret;
+  struct sockaddr_in addr;
+  char name[UPGRADE_NAME_MAX];
+  char room[UPGRADE_NAME_MAX];
+  uint64_t in_len;  // 之后的 DATA 中输入的字节数
+  uint64_t out_len; // 之后的 DATA 中待发送输出的字节数
+  uint64_t wire_len; // 输出开头可以原样发送的字节数，其余是尚未压缩的原始消息
+} UpgradeClient;
+
+// 发送一条消息，附带 nfds 个描述符（发送方仍持有它们）
+static inline int upgrade_send(int fd, const void *msg, size_t len,
+                               const int *fds, int nfds) {
+  union {
+    struct cmsghdr hdr;
+    char buf[CMSG_SPACE(sizeof(int) * UPGRADE_MAX_FDS)];
+  } control;
+  struct iovec iov = {(void *)msg, len};
+  struct msghdr mh;
+  memset(&mh, 0, sizeof(mh));
+  mh.msg_iov = &iov;
+  mh.msg_iovlen = 1;
+  if (nfds > 0) {
+    memset(&control, 0, sizeof(control));
+    mh.msg_control = control.buf;
+    mh.msg_controllen = CMSG_SPACE(sizeof(int) * nfds);
+    struct cmsghdr *cm = CMSG_FIRSTHDR(&mh);
+    cm->cmsg_level = SOL_SOCKET;
+    cm->cmsg_type = SCM_RIGHTS;
+    cm->cmsg_len = CMSG_LEN(sizeof(int) * nfds);
+    memcpy(CMSG_DATA(cm), fds, sizeof(int) * nfds);
+  }
+  for (;;) {
+    ssize_t n = sendmsg(fd, &mh, MSG_NOSIGNAL);
+    if (n == (ssize_t)len) {
+      return 0;
+    }
+    if (n < 0 && errno == EINTR) {
+      continue;
+    }
+    return -1;
+  }
+}
+
+// 按 UPGRADE_CHUNK 分成若干条 DATA 发送
+static inline int upgrade_send_data(int fd, const char *data, size_t len) {
+  char msg[sizeof(uint32_t) + UPGRADE_CHUNK];
+  uint32_t type = UPGRADE_DATA;
+  memcpy(msg, &type, sizeof(type));
+  while (len > 0) {
+    size_t n = len < UPGRADE_CHUNK ? len : UPGRADE_CHUNK;
+    memcpy(msg + sizeof(type), data, n);
+    if (upgrade_send(fd, msg, sizeof(type) + n, NULL, 0) < 0) {
+      return -1;
+    }
+    data += n;
+    len -= n;
+  }
+  return 0;
+}
+
+// 接收一条消息，附带的描述符（设置 close-on-exec）存入 fds，个数存入 *nfds。
+// 返回消息长度，对方关闭时返回 0，出错或消息被截断时返回 -1（已收到的描述符被关闭）
+static inline ssize_t upgrade_recv(int fd, void *buf, size_t cap, int *fds,
+                                   int *nfds) {
+  union {
+    struct cmsghdr hdr;
+    char buf[CMSG_SPACE(sizeof(int) * UPGRADE_MAX_FDS)];
+  } control;
+  struct iovec iov = {buf, cap};
+  struct msghdr mh;
+  ssize_t n;
+  memset(&mh, 0, sizeof(mh));
+  mh.msg_iov = &iov;
+  mh.msg_iovlen = 1;
+  mh.msg_control = control.buf;
+  mh.msg_controllen = sizeof(control.buf);
+  do {
+    n = recvmsg(fd, &mh, MSG_CMSG_CLOEXEC);
+  } while (n < 0 && errno == EINTR);
+  *nfds = 0;
+  if (n < 0) {
+    return -1;
+  }
+  for (struct cmsghdr *cm = CMSG_FIRSTHDR(&mh); cm != NULL;
+       cm = CMSG_NXTHDR(&mh, cm)) {
+    if (cm->cmsg_level == SOL_SOCKET && cm->cmsg_type == SCM_RIGHTS) {
+      int count = (int)((cm->cmsg_len - CMSG_LEN(0)) / sizeof(int));
+      memcpy(fds + *nfds, CMSG_DATA(cm), sizeof(int) * count);
+      *nfds += count;
+    }
+  }
+  if (mh.msg_flags & (MSG_TRUNC | MSG_CTRUNC)) {
+    for (int i = 0; i < *nfds; i++) {
+      close(fds[i]);
+    }
+    *nfds = 0;
+    errno = EMSGSIZE;
+    return -1;
+  }
+  return n;
+}
+
+#endif // UPGRADE_H